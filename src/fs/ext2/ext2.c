@@ -2,6 +2,7 @@
 
 #include "kalloc.h"
 #include "kernel.h"
+#include "meminfo.h"
 #include "paging.h"
 #include "palloc.h"
 #include "stdio.h"
@@ -101,30 +102,23 @@ struct {
 
 static u64 ext2_allocate_disk_item(u32 mode, bool want_inode);
 
-static s64 ext2_read_blocks(u64 block_index, u32 block_count, intp* ret, u8* order)
+static s64 ext2_read_blocks(u64 block_index, u32 block_count, intp* ret)
 {
     u32 offs = block_index * BLOCK_SIZE; // offs will always be at least device sector aligned
     u32 size = block_count * BLOCK_SIZE;
 
-    // number of pages for allocation
-    u32 num_pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
-
-    // allocate memory
-    u32 n = next_power_of_2(num_pages);
-    *ret = palloc_claim(n);
+    // allocate memory. free with kfree_tagged(ret, block_count * BLOCK_SIZE, MEMINFO_TAG_FS)
+    *ret = (intp)kalloc_tagged(size, MEMINFO_TAG_FS);
 
     // read sector is truncated down from offs
     u32 sector = offs / ext2_data.filesystem_callbacks->device_sector_size; 
 
     // read sectors is rounded up
     if(!ext2_data.filesystem_callbacks->read_sectors(ext2_data.filesystem_callbacks, sector, NUM_SECTORS(size), *ret)) {
-        palloc_abandon(*ret, n);
+        kfree_tagged((void*)*ret, size, MEMINFO_TAG_FS);
         return -1;
     }
 
-    // save order so the caller can free the allocated memory
-    if(order != null) *order = n;
-
     return 0;
 }
 
@@ -189,13 +183,12 @@ s64 ext2_read_inode(u64 inode_number, struct inode** ret)
 
     // read the block that has the inode
     intp table_data; 
-    u8 order;
     //fprintf(stderr, "ext2: inode %d reading block %d\n", inode_number, inode_table + table_offset_block);
-    if(ext2_read_blocks(inode_table + table_offset_block, 1, &table_data, &order) < 0) return -1;
+    if(ext2_read_blocks(inode_table + table_offset_block, 1, &table_data) < 0) return -1;
 
     // allocate space for the inode
-    struct ext2_inode* ext2_inode = (struct ext2_inode*)kalloc(EXT2_INODE_SIZE);
-    *ret = (struct inode*)kalloc(sizeof(struct inode));
+    struct ext2_inode* ext2_inode = (struct ext2_inode*)kalloc_tagged(EXT2_INODE_SIZE, MEMINFO_TAG_FS);
+    *ret = (struct inode*)kalloc_tagged(sizeof(struct inode), MEMINFO_TAG_FS);
     zero(*ret);
 
     // set up the return inode
@@ -207,7 +200,7 @@ s64 ext2_read_inode(u64 inode_number, struct inode** ret)
     memcpy(ext2_inode, (void*)(table_data + table_offset_byte - (table_offset_block * BLOCK_SIZE)), EXT2_INODE_SIZE);
 
     // free the storage allocated for the table data
-    palloc_abandon(table_data, order);
+    kfree_tagged((void*)table_data, BLOCK_SIZE, MEMINFO_TAG_FS);
 
     return 0;
 }
@@ -235,9 +228,8 @@ s64 ext2_write_inode(struct inode* inode)
 
     // read the block that has the inode
     intp table_data; 
-    u8 order;
     //fprintf(stderr, "ext2: inode %d reading block %d\n", inode_number, inode_table + table_offset_block);
-    if(ext2_read_blocks(inode_table + table_offset_block, 1, &table_data, &order) < 0) return -1;
+    if(ext2_read_blocks(inode_table + table_offset_block, 1, &table_data) < 0) return -1;
 
     // copy the inode data into the table
     memcpy((void*)(table_data + table_offset_byte - (table_offset_block * BLOCK_SIZE)), (void*)ext2_inode, EXT2_INODE_SIZE);
@@ -246,15 +238,15 @@ s64 ext2_write_inode(struct inode* inode)
     if(ext2_write_blocks(inode_table + table_offset_block, 1, table_data) < 0) return -1;
 
     // free the storage allocated for the table data
-    palloc_abandon(table_data, order);
+    kfree_tagged((void*)table_data, BLOCK_SIZE, MEMINFO_TAG_FS);
 
     return 0;
 }
 
 void ext2_free_inode(struct inode* inode)
 {
-    if(inode->ext2_inode != null) kfree(inode->ext2_inode, EXT2_INODE_SIZE);
-    kfree(inode, sizeof(struct inode));
+    if(inode->ext2_inode != null) kfree_tagged(inode->ext2_inode, EXT2_INODE_SIZE, MEMINFO_TAG_FS);
+    kfree_tagged(inode, sizeof(struct inode), MEMINFO_TAG_FS);
 }
 
 u64 ext2_block_size()
@@ -287,13 +279,13 @@ s64 ext2_write_inode_block(struct inode* inode, u64 inode_block_index, intp src)
 }
 
 // inode_block_index is relative to the start of inode data
-// blocks are <= page size, so order of allocated memory is always 0
+// the returned block must be freed with kfree_tagged(ret, ext2_block_size(), MEMINFO_TAG_FS)
 s64 ext2_read_inode_block(struct inode* inode, u64 inode_block_index, intp* ret)
 {
     struct ext2_inode* ext2_inode = inode->ext2_inode;
 
     if(inode_block_index < INODE_BLOCK_INDIRECT0) {
-        if(ext2_read_blocks(ext2_inode->i_block[inode_block_index], 1, ret, null) < 0) return -1;
+        if(ext2_read_blocks(ext2_inode->i_block[inode_block_index], 1, ret) < 0) return -1;
     } else if(inode_block_index < INODE_BLOCK_INDIRECT1) {
         assert(false, "TODO read nested blocks");
         return -1;
@@ -341,10 +333,12 @@ s64 ext2_ensure_inode_block(struct inode* inode, u64 inode_block_index)
 s64 ext2_read_superblock()
 {
     intp dest = palloc_claim_one();
+    meminfo_tag_alloc(MEMINFO_TAG_FS, PAGE_SIZE);
     u32 read_size = (sizeof(struct ext2_superblock) + ext2_data.filesystem_callbacks->device_sector_size - 1) / ext2_data.filesystem_callbacks->device_sector_size;
 
     u32 sector = 1024 / ext2_data.filesystem_callbacks->device_sector_size;
     if(!ext2_data.filesystem_callbacks->read_sectors(ext2_data.filesystem_callbacks, sector, read_size, dest)) {
+        meminfo_tag_free(MEMINFO_TAG_FS, PAGE_SIZE);
         palloc_abandon(dest, 0);
         return -1;
     }
@@ -396,7 +390,7 @@ s64 ext2_open(struct filesystem_callbacks* fscbs)
     assert(sb_block_index == (1024ULL / BLOCK_SIZE), "s_first_data_block incorrect");
 
     u32 read_block_count = NUM_BLOCKS(ext2_data.num_block_groups / sizeof(struct ext2_block_group_descriptor)); // number of blocks required to store all of the block group descriptors
-    if(ext2_read_blocks(sb_block_index + 1, read_block_count, (intp*)&ext2_data.bg_table, null) < 0) return -1;
+    if(ext2_read_blocks(sb_block_index + 1, read_block_count, (intp*)&ext2_data.bg_table) < 0) return -1;
 
     //struct ext2_block_group_descriptor* bg0 = &ext2_data.bg_table[32];
     //fprintf(stderr, "ext2: bg0: bg_block_bitmap=%d\n", bg0->bg_block_bitmap);
@@ -472,7 +466,7 @@ struct ext2_dirent* ext2_dirent_iter_next(struct ext2_dirent_iter* iter)
     // if the offset goes beyond this block, go into the next one by recursively calling iter_next once
     if(iter->offset >= iter->end_of_current_block_offset) {
         // free the current block
-        palloc_abandon(iter->current_data_block, 0);
+        kfree_tagged((void*)iter->current_data_block, BLOCK_SIZE, MEMINFO_TAG_FS);
         iter->current_data_block = 0;
         return ext2_dirent_iter_next(iter);
     }
@@ -484,7 +478,7 @@ valid:
 void ext2_dirent_iter_done(struct ext2_dirent_iter* iter)
 {
     if(iter->current_data_block != 0) {
-        palloc_abandon(iter->current_data_block, 0);
+        kfree_tagged((void*)iter->current_data_block, BLOCK_SIZE, MEMINFO_TAG_FS);
     }
 }
 
@@ -530,7 +524,7 @@ static u64 ext2_allocate_disk_item(u32 mode, bool want_inode)
         }
 
         // found a block group with a free inode/block, read the bitmap. the bitmap for both is 1 block in size
-        if(ext2_read_blocks(bitmap_block, 1, (intp*)&bitmap_data, null) < 0) goto error;
+        if(ext2_read_blocks(bitmap_block, 1, (intp*)&bitmap_data) < 0) goto error;
 
         // loop over bits to find a free entry
         for(u32 bit = 0; bit < num_items_per_group; bit++) {
@@ -564,7 +558,7 @@ static u64 ext2_allocate_disk_item(u32 mode, bool want_inode)
             if(ext2_write_superblock() < 0) goto error;
 
             // free memory
-            palloc_abandon((intp)bitmap_data, 0);
+            kfree_tagged(bitmap_data, BLOCK_SIZE, MEMINFO_TAG_FS);
             return (want_inode) ? (result + 1) : result;
         }
     }
@@ -573,7 +567,7 @@ static u64 ext2_allocate_disk_item(u32 mode, bool want_inode)
     return 0;
 
 error:
-    if(bitmap_data != 0) palloc_abandon((intp)bitmap_data, 0);
+    if(bitmap_data != 0) kfree_tagged(bitmap_data, BLOCK_SIZE, MEMINFO_TAG_FS);
     return 0;
 }
 
@@ -672,7 +666,7 @@ s64 ext2_write_inode_data(struct inode* inode, u64 offset, u8 const* data, u64 c
         if(wrsize < BLOCK_SIZE) {
             ext2_read_inode_block(inode, inode_block_index, &block_data);
         } else {
-            block_data = palloc_claim_one();
+            block_data = (intp)kalloc_tagged(BLOCK_SIZE, MEMINFO_TAG_FS);
         }
 
         // overwrite data
@@ -682,7 +676,7 @@ s64 ext2_write_inode_data(struct inode* inode, u64 offset, u8 const* data, u64 c
         ext2_write_inode_block(inode, inode_block_index, block_data);
 
         // free allocated space
-        palloc_abandon(block_data, 0);
+        kfree_tagged((void*)block_data, BLOCK_SIZE, MEMINFO_TAG_FS);
 
         data += wrsize;
         offset += wrsize;
@@ -696,14 +690,14 @@ s64 ext2_write_inode_data(struct inode* inode, u64 offset, u8 const* data, u64 c
 s64 ext2_create_file(struct inode* dir, char* filename, struct inode** file_inode)
 {
     // create a new inode
-    struct ext2_inode* ext2_inode = (struct ext2_inode*)kalloc(EXT2_INODE_SIZE);
+    struct ext2_inode* ext2_inode = (struct ext2_inode*)kalloc_tagged(EXT2_INODE_SIZE, MEMINFO_TAG_FS);
     memset(ext2_inode, 0, EXT2_INODE_SIZE);
     ext2_inode->i_uid = 1000;
     ext2_inode->i_gid = 1000;
     ext2_inode->i_links_count = 1;
     ext2_inode->i_mode = EXT2_S_IFREG | 0x0180; // user read/write
 
-    struct inode* inode = (struct inode*)kalloc(sizeof(struct inode));
+    struct inode* inode = (struct inode*)kalloc_tagged(sizeof(struct inode), MEMINFO_TAG_FS);
     zero(inode);
     inode->ext2_inode = ext2_inode;
 
@@ -727,14 +721,14 @@ s64 ext2_create_file(struct inode* dir, char* filename, struct inode** file_inod
 s64 ext2_create_directory(struct inode* dir, char* dirname, struct inode** newdir)
 {
     // create a new inode
-    struct ext2_inode* ext2_inode = (struct ext2_inode*)kalloc(EXT2_INODE_SIZE);
+    struct ext2_inode* ext2_inode = (struct ext2_inode*)kalloc_tagged(EXT2_INODE_SIZE, MEMINFO_TAG_FS);
     memset(ext2_inode, 0, EXT2_INODE_SIZE);
     ext2_inode->i_uid = 1000;
     ext2_inode->i_gid = 1000;
     ext2_inode->i_links_count = 2; // parent's referral to this directory and '.' directory references
     ext2_inode->i_mode = EXT2_S_IFDIR | 0x01C0; // user read/write/exec
 
-    struct inode* inode = (struct inode*)kalloc(sizeof(struct inode));
+    struct inode* inode = (struct inode*)kalloc_tagged(sizeof(struct inode), MEMINFO_TAG_FS);
     zero(inode);
     inode->ext2_inode = ext2_inode;
 
@@ -9,6 +9,7 @@
 #include "hpet.h"
 #include "kernel.h"
 #include "multiboot2.h"
+#include "numa.h"
 #include "pci.h"
 #include "stdio.h"
 #include "string.h"
@@ -37,6 +38,8 @@ static void _parse_apic_table(struct acpi_apic*);
 static void _parse_hpet_table(struct acpi_hpet*);
 static void _parse_mcfg_table(struct acpi_mcfg*);
 static void _parse_fadt_table(struct acpi_fadt*);
+static void _parse_srat_table(struct acpi_srat*);
+static void _parse_slit_table(struct acpi_slit*);
 
 static void _validate_checksum(intp base, u64 size, char* msg)
 {
@@ -108,6 +111,10 @@ void acpi_init()
             _parse_mcfg_table((struct acpi_mcfg*)hdr);
         } else if(CHECK_SIG(table_sig, "FACP")) {
             _parse_fadt_table((struct acpi_fadt*)hdr);
+        } else if(CHECK_SIG(table_sig, "SRAT")) {
+            _parse_srat_table((struct acpi_srat*)hdr);
+        } else if(CHECK_SIG(table_sig, "SLIT")) {
+            _parse_slit_table((struct acpi_slit*)hdr);
         } else {
             fprintf(stderr, "acpi: unhandled table [%s], address = 0x%lX\n", buf, (intp)hdr);
         }
@@ -354,3 +361,49 @@ static void _parse_fadt_table(struct acpi_fadt* fadt)
     fprintf(stderr, "acpi: century register = 0x%02X\n", fadt->century);
     //rtc_notify_century_register(fadt->century);
 }
+
+static void _parse_srat_table(struct acpi_srat* srat)
+{
+    struct acpi_srat_record_processor_local_apic_affinity*   lapic_affinity;
+    struct acpi_srat_record_memory_affinity*                 memory_affinity;
+    struct acpi_srat_record_processor_local_x2apic_affinity* x2apic_affinity;
+
+    u8* current_record = srat->records;
+    u8* records_end = (u8*)((intp)srat + srat->header.length);
+    while(current_record < records_end) {
+        u8 type = current_record[0];
+
+        switch(type) {
+        case ACPI_SRAT_RECORD_TYPE_PROCESSOR_LOCAL_APIC_AFFINITY:
+            lapic_affinity = (struct acpi_srat_record_processor_local_apic_affinity*)current_record;
+            numa_notify_cpu_affinity((u32)lapic_affinity->proximity_domain_low | ((u32)lapic_affinity->proximity_domain_high[0] << 8)
+                                     | ((u32)lapic_affinity->proximity_domain_high[1] << 16) | ((u32)lapic_affinity->proximity_domain_high[2] << 24),
+                                     lapic_affinity->apic_id, (lapic_affinity->flags & ACPI_SRAT_FLAG_ENABLED) != 0);
+            break;
+
+        case ACPI_SRAT_RECORD_TYPE_MEMORY_AFFINITY:
+            memory_affinity = (struct acpi_srat_record_memory_affinity*)current_record;
+            numa_notify_memory_affinity(memory_affinity->proximity_domain, (intp)memory_affinity->base_address, memory_affinity->length,
+                                        (memory_affinity->flags & ACPI_SRAT_FLAG_ENABLED) != 0);
+            break;
+
+        case ACPI_SRAT_RECORD_TYPE_PROCESSOR_LOCAL_X2APIC_AFFINITY:
+            x2apic_affinity = (struct acpi_srat_record_processor_local_x2apic_affinity*)current_record;
+            numa_notify_cpu_affinity(x2apic_affinity->proximity_domain, x2apic_affinity->x2apic_id, (x2apic_affinity->flags & ACPI_SRAT_FLAG_ENABLED) != 0);
+            break;
+
+        default:
+            fprintf(stderr, "acpi: unhandled SRAT record type %d\n", type);
+            break;
+        }
+
+        // next record
+        current_record = (u8*)((intp)current_record + current_record[1]);
+    }
+}
+
+static void _parse_slit_table(struct acpi_slit* slit)
+{
+    fprintf(stderr, "acpi: SLIT with %d localities\n", slit->num_localities);
+    numa_notify_distances(slit->num_localities, slit->entries);
+}
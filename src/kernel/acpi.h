@@ -166,6 +166,55 @@ struct acpi_mcfg {
     struct acpi_mcfg_configuration_space spaces[];
 } __packed;
 
+struct acpi_srat {
+    struct acpi_sdt_header   header;
+    u32    reserved0;
+    u64    reserved1;
+    u8     records[];
+} __packed;
+
+struct acpi_srat_record_header {
+    u8     type;
+    u8     length;
+} __packed;
+
+struct acpi_srat_record_processor_local_apic_affinity {
+    struct acpi_srat_record_header header;
+    u8     proximity_domain_low;
+    u8     apic_id;
+    u32    flags;
+    u8     local_sapic_eid;
+    u8     proximity_domain_high[3];
+    u32    clock_domain;
+} __packed;
+
+struct acpi_srat_record_memory_affinity {
+    struct acpi_srat_record_header header;
+    u32    proximity_domain;
+    u16    reserved0;
+    u64    base_address;
+    u64    length;
+    u32    reserved1;
+    u32    flags;
+    u64    reserved2;
+} __packed;
+
+struct acpi_srat_record_processor_local_x2apic_affinity {
+    struct acpi_srat_record_header header;
+    u16    reserved0;
+    u32    proximity_domain;
+    u32    x2apic_id;
+    u32    flags;
+    u32    clock_domain;
+    u32    reserved1;
+} __packed;
+
+struct acpi_slit {
+    struct acpi_sdt_header   header;
+    u64    num_localities;
+    u8     entries[];  // num_localities*num_localities matrix of distances
+} __packed;
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 #define ACPI_APIC_FLAG_HAS_PIC (1 << 0)
@@ -180,6 +229,14 @@ enum {
     ACPI_APIC_RECORD_TYPE_LOCAL_X2APIC = 9
 };
 
+enum {
+    ACPI_SRAT_RECORD_TYPE_PROCESSOR_LOCAL_APIC_AFFINITY   = 0,
+    ACPI_SRAT_RECORD_TYPE_MEMORY_AFFINITY                 = 1,
+    ACPI_SRAT_RECORD_TYPE_PROCESSOR_LOCAL_X2APIC_AFFINITY = 2
+};
+
+#define ACPI_SRAT_FLAG_ENABLED (1 << 0)
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 void acpi_set_rsdp_base(intp base);
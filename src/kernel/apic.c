@@ -13,6 +13,7 @@
 #include "stdlib.h"
 #include "string.h"
 #include "task.h"
+#include "tlb.h"
 
 #define IA32_APIC_BASE_MSR 0x1B
 #define IA32_APIC_BASE_MSR_ENABLE 0x800
@@ -24,6 +25,7 @@
 
 #define LOCAL_APIC_TIMER_INTERRUPT  49
 #define LOCAL_APIC_IPCALL_INTERRUPT 50
+#define LOCAL_APIC_TLB_SHOOTDOWN_INTERRUPT 51
 
 enum LAPIC_REGISTERS {
     LAPIC_REG_LOCAL_APIC_ID                         = 0x20,
@@ -92,6 +94,7 @@ static struct {
 
 void _send_lapic_eoi();
 static void _local_apic_ipcall_interrupt(struct interrupt_stack_registers*, intp, void*);
+static void _local_apic_tlb_shootdown_interrupt(struct interrupt_stack_registers*, intp, void*);
 
 static inline bool _has_lapic()
 {
@@ -308,6 +311,10 @@ void apic_map()
     // install the ipcall interrupt handler
     // TODO allocate interrupt numbers
     interrupts_install_handler(LOCAL_APIC_IPCALL_INTERRUPT, _local_apic_ipcall_interrupt, null);
+
+    // and tlb shootdowns
+    // TODO allocate interrupt numbers
+    interrupts_install_handler(LOCAL_APIC_TLB_SHOOTDOWN_INTERRUPT, _local_apic_tlb_shootdown_interrupt, null);
 }
 
 // See https://wiki.osdev.org/APIC#IO_APIC_Configuration
@@ -588,7 +595,7 @@ static void _local_apic_ipcall_interrupt(struct interrupt_stack_registers* regs,
     case IPCALL_TASK_ENQUEUE:
         {
             struct task* target = (struct task*)ipc->payload;
-            task_enqueue(&cpu->current_task, target);
+            task_enqueue_ready(target);
         }
         break;
 
@@ -604,3 +611,18 @@ static void _local_apic_ipcall_interrupt(struct interrupt_stack_registers* regs,
     free(ipc);
 }
 
+void apic_send_tlb_shootdown(u32 cpu_index)
+{
+    assert(cpu_index < num_local_apics, "index out of range");
+    u64 cmd = _build_lapic_command(true, local_apics[cpu_index]->apic_id, LOCAL_APIC_TLB_SHOOTDOWN_INTERRUPT, LAPIC_DELIVERY_MODE_NORMAL);
+    _write_lapic_command(cmd);
+}
+
+static void _local_apic_tlb_shootdown_interrupt(struct interrupt_stack_registers* regs, intp pc, void* userdata)
+{
+    unused(regs);
+    unused(pc);
+    unused(userdata);
+
+    tlb_notify_shootdown_interrupt();
+}
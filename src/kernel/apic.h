@@ -65,4 +65,7 @@ enum IPCALL_FUNCTIONS {
 struct ipcall* apic_ipcall_build(enum IPCALL_FUNCTIONS, void*);
 s64 apic_ipcall_send(u32, struct ipcall*);
 
+// interrupt the cpu to run its queued tlb shootdown requests
+void apic_send_tlb_shootdown(u32 cpu_index);
+
 #endif
@@ -0,0 +1,495 @@
+#include "common.h"
+
+#include "apic.h"
+#include "bench.h"
+#include "cpu.h"
+#include "heap.h"
+#include "interrupts.h"
+#include "paging.h"
+#include "palloc.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "task.h"
+#include "vmem.h"
+
+// Simple in-kernel microbenchmarks, run from the shell with "bench <name>"
+// all timings are in TSC cycles, so only compare numbers taken on the same machine
+
+#define BENCH_PALLOC_BLOCKS     256  // enough to spill past the per-cpu caches into the buddy lists
+#define BENCH_PALLOC_ITERATIONS 16
+
+static void bench_palloc()
+{
+    static intp blocks[BENCH_PALLOC_BLOCKS];
+
+    fprintf(stderr, "bench: palloc with %d regions in %d sections\n", palloc_num_regions(), palloc_num_sections());
+
+    for(u8 order = 0; order < PALLOC_MAX_ORDER - 1; order++) {
+        u64 claim_cycles = 0;
+        u64 abandon_cycles = 0;
+        u32 count = 0;
+
+        for(u32 iter = 0; iter < BENCH_PALLOC_ITERATIONS; iter++) {
+            u32 n;
+
+            u64 start = __rdtsc();
+            for(n = 0; n < BENCH_PALLOC_BLOCKS; n++) {
+                if((blocks[n] = palloc_claim(order)) == 0) break;
+            }
+            claim_cycles += __rdtsc() - start;
+
+            start = __rdtsc();
+            for(u32 i = 0; i < n; i++) {
+                palloc_abandon(blocks[i], order);
+            }
+            abandon_cycles += __rdtsc() - start;
+
+            count += n;
+        }
+
+        if(count == 0) {
+            fprintf(stderr, "bench: palloc order %d: out of memory\n", order);
+            continue;
+        }
+
+        fprintf(stderr, "bench: palloc order %2d: claim %5d cycles abandon %5d cycles (%d blocks)\n", 
+                order, claim_cycles / count, abandon_cycles / count, count);
+    }
+}
+
+#define BENCH_HEAP_SLOTS      64     // live allocations per cpu
+#define BENCH_HEAP_OPERATIONS 100000 // malloc/free pairs per cpu
+#define BENCH_HEAP_MAX_SIZE   2048   // most allocations in the kernel are small
+
+static u32 volatile bench_heap_done;
+static u64 volatile bench_heap_cycles;
+
+static inline u64 _xorshift(u64* state)
+{
+    u64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return (*state = x);
+}
+
+// replace random slots in a set of live allocations with new ones of random size
+static s64 _bench_heap_worker(struct task* task)
+{
+    void* slots[BENCH_HEAP_SLOTS] = { null };
+    u64 rng = 0x9E3779B97F4A7C15ULL * (task->task_id + 1);
+
+    u64 start = __rdtsc();
+    for(u32 i = 0; i < BENCH_HEAP_OPERATIONS; i++) {
+        u64 r = _xorshift(&rng);
+        u32 slot = r % BENCH_HEAP_SLOTS;
+        free(slots[slot]);
+        slots[slot] = malloc(1 + ((r >> 32) % BENCH_HEAP_MAX_SIZE));
+    }
+    u64 cycles = __rdtsc() - start;
+
+    for(u32 i = 0; i < BENCH_HEAP_SLOTS; i++) free(slots[i]);
+
+    __atomic_add(&bench_heap_cycles, cycles);
+    __atomic_inc(&bench_heap_done);
+    return 0;
+}
+
+static void bench_heap()
+{
+    struct heap_stats stats;
+
+    // first on just this cpu
+    bench_heap_done = 0;
+    bench_heap_cycles = 0;
+    _bench_heap_worker(get_cpu()->current_task);
+    fprintf(stderr, "bench: heap 1 cpu: %d cycles per malloc/free\n", bench_heap_cycles / BENCH_HEAP_OPERATIONS);
+
+    // then on all cpus at once
+    u32 ncpus = 0;
+    bench_heap_done = 0;
+    bench_heap_cycles = 0;
+    for(u32 i = 0; i < apic_num_local_apics(); i++) {
+        if(apic_get_cpu(i) == null) continue;
+        task_enqueue_for(i, task_create(_bench_heap_worker, (intp)null, false));
+        ncpus++;
+    }
+
+    while(bench_heap_done != ncpus) task_yield(TASK_YIELD_VOLUNTARY);
+
+    fprintf(stderr, "bench: heap %d cpus: %d cycles per malloc/free\n", ncpus, bench_heap_cycles / (ncpus * BENCH_HEAP_OPERATIONS));
+
+    heap_get_stats(&stats);
+    fprintf(stderr, "bench: heap break %d KiB, %d KiB in free runs, %d KiB free centrally, %d KiB in cpu caches\n",
+            stats.break_bytes / 1024, stats.free_run_bytes / 1024, stats.central_free_bytes / 1024, stats.cpu_cached_bytes / 1024);
+}
+
+#define BENCH_VMEM_PAGES 4096 // 16MiB
+
+// touch every page of a lazy region in order, with different fault-around sizes
+static void bench_vmem()
+{
+    for(u32 fault_around = 1; fault_around <= 64; fault_around <<= 2) {
+        intp region = vmem_alloc_lazy_region(VMEM_KERNEL, BENCH_VMEM_PAGES, MAP_PAGE_FLAG_WRITABLE, fault_around);
+
+        u64 start = __rdtsc();
+        for(u32 i = 0; i < BENCH_VMEM_PAGES; i++) {
+            *(u8 volatile*)(region + ((intp)i << PAGE_SHIFT)) = 1;
+        }
+        u64 touch_cycles = __rdtsc() - start;
+
+        start = __rdtsc();
+        vmem_free_lazy_region(VMEM_KERNEL, region);
+        u64 free_cycles = __rdtsc() - start;
+
+        fprintf(stderr, "bench: vmem fault_around %2d: touch %5d cycles/page free %5d cycles/page\n",
+                fault_around, touch_cycles / BENCH_VMEM_PAGES, free_cycles / BENCH_VMEM_PAGES);
+    }
+}
+
+#define BENCH_PAGING_SIZE (64ULL * 1024 * 1024)
+
+// map and unmap 64MiB one page at a time, as a range of 4KiB pages, and as a range of 2MiB pages.
+// nothing is touched, so the physical memory doesn't need to be ours
+static void bench_paging()
+{
+    u64 npages = BENCH_PAGING_SIZE >> PAGE_SHIFT;
+    intp virt = vmem_alloc_region_aligned(VMEM_KERNEL, npages, 1ULL << 21, 0);
+    intp phys = 1ULL << 30;
+
+    u64 start = __rdtsc();
+    for(u64 i = 0; i < npages; i++) {
+        paging_map_page(PAGING_KERNEL, phys + (i << PAGE_SHIFT), virt + (i << PAGE_SHIFT), MAP_PAGE_FLAG_WRITABLE);
+    }
+    u64 map_cycles = __rdtsc() - start;
+
+    start = __rdtsc();
+    for(u64 i = 0; i < npages; i++) {
+        paging_unmap_page(PAGING_KERNEL, virt + (i << PAGE_SHIFT));
+    }
+    u64 unmap_cycles = __rdtsc() - start;
+    fprintf(stderr, "bench: paging 64MiB per page:        map %9d cycles unmap %9d cycles\n", map_cycles, unmap_cycles);
+
+    // offsetting the physical address by a page keeps paging_map_range from using 2MiB pages
+    start = __rdtsc();
+    paging_map_range(PAGING_KERNEL, phys + PAGE_SIZE, virt, BENCH_PAGING_SIZE, MAP_PAGE_FLAG_WRITABLE);
+    map_cycles = __rdtsc() - start;
+
+    start = __rdtsc();
+    paging_unmap_range(PAGING_KERNEL, virt, BENCH_PAGING_SIZE);
+    unmap_cycles = __rdtsc() - start;
+    fprintf(stderr, "bench: paging 64MiB range (4KiB):    map %9d cycles unmap %9d cycles\n", map_cycles, unmap_cycles);
+
+    start = __rdtsc();
+    paging_map_range(PAGING_KERNEL, phys, virt, BENCH_PAGING_SIZE, MAP_PAGE_FLAG_WRITABLE);
+    map_cycles = __rdtsc() - start;
+
+    start = __rdtsc();
+    paging_unmap_range(PAGING_KERNEL, virt, BENCH_PAGING_SIZE);
+    unmap_cycles = __rdtsc() - start;
+    fprintf(stderr, "bench: paging 64MiB range (2MiB):    map %9d cycles unmap %9d cycles\n", map_cycles, unmap_cycles);
+
+    // unmapping a page out of the middle of every 2MiB page forces a split
+    paging_map_range(PAGING_KERNEL, phys, virt, BENCH_PAGING_SIZE, MAP_PAGE_FLAG_WRITABLE);
+    start = __rdtsc();
+    for(intp offs = 0; offs < BENCH_PAGING_SIZE; offs += (1ULL << 21)) {
+        paging_unmap_range(PAGING_KERNEL, virt + offs + (1ULL << 20), PAGE_SIZE);
+    }
+    unmap_cycles = __rdtsc() - start;
+    fprintf(stderr, "bench: paging 64MiB split 2MiB pages:              unmap %9d cycles (%d per split)\n", unmap_cycles, unmap_cycles / (BENCH_PAGING_SIZE >> 21));
+
+    for(intp offs = 0; offs < BENCH_PAGING_SIZE; offs += (1ULL << 21)) {
+        paging_unmap_range(PAGING_KERNEL, virt + offs, 1ULL << 20);
+        paging_unmap_range(PAGING_KERNEL, virt + offs + (1ULL << 20) + PAGE_SIZE, (1ULL << 20) - PAGE_SIZE);
+    }
+
+    vmem_free_region(VMEM_KERNEL, virt, npages);
+}
+
+#define BENCH_SWITCH_ROUNDS 100000
+#define BENCH_SWITCH_PAGES  64    // pages touched between switches, so that losing the TLB shows up in the timing
+
+static u32 volatile bench_switch_done;
+static u64 volatile bench_switch_cycles;
+static u8* bench_switch_buffer;
+
+static s64 _bench_switch_worker(struct task* task)
+{
+    unused(task);
+
+    u64 start = __rdtsc();
+    for(u32 i = 0; i < BENCH_SWITCH_ROUNDS; i++) {
+        for(u32 j = 0; j < BENCH_SWITCH_PAGES; j++) bench_switch_buffer[(intp)j << PAGE_SHIFT]++;
+        task_yield(TASK_YIELD_VOLUNTARY);
+    }
+    u64 cycles = __rdtsc() - start;
+
+    __atomic_add(&bench_switch_cycles, cycles);
+    __atomic_inc(&bench_switch_done);
+    return 0;
+}
+
+// two tasks on this cpu yield back and forth. the shell task is in the rotation too, so a round is
+// a trip through every runnable task on the cpu
+static void _bench_switch_run(char const* name, struct page_table* table_a, struct page_table* table_b)
+{
+    bench_switch_done = 0;
+    bench_switch_cycles = 0;
+
+    // the tasks run kernel code, but in whichever address space they're given. cr3 is set by the scheduler
+    struct task* task_a = task_create(_bench_switch_worker, (intp)null, false);
+    struct task* task_b = task_create(_bench_switch_worker, (intp)null, false);
+    task_a->page_table = table_a;
+    task_b->page_table = table_b;
+    task_enqueue_ready(task_a);
+    task_enqueue_ready(task_b);
+
+    while(bench_switch_done != 2) task_yield(TASK_YIELD_VOLUNTARY);
+
+    fprintf(stderr, "bench: switch %-20s %6d cycles per round\n", name, bench_switch_cycles / (2 * BENCH_SWITCH_ROUNDS));
+}
+
+static void bench_switch()
+{
+    // keep the tables around for the next run instead of creating and destroying a pair every time
+    static struct page_table* tables[2] = { null, null };
+    if(tables[0] == null) {
+        tables[0] = paging_create_private_table();
+        tables[1] = paging_create_private_table();
+    }
+
+    bench_switch_buffer = (u8*)malloc(BENCH_SWITCH_PAGES << PAGE_SHIFT);
+    fprintf(stderr, "bench: switch with pcids %s\n", paging_has_pcid() ? "enabled" : "disabled");
+
+    _bench_switch_run("kernel <-> kernel", PAGING_KERNEL, PAGING_KERNEL);
+    _bench_switch_run("same process", tables[0], tables[0]);
+    _bench_switch_run("different processes", tables[0], tables[1]);
+
+    free(bench_switch_buffer);
+}
+
+#define BENCH_SCHED_TASKS  1000   // runnable tasks waiting below the ones being timed
+#define BENCH_SCHED_ROUNDS 100000
+
+static u32 volatile bench_sched_done;
+static u64 volatile bench_sched_cycles;
+static u32 volatile bench_sched_stop;
+static u32 volatile bench_sched_alive;
+
+static s64 _bench_sched_worker(struct task* task)
+{
+    unused(task);
+
+    u64 start = __rdtsc();
+    for(u32 i = 0; i < BENCH_SCHED_ROUNDS; i++) task_yield(TASK_YIELD_VOLUNTARY);
+    u64 cycles = __rdtsc() - start;
+
+    __atomic_add(&bench_sched_cycles, cycles);
+    __atomic_inc(&bench_sched_done);
+    return 0;
+}
+
+// stands in for an idle connection task. it stays in the run queue behind the timed tasks until they're done
+static s64 _bench_sched_background(struct task* task)
+{
+    unused(task);
+
+    while(!bench_sched_stop) task_yield(TASK_YIELD_VOLUNTARY);
+    __atomic_dec(&bench_sched_alive);
+    return 0;
+}
+
+// two tasks at the highest priority yield back and forth while 'background' tasks are ready at the normal one,
+// which shows whether picking the next task depends on how many tasks are queued
+static void _bench_sched_run(u32 background)
+{
+    bench_sched_done = 0;
+    bench_sched_cycles = 0;
+    bench_sched_stop = 0;
+    bench_sched_alive = background;
+
+    for(u32 i = 0; i < background; i++) task_enqueue_ready(task_create(_bench_sched_background, (intp)null, false));
+
+    struct task* task_a = task_create(_bench_sched_worker, (intp)null, false);
+    struct task* task_b = task_create(_bench_sched_worker, (intp)null, false);
+    task_set_priority(task_a, TASK_PRIORITY_MAX);
+    task_set_priority(task_b, TASK_PRIORITY_MAX);
+    task_enqueue_ready(task_a);
+    task_enqueue_ready(task_b);
+
+    while(bench_sched_done != 2) task_yield(TASK_YIELD_VOLUNTARY);
+
+    // both tasks ran for about the same time, and every one of their yields was a switch
+    fprintf(stderr, "bench: sched %4d tasks ready %6d cycles per switch\n", background, bench_sched_cycles / (4 * BENCH_SCHED_ROUNDS));
+
+    bench_sched_stop = 1;
+    while(bench_sched_alive != 0) task_yield(TASK_YIELD_VOLUNTARY);
+}
+
+static void bench_sched()
+{
+    _bench_sched_run(0);
+    _bench_sched_run(BENCH_SCHED_TASKS);
+}
+
+#define BENCH_IRQ_VECTOR     52 // not used by anything else
+#define BENCH_IRQ_ITERATIONS 10000
+
+static void _bench_irq_handler(struct interrupt_stack_registers* regs, intp pc, void* userdata)
+{
+    unused(regs);
+    unused(pc);
+    unused(userdata);
+}
+
+static u64 _bench_irq_round_trip(bool reload_cr3)
+{
+    u64 cycles = 0;
+
+    for(u32 i = 0; i < BENCH_IRQ_ITERATIONS; i++) {
+        if(reload_cr3) __wrcr3(__rdcr3());
+
+        u64 start = __rdtsc();
+        asm volatile("int %0" : : "i"(BENCH_IRQ_VECTOR) : "memory");
+        cycles += __rdtsc() - start;
+    }
+
+    return cycles / BENCH_IRQ_ITERATIONS;
+}
+
+// round trips through the interrupt entry and exit path, which system calls take too, with and without global
+// pages. right after a cr3 write, only global pages keep the kernel's TLB entries for the handler
+static void bench_irq()
+{
+    u64 results[2][2];
+
+    interrupts_install_handler(BENCH_IRQ_VECTOR, _bench_irq_handler, null);
+
+    // stay on this cpu while CR4 is changed
+    u64 cpu_flags = __cli_saveflags();
+    u64 cr4 = __rdcr4();
+
+    for(u32 pass = 0; pass < 2; pass++) {
+        if(pass == 1) __wrcr4(cr4 & ~CR4_PGE);
+        results[pass][0] = _bench_irq_round_trip(false);
+        results[pass][1] = _bench_irq_round_trip(true);
+    }
+
+    __wrcr4(cr4);
+    __restoreflags(cpu_flags);
+
+    fprintf(stderr, "bench: irq with global pages:    %5d cycles warm, %5d cycles after cr3 write\n", results[0][0], results[0][1]);
+    fprintf(stderr, "bench: irq without global pages: %5d cycles warm, %5d cycles after cr3 write\n", results[1][0], results[1][1]);
+}
+
+#define BENCH_CLONE_REGION_PAGES (1ULL << 18) // 1GiB lazy region
+
+// clone an address space with a 1GiB lazy region that has 0, 64 and 4096 pages touched, then write to every touched
+// page of the clone. the table isn't loaded, so pages are mapped and copy-on-write faults resolved by calling paging
+// directly
+static void bench_clone()
+{
+    u32 flags = MAP_PAGE_FLAG_WRITABLE | MAP_PAGE_FLAG_USER;
+
+    for(u32 touched = 0; touched <= 4096; touched = (touched == 0) ? 64 : (touched << 6)) {
+        struct page_table* table = paging_create_private_table();
+        intp vmem = vmem_create_private_memory(table);
+        intp region = vmem_alloc_lazy_region(vmem, BENCH_CLONE_REGION_PAGES, flags, 0);
+        for(u32 i = 0; i < touched; i++) {
+            paging_map_page(table, palloc_claim_one(), region + ((intp)i << PAGE_SHIFT), flags);
+        }
+
+        struct page_table* clone_table = paging_create_private_table();
+        u64 tables = paging_num_tables();
+        u64 start = __rdtsc();
+        intp clone = vmem_clone_private_memory(vmem, clone_table);
+        u64 clone_cycles = __rdtsc() - start;
+        tables = paging_num_tables() - tables;
+
+        start = __rdtsc();
+        for(u32 i = 0; i < touched; i++) {
+            paging_handle_cow_fault(clone_table, region + ((intp)i << PAGE_SHIFT));
+        }
+        u64 copy_cycles = __rdtsc() - start;
+
+        fprintf(stderr, "bench: clone 1GiB with %4d pages touched: %8d cycles, %2d page tables, %6d cycles per copy\n",
+                touched, clone_cycles, tables, (touched == 0) ? 0 : copy_cycles / touched);
+
+        vmem_destroy_private_memory(clone);
+        vmem_destroy_private_memory(vmem);
+        paging_destroy_private_table(clone_table);
+        paging_destroy_private_table(table);
+    }
+}
+
+#define BENCH_HUGE_SIZE     (64ULL * 1024 * 1024)
+#define BENCH_HUGE_ACCESSES 1000000
+
+static u64 _bench_huge_touch(intp buffer)
+{
+    u64 state = 0x9E3779B97F4A7C15ULL;
+    u64 start = __rdtsc();
+    for(u32 i = 0; i < BENCH_HUGE_ACCESSES; i++) {
+        // one random word per page, so nearly every access needs a different translation
+        *(u64 volatile*)(buffer + ((_xorshift(&state) % BENCH_HUGE_SIZE) & ~(intp)7)) += 1;
+    }
+    return __rdtsc() - start;
+}
+
+// random accesses over 64MiB mapped with 4KiB pages, then with 2MiB pages. 64MiB is far more than the 4KiB TLB reach
+static void bench_huge()
+{
+    intp region = vmem_alloc_lazy_region(VMEM_KERNEL, BENCH_HUGE_SIZE >> PAGE_SHIFT, MAP_PAGE_FLAG_WRITABLE, 64);
+    if(region == 0) return;
+    for(intp offs = 0; offs < BENCH_HUGE_SIZE; offs += PAGE_SIZE) *(u8 volatile*)(region + offs) = 0; // fault it all in
+    u64 small_cycles = _bench_huge_touch(region);
+    vmem_free_lazy_region(VMEM_KERNEL, region);
+
+    u64 start = __rdtsc();
+    intp buffer = vmem_alloc_huge(VMEM_KERNEL, BENCH_HUGE_SIZE, MAP_PAGE_FLAG_WRITABLE);
+    u64 alloc_cycles = __rdtsc() - start;
+    if(buffer == 0) return;
+    u64 huge_cycles = _bench_huge_touch(buffer);
+
+    start = __rdtsc();
+    vmem_free_huge(VMEM_KERNEL, buffer, BENCH_HUGE_SIZE);
+    u64 free_cycles = __rdtsc() - start;
+
+    fprintf(stderr, "bench: huge 64MiB random access: 4KiB pages %4d cycles/access, 2MiB pages %4d cycles/access\n",
+            small_cycles / BENCH_HUGE_ACCESSES, huge_cycles / BENCH_HUGE_ACCESSES);
+    fprintf(stderr, "bench: huge 64MiB alloc %9d cycles free %9d cycles\n", alloc_cycles, free_cycles);
+}
+
+static struct {
+    char const* name;
+    void (*func)();
+} const benchmarks[] = {
+    { "palloc", bench_palloc },
+    { "heap"  , bench_heap   },
+    { "vmem"  , bench_vmem   },
+    { "paging", bench_paging },
+    { "switch", bench_switch },
+    { "sched" , bench_sched  },
+    { "irq"   , bench_irq    },
+    { "clone" , bench_clone  },
+    { "huge"  , bench_huge   },
+};
+
+void bench_run(char const* name)
+{
+    bool found = false;
+
+    for(u32 i = 0; i < countof(benchmarks); i++) {
+        if(*name == '\0' || strcmp(name, benchmarks[i].name) == 0) {
+            benchmarks[i].func();
+            found = true;
+        }
+    }
+
+    if(!found) {
+        fprintf(stderr, "bench: unknown benchmark '%s'. available:", name);
+        for(u32 i = 0; i < countof(benchmarks); i++) fprintf(stderr, " %s", benchmarks[i].name);
+        fprintf(stderr, "\n");
+    }
+}
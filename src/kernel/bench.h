@@ -0,0 +1,6 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+void bench_run(char const* name); // run the named benchmark, or all of them if name is empty
+
+#endif
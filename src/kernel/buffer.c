@@ -1,8 +1,8 @@
 #include "common.h"
 
 #include "buffer.h"
-#include "kalloc.h"
 #include "kernel.h"
+#include "kmem.h"
 #include "stdlib.h"
 #include "string.h"
 
@@ -10,10 +10,22 @@ enum BUFFER_FLAGS {
     BUFFER_FLAG_USER_BUFFER = 1 << 0,
 };
 
+// buffers are constructed zeroed, and buffer_destroy() zeroes them again before giving them back
+static struct kmem_cache* buffer_cache;
+
+static void _buffer_ctor(void* object)
+{
+    zero((struct buffer*)object);
+}
+
+void buffer_init()
+{
+    buffer_cache = kmem_cache_create("buffer", sizeof(struct buffer), 0, _buffer_ctor);
+}
+
 struct buffer* buffer_create(u32 size)
 {
-    struct buffer* buf = (struct buffer*)kalloc(sizeof(struct buffer));
-    zero(buf);
+    struct buffer* buf = (struct buffer*)kmem_cache_alloc(buffer_cache);
     buf->buf = (u8*)malloc(size);
     buf->size = size;
     return buf;
@@ -21,8 +33,7 @@ struct buffer* buffer_create(u32 size)
 
 struct buffer* buffer_create_with(u8* userbuf, u32 size, u32 write_pos)
 {
-    struct buffer* buf = (struct buffer*)kalloc(sizeof(struct buffer));
-    zero(buf);
+    struct buffer* buf = (struct buffer*)kmem_cache_alloc(buffer_cache);
     buf->buf       = userbuf;
     buf->size      = size;
     buf->write_pos = write_pos;
@@ -33,7 +44,8 @@ struct buffer* buffer_create_with(u8* userbuf, u32 size, u32 write_pos)
 void buffer_destroy(struct buffer* buf)
 {
     if((buf->buf_flags & BUFFER_FLAG_USER_BUFFER) == 0) free(buf->buf);
-    kfree(buf, sizeof(struct buffer));
+    zero(buf);
+    kmem_cache_free(buffer_cache, buf);
 }
 
 u32 buffer_peek(struct buffer* buf, u8* dest, u32 max_read_size)
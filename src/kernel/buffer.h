@@ -32,6 +32,7 @@ struct buffer {
     u64 unused1;
 };
 
+void           buffer_init(); // create the object cache for struct buffer
 struct buffer* buffer_create(u32 size);
 struct buffer* buffer_create_with(u8*, u32 size, u32 write_pos);     // provide your own storage
 void           buffer_destroy(struct buffer*);
@@ -141,14 +141,55 @@ static inline u64 __rdcr3()
     return ret;
 }
 
+enum CR4_FLAGS {
+    CR4_PGE   = (1 << 7),  // global pages
+    CR4_PCIDE = (1 << 17)  // process-context identifiers
+};
+
+static inline void __wrcr4(u64 val)
+{
+    asm volatile("mov %0, %%cr4" : : "r"(val) : "memory");
+}
+
+static inline u64 __rdcr4()
+{
+    u64 ret;
+    asm volatile("mov %%cr4, %0" : "=r"(ret) );
+    return ret;
+}
+
 static inline void __invlpg(intp addr) 
 {
     asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
 }
 
+enum INVPCID_TYPES {
+    INVPCID_ADDRESS             = 0, // one address in one pcid
+    INVPCID_SINGLE_CONTEXT      = 1, // every non-global translation in one pcid
+    INVPCID_ALL_CONTEXTS_GLOBAL = 2, // everything, including global translations
+    INVPCID_ALL_CONTEXTS        = 3  // every non-global translation in every pcid
+};
+
+static inline void __invpcid(u64 type, u16 pcid, intp addr)
+{
+    struct { u64 pcid; u64 addr; } desc = { pcid, addr };
+    asm volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+static inline u64 __rdtsc()
+{
+    u32 low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((u64)high << 32) | low;
+}
+
 // GSBase
 //
 struct task;
+struct task_run_queue;
+struct palloc_cpu_cache;
+struct kalloc_cpu_cache;
+struct heap_cpu_cache;
 
 struct cpu {
     struct cpu* this;
@@ -159,12 +200,12 @@ struct cpu {
     // stack that the tss for this cpu will use
     intp tss_stack_bottom;
 
-    // current_task serves as the task queue, with the head
-    // of the list being the currently running task
+    // the task running on this cpu. it isn't in the run queue while it runs
     struct task* current_task;
     struct task* exited_task; // list of tasks that have exited and need freeing
     struct task* blocked_task; // list of tasks that are waiting on events
-    struct task* volatile unblocked_task; // list of tasks that have been unblocked but need to be added to the current task queue
+    struct task* volatile unblocked_task; // list of tasks that have been unblocked but need to be added to the run queue
+    struct task_run_queue* run_queue; // ready tasks by priority, see task.c
 
     // local APIC (or other) timer frequency
     u64 timer_frequency;
@@ -175,6 +216,27 @@ struct cpu {
     // ipcall support
     struct ticketlock ipcall_lock;
     struct ipcall*    ipcall;
+
+    // per-cpu page cache in front of palloc
+    struct palloc_cpu_cache* palloc_cache;
+
+    // per-cpu magazines in front of the kalloc pools
+    struct kalloc_cpu_cache* kalloc_cache;
+
+    // per-cpu free lists in front of the malloc heap
+    struct heap_cpu_cache* heap_cache;
+
+    // mapped kernel stacks ready for new tasks
+    struct task_stack_cache* task_stack_cache;
+
+    // pcids handed out on this cpu. every address space's pcid is only valid for one generation
+    u64 pcid_generation;
+    u16 pcid_next;
+    u16 padding1;
+    u32 padding2;
+
+    // pending tlb shootdown requests from other cpus
+    struct tlb_request* volatile tlb_requests;
 };
 
 static inline intp __get_cpu()
@@ -2,12 +2,29 @@
 #define __CPUID_H__
 
 enum {
+    CPUID_FEAT_ECX_PCID = (1 << 17),
     CPUID_FEAT_EDX_APIC = (1 << 9)
 };
 
+// structured extended features, cpuid 7 subleaf 0
+enum {
+    CPUID_EXT7_FEAT_EBX_INVPCID = (1 << 10)
+};
+
+// extended features, cpuid 0x80000001
+enum {
+    CPUID_EXT_FEAT_EDX_PAGE1GB = (1 << 26)
+};
+
 static inline void __cpuid(u64 code, u64* eax, u64* ebx, u64* ecx, u64* edx)
 {
     __asm__ ("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "0" (code));
 }
 
+// for leaves that take a subleaf in ecx
+static inline void __cpuid_subleaf(u64 code, u64 subleaf, u64* eax, u64* ebx, u64* ecx, u64* edx)
+{
+    __asm__ ("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "0" (code), "2" (subleaf));
+}
+
 #endif
@@ -3,6 +3,7 @@
 #include "apic.h"
 #include "cpu.h"
 #include "gdt.h"
+#include "kernel.h"
 #include "paging.h"
 #include "palloc.h"
 #include "stdio.h"
@@ -169,6 +170,21 @@ void gdt_install(u32 cpu_index)
 //                  ".reload_cs:\n" : : "m"(_gdtr));
 }
 
+void gdt_set_tss_ist(u8 ist, intp rsp)
+{
+    u32 ncpus = apic_num_local_apics(); // needed for ALL_GDTs_SIZE
+
+    assert(ist >= 1 && ist <= 7, "invalid interrupt stack table index");
+
+    // get pointer to TSS
+    struct cpu* cpu = get_cpu();
+    struct gdt_tss* tss = (struct gdt_tss*)(_gdt + ALL_GDTs_SIZE + cpu->cpu_index * ONE_TSS_SIZE);
+
+    // ist1..ist7 are consecutive, and the cpu reads them when the interrupt happens so there's nothing to reload
+    u64* ist_table = (u64*)((u8*)tss + offsetof(struct gdt_tss, ist1));
+    ist_table[ist - 1] = rsp;
+}
+
 void gdt_set_tss_rsp0(intp rsp)
 {
     u32 ncpus = apic_num_local_apics(); // needed for ALL_GDTs_SIZE
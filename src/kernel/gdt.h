@@ -24,4 +24,7 @@ void gdt_init();
 void gdt_install(u32);
 void gdt_set_tss_rsp0(intp);
 
+// set interrupt stack table entry ist (1..7) in the current cpu's TSS
+void gdt_set_tss_ist(u8 ist, intp rsp);
+
 #endif
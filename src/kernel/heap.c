@@ -0,0 +1,697 @@
+// heap - the general purpose kernel heap behind malloc() and free()
+//
+// The heap lives in a single contiguous region of kernel virtual memory that is reserved at boot and backed
+// with physical pages as it grows. The region is handed out in 64KiB chunks, and each chunk starts with a small
+// header so that free() can find out what a pointer is by masking off the low bits of the address.
+//
+// Requests up to HEAP_MAX_SMALL bytes are rounded to a size class. Each chunk of a class keeps its own free list,
+// and the class keeps the chunks with free objects on a central list. Every cpu keeps its own list per class in
+// front of it (like the thread caches in tcmalloc). malloc/free only touch the cpu list with interrupts disabled,
+// and move objects to and from the chunks in batches. Objects on cpu lists count as allocated in their chunk. Once
+// every object in a chunk is free, the chunk is kept for reuse (up to HEAP_EMPTY_CHUNKS_MAX per class) or goes back
+// to the chunk allocator. Objects are aligned to the lowest set bit of their class size, which costs no space since
+// the chunk header fits in the slack at the end of every chunk.
+//
+// Larger requests get a run of chunks of their own, with only the pages that are needed mapped in. Freed runs give
+// their physical pages back to palloc right away, and are merged with their free neighbours. The free runs are kept
+// in address order and allocated first fit.
+//
+// The central locks and the chunk allocator's lock are taken with interrupts disabled, since the cpu lists are.
+// Pages are mapped and unmapped outside of them with interrupts in whatever state the caller had.
+
+#include "common.h"
+
+#include "apic.h"
+#include "cpu.h"
+#include "heap.h"
+#include "kalloc.h"
+#include "kernel.h"
+#include "paging.h"
+#include "palloc.h"
+#include "smp.h"
+#include "stdio.h"
+#include "string.h"
+#include "vmem.h"
+
+// verbosity levels 1 or 2
+#define HEAP_VERBOSE 0
+
+#define HEAP_MAX_SIZE     (64ULL << 30)  // amount of virtual memory reserved for the heap
+#define HEAP_CHUNK_SHIFT  16
+#define HEAP_CHUNK_SIZE   (1ULL << HEAP_CHUNK_SHIFT)
+#define HEAP_CHUNK_PAGES  (HEAP_CHUNK_SIZE >> PAGE_SHIFT)
+#define HEAP_HEADER_SIZE  64
+#define HEAP_MAX_SMALL    16384          // largest size class
+#define HEAP_CACHE_BYTES  (32 * 1024)    // most memory each cpu list holds on to
+#define HEAP_CHUNK_MAGIC  0x50414548     // 'HEAP'
+#define HEAP_UNMAP_BATCH  64             // pages freed per tlb shootdown
+#define HEAP_EMPTY_CHUNKS_MAX 1          // completely free chunks each class holds on to
+
+#define HEAP_CLASS_LARGE  0xFFFF
+#define HEAP_CLASS_FREE   0xFFFE
+
+struct heap_chunk {
+    u32    magic;
+    u16    size_class;      // size class, or HEAP_CLASS_LARGE/HEAP_CLASS_FREE for runs
+    u16    offset;          // large objects: offset of the object from the start of the chunk
+    u32    nchunks;         // chunks in this run. always 1 for size class chunks
+    u32    npages;          // pages mapped from the start of the run
+    u64    requested;       // large objects: size requested
+    struct heap_chunk* next; // free run list, or the central partial/empty lists for size class chunks
+    struct heap_chunk* prev; // same lists as next
+    void*  free_list;       // size class chunks: free objects
+    u32    num_free;
+    u32    num_objects;
+    u8     padding0[HEAP_HEADER_SIZE - 56];
+};
+
+static_assert(sizeof(struct heap_chunk) == HEAP_HEADER_SIZE, "chunk header size must match HEAP_HEADER_SIZE");
+
+static u16 const heap_classes[] = {
+       16,    32,    48,    64,    80,    96,   128,   160,   192,   256,   320,   384,   512,   640,
+      768,  1024,  1280,  1536,  2048,  2560,  3072,  4096,  5120,  6144,  8192, 10240, 12288, 16384,
+};
+
+#define HEAP_NUM_CLASSES countof(heap_classes)
+
+// lookup tables from size to class: 16 byte granularity up to 1KiB, 128 byte granularity after that
+static u8 small_size_to_class[1024 / 16 + 1];
+static u8 large_size_to_class[HEAP_MAX_SMALL / 128 + 1];
+
+// full chunks aren't on either list. they go back on the partial list when an object is returned to them
+struct heap_central {
+    struct ticketlock lock;
+    struct heap_chunk* partial_chunks;
+    struct heap_chunk* empty_chunks;
+    u64    num_free;
+    u64    num_chunks;
+    u32    num_empty;
+};
+
+static struct heap_central central_lists[HEAP_NUM_CLASSES];
+
+struct heap_cpu_list {
+    void*  head;
+    u32    count;
+    u32    max;
+};
+
+struct heap_cpu_cache {
+    struct heap_cpu_list lists[HEAP_NUM_CLASSES];
+};
+
+// the chunk allocator
+static intp heap_base = 0;
+static intp heap_break;
+static intp heap_end;
+static struct heap_chunk* free_runs = null;
+declare_ticketlock(heap_lock);
+
+static inline u8 _size_class(u64 size)
+{
+    if(size <= 1024) return small_size_to_class[(size + 15) >> 4];
+    return large_size_to_class[(size + 127) >> 7];
+}
+
+static inline struct heap_chunk* _chunk_of(void* ptr)
+{
+    struct heap_chunk* chunk = (struct heap_chunk*)((intp)ptr & ~(HEAP_CHUNK_SIZE - 1));
+    assert(chunk->magic == HEAP_CHUNK_MAGIC, "pointer was not allocated with malloc");
+    return chunk;
+}
+
+// paging_unmap_pages invalidates the pages on every cpu before returning, once per batch, so the
+// physical pages can be given back right after
+static void _unmap_pages(intp virt, u64 npages)
+{
+    intp phys[HEAP_UNMAP_BATCH];
+
+    while(npages > 0) {
+        u64 count = min(npages, HEAP_UNMAP_BATCH);
+        paging_unmap_pages(PAGING_KERNEL, virt, count, phys);
+        for(u64 i = 0; i < count; i++) {
+            if(phys[i] != 0) palloc_abandon(phys[i], 0);
+        }
+
+        virt += count << PAGE_SHIFT;
+        npages -= count;
+    }
+}
+
+// back [virt, virt+npages) with new physical pages. on failure nothing is left mapped
+static bool _map_pages(intp virt, u64 npages)
+{
+    for(u64 i = 0; i < npages; i++) {
+        intp phys = palloc_claim_one();
+        if(phys == 0) {
+            _unmap_pages(virt, i);
+            return false;
+        }
+        paging_map_page(PAGING_KERNEL, phys, virt + (i << PAGE_SHIFT), MAP_PAGE_FLAG_WRITABLE);
+    }
+
+    return true;
+}
+
+static inline u64 _lock_heap()
+{
+    u64 cpu_flags = __cli_saveflags();
+    acquire_lock(heap_lock);
+    return cpu_flags;
+}
+
+static inline void _unlock_heap(u64 cpu_flags)
+{
+    release_lock(heap_lock);
+    __restoreflags(cpu_flags);
+}
+
+static inline intp _run_end(struct heap_chunk* run)
+{
+    return (intp)run + ((intp)run->nchunks << HEAP_CHUNK_SHIFT);
+}
+
+// called with heap_lock held
+static inline void _run_list_remove(struct heap_chunk* run)
+{
+    if(run->prev != null) run->prev->next = run->next;
+    else                  free_runs = run->next;
+    if(run->next != null) run->next->prev = run->prev;
+}
+
+// put a run with only its first page mapped on the free list, merging it with its neighbours. the neighbours are
+// taken off the list while their headers are unmapped, so that nobody can claim the merged run in the meantime
+static void _put_free_run(struct heap_chunk* run)
+{
+    run->size_class = HEAP_CLASS_FREE;
+
+    while(true) {
+        u64 cpu_flags = _lock_heap();
+
+        // the list is kept in address order
+        struct heap_chunk* prev = null;
+        struct heap_chunk* next = free_runs;
+        while(next != null && next < run) {
+            prev = next;
+            next = next->next;
+        }
+
+        bool merge_prev = (prev != null && _run_end(prev) == (intp)run);
+        bool merge_next = (next != null && _run_end(run) == (intp)next);
+
+        if(!merge_prev && !merge_next) {
+            run->prev = prev;
+            run->next = next;
+            if(prev != null) prev->next = run;
+            else             free_runs = run;
+            if(next != null) next->prev = run;
+            _unlock_heap(cpu_flags);
+            return;
+        }
+
+        if(merge_prev) _run_list_remove(prev);
+        if(merge_next) _run_list_remove(next);
+        _unlock_heap(cpu_flags);
+
+        // the absorbed headers end up in the middle of the merged run, where free runs have nothing mapped
+        if(merge_next) {
+            run->nchunks += next->nchunks;
+            _unmap_pages((intp)next, 1);
+        }
+
+        if(merge_prev) {
+            prev->nchunks += run->nchunks;
+            _unmap_pages((intp)run, 1);
+            run = prev;
+        }
+    }
+}
+
+// reserve nchunks at the break and map the first page. the page is claimed before the break moves, so that the
+// new run can always go on the free list if the rest of it can't be mapped
+static struct heap_chunk* _grow_heap(u32 nchunks)
+{
+    intp header = palloc_claim_one();
+    if(header == 0) return null;
+
+    struct heap_chunk* run = null;
+
+    u64 cpu_flags = _lock_heap();
+    if((heap_break + ((intp)nchunks << HEAP_CHUNK_SHIFT)) <= heap_end) {
+        run = (struct heap_chunk*)heap_break;
+        heap_break += (intp)nchunks << HEAP_CHUNK_SHIFT;
+    }
+    _unlock_heap(cpu_flags);
+
+    if(run == null) {
+        palloc_abandon(header, 0);
+        return null;
+    }
+
+    paging_map_page(PAGING_KERNEL, header, (intp)run, MAP_PAGE_FLAG_WRITABLE);
+    run->magic      = HEAP_CHUNK_MAGIC;
+    run->size_class = HEAP_CLASS_FREE;
+    run->nchunks    = nchunks;
+    run->npages     = 1;
+    return run;
+}
+
+// allocate a run of nchunks chunks with the first npages pages mapped. heap_lock only covers taking the run, so that
+// mapping (which can reclaim) happens with interrupts in whatever state the caller had
+static struct heap_chunk* _alloc_run(u32 nchunks, u32 npages)
+{
+    // first fit from the free runs, which only ever have their first page mapped
+    u64 cpu_flags = _lock_heap();
+    struct heap_chunk* run = free_runs;
+    while(run != null && run->nchunks < nchunks) run = run->next;
+    if(run != null) _run_list_remove(run);
+    _unlock_heap(cpu_flags);
+
+    // nothing free, so grow the heap
+    if(run == null && (run = _grow_heap(nchunks)) == null) return null;
+
+    // the run is ours now. on failure it goes back on the free list whole
+    if(!_map_pages((intp)run + PAGE_SIZE, npages - 1)) {
+        _put_free_run(run);
+        return null;
+    }
+
+    // split off the tail as a new free run
+    if(run->nchunks > nchunks) {
+        struct heap_chunk* rest = (struct heap_chunk*)((intp)run + ((intp)nchunks << HEAP_CHUNK_SHIFT));
+        if(!_map_pages((intp)rest, 1)) {
+            _unmap_pages((intp)run + PAGE_SIZE, npages - 1);
+            _put_free_run(run);
+            return null;
+        }
+
+        rest->magic   = HEAP_CHUNK_MAGIC;
+        rest->nchunks = run->nchunks - nchunks;
+        rest->npages  = 1;
+        _put_free_run(rest);
+    }
+
+    zero(run);
+    run->magic   = HEAP_CHUNK_MAGIC;
+    run->nchunks = nchunks;
+    run->npages  = npages;
+
+#if HEAP_VERBOSE > 1
+    fprintf(stderr, "heap: allocated run 0x%lX nchunks=%d npages=%d break=0x%lX\n", run, nchunks, npages, heap_break);
+#endif
+
+    return run;
+}
+
+static void _free_run(struct heap_chunk* run)
+{
+    // all but the first page go back to palloc right away
+    _unmap_pages((intp)run + PAGE_SIZE, run->npages - 1);
+    run->npages = 1;
+    _put_free_run(run);
+}
+
+static inline u64 _lock_central(struct heap_central* central)
+{
+    u64 cpu_flags = __cli_saveflags();
+    acquire_lock(central->lock);
+    return cpu_flags;
+}
+
+static inline void _unlock_central(struct heap_central* central, u64 cpu_flags)
+{
+    release_lock(central->lock);
+    __restoreflags(cpu_flags);
+}
+
+static inline void _chunk_list_remove(struct heap_chunk** head, struct heap_chunk* chunk)
+{
+    if(chunk->prev != null) chunk->prev->next = chunk->next;
+    else                    *head = chunk->next;
+    if(chunk->next != null) chunk->next->prev = chunk->prev;
+}
+
+static inline void _chunk_list_push(struct heap_chunk** head, struct heap_chunk* chunk)
+{
+    chunk->prev = null;
+    chunk->next = *head;
+    if(chunk->next != null) chunk->next->prev = chunk;
+    *head = chunk;
+}
+
+// called with the central lock held. returns null when no chunk of the class has a free object
+static void** _central_next(u8 c)
+{
+    struct heap_central* central = &central_lists[c];
+
+    // prefer partially used chunks so that the empty one can stay empty
+    struct heap_chunk* chunk = central->partial_chunks;
+    if(chunk == null) {
+        if((chunk = central->empty_chunks) == null) return null;
+        _chunk_list_remove(&central->empty_chunks, chunk);
+        _chunk_list_push(&central->partial_chunks, chunk);
+        central->num_empty--;
+    }
+
+    void** obj = (void**)chunk->free_list;
+    chunk->free_list = *obj;
+    chunk->num_free--;
+    central->num_free--;
+
+    if(chunk->num_free == 0) _chunk_list_remove(&central->partial_chunks, chunk);
+    return obj;
+}
+
+// called with the central lock held. returns the chunk if it's now unused and has to be freed by the caller, which
+// should happen after the lock is released
+static struct heap_chunk* _central_return(u8 c, void* obj)
+{
+    struct heap_central* central = &central_lists[c];
+    struct heap_chunk* chunk = _chunk_of(obj);
+
+    // a full chunk becomes partial again
+    if(chunk->num_free == 0) _chunk_list_push(&central->partial_chunks, chunk);
+
+    *(void**)obj = chunk->free_list;
+    chunk->free_list = obj;
+    chunk->num_free++;
+    central->num_free++;
+
+    if(chunk->num_free != chunk->num_objects) return null;
+
+    // the chunk is now completely unused
+    _chunk_list_remove(&central->partial_chunks, chunk);
+
+    if(central->num_empty < HEAP_EMPTY_CHUNKS_MAX) {
+        _chunk_list_push(&central->empty_chunks, chunk);
+        central->num_empty++;
+        return null;
+    }
+
+    central->num_free -= chunk->num_objects;
+    central->num_chunks--;
+    return chunk;
+}
+
+// carve up a new chunk for class c and return one object from it. the rest go to the central list. called without
+// the central lock, so the pages are mapped with interrupts in whatever state the caller had
+static void* _central_grow(u8 c)
+{
+    struct heap_central* central = &central_lists[c];
+    u32 size = heap_classes[c];
+
+    struct heap_chunk* chunk = _alloc_run(1, HEAP_CHUNK_PAGES);
+    if(chunk == null) return null;
+
+    chunk->size_class = c;
+
+    // the first object is aligned to the lowest set bit in size. the header always fits in front of it
+    intp first = (intp)chunk + max(HEAP_HEADER_SIZE, size & -size);
+    chunk->num_objects = ((intp)chunk + HEAP_CHUNK_SIZE - first) / size;
+
+    // thread the objects in reverse so that the list ends up in address order. the first one is returned
+    for(s32 i = chunk->num_objects - 1; i > 0; i--) {
+        void** obj = (void**)(first + (intp)i * size);
+        *obj = chunk->free_list;
+        chunk->free_list = obj;
+    }
+    chunk->num_free = chunk->num_objects - 1;
+
+    u64 cpu_flags = _lock_central(central);
+    if(chunk->num_free != 0) _chunk_list_push(&central->partial_chunks, chunk);
+    central->num_free += chunk->num_free;
+    central->num_chunks++;
+    _unlock_central(central, cpu_flags);
+
+    return (void*)first;
+}
+
+// move up to count objects from the central list onto the cpu list. called with interrupts disabled, so the central
+// lock is taken directly. doesn't grow the class
+static void _central_take(u8 c, struct heap_cpu_list* list, u32 count)
+{
+    struct heap_central* central = &central_lists[c];
+
+    acquire_lock(central->lock);
+    while(count-- > 0) {
+        void** obj = _central_next(c);
+        if(obj == null) break;
+
+        *obj = list->head;
+        list->head = obj;
+        list->count++;
+    }
+    release_lock(central->lock);
+}
+
+// move count objects from the cpu list back to their chunks. called with interrupts disabled. returns the chunks that
+// became unused, linked through next, to be freed once interrupts are enabled again
+static struct heap_chunk* _central_put(u8 c, struct heap_cpu_list* list, u32 count)
+{
+    struct heap_central* central = &central_lists[c];
+    struct heap_chunk* unused_chunks = null;
+
+    acquire_lock(central->lock);
+    while(count-- > 0 && list->head != null) {
+        void** obj = (void**)list->head;
+        list->head = *obj;
+        list->count--;
+
+        struct heap_chunk* chunk = _central_return(c, obj);
+        if(chunk != null) {
+            chunk->next = unused_chunks;
+            unused_chunks = chunk;
+        }
+    }
+    release_lock(central->lock);
+
+    return unused_chunks;
+}
+
+static void _free_chunks(struct heap_chunk* chunks)
+{
+    while(chunks != null) {
+        struct heap_chunk* next = chunks->next;
+        _free_run(chunks);
+        chunks = next;
+    }
+}
+
+void heap_init()
+{
+    declare_ticketlock(lock_init);
+
+    // build the size lookup tables. each slot gets the smallest class that fits
+    u8 c = 0;
+    for(u32 i = 0; i < countof(small_size_to_class); i++) {
+        while(heap_classes[c] < i * 16) c++;
+        small_size_to_class[i] = c;
+    }
+
+    c = 0;
+    for(u32 i = 0; i < countof(large_size_to_class); i++) {
+        while(heap_classes[c] < i * 128) c++;
+        large_size_to_class[i] = c;
+    }
+
+    for(u8 i = 0; i < HEAP_NUM_CLASSES; i++) {
+        central_lists[i].lock = lock_init;
+    }
+
+    // reserve virtual memory for the whole heap, aligned to a chunk
+    heap_base = vmem_alloc_region_aligned(VMEM_KERNEL, HEAP_MAX_SIZE >> PAGE_SHIFT, HEAP_CHUNK_SIZE, 0);
+    assert(heap_base != 0, "couldn't reserve virtual memory for the heap");
+
+    heap_break = heap_base;
+    heap_end   = heap_base + HEAP_MAX_SIZE;
+
+#if HEAP_VERBOSE > 0
+    fprintf(stderr, "heap: reserved 0x%lX-0x%lX for the kernel heap\n", heap_base, heap_end - 1);
+#endif
+}
+
+void heap_init_cpu()
+{
+    struct cpu* cpu = get_cpu();
+    assert(cpu->heap_cache == null, "only call heap_init_cpu once per cpu");
+
+    struct heap_cpu_cache* hcc = (struct heap_cpu_cache*)kalloc(sizeof(struct heap_cpu_cache));
+    zero(hcc);
+
+    for(u8 c = 0; c < HEAP_NUM_CLASSES; c++) {
+        hcc->lists[c].max = min(256, max(2, HEAP_CACHE_BYTES / heap_classes[c]));
+    }
+
+    cpu->heap_cache = hcc;
+}
+
+static void* _alloc_large(u64 size, u32 offset)
+{
+    u64 total = size + offset;
+    struct heap_chunk* run = _alloc_run((total + HEAP_CHUNK_SIZE - 1) >> HEAP_CHUNK_SHIFT, (total + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    if(run == null) return null;
+
+    run->size_class = HEAP_CLASS_LARGE;
+    run->offset     = offset;
+    run->requested  = size;
+
+    return (void*)((intp)run + offset);
+}
+
+static u64 _usable_size(void* ptr)
+{
+    struct heap_chunk* chunk = _chunk_of(ptr);
+    if(chunk->size_class == HEAP_CLASS_LARGE) return ((u64)chunk->npages << PAGE_SHIFT) - chunk->offset;
+    return heap_classes[chunk->size_class];
+}
+
+static void* _alloc_small(u8 c)
+{
+    void** obj;
+
+    if(smp_ready()) {
+        u64 cpu_flags = __cli_saveflags();
+        struct heap_cpu_list* list = &get_cpu()->heap_cache->lists[c];
+
+        if(list->head == null) _central_take(c, list, max(1, list->max / 2));
+
+        if((obj = (void**)list->head) != null) {
+            list->head = *obj;
+            list->count--;
+        }
+
+        __restoreflags(cpu_flags);
+    } else {
+        struct heap_central* central = &central_lists[c];
+
+        u64 cpu_flags = _lock_central(central);
+        obj = _central_next(c);
+        _unlock_central(central, cpu_flags);
+    }
+
+    // the class is out of objects
+    if(obj == null) return _central_grow(c);
+    return (void*)obj;
+}
+
+void* malloc(size_t size)
+{
+    assert(heap_base != 0, "heap_init() hasn't been called yet");
+
+    if(size == 0) size = 1;
+    if(size > HEAP_MAX_SMALL) return _alloc_large(size, HEAP_HEADER_SIZE);
+
+    return _alloc_small(_size_class(size));
+}
+
+void free(void* ptr)
+{
+    if(ptr == null) return;
+
+    struct heap_chunk* chunk = _chunk_of(ptr);
+    if(chunk->size_class == HEAP_CLASS_LARGE) {
+        _free_run(chunk);
+        return;
+    }
+
+    u8 c = chunk->size_class;
+    assert(c < HEAP_NUM_CLASSES, "double free?");
+
+    struct heap_chunk* unused_chunks = null;
+
+    if(smp_ready()) {
+        u64 cpu_flags = __cli_saveflags();
+        struct heap_cpu_list* list = &get_cpu()->heap_cache->lists[c];
+
+        *(void**)ptr = list->head;
+        list->head = ptr;
+        list->count++;
+
+        // over the limit, so give half back
+        if(list->count > list->max) unused_chunks = _central_put(c, list, list->max / 2);
+
+        __restoreflags(cpu_flags);
+    } else {
+        struct heap_central* central = &central_lists[c];
+
+        u64 cpu_flags = _lock_central(central);
+        unused_chunks = _central_return(c, ptr);
+        if(unused_chunks != null) unused_chunks->next = null;
+        _unlock_central(central, cpu_flags);
+    }
+
+    _free_chunks(unused_chunks);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    if(size != 0 && nmemb > ((size_t)-1 / size)) return null;
+
+    void* ptr = malloc(nmemb * size);
+    if(ptr != null) memset(ptr, 0, nmemb * size);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    if(ptr == null) return malloc(size);
+
+    if(size == 0) {
+        free(ptr);
+        return null;
+    }
+
+    // still fits?
+    u64 usable = _usable_size(ptr);
+    if(size <= usable) return ptr;
+
+    void* newptr = malloc(size);
+    if(newptr == null) return null;
+
+    memcpy(newptr, ptr, usable);
+    free(ptr);
+    return newptr;
+}
+
+// objects in a size class are aligned to the lowest set bit of the class size, so the first class that fits and is
+// aligned enough will do. only when there isn't one does the allocation become a large object with the alignment
+// as its offset
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    if(alignment <= 16) return malloc(size);
+
+    assert(is_power_of_2(alignment) && alignment <= PAGE_SIZE, "unsupported alignment");
+
+    if(size <= HEAP_MAX_SMALL) {
+        for(u8 c = _size_class(max(size, alignment)); c < HEAP_NUM_CLASSES; c++) {
+            if((heap_classes[c] & -heap_classes[c]) >= alignment) return _alloc_small(c);
+        }
+    }
+
+    return _alloc_large(size, max(alignment, HEAP_HEADER_SIZE));
+}
+
+void heap_get_stats(struct heap_stats* stats)
+{
+    zero(stats);
+
+    u64 cpu_flags = _lock_heap();
+    stats->reserved_bytes = heap_end - heap_base;
+    stats->break_bytes    = heap_break - heap_base;
+    for(struct heap_chunk* run = free_runs; run != null; run = run->next) {
+        stats->free_run_bytes += (u64)run->nchunks << HEAP_CHUNK_SHIFT;
+    }
+    _unlock_heap(cpu_flags);
+
+    for(u8 c = 0; c < HEAP_NUM_CLASSES; c++) {
+        stats->central_free_bytes += central_lists[c].num_free * heap_classes[c];
+    }
+
+    for(u32 i = 0; i < apic_num_local_apics(); i++) {
+        struct cpu* cpu = apic_get_cpu(i);
+        if(cpu == null || cpu->heap_cache == null) continue;
+        for(u8 c = 0; c < HEAP_NUM_CLASSES; c++) {
+            stats->cpu_cached_bytes += (u64)cpu->heap_cache->lists[c].count * heap_classes[c];
+        }
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef __HEAP_H__
+#define __HEAP_H__
+
+// malloc(), free(), calloc(), realloc() and aligned_alloc() are implemented in heap.c
+
+void heap_init();     // call after vmem_init()
+void heap_init_cpu(); // create the heap cache for the current cpu
+
+struct heap_stats {
+    u64 reserved_bytes;     // virtual memory set aside for the heap
+    u64 break_bytes;        // virtual memory handed out so far
+    u64 free_run_bytes;     // virtual memory in free runs below the break
+    u64 central_free_bytes; // free objects in the central lists
+    u64 cpu_cached_bytes;   // free objects held by the cpu caches
+};
+
+void heap_get_stats(struct heap_stats*);
+
+#endif
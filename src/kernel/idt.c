@@ -49,6 +49,12 @@ void idt_set_entry(u8 vector_number, void* interrupt_handler, u8 flags)
     entry->reserved   = 0;
 }
 
+// switch the vector to an interrupt stack from the TSS. every cpu has to have set that stack before this is called
+void idt_set_ist(u8 vector_number, u8 ist)
+{
+    _idt[vector_number].ist = ist;
+}
+
 void idt_init() 
 {
    
@@ -61,7 +67,7 @@ void idt_init()
     idt_set_entry( 5, interrupt_stub_noerr , IDT_FLAG_PRESENT | IDT_FLAG_PRIVILEGE_LEVEL0 | IDT_FLAG_GATE_TYPE_TRAP); // bound range exceeded
     idt_set_entry( 6, interrupt_invalid_op , IDT_FLAG_PRESENT | IDT_FLAG_PRIVILEGE_LEVEL0 | IDT_FLAG_GATE_TYPE_TRAP); // invalid opcode
     idt_set_entry( 7, interrupt_stub_noerr , IDT_FLAG_PRESENT | IDT_FLAG_PRIVILEGE_LEVEL0 | IDT_FLAG_GATE_TYPE_TRAP); // device not available
-    idt_set_entry( 8, interrupt_stub       , IDT_FLAG_PRESENT | IDT_FLAG_PRIVILEGE_LEVEL0 | IDT_FLAG_GATE_TYPE_TRAP); // double fault
+    idt_set_entry( 8, interrupt_double_fault, IDT_FLAG_PRESENT | IDT_FLAG_PRIVILEGE_LEVEL0 | IDT_FLAG_GATE_TYPE_TRAP); // double fault
     idt_set_entry( 9, interrupt_stub_noerr , IDT_FLAG_PRESENT | IDT_FLAG_PRIVILEGE_LEVEL0 | IDT_FLAG_GATE_TYPE_TRAP); // cop segment overrun
     idt_set_entry(10, interrupt_stub       , IDT_FLAG_PRESENT | IDT_FLAG_PRIVILEGE_LEVEL0 | IDT_FLAG_GATE_TYPE_TRAP); // invalid tss
     idt_set_entry(11, interrupt_stub       , IDT_FLAG_PRESENT | IDT_FLAG_PRIVILEGE_LEVEL0 | IDT_FLAG_GATE_TYPE_TRAP); // segment not present
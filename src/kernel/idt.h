@@ -1,7 +1,10 @@
 #ifndef __IDT_H__
 #define __IDT_H__
 
+#define IDT_DOUBLE_FAULT_IST 1 // TSS interrupt stack used for double faults
+
 void idt_init();
 void idt_install();
+void idt_set_ist(u8, u8);
 
 #endif
@@ -51,9 +51,16 @@ _interrupt_handler_common:
     mov rbp, rsp
 %endif
 
+    mov r12, rdi         ; keep the vector across the call. r12 is preserved by the handler and restored below
     cld                  ; C code following the SysV ABI requires DF to be clear on function entry
     call rax             ; Call the C function handler
+
+    ; exceptions don't come from the local apic, and now that page faults can return, sending an eoi for one
+    ; would acknowledge whatever irq happens to be in service
+    cmp r12, 32
+    jb .no_eoi
     call _send_lapic_eoi ; end of interrupt
+.no_eoi:
 
     ; we have to fix up the stack for the backtraces
 %ifdef DEBUG
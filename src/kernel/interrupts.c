@@ -11,6 +11,7 @@
 #include "syscall.h"
 #include "task.h"
 #include "terminal.h"
+#include "vmem.h"
 
 // Temporarily use PIC to enable some basic interrputs. This will all be wiped once APIC is implemented.
 #define PIC1_COMMAND    0x20        // IO base address for master PIC
@@ -279,6 +280,23 @@ DEFINE_INTERRUPT_HANDLER(6, interrupt_invalid_op)
     kernel_panic(COLOR(0, 128, 128));
 }
 
+DEFINE_INTERRUPT_HANDLER_ERR(8, interrupt_double_fault)
+{
+    unused(irq_vector);
+    unused(regs);
+    unused(error_code);
+    __cli();
+
+    // overflowing a kernel stack faults on its guard page, and the page fault can't be delivered on that same stack
+    intp access_address = (intp)__rdcr2();
+    if(task_is_stack_guard(access_address)) {
+        fprintf(stderr, "double fault: task %lu overflowed its stack at $%lX (rip $%lX)\n", get_cpu()->current_task->task_id, access_address, fault_addr);
+    } else {
+        fprintf(stderr, "double fault at address $%lX\n", fault_addr);
+    }
+    kernel_panic(COLOR(255, 0, 255));
+}
+
 DEFINE_INTERRUPT_HANDLER_ERR(13, interrupt_gpf)
 {
     unused(irq_vector);
@@ -293,6 +311,11 @@ DEFINE_INTERRUPT_HANDLER_ERR(14, interrupt_page_fault)
     unused(irq_vector);
     unused(regs);
 
+    // not-present faults in lazy vmem regions are handled by mapping in new pages, and writes to
+    // copy-on-write pages (present and write, bits 0 and 1) by copying the page
+    if((error_code & 0x01) == 0 && vmem_handle_page_fault((intp)__rdcr2(), false)) return;
+    if((error_code & 0x03) == 0x03 && vmem_handle_page_fault((intp)__rdcr2(), true)) return;
+
     if(smp_ready()) {
         fprintf(stderr, "page fault: on cpu %d error = $%lX at address $%lX ", get_cpu()->cpu_index, error_code, fault_addr);
     } else {
@@ -303,6 +326,9 @@ DEFINE_INTERRUPT_HANDLER_ERR(14, interrupt_page_fault)
 
     u64 access_address = __rdcr2();
     fprintf(stderr, " %s $%lX\n", rw ? "writing to" : "reading from", (intp)access_address);
+    if(task_is_stack_guard((intp)access_address)) {
+        fprintf(stderr, "page fault: task %lu overflowed its stack\n", get_cpu()->current_task->task_id);
+    }
 
     // put a page at the access_address 
 #if 0
@@ -41,6 +41,7 @@ void interrupt_stub_noerr();
 
 void interrupt_div_by_zero();
 void interrupt_invalid_op();
+void interrupt_double_fault();
 void interrupt_gpf();
 void interrupt_page_fault();
 
@@ -1,9 +1,13 @@
 #include "common.h"
 
+#include "apic.h"
+#include "cpu.h"
 #include "kalloc.h"
 #include "kernel.h"
+#include "meminfo.h"
 #include "paging.h"
 #include "palloc.h"
+#include "shrinker.h"
 #include "smp.h"
 #include "stdio.h"
 
@@ -12,82 +16,289 @@
 // the end of the page/associated memory
 #define KALLOC_MAGIC 0x1E1EA5A5A5A5E1E1ULL
 
-#define KALLOC_MIN_N 4   // 16 bytes is the smallest allocation unit
-#define KALLOC_MAX_N 12  // 4096 bytes is the largest allocation unit
+#define KALLOC_MIN_SIZE     16    // smallest allocation unit, and the granularity of the size lookup table
+#define KALLOC_MAX_SIZE     4096  // largest allocation unit
 
 #define KALLOC_VERBOSE 0
 
-struct kalloc_pool {
+// Size classes. Besides the powers of two, there's a class halfway between each pair so that common
+// structures don't end up in a class almost twice their size. Each entry is the object size and the
+// page order of the slabs for that class. Objects are aligned to the largest power of two that divides
+// their size, so power of two classes stay naturally aligned.
+struct kalloc_class {
+    u16    size;
+    u8     page_order;
+};
+
+static struct kalloc_class const kalloc_classes[] = {
+    {   16, 0 }, {   32, 0 }, {   48, 0 }, {   64, 1 }, {   96, 1 }, {  128, 2 }, {  192, 2 }, {  256, 3 },
+    {  384, 3 }, {  512, 4 }, {  768, 4 }, { 1024, 5 }, { 1536, 5 }, { 2048, 5 }, { 3072, 5 }, { 4096, 5 },
+};
+
+#define KALLOC_NUM_CLASSES countof(kalloc_classes)
+
+// maps (size + KALLOC_MIN_SIZE - 1) / KALLOC_MIN_SIZE to a class index
+static u8 size_to_class[KALLOC_MAX_SIZE / KALLOC_MIN_SIZE + 1];
+
+// Each cpu has a pair of magazines (loaded and previous) for every pool, and kalloc/kfree only
+// touch those with interrupts disabled. When both are empty (or both full) the cpu trades a magazine
+// with the pool's depot, which is the only time the pool lock is taken on the fast path. Objects sitting
+// in magazines are counted as allocated in the pool. See Bonwick & Adams, "Magazines and Vmem", 2001.
+// The depot holds at most KALLOC_DEPOT_FULL_MAX full magazines. Past that, a cpu flushes its magazine back
+// into the slabs instead, and the shrinker drains the depot so the slabs under it can empty out.
+#define KALLOC_MAGAZINE_SIZE  14 // rounds per magazine, makes a magazine 128 bytes
+#define KALLOC_DEPOT_FULL_MAX 8  // full magazines a pool's depot holds on to
+
+struct kalloc_magazine {
+    struct kalloc_magazine* next;  // link in the depot lists
+    u32    rounds;
+    u32    padding0;
+    void*  objects[KALLOC_MAGAZINE_SIZE];
+};
+
+static_assert(sizeof(struct kalloc_magazine) == 128, "magazine should be 128 bytes");
+
+// Pools are made of slabs of 2^page_order pages. Since palloc blocks are naturally aligned, the slab
+// header at the start of each slab can be found from any object in it by masking off the low address bits.
+// Each slab keeps its own free list (using the KALLOC_MAGIC trick) and sits on one of the pool's partial,
+// full or empty lists, so the pool knows when a slab is no longer used and can give it back to palloc.
+// Empty slabs beyond KALLOC_EMPTY_SLABS_MAX go back right away, and the ones kept are given back by the shrinker
+// when palloc runs low.
+#define KALLOC_EMPTY_SLABS_MAX 4 // number of completely free slabs a pool holds on to before releasing them to palloc
+
+struct kalloc_slab {
+    struct kalloc_slab* next;
+    struct kalloc_slab* prev;
     intp   next_free;
+    u32    num_free;
+    u32    num_objects;
+};
+
+struct kalloc_pool {
     u32    num_free;
     u32    num_alloc;
     struct ticketlock lock;
+
+    // slabs
+    struct kalloc_slab* partial_slabs;
+    struct kalloc_slab* full_slabs;
+    struct kalloc_slab* empty_slabs;
+    u32    num_slabs;
+    u32    num_empty;
+    u64    num_grows;    // slabs claimed from palloc
+    u64    num_shrinks;  // slabs given back to palloc
+
+    // depot
+    struct kalloc_magazine* full_magazines;
+    struct kalloc_magazine* empty_magazines;
+    u32    num_full;
+    u32    num_empty_magazines;
+
+    // usage from before smp was up. after that, the counters are per cpu
+    u64    bytes_requested;
+    u64    bytes_allocated;
 };
 
-static struct kalloc_pool kalloc_pools[KALLOC_MAX_N - KALLOC_MIN_N + 1]; // allocation pools. if you allocate anything not equal to 2^n you're wasting space
+static struct kalloc_pool kalloc_pools[KALLOC_NUM_CLASSES];
+
+// Anything larger than KALLOC_MAX_SIZE is a large object and is served directly from palloc with page
+// granularity: the buddy block is claimed at the next order up, and the unused pages at the end are given
+// straight back. The size of each large object lives in a small hash table keyed by address, so kfree
+// doesn't have to trust the size given by the caller.
+#define KALLOC_LARGE_BUCKETS 256
+
+struct kalloc_large {
+    struct kalloc_large* next;
+    intp   base;
+    u32    npages;
+    u32    requested;
+};
+
+static struct kalloc_large* large_objects[KALLOC_LARGE_BUCKETS];
+static u64 large_bytes_requested;
+static u64 large_pages_allocated;
+static u32 large_num_objects;
+declare_ticketlock(large_lock);
+
+struct kalloc_cpu_pool {
+    struct kalloc_magazine* loaded;
+    struct kalloc_magazine* previous;
+
+    // live bytes allocated minus freed on this cpu. can go negative if other cpus allocated the memory
+    s64    bytes_requested;
+    s64    bytes_allocated;
+};
+
+struct kalloc_cpu_cache {
+    struct kalloc_cpu_pool pools[KALLOC_NUM_CLASSES];
+};
+
+// magazines come from their own pages so that they never recurse into the pools
+static struct kalloc_magazine* free_magazines = null;
+declare_ticketlock(magazine_lock);
+
+static struct kalloc_magazine* _alloc_magazine()
+{
+    // taken inside the pool locks, so interrupts have to be disabled here too
+    u64 cpu_flags = __cli_saveflags();
+    acquire_lock(magazine_lock);
+
+    if(free_magazines == null) {
+        struct kalloc_magazine* mags = (struct kalloc_magazine*)palloc_claim_one();
+        if(mags != null) {
+            for(u32 i = 0; i < PAGE_SIZE / sizeof(struct kalloc_magazine); i++) {
+                mags[i].next = free_magazines;
+                free_magazines = &mags[i];
+            }
+        }
+    }
+
+    struct kalloc_magazine* mag = free_magazines;
+    if(mag != null) free_magazines = mag->next;
+
+    release_lock(magazine_lock);
+    __restoreflags(cpu_flags);
+
+    if(mag != null) {
+        mag->next = null;
+        mag->rounds = 0;
+    }
+
+    return mag;
+}
+
+static inline void _slab_list_remove(struct kalloc_slab** head, struct kalloc_slab* slab)
+{
+    if(slab->prev != null) slab->prev->next = slab->next;
+    else                   *head = slab->next;
+    if(slab->next != null) slab->next->prev = slab->prev;
+}
+
+static inline void _slab_list_push(struct kalloc_slab** head, struct kalloc_slab* slab)
+{
+    slab->prev = null;
+    slab->next = *head;
+    if(slab->next != null) slab->next->prev = slab;
+    *head = slab;
+}
+
+// the magazine layer takes pool locks with interrupts disabled, so every other path has to as well
+static inline u64 _lock_pool(struct kalloc_pool* pool)
+{
+    u64 cpu_flags = __cli_saveflags();
+    acquire_lock(pool->lock);
+    return cpu_flags;
+}
 
-static u8 pool_to_order[KALLOC_MAX_N - KALLOC_MIN_N + 1] = { 0, 0, 1, 2, 3, 4, 5 };
+static inline void _unlock_pool(struct kalloc_pool* pool, u64 cpu_flags)
+{
+    release_lock(pool->lock);
+    __restoreflags(cpu_flags);
+}
+
+static inline u8 _size_class(u32 size)
+{
+    assert(size <= KALLOC_MAX_SIZE, "allocation too large");
+    return size_to_class[(size + KALLOC_MIN_SIZE - 1) / KALLOC_MIN_SIZE];
+}
 
-// Allocate and initialize a new chunk of 2^page_order pages into pool n
-static void _increase_pool(u8 n, u8 page_order)
+// Allocate and initialize a new slab for pool c. This is done without the pool lock and with interrupts
+// enabled when possible, since palloc may have to reclaim memory first
+static struct kalloc_slab* _claim_slab(u8 c)
 {
-    assert(n < countof(kalloc_pools), "pool index out of range");
-    struct kalloc_pool* pool = &kalloc_pools[n];
-    assert(pool->num_free == 0, "only increase pool when no more objects exist");
+    assert(c < KALLOC_NUM_CLASSES, "pool index out of range");
+    struct kalloc_pool* pool = &kalloc_pools[c];
+    u32 size = kalloc_classes[c].size;
+    u8 page_order = kalloc_classes[c].page_order;
 
 #if KALLOC_VERBOSE > 0
-    fprintf(stderr, "kalloc: _increase_pool(pool=0x%lX, n=%d (2^%d), page_order=%d)\n", pool, n, n+KALLOC_MIN_N, page_order);
+    fprintf(stderr, "kalloc: _claim_slab(pool=0x%lX, c=%d (%d bytes), page_order=%d)\n", pool, c, size, page_order);
 #endif
 
     intp mem = palloc_claim(page_order);
-    zero((u8*)mem);
+    if(mem == 0) return null;
+
+    // first object goes after the header, aligned to the lowest set bit in size
+    u32 align = size & -size;
+    u32 first = (u32)(intp)__alignup(sizeof(struct kalloc_slab), align);
+
+    // the descriptor says which pool a page belongs to. palloc clears it when the slab is released. it's only
+    // informational, so the slab is still usable when there's no memory for the descriptors
+    struct page* page = palloc_page(mem);
+    if(page != null) {
+        page->owner = pool;
+        __sync_fetch_and_or(&page->flags, PAGE_FLAG_SLAB);
+    }
+
+    struct kalloc_slab* slab = (struct kalloc_slab*)mem;
+    zero(slab);
+    slab->num_objects = ((1 << (PAGE_SHIFT + page_order)) - first) / size;
+    slab->num_free = slab->num_objects;
 
-    u32 added_count = 1 << (PAGE_SHIFT + page_order - (n + KALLOC_MIN_N)); // 4096*2^page_order / 2^n == 2^(12+page_order)/2^n == 2^(12+page_order-n) 
+    // first free slot uses the KALLOC_MAGIC series
+    slab->next_free = mem + first;
+    *(u64*)slab->next_free = KALLOC_MAGIC;
 
-    // first free slot is at the beginning of memory
-    pool->next_free = mem;
+    return slab;
+}
 
-    // make the data at next_free use KALLOC_MAGIC series
-    *(u64*)pool->next_free = KALLOC_MAGIC;
+// add a slab from _claim_slab to pool c. the pool lock must be held
+static void _add_slab(u8 c, struct kalloc_slab* slab)
+{
+    struct kalloc_pool* pool = &kalloc_pools[c];
 
-    pool->num_free = added_count; // set the total # of free/available objects
+    _slab_list_push(&pool->partial_slabs, slab);
+    pool->num_slabs++;
+    pool->num_grows++;
+    pool->num_free += slab->num_free; // set the total # of free/available objects
 
 #if KALLOC_VERBOSE > 1
-    fprintf(stderr, "kalloc: increased pool by %d objects, next_free=0x%lX *next_free=0x%lX\n", added_count, pool->next_free, *(u64*)pool->next_free);
+    fprintf(stderr, "kalloc: increased pool by %d objects, next_free=0x%lX *next_free=0x%lX\n", slab->num_objects, slab->next_free, *(u64*)slab->next_free);
 #endif
 }
 
-static intp _next_from_pool(u8 n)
+static intp _next_from_pool(u8 c)
 {
-    struct kalloc_pool* pool = &kalloc_pools[n - KALLOC_MIN_N];
-    u32 size = 1 << n;
+    struct kalloc_pool* pool = &kalloc_pools[c];
+    u32 size = kalloc_classes[c].size;
 
 #if KALLOC_VERBOSE > 0
-    fprintf(stderr, "kalloc: _next_from_pool(pool=0x%lX (2^%d), size=%d, num_free=%d, next_free=0x%lX)\n", pool, n, size, pool->num_free, pool->next_free);
+    fprintf(stderr, "kalloc: _next_from_pool(pool=0x%lX (%d bytes), num_free=%d)\n", pool, size, pool->num_free);
 #endif
 
-    // in order for KALLOC_MAGIC to work, pools are only increased in size when there's 0 objects left
-    if(pool->num_free == 0) _increase_pool(n - KALLOC_MIN_N, pool_to_order[n - KALLOC_MIN_N]);
-    assert(pool->num_free != 0, "_increase_pool failed");
+    // prefer partially used slabs, then empty ones. returns 0 when the pool has to grow
+    struct kalloc_slab* slab = pool->partial_slabs;
+    if(slab == null) {
+        if((slab = pool->empty_slabs) == null) return 0;
+        _slab_list_remove(&pool->empty_slabs, slab);
+        _slab_list_push(&pool->partial_slabs, slab);
+        pool->num_empty--;
+    }
+    assert(slab->num_free != 0, "partial slab can't be full");
 
     // pointer to the new memory
-    intp ret = pool->next_free;
+    intp ret = slab->next_free;
 
     // set up next_free
     if(*(u64*)ret == KALLOC_MAGIC) {
         // move linearly in memory, guaranteed not to run out space
         // since num_free must have been nonzero to get here
-        assert(pool->num_free > 0, "told ya");
-        pool->next_free += size; // KALLOC_MAGIC lets us move linearly in the block of memory
-        if(pool->num_free > 1) { // only write magic into the next byte if there's actually valid memory there
-            *(u64 *)pool->next_free = KALLOC_MAGIC; // be sure to set magic value for the next allocation
+        slab->next_free += size; // KALLOC_MAGIC lets us move linearly in the block of memory
+        if(slab->num_free > 1) { // only write magic into the next byte if there's actually valid memory there
+            *(u64 *)slab->next_free = KALLOC_MAGIC; // be sure to set magic value for the next allocation
         }
     } else {
         // follow the linked list. guaranteed to not run out of memory
-        pool->next_free = *(intp*)ret;
+        slab->next_free = *(intp*)ret;
     }
 
     // decrease count and move to full if necessary
+    slab->num_free--;
+    if(slab->num_free == 0) {
+        _slab_list_remove(&pool->partial_slabs, slab);
+        _slab_list_push(&pool->full_slabs, slab);
+    }
+
     pool->num_free--;
     pool->num_alloc++;
 
@@ -95,6 +306,222 @@ static intp _next_from_pool(u8 n)
     return ret;
 }
 
+static void _return_to_pool(u8 c, void* mem)
+{
+    struct kalloc_pool* pool = &kalloc_pools[c];
+    u8 page_order = kalloc_classes[c].page_order;
+    struct kalloc_slab* slab = (struct kalloc_slab*)((intp)mem & ~((1ULL << (PAGE_SHIFT + page_order)) - 1));
+
+    // a full slab becomes partial again
+    if(slab->num_free == 0) {
+        _slab_list_remove(&pool->full_slabs, slab);
+        _slab_list_push(&pool->partial_slabs, slab);
+    }
+
+    *(intp*)mem = slab->next_free;
+    slab->next_free = (intp)mem;
+    slab->num_free++;
+
+    pool->num_free++;
+    pool->num_alloc--;
+
+    if(slab->num_free != slab->num_objects) return;
+
+    // the slab is now completely unused
+    _slab_list_remove(&pool->partial_slabs, slab);
+
+    if(pool->num_empty < KALLOC_EMPTY_SLABS_MAX) {
+        _slab_list_push(&pool->empty_slabs, slab);
+        pool->num_empty++;
+        return;
+    }
+
+#if KALLOC_VERBOSE > 0
+    fprintf(stderr, "kalloc: releasing slab 0x%lX from pool %d\n", slab, kalloc_classes[c].size);
+#endif
+
+    pool->num_free -= slab->num_objects;
+    pool->num_slabs--;
+    pool->num_shrinks++;
+    palloc_abandon((intp)slab, page_order);
+}
+
+// take an object from pool c, growing it if necessary. takes the pool lock itself, and must not be called with
+// it held. returns 0 when out of memory
+static intp _alloc_from_pool(u8 c)
+{
+    struct kalloc_pool* pool = &kalloc_pools[c];
+
+    while(true) {
+        u64 pool_flags = _lock_pool(pool);
+        intp ret = _next_from_pool(c);
+        _unlock_pool(pool, pool_flags);
+        if(ret != 0) return ret;
+
+        // another cpu may grow the pool at the same time, in which case the extra slab just stays partial
+        struct kalloc_slab* slab = _claim_slab(c);
+        if(slab == null) return 0;
+
+        pool_flags = _lock_pool(pool);
+        _add_slab(c, slab);
+        _unlock_pool(pool, pool_flags);
+    }
+}
+
+// return every object in the magazine to the slabs of pool c. the pool lock must be held
+static void _flush_magazine(u8 c, struct kalloc_magazine* mag)
+{
+    while(mag->rounds > 0) _return_to_pool(c, mag->objects[--mag->rounds]);
+}
+
+// the empty slabs and whatever sits in the depot are what the pools have to give back. they may be called from
+// inside palloc_claim while a pool lock is held, so busy pools are skipped
+static u64 _kalloc_shrinker_count(struct shrinker* shrinker)
+{
+    unused(shrinker);
+
+    u64 pages = 0;
+    for(u8 c = 0; c < KALLOC_NUM_CLASSES; c++) {
+        struct kalloc_pool* pool = &kalloc_pools[c];
+        pages += (u64)pool->num_empty << kalloc_classes[c].page_order;
+        pages += ((u64)pool->num_full * KALLOC_MAGAZINE_SIZE * kalloc_classes[c].size) >> PAGE_SHIFT;
+    }
+    return pages;
+}
+
+static u64 _kalloc_shrinker_scan(struct shrinker* shrinker, u64 nr_pages)
+{
+    unused(shrinker);
+
+    u64 freed = 0;
+    for(u8 c = 0; c < KALLOC_NUM_CLASSES && freed < nr_pages; c++) {
+        struct kalloc_pool* pool = &kalloc_pools[c];
+        u8 page_order = kalloc_classes[c].page_order;
+        if(pool->num_empty == 0 && pool->num_full == 0) continue;
+
+        u64 pool_flags = __cli_saveflags();
+        if(!try_lock(pool->lock)) {
+            __restoreflags(pool_flags);
+            continue;
+        }
+
+        // drain the depot first so the slabs under it can become empty. the magazines are kept for reuse
+        struct kalloc_magazine* mag;
+        while((mag = pool->full_magazines) != null) {
+            pool->full_magazines = mag->next;
+            pool->num_full--;
+
+            _flush_magazine(c, mag);
+
+            mag->next = pool->empty_magazines;
+            pool->empty_magazines = mag;
+            pool->num_empty_magazines++;
+        }
+
+        struct kalloc_slab* slab;
+        while(freed < nr_pages && (slab = pool->empty_slabs) != null) {
+            _slab_list_remove(&pool->empty_slabs, slab);
+            pool->num_empty--;
+            pool->num_free -= slab->num_objects;
+            pool->num_slabs--;
+            pool->num_shrinks++;
+            palloc_abandon((intp)slab, page_order);
+            freed += 1 << page_order;
+        }
+
+        _unlock_pool(pool, pool_flags);
+    }
+
+    return freed;
+}
+
+static struct shrinker kalloc_shrinker = {
+    .name  = "kalloc",
+    .count = _kalloc_shrinker_count,
+    .scan  = _kalloc_shrinker_scan,
+    .flags = SHRINKER_FLAG_DIRECT,
+};
+
+static inline u32 _large_bucket(intp base)
+{
+    return (u32)(((base >> PAGE_SHIFT) * 0x9E3779B97F4A7C15ULL) >> 56) & (KALLOC_LARGE_BUCKETS - 1);
+}
+
+// give the pages [base, base+npages) back to palloc in the largest aligned blocks possible
+static void _abandon_pages(intp base, u64 npages)
+{
+    while(npages != 0) {
+        u8 order = 0;
+        while((order + 1) < PALLOC_MAX_ORDER && (1ULL << (order + 1)) <= npages
+              && (base & ((1ULL << (order + 1 + PAGE_SHIFT)) - 1)) == 0) order++;
+
+        palloc_abandon(base, order);
+        base += 1ULL << (order + PAGE_SHIFT);
+        npages -= 1ULL << order;
+    }
+}
+
+static void* _kalloc_large(u32 size)
+{
+    u32 npages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    u8 order = next_power_of_2(npages);
+    if(order >= PALLOC_MAX_ORDER) return null; // larger than any buddy block
+
+    intp base = palloc_claim(order);
+    if(base == 0) return null;
+
+    // trim the block down to the pages actually needed
+    if(npages < (1U << order)) _abandon_pages(base + ((intp)npages << PAGE_SHIFT), (1U << order) - npages);
+
+    struct kalloc_large* obj = (struct kalloc_large*)kalloc(sizeof(struct kalloc_large));
+    if(obj == null) {
+        _abandon_pages(base, npages);
+        return null;
+    }
+
+    obj->base = base;
+    obj->npages = npages;
+    obj->requested = size;
+
+    u32 bucket = _large_bucket(base);
+    acquire_lock(large_lock);
+    obj->next = large_objects[bucket];
+    large_objects[bucket] = obj;
+    large_bytes_requested += size;
+    large_pages_allocated += npages;
+    large_num_objects++;
+    release_lock(large_lock);
+
+#if KALLOC_VERBOSE > 1
+    fprintf(stderr, "kalloc: large allocation size=%d npages=%d (order %d) ret=0x%lX\n", size, npages, order, base);
+#endif
+
+    return (void*)base;
+}
+
+static void _kfree_large(void* mem)
+{
+    u32 bucket = _large_bucket((intp)mem);
+
+    acquire_lock(large_lock);
+    struct kalloc_large** prev = &large_objects[bucket];
+    struct kalloc_large* obj = *prev;
+    while(obj != null && obj->base != (intp)mem) {
+        prev = &obj->next;
+        obj = obj->next;
+    }
+    assert(obj != null, "kfree of unknown large object");
+
+    *prev = obj->next;
+    large_bytes_requested -= obj->requested;
+    large_pages_allocated -= obj->npages;
+    large_num_objects--;
+    release_lock(large_lock);
+
+    _abandon_pages(obj->base, obj->npages);
+    kfree(obj, sizeof(struct kalloc_large));
+}
+
 void kalloc_init()
 {
     declare_ticketlock(lock_init);
@@ -104,34 +531,167 @@ void kalloc_init()
 #endif
     zero(kalloc_pools);
 
+    // build the size lookup table. each slot gets the smallest class that fits
+    u8 class = 0;
+    for(u32 i = 0; i < countof(size_to_class); i++) {
+        while(kalloc_classes[class].size < i * KALLOC_MIN_SIZE) class++;
+        size_to_class[i] = class;
+    }
+
     // preinit all the pools
-    for(u8 n = 0; n < countof(kalloc_pools); n++) {
-        kalloc_pools[n].lock = lock_init;
-        acquire_lock(kalloc_pools[n].lock);
-        _increase_pool(n, pool_to_order[n]);
-        release_lock(kalloc_pools[n].lock);
+    for(u8 c = 0; c < KALLOC_NUM_CLASSES; c++) {
+        kalloc_pools[c].lock = lock_init;
+        struct kalloc_slab* slab = _claim_slab(c);
+        assert(slab != null, "out of memory");
+        u64 pool_flags = _lock_pool(&kalloc_pools[c]);
+        _add_slab(c, slab);
+        _unlock_pool(&kalloc_pools[c], pool_flags);
+    }
+
+    shrinker_register(&kalloc_shrinker);
+}
+
+void kalloc_init_cpu()
+{
+    struct cpu* cpu = get_cpu();
+    assert(cpu->kalloc_cache == null, "only call kalloc_init_cpu once per cpu");
+
+    // smp isn't ready yet, so this comes from the pools directly
+    struct kalloc_cpu_cache* kcc = (struct kalloc_cpu_cache*)kalloc(sizeof(struct kalloc_cpu_cache));
+    zero(kcc);
+
+    for(u8 c = 0; c < KALLOC_NUM_CLASSES; c++) {
+        kcc->pools[c].loaded   = _alloc_magazine();
+        kcc->pools[c].previous = _alloc_magazine();
+        assert(kcc->pools[c].loaded != null && kcc->pools[c].previous != null, "out of memory for magazines");
+    }
+
+    cpu->kalloc_cache = kcc;
+}
+
+// called with interrupts disabled, so the pool lock is taken directly. returns null if there are no objects in the
+// magazine layer
+static void* _magazine_alloc(struct kalloc_cpu_pool* cp, u8 c)
+{
+    while(true) {
+        if(cp->loaded->rounds > 0) return cp->loaded->objects[--cp->loaded->rounds];
+
+        // loaded is empty, but if previous is full swap them
+        if(cp->previous->rounds > 0) {
+            struct kalloc_magazine* tmp = cp->loaded;
+            cp->loaded = cp->previous;
+            cp->previous = tmp;
+            continue;
+        }
+
+        // both are empty, so trade previous for a full one from the depot
+        struct kalloc_pool* pool = &kalloc_pools[c];
+        acquire_lock(pool->lock);
+        struct kalloc_magazine* full = pool->full_magazines;
+        if(full == null) {
+            release_lock(pool->lock);
+            return null;
+        }
+
+        pool->full_magazines = full->next;
+        pool->num_full--;
+
+        cp->previous->next = pool->empty_magazines;
+        pool->empty_magazines = cp->previous;
+        pool->num_empty_magazines++;
+        release_lock(pool->lock);
+
+        cp->previous = cp->loaded;
+        cp->loaded = full;
+    }
+}
+
+// called with interrupts disabled, so the pool lock is taken directly. returns false if the object couldn't be put
+// into a magazine
+static bool _magazine_free(struct kalloc_cpu_pool* cp, u8 c, void* mem)
+{
+    while(true) {
+        if(cp->loaded->rounds < KALLOC_MAGAZINE_SIZE) {
+            cp->loaded->objects[cp->loaded->rounds++] = mem;
+            return true;
+        }
+
+        // loaded is full, but if previous is empty swap them
+        if(cp->previous->rounds == 0) {
+            struct kalloc_magazine* tmp = cp->loaded;
+            cp->loaded = cp->previous;
+            cp->previous = tmp;
+            continue;
+        }
+
+        // both are full. if the depot already has enough full magazines, previous goes back into the slabs and
+        // becomes the empty one
+        struct kalloc_pool* pool = &kalloc_pools[c];
+        acquire_lock(pool->lock);
+        if(pool->num_full >= KALLOC_DEPOT_FULL_MAX) {
+            _flush_magazine(c, cp->previous);
+            release_lock(pool->lock);
+            continue;
+        }
+
+        // otherwise give previous to the depot and take an empty one
+        struct kalloc_magazine* empty = pool->empty_magazines;
+        if(empty != null) {
+            pool->empty_magazines = empty->next;
+            pool->num_empty_magazines--;
+        } else if((empty = _alloc_magazine()) == null) {
+            release_lock(pool->lock);
+            return false;
+        }
+
+        cp->previous->next = pool->full_magazines;
+        pool->full_magazines = cp->previous;
+        pool->num_full++;
+        release_lock(pool->lock);
+
+        cp->previous = cp->loaded;
+        cp->loaded = empty;
     }
 }
 
 void* kalloc(u32 size)
 {
-    u8 n = next_power_of_2(size);
-    n = max(KALLOC_MIN_N, n); // set a minimum value of KALLOC_MIN_N
+    if(size > KALLOC_MAX_SIZE) return _kalloc_large(size);
 
-    assert(n <= KALLOC_MAX_N, "allocation too large");
+    u8 c = _size_class(size);
+    struct kalloc_pool* pool = &kalloc_pools[c];
 
 #if KALLOC_VERBOSE > 0
-    fprintf(stderr, "kalloc: kalloc(size=%d), n=%d\n", size, n);
+    fprintf(stderr, "kalloc: kalloc(size=%d), class=%d\n", size, kalloc_classes[c].size);
 #endif
 
-    u32 wasted = (1 << n) - size;
-    unused(wasted); // TODO
+    void* ret;
+
+    // try the cpu magazines first, once every cpu has them
+    if(smp_ready()) {
+        u64 cpu_flags = __cli_saveflags();
+        if((ret = _magazine_alloc(&get_cpu()->kalloc_cache->pools[c], c)) == null) {
+            // the pool may have to grow, which shouldn't happen with interrupts disabled
+            __restoreflags(cpu_flags);
+            ret = (void*)_alloc_from_pool(c);
+            assert(ret != null, "out of memory");
+            cpu_flags = __cli_saveflags();
+        }
 
-    struct kalloc_pool* pool = &kalloc_pools[n - KALLOC_MIN_N];
-    acquire_lock(pool->lock); // lock only the pool involved
+        // the task may have moved to another cpu while the pool grew, so look the cpu up again
+        struct kalloc_cpu_pool* cp = &get_cpu()->kalloc_cache->pools[c];
+        cp->bytes_requested += size;
+        cp->bytes_allocated += kalloc_classes[c].size;
+        __restoreflags(cpu_flags);
+    } else {
+        ret = (void*)_alloc_from_pool(c);
+        assert(ret != null, "out of memory");
 
-    void* ret = (void*)_next_from_pool(n);
-    release_lock(pool->lock);
+        u64 pool_flags = _lock_pool(pool);
+        pool->bytes_requested += size;
+        pool->bytes_allocated += kalloc_classes[c].size;
+        _unlock_pool(pool, pool_flags);
+    }
 
 #if KALLOC_VERBOSE > 1
     fprintf(stderr, "kalloc: kalloc(size=%d) ret=0x%lX\n", size, ret);
@@ -141,18 +701,124 @@ void* kalloc(u32 size)
 
 void kfree(void* mem, u32 size)
 {
+    // the real size of large objects is in the side table
+    if(size > KALLOC_MAX_SIZE) {
+        _kfree_large(mem);
+        return;
+    }
+
     // determine the pool
-    u8 n = next_power_of_2(size);
-    n = max(KALLOC_MIN_N, n); // set a minimum value of KALLOC_MIN_N
-    assert(n <= KALLOC_MAX_N, "allocation too large");
-    struct kalloc_pool* pool = &kalloc_pools[n - KALLOC_MIN_N];
+    u8 c = _size_class(size);
+    struct kalloc_pool* pool = &kalloc_pools[c];
 
-    acquire_lock(pool->lock);
-    intp old_next_free = pool->next_free;
-    pool->next_free = (intp)mem;
-    *(u64*)mem = old_next_free;
-    pool->num_free++;
-    pool->num_alloc--;
-    release_lock(pool->lock);
+    if(smp_ready()) {
+        u64 cpu_flags = __cli_saveflags();
+        struct kalloc_cpu_pool* cp = &get_cpu()->kalloc_cache->pools[c];
+
+        if(!_magazine_free(cp, c, mem)) {
+            acquire_lock(pool->lock);
+            _return_to_pool(c, mem);
+            release_lock(pool->lock);
+        }
+
+        cp->bytes_requested -= size;
+        cp->bytes_allocated -= kalloc_classes[c].size;
+        __restoreflags(cpu_flags);
+    } else {
+        u64 pool_flags = _lock_pool(pool);
+        _return_to_pool(c, mem);
+        pool->bytes_requested -= size;
+        pool->bytes_allocated -= kalloc_classes[c].size;
+        _unlock_pool(pool, pool_flags);
+    }
+}
+
+void* kalloc_tagged(u32 size, u8 tag)
+{
+    void* ret = kalloc(size);
+    meminfo_tag_alloc(tag, size);
+    return ret;
+}
+
+void kfree_tagged(void* ptr, u32 size, u8 tag)
+{
+    meminfo_tag_free(tag, size);
+    kfree(ptr, size);
 }
 
+u8 kalloc_num_pools()
+{
+    return KALLOC_NUM_CLASSES;
+}
+
+void kalloc_get_pool_stats(u8 c, struct kalloc_pool_stats* stats)
+{
+    assert(c < KALLOC_NUM_CLASSES, "pool index out of range");
+    struct kalloc_pool* pool = &kalloc_pools[c];
+
+    u64 pool_flags = _lock_pool(pool);
+    stats->size      = kalloc_classes[c].size;
+    stats->num_slabs = pool->num_slabs;
+    stats->num_free  = pool->num_free;
+    stats->num_alloc = pool->num_alloc;
+    stats->pages     = (u64)pool->num_slabs << kalloc_classes[c].page_order;
+    stats->grows     = pool->num_grows;
+    stats->shrinks   = pool->num_shrinks;
+    _unlock_pool(pool, pool_flags);
+}
+
+void kalloc_get_large_stats(struct kalloc_pool_stats* stats)
+{
+    zero(stats);
+
+    acquire_lock(large_lock);
+    stats->num_alloc = large_num_objects;
+    stats->pages     = large_pages_allocated;
+    release_lock(large_lock);
+}
+
+// print the internal fragmentation of every size class. the per-cpu counters are read without
+// synchronization, so the numbers are only approximate while other cpus are allocating
+void kalloc_dump_stats()
+{
+    u64 total_requested = 0;
+    u64 total_allocated = 0;
+
+    fprintf(stderr, "class  slabs   objects   requested   allocated  waste\n");
+
+    for(u8 c = 0; c < KALLOC_NUM_CLASSES; c++) {
+        struct kalloc_pool* pool = &kalloc_pools[c];
+
+        s64 requested = (s64)pool->bytes_requested;
+        s64 allocated = (s64)pool->bytes_allocated;
+
+        for(u32 i = 0; i < apic_num_local_apics(); i++) {
+            struct cpu* cpu = apic_get_cpu(i);
+            if(cpu == null || cpu->kalloc_cache == null) continue;
+            requested += cpu->kalloc_cache->pools[c].bytes_requested;
+            allocated += cpu->kalloc_cache->pools[c].bytes_allocated;
+        }
+
+        u32 waste = (allocated > 0) ? (u32)(((allocated - requested) * 1000) / allocated) : 0;
+        fprintf(stderr, "%5d  %5d  %8d  %10ld  %10ld  %2d.%d%%\n", kalloc_classes[c].size, pool->num_slabs,
+                allocated / kalloc_classes[c].size, requested, allocated, waste / 10, waste % 10);
+
+        total_requested += requested;
+        total_allocated += allocated;
+    }
+
+    acquire_lock(large_lock);
+    u64 requested = large_bytes_requested;
+    u64 allocated = large_pages_allocated << PAGE_SHIFT;
+    u32 num_objects = large_num_objects;
+    release_lock(large_lock);
+
+    u32 waste = (allocated > 0) ? (u32)(((allocated - requested) * 1000) / allocated) : 0;
+    fprintf(stderr, "large         %8d  %10ld  %10ld  %2d.%d%%\n", num_objects, requested, allocated, waste / 10, waste % 10);
+
+    total_requested += requested;
+    total_allocated += allocated;
+
+    waste = (total_allocated > 0) ? (u32)(((total_allocated - total_requested) * 1000) / total_allocated) : 0;
+    fprintf(stderr, "total                 %10ld  %10ld  %2d.%d%%\n", total_requested, total_allocated, waste / 10, waste % 10);
+}
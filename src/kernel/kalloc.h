@@ -2,8 +2,32 @@
 #define __KALLOC_H__
 
 void kalloc_init();
+void kalloc_init_cpu(); // create the magazines for the current cpu
 
+// allocations larger than 4KiB are page granular and page aligned. for those, kfree only needs
+// to know that size is > 4KiB, since the actual size is tracked internally. large allocations return null
+// when palloc can't supply them, including sizes beyond the largest buddy block
 void* kalloc(u32 size);
 void  kfree(void* ptr, u32 size);
 
+// kalloc and kfree that also count the size against a subsystem (enum MEMINFO_TAGS)
+void* kalloc_tagged(u32 size, u8 tag);
+void  kfree_tagged(void* ptr, u32 size, u8 tag);
+
+void  kalloc_dump_stats(); // print requested vs allocated bytes for each size class
+
+struct kalloc_pool_stats {
+    u32 size;       // object size of the class, 0 for large objects
+    u32 num_slabs;
+    u64 num_free;   // free objects in the pool's slabs
+    u64 num_alloc;  // objects handed out, including the ones waiting in per-cpu magazines
+    u64 pages;      // pages the pool holds from palloc
+    u64 grows;      // slabs claimed from palloc
+    u64 shrinks;    // empty slabs given back to palloc
+};
+
+u8   kalloc_num_pools();
+void kalloc_get_pool_stats(u8 pool, struct kalloc_pool_stats*);
+void kalloc_get_large_stats(struct kalloc_pool_stats*); // objects over 4KiB, which don't live in a pool
+
 #endif
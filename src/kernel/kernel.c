@@ -5,6 +5,7 @@
 
 #include "acpi.h"
 #include "apic.h"
+#include "bench.h"
 #include "bootmem.h"
 #include "buffer.h"
 #include "cmos.h"
@@ -15,10 +16,13 @@
 #include "efifb.h"
 #include "fs/ext2/ext2.h"
 #include "gdt.h"
+#include "heap.h"
 #include "hpet.h"
 #include "interrupts.h"
 #include "kalloc.h"
 #include "kernel.h"
+#include "kmem.h"
+#include "meminfo.h"
 #include "multiboot2.h"
 #include "net/arp.h"
 #include "net/dhcp.h"
@@ -28,15 +32,18 @@
 #include "net/net.h"
 #include "net/tcp.h"
 #include "net/udp.h"
+#include "numa.h"
 #include "paging.h"
 #include "palloc.h"
 #include "pci.h"
 #include "serial.h"
+#include "shrinker.h"
 #include "smp.h"
 #include "stdio.h"
 #include "task.h"
 #include "terminal.h"
 #include "time.h"
+#include "tlb.h"
 #include "vmem.h"
 
 char const* assert_error_message = null;
@@ -90,6 +97,9 @@ static void initialize_kernel(struct multiboot_info* multiboot_info)
     // parse the ACPI tables. we need it to enable interrupts
     acpi_init();
 
+    // SRAT/SLIT were parsed by acpi_init(), so build the node tables before palloc needs them
+    numa_init();
+
     // init CMOS/NMI and RTC
     cmos_init();
 
@@ -125,8 +135,9 @@ static void initialize_kernel(struct multiboot_info* multiboot_info)
     // initialize the virtual memory manager
     vmem_init();
 
-    // with palloc, paging and vmem initialized, we can now have a working malloc()... 
-    free(malloc(1*1024*1024)); // initialize malloc with 1MiB of storage
+    // with palloc, paging and vmem initialized, we can now have a working malloc()
+    heap_init();
+    buffer_init();
 
     // safe to enable interrupts now
     __sti();
@@ -141,6 +152,7 @@ static void initialize_kernel(struct multiboot_info* multiboot_info)
     acpi_init_lai();
 
     // startup smp, multithreading and tasks
+    task_init();
     smp_init();
 
     // initialize networking
@@ -393,7 +405,7 @@ static void run_command(char* cmdbuffer)
                         fprintf(stderr, "%c", *(u8*)(data + i));
                     }
 
-                    palloc_abandon(data, 0);
+                    kfree_tagged((void*)data, ext2_block_size(), MEMINFO_TAG_FS);
                     offs += left;
                     block_index += 1;
                 }
@@ -491,6 +503,47 @@ static void run_command(char* cmdbuffer)
         task_enqueue_for(targetcpu, newtask);
     } else if(strcmp(cmdbuffer, "pt") == 0) {
         paging_debug_table(get_cpu()->current_task->page_table);
+    } else if(strcmp(cmdbuffer, "kalloc") == 0) {
+        kalloc_dump_stats();
+    } else if(strcmp(cmdbuffer, "palloc") == 0) {
+        palloc_dump_stats();
+    } else if(strcmp(cmdbuffer, "meminfo") == 0) {
+        // skip whitespace or until end of string
+        while((*cmdptr != 0) && (*cmdptr == ' ' || *cmdptr == '\t')) cmdptr++;
+
+        // "meminfo serial" writes key/value lines to the serial port only
+        if(strcmp(cmdptr, "serial") == 0) meminfo_dump_serial();
+        else                              meminfo_dump();
+    } else if(strcmp(cmdbuffer, "kmem") == 0) {
+        kmem_dump_stats();
+    } else if(strcmp(cmdbuffer, "shrink") == 0) {
+        // skip whitespace or until end of string
+        while((*cmdptr != 0) && (*cmdptr == ' ' || *cmdptr == '\t')) cmdptr++;
+
+        // "shrink <pages>" reclaims that many pages from the caches before showing the stats
+        if(*cmdptr != 0) {
+            u64 want = atoi(cmdptr);
+            fprintf(stderr, "reclaimed %lu of %lu pages\n", shrinker_reclaim(want, false), want);
+        }
+
+        shrinker_dump_stats();
+    } else if(strcmp(cmdbuffer, "stacks") == 0) {
+        task_dump_stack_stats();
+    } else if(strcmp(cmdbuffer, "tlb") == 0) {
+        tlb_dump_stats();
+    } else if(strcmp(cmdbuffer, "bench") == 0) {
+        // skip whitespace or until end of string
+        while((*cmdptr != 0) && (*cmdptr == ' ' || *cmdptr == '\t')) cmdptr++;
+
+        char* name = cmdptr;
+        cmdptr = strchr(cmdptr, ' ');
+        if(cmdptr != null) {
+            *cmdptr++ = '\0';
+        } else {
+            cmdptr = end;
+        }
+
+        bench_run(name);
     } else if(strcmp(cmdbuffer, "arp") == 0) {
         struct net_device* ndev = net_device_by_index(0); // grab the first network adapter
         if(ndev == null) return;
@@ -609,8 +662,7 @@ static void run_command(char* cmdbuffer)
 
         // start the echo server
         struct task* echo_server_task = task_create(echo_server, (intp)port, false);
-        struct cpu* cpu = get_cpu();
-        task_enqueue(&cpu->current_task, echo_server_task);
+        task_enqueue_ready(echo_server_task);
 
     } else if(strcmp(cmdbuffer, "www") == 0) {
         // get IP or hostname to fetch from
@@ -629,8 +681,7 @@ static void run_command(char* cmdbuffer)
             buffer_write(buf, (u8*)server, slen);
 
             struct task* get_www_task = task_create(get_www, (intp)buf, false);
-            struct cpu* cpu = get_cpu();
-            task_enqueue(&cpu->current_task, get_www_task);
+            task_enqueue_ready(get_www_task);
         }
     } else if(strcmp(cmdbuffer, "host") == 0) {
         // get hostname parameter
@@ -936,7 +987,7 @@ static s64 echo_server(struct task* task)
         fprintf(stderr, "starting echo connection with %s:%d\n", buf, peersocket->socket_info.source_port);
 
         struct task* peer_echo_task = task_create(echo_server_per_socket, (intp)peersocket, false);
-        task_enqueue(&get_cpu()->current_task, peer_echo_task);
+        task_enqueue_ready(peer_echo_task);
     }
 }
 
@@ -947,8 +998,7 @@ void kernel_main(struct multiboot_info* multiboot_info)
 
     // start the shell and exit
     struct task* shell_task = task_create(shell, (intp)null, false);
-    struct cpu* cpu = get_cpu();
-    task_enqueue(&cpu->current_task, shell_task);
+    task_enqueue_ready(shell_task);
 
     // never exit
     kernel_do_work();
@@ -968,10 +1018,20 @@ __noreturn void kernel_do_work()
 
         //if(!priority_queue.empty()) { work = priority_queue.pop(); do_work(work); continue; }
 
+        // every cpu helps bring up the memory that was skipped during boot, until there's none left to hand out
+        if(palloc_init_deferred() == PALLOC_DEFERRED_INITIALIZED) continue;
+
         if(net_do_work()) continue;
 
         //if(io_do_work()) continue;
 
+        // out of work, so take memory back from the caches if it's running low, clear some pages ahead of time
+        // and give back any pages and objects this cpu has been hoarding
+        palloc_reclaim_idle();
+        palloc_zero_idle();
+        palloc_drain_idle();
+        kmem_drain_idle();
+
         // if there's no more work to do, yield to any running tasks
         //fprintf(stderr, "cpu%d: done with work\n", get_cpu()->cpu_index);
         task_yield(TASK_YIELD_VOLUNTARY); // faster than __hlt since it doesn't wait for preempt
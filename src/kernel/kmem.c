@@ -0,0 +1,518 @@
+// kmem - typed object caches
+//
+// Each cache hands out objects of a single type. Slabs come straight from palloc and start with a small header,
+// which can be found from any object in the slab by masking, since palloc blocks are naturally aligned. When a slab
+// is created every object in it is run through the cache's constructor, and from then on objects are only ever
+// exchanged in their constructed state, so locks, lists and other invariant fields are set up once per slab instead
+// of on every allocation. The free list is linked through a word placed after each object, so that it doesn't
+// disturb what the constructor set up. Leftover space at the end of a slab is used to shift the first object of
+// each new slab by a different number of cache lines (the slab's color), so that the same object in different slabs
+// doesn't always land in the same cache sets. See Bonwick, "The Slab Allocator: An Object-Caching Kernel Memory
+// Allocator", 1994.
+//
+// Once smp is up, every cpu keeps a short list of objects per cache that it can take from and give to with only
+// interrupts disabled. The cache lock is taken when a list runs empty or full to move a batch at a time, so it's
+// taken with interrupts disabled everywhere. Slabs are claimed and constructed outside of it. Objects sitting in cpu
+// lists keep their slabs from ever becoming empty, so the shrinker drains the lists: its own cpu's right away, and
+// the other cpus' the next time they're idle (see kmem_drain_idle()).
+
+#include "common.h"
+
+#include "apic.h"
+#include "cpu.h"
+#include "kalloc.h"
+#include "kernel.h"
+#include "kmem.h"
+#include "paging.h"
+#include "palloc.h"
+#include "shrinker.h"
+#include "smp.h"
+#include "stdio.h"
+#include "string.h"
+
+#define KMEM_VERBOSE 0
+
+#define KMEM_MIN_OBJECTS     8   // slabs are made large enough to hold at least this many objects
+#define KMEM_MAX_ORDER       5   // up to 128KiB slabs
+#define KMEM_COLOR_ALIGN     64  // slab colors are cache line multiples
+#define KMEM_EMPTY_SLABS_MAX 4   // completely free slabs a cache holds on to until the shrinker asks for them
+#define KMEM_MAX_CACHES      32
+#define KMEM_CPU_OBJECTS     14  // objects each cpu keeps per cache, makes a cpu list 128 bytes
+#define KMEM_CPU_BATCH       7   // objects moved between a cpu list and the slabs at once
+
+struct kmem_slab {
+    struct kmem_slab* next;
+    struct kmem_slab* prev;
+    void*  free_list;
+    u32    num_free;
+    u32    num_objects;
+};
+
+struct kmem_cpu_list {
+    void*  objects[KMEM_CPU_OBJECTS];
+    u32    count;
+    u32    drain_generation; // the last kmem_drain_generation this list was drained for
+    u64    allocs;
+};
+
+static_assert(sizeof(struct kmem_cpu_list) == 128, "cpu list should be 128 bytes");
+
+struct kmem_cache {
+    char const* name;
+    kmem_ctor_function* ctor;
+
+    // layout
+    u32    object_size;
+    u32    link_offset;   // where the free list link lives in each object
+    u32    stride;
+    u32    first;         // offset of the first object in a slab of color 0
+    u32    num_objects;   // objects per slab
+    u32    color_step;
+    u32    num_colors;
+    u32    next_color;
+    u8     page_order;
+    u8     padding0[7];
+
+    struct ticketlock lock;
+    struct kmem_slab* partial_slabs;
+    struct kmem_slab* full_slabs;
+    struct kmem_slab* empty_slabs;
+    u32    num_slabs;
+    u32    num_empty;
+
+    // statistics, protected by the lock
+    u64    num_alloc;
+    u64    num_free;
+    u64    allocs;        // only from before smp, after that they're counted in the cpu lists
+    u64    grows;
+    u64    shrinks;
+    u64    constructed;
+
+    // one list per cpu, created the first time the cache is used after smp is up
+    struct kmem_cpu_list* volatile cpu_lists;
+    u32    num_cpu_lists;
+    u32    padding1;
+};
+
+static struct kmem_cache* caches[KMEM_MAX_CACHES];
+static u32 num_caches = 0;
+declare_ticketlock(caches_lock);
+
+// bumped by the shrinker to ask every cpu to drain its lists
+static u32 volatile kmem_drain_generation = 0;
+
+static inline u64 _lock_cache(struct kmem_cache* cache)
+{
+    u64 cpu_flags = __cli_saveflags();
+    acquire_lock(cache->lock);
+    return cpu_flags;
+}
+
+static inline void _unlock_cache(struct kmem_cache* cache, u64 cpu_flags)
+{
+    release_lock(cache->lock);
+    __restoreflags(cpu_flags);
+}
+
+static inline void _slab_list_remove(struct kmem_slab** head, struct kmem_slab* slab)
+{
+    if(slab->prev != null) slab->prev->next = slab->next;
+    else                   *head = slab->next;
+    if(slab->next != null) slab->next->prev = slab->prev;
+}
+
+static inline void _slab_list_push(struct kmem_slab** head, struct kmem_slab* slab)
+{
+    slab->prev = null;
+    slab->next = *head;
+    if(slab->next != null) slab->next->prev = slab;
+    *head = slab;
+}
+
+static inline void** _link_of(struct kmem_cache* cache, void* object)
+{
+    return (void**)((intp)object + cache->link_offset);
+}
+
+static void _give_locked(struct kmem_cache* cache, void* object);
+
+// give every object in this cpu's list back to the slabs. called with interrupts disabled and the cache lock held
+static void _drain_cpu_list_locked(struct kmem_cache* cache, struct kmem_cpu_list* list)
+{
+    for(u32 i = 0; i < list->count; i++) _give_locked(cache, list->objects[i]);
+    list->count = 0;
+    list->drain_generation = kmem_drain_generation;
+}
+
+// the empty slabs and the objects waiting in cpu lists are given back when memory runs low. this can happen inside
+// palloc_claim with any lock held, so caches that are busy are skipped
+static u64 _kmem_shrinker_count(struct shrinker* shrinker)
+{
+    unused(shrinker);
+
+    u64 pages = 0;
+    for(u32 i = 0; i < num_caches; i++) {
+        struct kmem_cache* cache = caches[i];
+        pages += (u64)cache->num_empty << cache->page_order;
+
+        // read without synchronization, it's only an estimate
+        if(cache->cpu_lists == null) continue;
+        u64 cached = 0;
+        for(u32 j = 0; j < cache->num_cpu_lists; j++) cached += cache->cpu_lists[j].count;
+        pages += (cached * cache->stride + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    }
+    return pages;
+}
+
+static u64 _kmem_shrinker_scan(struct shrinker* shrinker, u64 nr_pages)
+{
+    unused(shrinker);
+
+    // the other cpus drain their lists the next time they're idle
+    __atomic_inc(&kmem_drain_generation);
+
+    u64 freed = 0;
+    for(u32 i = 0; i < num_caches && freed < nr_pages; i++) {
+        struct kmem_cache* cache = caches[i];
+
+        u64 cpu_flags = __cli_saveflags();
+        if(!try_lock(cache->lock)) {
+            __restoreflags(cpu_flags);
+            continue;
+        }
+
+        // this cpu's objects go back right away, so the slabs they came from might become empty
+        if(cache->cpu_lists != null) _drain_cpu_list_locked(cache, &cache->cpu_lists[get_cpu()->cpu_index]);
+
+        struct kmem_slab* slab;
+        while(freed < nr_pages && (slab = cache->empty_slabs) != null) {
+            _slab_list_remove(&cache->empty_slabs, slab);
+            cache->num_empty--;
+            cache->num_free -= slab->num_objects;
+            cache->num_slabs--;
+            cache->shrinks++;
+            palloc_abandon((intp)slab, cache->page_order);
+            freed += 1 << cache->page_order;
+        }
+
+        _unlock_cache(cache, cpu_flags);
+    }
+
+    return freed;
+}
+
+static struct shrinker kmem_shrinker = {
+    .name  = "kmem",
+    .count = _kmem_shrinker_count,
+    .scan  = _kmem_shrinker_scan,
+    .flags = SHRINKER_FLAG_DIRECT,
+};
+
+struct kmem_cache* kmem_cache_create(char const* name, u32 size, u32 align, kmem_ctor_function* ctor)
+{
+    if(align == 0) align = sizeof(void*);
+    assert(size != 0, "objects must have a size");
+    assert(is_power_of_2(align) && align >= sizeof(void*), "alignment must be a power of 2 and at least 8");
+
+    struct kmem_cache* cache = (struct kmem_cache*)kalloc(sizeof(struct kmem_cache));
+    zero(cache);
+
+    declare_ticketlock(lock_init);
+    cache->lock = lock_init;
+    cache->name = name;
+    cache->ctor = ctor;
+
+    // the link goes right after the object, and the stride keeps every object aligned
+    cache->object_size = size;
+    cache->link_offset = (u32)(intp)__alignup(size, sizeof(void*));
+    cache->stride      = (u32)(intp)__alignup(cache->link_offset + sizeof(void*), align);
+    cache->first       = (u32)(intp)__alignup(sizeof(struct kmem_slab), align);
+
+    // use the smallest slab that holds enough objects
+    u8 order = 0;
+    while(order < KMEM_MAX_ORDER && ((PAGE_SIZE << order) - cache->first) / cache->stride < KMEM_MIN_OBJECTS) order++;
+    cache->page_order  = order;
+    cache->num_objects = ((PAGE_SIZE << order) - cache->first) / cache->stride;
+    assert(cache->num_objects != 0, "object too large for a kmem cache");
+
+    // whatever is left over at the end of a slab is the room there is for coloring
+    u32 slack = (PAGE_SIZE << order) - cache->first - cache->num_objects * cache->stride;
+    cache->color_step = max(align, KMEM_COLOR_ALIGN);
+    cache->num_colors = slack / cache->color_step + 1;
+
+    acquire_lock(caches_lock);
+    assert(num_caches < KMEM_MAX_CACHES, "too many kmem caches");
+    caches[num_caches] = cache;
+    __sync_synchronize(); // the shrinker reads the array without the lock
+    num_caches++;
+    if(num_caches == 1) shrinker_register(&kmem_shrinker);
+    release_lock(caches_lock);
+
+#if KMEM_VERBOSE > 0
+    fprintf(stderr, "kmem: created cache %s size=%d stride=%d order=%d objects=%d colors=%d\n",
+            name, size, cache->stride, order, cache->num_objects, cache->num_colors);
+#endif
+
+    return cache;
+}
+
+// claim a new slab, construct every object in it and add it to the cache. called without the cache lock, and
+// ideally with interrupts enabled, since palloc may have to reclaim and the constructors can take a while.
+// returns false when out of memory
+static bool _grow_cache(struct kmem_cache* cache)
+{
+    intp mem = palloc_claim(cache->page_order);
+    if(mem == 0) return false;
+
+    // the descriptor says which cache a page belongs to. palloc clears it when the slab is released
+    struct page* page = palloc_page(mem);
+    if(page != null) {
+        page->owner = cache;
+        __sync_fetch_and_or(&page->flags, PAGE_FLAG_SLAB);
+    }
+
+    struct kmem_slab* slab = (struct kmem_slab*)mem;
+    zero(slab);
+    slab->num_objects = cache->num_objects;
+    slab->num_free    = cache->num_objects;
+
+    // colors only need to vary, so cpus growing the cache at the same time can share one
+    u32 color = cache->next_color;
+    cache->next_color = (color + 1) % cache->num_colors;
+    intp start = mem + cache->first + color * cache->color_step;
+
+    // build the free list backwards so that objects are handed out in address order
+    for(s32 i = cache->num_objects - 1; i >= 0; i--) {
+        void* object = (void*)(start + (intp)i * cache->stride);
+        if(cache->ctor != null) cache->ctor(object);
+        *_link_of(cache, object) = slab->free_list;
+        slab->free_list = object;
+    }
+
+    u64 cpu_flags = _lock_cache(cache);
+    if(cache->ctor != null) cache->constructed += cache->num_objects;
+
+    _slab_list_push(&cache->partial_slabs, slab);
+    cache->num_slabs++;
+    cache->num_free += cache->num_objects;
+    cache->grows++;
+    _unlock_cache(cache, cpu_flags);
+
+#if KMEM_VERBOSE > 1
+    fprintf(stderr, "kmem: %s grew by slab 0x%lX\n", cache->name, slab);
+#endif
+
+    return true;
+}
+
+// called with the cache lock held. returns null when the cache has to grow
+static void* _take_locked(struct kmem_cache* cache)
+{
+    // prefer partially used slabs, then empty ones
+    struct kmem_slab* slab = cache->partial_slabs;
+    if(slab == null) {
+        if((slab = cache->empty_slabs) == null) return null;
+        _slab_list_remove(&cache->empty_slabs, slab);
+        _slab_list_push(&cache->partial_slabs, slab);
+        cache->num_empty--;
+    }
+
+    void* object = slab->free_list;
+    slab->free_list = *_link_of(cache, object);
+
+    if(--slab->num_free == 0) {
+        _slab_list_remove(&cache->partial_slabs, slab);
+        _slab_list_push(&cache->full_slabs, slab);
+    }
+
+    cache->num_free--;
+    cache->num_alloc++;
+    return object;
+}
+
+// called with the cache lock held
+static void _give_locked(struct kmem_cache* cache, void* object)
+{
+    struct kmem_slab* slab = (struct kmem_slab*)((intp)object & ~((PAGE_SIZE << cache->page_order) - 1));
+
+    // a full slab becomes partial again
+    if(slab->num_free == 0) {
+        _slab_list_remove(&cache->full_slabs, slab);
+        _slab_list_push(&cache->partial_slabs, slab);
+    }
+
+    *_link_of(cache, object) = slab->free_list;
+    slab->free_list = object;
+    slab->num_free++;
+
+    cache->num_free++;
+    cache->num_alloc--;
+
+    if(slab->num_free != slab->num_objects) return;
+
+    // the slab is now completely unused
+    _slab_list_remove(&cache->partial_slabs, slab);
+
+    if(cache->num_empty < KMEM_EMPTY_SLABS_MAX) {
+        _slab_list_push(&cache->empty_slabs, slab);
+        cache->num_empty++;
+        return;
+    }
+
+    cache->num_free -= slab->num_objects;
+    cache->num_slabs--;
+    cache->shrinks++;
+    palloc_abandon((intp)slab, cache->page_order);
+}
+
+static struct kmem_cpu_list* _get_cpu_lists(struct kmem_cache* cache)
+{
+    if(cache->cpu_lists != null) return cache->cpu_lists;
+
+    u32 num_cpus = apic_num_local_apics();
+    struct kmem_cpu_list* lists = (struct kmem_cpu_list*)kalloc(sizeof(struct kmem_cpu_list) * num_cpus);
+    memset(lists, 0, sizeof(struct kmem_cpu_list) * num_cpus);
+
+    // another cpu could have beaten us to it. num_cpu_lists has to be set before the lists are visible
+    u64 cpu_flags = _lock_cache(cache);
+    if(cache->cpu_lists == null) {
+        cache->num_cpu_lists = num_cpus;
+        __sync_synchronize();
+        cache->cpu_lists = lists;
+        lists = null;
+    }
+    _unlock_cache(cache, cpu_flags);
+
+    if(lists != null) kfree(lists, sizeof(struct kmem_cpu_list) * num_cpus);
+    return cache->cpu_lists;
+}
+
+void* kmem_cache_alloc(struct kmem_cache* cache)
+{
+    void* ret = null;
+
+    while(true) {
+        if(smp_ready()) {
+            struct kmem_cpu_list* lists = _get_cpu_lists(cache);
+
+            u64 cpu_flags = __cli_saveflags();
+            struct kmem_cpu_list* list = &lists[get_cpu()->cpu_index];
+
+            // refill with a batch from the slabs. interrupts are already disabled
+            if(list->count == 0) {
+                acquire_lock(cache->lock);
+                while(list->count < KMEM_CPU_BATCH) {
+                    void* object = _take_locked(cache);
+                    if(object == null) break;
+                    list->objects[list->count++] = object;
+                }
+                release_lock(cache->lock);
+            }
+
+            if(list->count != 0) {
+                ret = list->objects[--list->count];
+                list->allocs++;
+            }
+
+            __restoreflags(cpu_flags);
+        } else {
+            u64 cpu_flags = _lock_cache(cache);
+            if((ret = _take_locked(cache)) != null) cache->allocs++;
+            _unlock_cache(cache, cpu_flags);
+        }
+
+        // out of objects, so grow the cache now that interrupts are enabled again and try once more
+        if(ret != null || !_grow_cache(cache)) return ret;
+    }
+}
+
+void kmem_cache_free(struct kmem_cache* cache, void* object)
+{
+    if(smp_ready() && cache->cpu_lists != null) {
+        u64 cpu_flags = __cli_saveflags();
+        struct kmem_cpu_list* list = &cache->cpu_lists[get_cpu()->cpu_index];
+
+        // give the oldest batch back to the slabs, keeping the recently used objects here. interrupts are already
+        // disabled
+        if(list->count == KMEM_CPU_OBJECTS) {
+            acquire_lock(cache->lock);
+            for(u32 i = 0; i < KMEM_CPU_BATCH; i++) _give_locked(cache, list->objects[i]);
+            release_lock(cache->lock);
+
+            list->count -= KMEM_CPU_BATCH;
+            memmove(&list->objects[0], &list->objects[KMEM_CPU_BATCH], list->count * sizeof(void*));
+        }
+
+        list->objects[list->count++] = object;
+        __restoreflags(cpu_flags);
+        return;
+    }
+
+    u64 cpu_flags = _lock_cache(cache);
+    _give_locked(cache, object);
+    _unlock_cache(cache, cpu_flags);
+}
+
+void kmem_drain_idle()
+{
+    if(!smp_ready()) return;
+
+    u64 cpu_flags = __cli_saveflags();
+    u32 cpu_index = get_cpu()->cpu_index;
+
+    for(u32 i = 0; i < num_caches; i++) {
+        struct kmem_cache* cache = caches[i];
+        if(cache->cpu_lists == null) continue;
+
+        struct kmem_cpu_list* list = &cache->cpu_lists[cpu_index];
+        if(list->drain_generation == kmem_drain_generation) continue;
+
+        acquire_lock(cache->lock);
+        _drain_cpu_list_locked(cache, list);
+        release_lock(cache->lock);
+    }
+
+    __restoreflags(cpu_flags);
+}
+
+u32 kmem_num_caches()
+{
+    return num_caches;
+}
+
+void kmem_cache_get_stats(u32 index, struct kmem_cache_stats* stats)
+{
+    assert(index < num_caches, "cache index out of range");
+    struct kmem_cache* cache = caches[index];
+
+    u64 cpu_flags = _lock_cache(cache);
+    stats->name        = cache->name;
+    stats->object_size = cache->object_size;
+    stats->stride      = cache->stride;
+    stats->num_slabs   = cache->num_slabs;
+    stats->num_colors  = cache->num_colors;
+    stats->num_alloc   = cache->num_alloc;
+    stats->num_free    = cache->num_free;
+    stats->allocs      = cache->allocs;
+    stats->grows       = cache->grows;
+    stats->shrinks     = cache->shrinks;
+    stats->constructed = cache->constructed;
+    _unlock_cache(cache, cpu_flags);
+
+    // the cpu lists are read without synchronization, so this is only approximate while other cpus are allocating
+    if(cache->cpu_lists != null) {
+        for(u32 i = 0; i < cache->num_cpu_lists; i++) stats->allocs += cache->cpu_lists[i].allocs;
+    }
+}
+
+void kmem_dump_stats()
+{
+    fprintf(stderr, "cache            size  stride  slabs  colors    objects       free      allocs  grows  shrinks\n");
+
+    for(u32 i = 0; i < kmem_num_caches(); i++) {
+        struct kmem_cache_stats stats;
+        kmem_cache_get_stats(i, &stats);
+        fprintf(stderr, "%-14s  %5d  %6d  %5d  %6d  %9lu  %9lu  %10lu  %5lu  %7lu\n", stats.name, stats.object_size, stats.stride,
+                stats.num_slabs, stats.num_colors, stats.num_alloc, stats.num_free, stats.allocs, stats.grows, stats.shrinks);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef __KMEM_H__
+#define __KMEM_H__
+
+// typed object caches. objects are built by the cache's constructor once, when the slab holding them is created,
+// and have to be given back in that same constructed state (locks released, lists empty, etc). that way allocating
+// is only a pop from a list of ready objects. the constructed state must not own other memory, since objects are
+// released to palloc without any destructor running
+typedef void (kmem_ctor_function)(void* object);
+
+struct kmem_cache;
+
+struct kmem_cache_stats {
+    char const* name;
+    u32 object_size;
+    u32 stride;        // bytes per object in a slab, including the free list link
+    u32 num_slabs;
+    u32 num_colors;    // distinct offsets the first object of a slab can start at
+    u64 num_alloc;     // objects handed out, including the ones waiting in per-cpu lists
+    u64 num_free;      // free objects in the slabs
+    u64 allocs;        // kmem_cache_alloc calls
+    u64 grows;         // slabs claimed from palloc
+    u64 shrinks;       // empty slabs given back to palloc
+    u64 constructed;   // constructor calls
+};
+
+// align is a power of 2 (0 for 8 bytes), and ctor can be null
+struct kmem_cache* kmem_cache_create(char const* name, u32 size, u32 align, kmem_ctor_function* ctor);
+
+void* kmem_cache_alloc(struct kmem_cache*); // returns null when out of memory
+void  kmem_cache_free(struct kmem_cache*, void* object);
+
+// give the objects in this cpu's lists back to the slabs if the shrinker has asked for it since the last time.
+// called from the idle loop
+void kmem_drain_idle();
+
+u32  kmem_num_caches();
+void kmem_cache_get_stats(u32 index, struct kmem_cache_stats*); // index is the order of creation
+void kmem_dump_stats();
+
+#endif
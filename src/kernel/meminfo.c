@@ -0,0 +1,224 @@
+// meminfo - a snapshot of where memory is going
+//
+// The numbers come from palloc (free blocks per order), kalloc (pool occupancy and how often pools grew or
+// shrank), the kmem object caches, the shrinkers, the kernel vmem (free areas) and the allocation tags kept here. Nothing is locked across the
+// whole snapshot, so the parts can disagree slightly while other cpus are allocating.
+
+#include "common.h"
+
+#include "cpu.h"
+#include "kalloc.h"
+#include "kernel.h"
+#include "kmem.h"
+#include "meminfo.h"
+#include "paging.h"
+#include "palloc.h"
+#include "serial.h"
+#include "shrinker.h"
+#include "stdio.h"
+#include "string.h"
+#include "vmem.h"
+
+// each tag gets its own cache line, since unrelated subsystems update them from every cpu
+struct meminfo_tag {
+    u64 volatile bytes;
+    u64 volatile max_bytes;
+    u64 volatile allocs;
+    u64 volatile frees;
+    u8  padding0[32];
+} __aligned(64);
+
+static struct meminfo_tag tags[MEMINFO_NUM_TAGS];
+
+static char const* const tag_names[MEMINFO_NUM_TAGS] = { "net", "fs", "task", "paging" };
+
+void meminfo_tag_alloc(u8 tag, u64 bytes)
+{
+    assert(tag < MEMINFO_NUM_TAGS, "invalid meminfo tag");
+    struct meminfo_tag* t = &tags[tag];
+
+    __atomic_inc(&t->allocs);
+    u64 now = __atomic_add(&t->bytes, bytes);
+
+    u64 max_bytes;
+    while((max_bytes = t->max_bytes) < now) {
+        if(__compare_and_exchange(&t->max_bytes, max_bytes, now) == max_bytes) break;
+    }
+}
+
+void meminfo_tag_free(u8 tag, u64 bytes)
+{
+    assert(tag < MEMINFO_NUM_TAGS, "invalid meminfo tag");
+    struct meminfo_tag* t = &tags[tag];
+
+    __atomic_inc(&t->frees);
+    __atomic_add(&t->bytes, -(s64)bytes);
+}
+
+void meminfo_get_tag_stats(u8 tag, struct meminfo_tag_stats* stats)
+{
+    assert(tag < MEMINFO_NUM_TAGS, "invalid meminfo tag");
+
+    stats->bytes     = tags[tag].bytes;
+    stats->max_bytes = tags[tag].max_bytes;
+    stats->allocs    = tags[tag].allocs;
+    stats->frees     = tags[tag].frees;
+}
+
+char const* meminfo_tag_name(u8 tag)
+{
+    assert(tag < MEMINFO_NUM_TAGS, "invalid meminfo tag");
+    return tag_names[tag];
+}
+
+void meminfo_dump()
+{
+    struct palloc_mem_stats ps;
+    palloc_get_mem_stats(&ps);
+
+    fprintf(stderr, "meminfo: %lu pages total, %lu free in palloc, %lu in cpu caches, %lu pre-zeroed, %lu in the huge page pool\n",
+            ps.total_pages, ps.free_pages, ps.cached_pages, ps.zero_pages, ps.huge_pages);
+    fprintf(stderr, "meminfo: %lu pages of page descriptors\n", ps.descriptor_pages);
+
+    fprintf(stderr, "order     free blocks  frag index\n");
+    for(u8 order = 0; order < PALLOC_MAX_ORDER; order++) {
+        u32 frag = palloc_fragmentation_index(&ps, order);
+        fprintf(stderr, "%5d  %14lu  %3d.%d%%\n", order, ps.free_blocks[order], frag / 10, frag % 10);
+    }
+
+    fprintf(stderr, "pool   slabs   pages    objects       free    grows  shrinks\n");
+    for(u8 c = 0; c < kalloc_num_pools(); c++) {
+        struct kalloc_pool_stats ks;
+        kalloc_get_pool_stats(c, &ks);
+        if(ks.grows == 0) continue;
+
+        fprintf(stderr, "%4d  %6d  %6lu  %9lu  %9lu  %7lu  %7lu\n", ks.size, ks.num_slabs, ks.pages, ks.num_alloc, ks.num_free, ks.grows, ks.shrinks);
+    }
+
+    struct kalloc_pool_stats ls;
+    kalloc_get_large_stats(&ls);
+    fprintf(stderr, "large         %6lu  %9lu\n", ls.pages, ls.num_alloc);
+
+    kmem_dump_stats();
+    shrinker_dump_stats();
+
+    struct vmem_stats vs;
+    vmem_get_stats(VMEM_KERNEL, &vs);
+    fprintf(stderr, "meminfo: kernel vmem %lu free areas, %lu MiB free, largest gap %lu MiB, %lu lazy regions\n",
+            vs.free_areas, vs.free_bytes >> 20, vs.largest_free >> 20, vs.lazy_areas);
+
+    fprintf(stderr, "tag          bytes  peak bytes     allocs      frees\n");
+    for(u8 tag = 0; tag < MEMINFO_NUM_TAGS; tag++) {
+        struct meminfo_tag_stats ts;
+        meminfo_get_tag_stats(tag, &ts);
+        fprintf(stderr, "%-6s  %10lu  %10lu  %9lu  %9lu\n", meminfo_tag_name(tag), ts.bytes, ts.max_bytes, ts.allocs, ts.frees);
+    }
+}
+
+static void _serial_line(char const* key, u64 value)
+{
+    char buf[96];
+    int len = sprintf(buf, "%s %lu\n", key, value);
+    serial_write_buffer(buf, (u16)len);
+}
+
+void meminfo_dump_serial()
+{
+    char key[64];
+    char begin[] = "meminfo begin\n";
+    char end[] = "meminfo end\n";
+
+    serial_write_buffer(begin, sizeof(begin) - 1);
+
+    struct palloc_mem_stats ps;
+    palloc_get_mem_stats(&ps);
+    _serial_line("palloc.total_pages", ps.total_pages);
+    _serial_line("palloc.free_pages", ps.free_pages);
+    _serial_line("palloc.cached_pages", ps.cached_pages);
+    _serial_line("palloc.zero_pages", ps.zero_pages);
+    _serial_line("palloc.huge_pages", ps.huge_pages);
+    _serial_line("palloc.descriptor_pages", ps.descriptor_pages);
+    for(u8 order = 0; order < PALLOC_MAX_ORDER; order++) {
+        sprintf(key, "palloc.free_blocks.%d", order);
+        _serial_line(key, ps.free_blocks[order]);
+        sprintf(key, "palloc.frag_index.%d", order);
+        _serial_line(key, palloc_fragmentation_index(&ps, order));
+    }
+
+    for(u8 c = 0; c < kalloc_num_pools(); c++) {
+        struct kalloc_pool_stats ks;
+        kalloc_get_pool_stats(c, &ks);
+
+        sprintf(key, "kalloc.%d.slabs", ks.size);
+        _serial_line(key, ks.num_slabs);
+        sprintf(key, "kalloc.%d.pages", ks.size);
+        _serial_line(key, ks.pages);
+        sprintf(key, "kalloc.%d.alloc", ks.size);
+        _serial_line(key, ks.num_alloc);
+        sprintf(key, "kalloc.%d.free", ks.size);
+        _serial_line(key, ks.num_free);
+        sprintf(key, "kalloc.%d.grows", ks.size);
+        _serial_line(key, ks.grows);
+        sprintf(key, "kalloc.%d.shrinks", ks.size);
+        _serial_line(key, ks.shrinks);
+    }
+
+    struct kalloc_pool_stats ls;
+    kalloc_get_large_stats(&ls);
+    _serial_line("kalloc.large.pages", ls.pages);
+    _serial_line("kalloc.large.alloc", ls.num_alloc);
+
+    for(u32 i = 0; i < kmem_num_caches(); i++) {
+        struct kmem_cache_stats cs;
+        kmem_cache_get_stats(i, &cs);
+
+        sprintf(key, "kmem.%s.slabs", cs.name);
+        _serial_line(key, cs.num_slabs);
+        sprintf(key, "kmem.%s.alloc", cs.name);
+        _serial_line(key, cs.num_alloc);
+        sprintf(key, "kmem.%s.free", cs.name);
+        _serial_line(key, cs.num_free);
+        sprintf(key, "kmem.%s.allocs", cs.name);
+        _serial_line(key, cs.allocs);
+        sprintf(key, "kmem.%s.grows", cs.name);
+        _serial_line(key, cs.grows);
+        sprintf(key, "kmem.%s.shrinks", cs.name);
+        _serial_line(key, cs.shrinks);
+    }
+
+    struct shrinker_stats ss;
+    shrinker_get_stats(&ss);
+    _serial_line("shrinker.direct_runs", ss.direct_runs);
+    _serial_line("shrinker.background_runs", ss.background_runs);
+    _serial_line("shrinker.pages_reclaimed", ss.pages_reclaimed);
+
+    for(struct shrinker* shrinker = shrinker_first(); shrinker != null; shrinker = shrinker->next) {
+        sprintf(key, "shrinker.%s.calls", shrinker->name);
+        _serial_line(key, shrinker->calls);
+        sprintf(key, "shrinker.%s.reclaimed", shrinker->name);
+        _serial_line(key, shrinker->pages_reclaimed);
+    }
+
+    struct vmem_stats vs;
+    vmem_get_stats(VMEM_KERNEL, &vs);
+    _serial_line("vmem.kernel.free_areas", vs.free_areas);
+    _serial_line("vmem.kernel.free_bytes", vs.free_bytes);
+    _serial_line("vmem.kernel.largest_free", vs.largest_free);
+    _serial_line("vmem.kernel.lazy_areas", vs.lazy_areas);
+
+    for(u8 tag = 0; tag < MEMINFO_NUM_TAGS; tag++) {
+        struct meminfo_tag_stats ts;
+        meminfo_get_tag_stats(tag, &ts);
+
+        sprintf(key, "tag.%s.bytes", meminfo_tag_name(tag));
+        _serial_line(key, ts.bytes);
+        sprintf(key, "tag.%s.max_bytes", meminfo_tag_name(tag));
+        _serial_line(key, ts.max_bytes);
+        sprintf(key, "tag.%s.allocs", meminfo_tag_name(tag));
+        _serial_line(key, ts.allocs);
+        sprintf(key, "tag.%s.frees", meminfo_tag_name(tag));
+        _serial_line(key, ts.frees);
+    }
+
+    serial_write_buffer(end, sizeof(end) - 1);
+}
@@ -0,0 +1,35 @@
+#ifndef __MEMINFO_H__
+#define __MEMINFO_H__
+
+// subsystems that tag their allocations, so that meminfo can say who is holding memory
+enum MEMINFO_TAGS {
+    MEMINFO_TAG_NET = 0,
+    MEMINFO_TAG_FS,
+    MEMINFO_TAG_TASK,
+    MEMINFO_TAG_PAGING,
+    MEMINFO_NUM_TAGS
+};
+
+struct meminfo_tag_stats {
+    u64 bytes;      // currently allocated
+    u64 max_bytes;  // the most ever allocated at once
+    u64 allocs;
+    u64 frees;
+};
+
+// count memory allocated or freed by a subsystem. kalloc_tagged() and kfree_tagged() call these, and
+// anything allocated straight from palloc calls them itself
+void meminfo_tag_alloc(u8 tag, u64 bytes);
+void meminfo_tag_free(u8 tag, u64 bytes);
+
+void meminfo_get_tag_stats(u8 tag, struct meminfo_tag_stats*);
+char const* meminfo_tag_name(u8 tag);
+
+// print free memory by order, fragmentation, kalloc pools, kmem caches, kernel vmem and the tags
+void meminfo_dump();
+
+// write the same numbers to the serial port only, one "key value" line each between "meminfo begin" and
+// "meminfo end", for scripts reading the serial log
+void meminfo_dump_serial();
+
+#endif
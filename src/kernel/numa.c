@@ -0,0 +1,214 @@
+#include "common.h"
+
+#include "kernel.h"
+#include "numa.h"
+#include "stdio.h"
+#include "string.h"
+
+// verbosity levels 1 or 2
+#define NUMA_VERBOSE 1
+
+// Nodes are numbered densely in the order their proximity domains first show up with memory, since domain ids can be
+// sparse or large. Only domains with memory become nodes (and palloc zones). Cpus in a domain without memory belong
+// to the closest node that has some. The SLIT is indexed by proximity domain, so it's kept until numa_init() and
+// translated once every domain is known. Distances it doesn't cover get the local/remote defaults.
+//
+// All of this is filled in by acpi_init() before any memory allocator is available, so the storage is static.
+
+struct numa_memory_range {
+    intp start;
+    u64  size;
+    u8   node;
+};
+
+static struct numa_memory_range memory_ranges[NUMA_MAX_MEMORY_RANGES];
+static u8 num_memory_ranges = 0;
+
+struct numa_cpu_affinity {
+    u32  apic_id;
+    u32  proximity_domain;
+    u8   node;  // set by numa_init()
+};
+
+static struct numa_cpu_affinity cpu_affinities[256];
+static u16 num_cpu_affinities = 0;
+
+static u8 num_nodes = 0;
+static u32 node_domains[NUMA_MAX_NODES]; // proximity domain of each node
+static u8 distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static u8 fallback_nodes[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+static u8 const* slit_matrix = null;
+static u64 slit_localities = 0;
+
+// returns NUMA_MAX_NODES when the domain has no node
+static u8 _find_node(u32 proximity_domain)
+{
+    for(u8 node = 0; node < num_nodes; node++) {
+        if(node_domains[node] == proximity_domain) return node;
+    }
+
+    return NUMA_MAX_NODES;
+}
+
+static u8 _add_node(u32 proximity_domain)
+{
+    u8 node = _find_node(proximity_domain);
+    if(node != NUMA_MAX_NODES) return node;
+
+    if(num_nodes == NUMA_MAX_NODES) {
+        fprintf(stderr, "numa: warning: too many nodes, proximity domain %d is merged into node 0\n", proximity_domain);
+        return 0;
+    }
+
+    node_domains[num_nodes] = proximity_domain;
+    return num_nodes++;
+}
+
+// distance between two proximity domains from the SLIT, or the defaults when it doesn't cover them
+static u8 _domain_distance(u32 from, u32 to)
+{
+    if(slit_matrix != null && from < slit_localities && to < slit_localities) return slit_matrix[from * slit_localities + to];
+    return (from == to) ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+}
+
+void numa_notify_memory_affinity(u32 proximity_domain, intp base, u64 length, bool enabled)
+{
+#if NUMA_VERBOSE > 0
+    fprintf(stderr, "numa: memory 0x%lX-0x%lX proximity_domain=%d enabled=%d\n", base, base + length - 1, proximity_domain, enabled);
+#endif
+    if(!enabled || length == 0) return;
+
+    if(num_memory_ranges == NUMA_MAX_MEMORY_RANGES) {
+        fprintf(stderr, "numa: warning: too many memory affinity ranges, ignoring 0x%lX\n", base);
+        return;
+    }
+
+    struct numa_memory_range* range = &memory_ranges[num_memory_ranges++];
+    range->start = base;
+    range->size  = length;
+    range->node  = _add_node(proximity_domain);
+}
+
+void numa_notify_cpu_affinity(u32 proximity_domain, u32 apic_id, bool enabled)
+{
+#if NUMA_VERBOSE > 1
+    fprintf(stderr, "numa: cpu apic_id=%d proximity_domain=%d enabled=%d\n", apic_id, proximity_domain, enabled);
+#endif
+    if(!enabled || num_cpu_affinities == countof(cpu_affinities)) return;
+
+    // the node isn't known until all of the memory affinities have been seen
+    cpu_affinities[num_cpu_affinities].apic_id          = apic_id;
+    cpu_affinities[num_cpu_affinities].proximity_domain = proximity_domain;
+    cpu_affinities[num_cpu_affinities].node             = 0;
+    num_cpu_affinities++;
+}
+
+// the SLIT stays mapped until numa_init(), which reads it once every node is known
+void numa_notify_distances(u64 num_localities, u8 const* matrix)
+{
+    slit_matrix     = matrix;
+    slit_localities = num_localities;
+}
+
+void numa_init()
+{
+    // without an SRAT everything is one node
+    if(num_nodes == 0) {
+        num_nodes = 1;
+        node_domains[0] = 0;
+    }
+
+    for(u8 i = 0; i < num_nodes; i++) {
+        for(u8 j = 0; j < num_nodes; j++) {
+            distances[i][j] = (i == j) ? NUMA_LOCAL_DISTANCE : _domain_distance(node_domains[i], node_domains[j]);
+        }
+    }
+
+    // cpus go to the node of their domain, or the closest node when their domain has no memory
+    for(u16 i = 0; i < num_cpu_affinities; i++) {
+        struct numa_cpu_affinity* affinity = &cpu_affinities[i];
+        affinity->node = _find_node(affinity->proximity_domain);
+        if(affinity->node != NUMA_MAX_NODES) continue;
+
+        affinity->node = 0;
+        for(u8 node = 1; node < num_nodes; node++) {
+            if(_domain_distance(affinity->proximity_domain, node_domains[node])
+               < _domain_distance(affinity->proximity_domain, node_domains[affinity->node])) affinity->node = node;
+        }
+    }
+
+    slit_matrix = null; // not needed anymore
+
+    // build the fallback order for each node with an insertion sort on distance. ties go to the lower node id
+    for(u8 node = 0; node < num_nodes; node++) {
+        u8* order = fallback_nodes[node];
+        for(u8 i = 0; i < num_nodes; i++) {
+            u8 j = i;
+            while(j > 0 && distances[node][order[j - 1]] > distances[node][i]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+
+        // the local node should always be tried first, even if the SLIT is strange
+        for(u8 i = 1; i < num_nodes; i++) {
+            if(order[i] == node) {
+                memmove(&order[1], &order[0], i);
+                order[0] = node;
+                break;
+            }
+        }
+    }
+
+#if NUMA_VERBOSE > 0
+    fprintf(stderr, "numa: %d node(s), %d memory range(s), %d cpu(s) with affinity\n", num_nodes, num_memory_ranges, num_cpu_affinities);
+    for(u8 node = 0; node < num_nodes; node++) {
+        fprintf(stderr, "numa: node %d (proximity domain %d) distances:", node, node_domains[node]);
+        for(u8 i = 0; i < num_nodes; i++) fprintf(stderr, " %d", distances[node][i]);
+        fprintf(stderr, "\n");
+    }
+#endif
+}
+
+u8 numa_num_nodes()
+{
+    return num_nodes;
+}
+
+u8 numa_node_of_address(intp address)
+{
+    return numa_node_of_range(address, 1);
+}
+
+u8 numa_node_of_range(intp start, u64 size)
+{
+    for(u8 i = 0; i < num_memory_ranges; i++) {
+        struct numa_memory_range* range = &memory_ranges[i];
+        if(start < (range->start + range->size) && (start + size) > range->start) return range->node;
+    }
+
+    return 0;
+}
+
+u8 numa_node_of_apic_id(u32 apic_id)
+{
+    for(u16 i = 0; i < num_cpu_affinities; i++) {
+        if(cpu_affinities[i].apic_id == apic_id) return cpu_affinities[i].node;
+    }
+
+    return 0;
+}
+
+u8 numa_distance(u8 from, u8 to)
+{
+    assert(from < num_nodes && to < num_nodes, "invalid node");
+    return distances[from][to];
+}
+
+u8 const* numa_fallback_nodes(u8 node)
+{
+    assert(node < num_nodes, "invalid node");
+    return fallback_nodes[node];
+}
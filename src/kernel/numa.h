@@ -0,0 +1,25 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#define NUMA_MAX_NODES          8
+#define NUMA_MAX_MEMORY_RANGES  32
+#define NUMA_LOCAL_DISTANCE     10  // SLIT distance to the same node
+#define NUMA_REMOTE_DISTANCE    20  // assumed distance between nodes when there's no SLIT
+
+void numa_notify_memory_affinity(u32 proximity_domain, intp base, u64 length, bool enabled);
+void numa_notify_cpu_affinity(u32 proximity_domain, u32 apic_id, bool enabled);
+void numa_notify_distances(u64 num_localities, u8 const* distances);
+
+// call after acpi_init() and before palloc_init()
+void numa_init();
+
+u8 numa_num_nodes();
+u8 numa_node_of_address(intp address);
+u8 numa_node_of_range(intp start, u64 size); // node of the first memory range that overlaps [start, start+size)
+u8 numa_node_of_apic_id(u32 apic_id);
+u8 numa_distance(u8 from, u8 to);
+
+// nodes sorted by distance from 'node', starting with 'node' itself. numa_num_nodes() entries long
+u8 const* numa_fallback_nodes(u8 node);
+
+#endif
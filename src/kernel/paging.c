@@ -1,17 +1,34 @@
 #include "common.h"
 
 #include "cpu.h"
+#include "cpuid.h"
 #include "kalloc.h"
 #include "kernel.h"
+#include "meminfo.h"
 #include "multiboot2.h"
 #include "paging.h"
 #include "palloc.h"
 #include "stdio.h"
+#include "string.h"
+#include "tlb.h"
 
-// bits 51-63 are not address, and the physical address must be 2MiB aligned
-#define CPU_PAGE_TABLE_ADDRESS_MASK_1GB     0x0007FFFFC0000000
-#define CPU_PAGE_TABLE_ADDRESS_MASK_2MB     0x0007FFFFFFE00000
-#define CPU_PAGE_TABLE_ADDRESS_MASK_4KB     0x0007FFFFFFFFFC00
+// bits 52-63 are not address, and the physical address must be aligned to the page size
+#define CPU_PAGE_TABLE_ADDRESS_MASK_1GB     0x000FFFFFC0000000
+#define CPU_PAGE_TABLE_ADDRESS_MASK_2MB     0x000FFFFFFFE00000
+#define CPU_PAGE_TABLE_ADDRESS_MASK_4KB     0x000FFFFFFFFFF000
+
+#define PAGING_2MB (1ULL << 21)
+#define PAGING_1GB (1ULL << 30)
+
+#define CR3_NOFLUSH        (1ULL << 63)  // keep the new pcid's TLB entries when writing cr3
+#define PAGING_NUM_PCIDS   4096
+#define PAGING_KERNEL_PCID 0             // the kernel table has the same pcid on every cpu
+#define PAGING_MAX_CPUS    64            // cpu_mask and the pcid array are indexed by cpu_index
+
+// every table keeps the number of entries in use in bits 52-61 of its own entry 0. the cpu ignores them at every level
+// and whether or not the entry is present (bits 59-62 would be protection keys, but CR4.PKE is never set)
+#define PAGING_COUNT_SHIFT 52
+#define PAGING_COUNT_MASK  (0x3FFULL << PAGING_COUNT_SHIFT)
 
 enum CPU_PAGE_TABLE_ENTRY_FLAGS {
     CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT   = (1 << 0),
@@ -21,41 +38,168 @@ enum CPU_PAGE_TABLE_ENTRY_FLAGS {
     CPU_PAGE_TABLE_ENTRY_CACHE_DISABLE  = (1 << 4),
     CPU_PAGE_TABLE_ENTRY_ACCESSED       = (1 << 5),
     CPU_PAGE_TABLE_ENTRY_DIRTY          = (1 << 6),
-    CPU_PAGE_TABLE_ENTRY_FLAG_HUGE      = (1 << 7)
+    CPU_PAGE_TABLE_ENTRY_FLAG_HUGE      = (1 << 7),
+    CPU_PAGE_TABLE_ENTRY_FLAG_GLOBAL    = (1 << 8),
+    CPU_PAGE_TABLE_ENTRY_FLAG_COW       = (1 << 9)   // ignored by the cpu. read-only until the next write copies the page
+};
+
+// a pcid is only valid on a cpu while the cpu's generation hasn't changed
+struct page_table_pcid {
+    u64 generation;
+    u16 pcid;
+    u8  unused0[6];
 };
 
+// the root of an address space. the tables below it are nothing but the page the cpu walks: they all come from
+// palloc, which is identity mapped, so the next level is found from the physical address in the entry
 struct page_table {
-    u64*   _cpu_table;             // always one page, and page aligned. this is the table sent to the cpu
-    struct page_table** entries;   // always 512 entries, might as well be page aligned since it takes 4096 bytes
-    u64    flags;                  // TODO fun flaggies
-    u8     num_entries;
-    u8     unused0[7];
+    u64*   _cpu_table;             // the pml4. always one page, and page aligned. this is the table sent to the cpu
+    u64 volatile cpu_mask;         // cpus that may have TLB entries for this table
+    struct page_table_pcid* pcids; // PAGING_MAX_CPUS entries, only on private tables when pcids are enabled
 };
 
 static struct page_table* kernel_page_table;
+static bool has_1gb_pages = false;
+static bool has_pcid = false;
+static u64 volatile num_tables = 0;
 
 static void _map_page(struct page_table* table_root, intp phys, intp virt, u32 flags);
-static intp _unmap_page(struct page_table* table_root, intp virt);
-static void _map_2mb(intp phys, intp virt, u32 flags);
+
+static u64* _allocate_table()
+{
+    u64* table = (u64*)palloc_claim_flags(0, PALLOC_ZERO);
+    __atomic_inc(&num_tables);
+    meminfo_tag_alloc(MEMINFO_TAG_PAGING, PAGE_SIZE);
+    return table;
+}
+
+static void _free_table(u64* table)
+{
+    palloc_abandon((intp)table, 0);
+    __atomic_dec(&num_tables);
+    meminfo_tag_free(MEMINFO_TAG_PAGING, PAGE_SIZE);
+}
 
 static struct page_table* _allocate_page_table()
 {
     struct page_table* pt = kalloc(sizeof(struct page_table));
 
-    pt->_cpu_table  = (u64*)palloc_claim_one();
-    pt->entries     = (struct page_table**)palloc_claim_one();
-    pt->num_entries = 0;
-    pt->flags       = 0;
-
-    memset64(pt->_cpu_table, 0, 512);
-    memset64(pt->entries, 0, 512);
+    pt->_cpu_table  = _allocate_table();
+    pt->cpu_mask    = 0;
+    pt->pcids       = null;
 
     return pt;
 }
 
-static void _free_page_table(struct page_table* pt)
+// the next level table that `entry` points to
+static inline u64* _table_of(u64 entry)
 {
-    kfree(pt, sizeof(struct page_table));
+    return (u64*)(entry & CPU_PAGE_TABLE_ADDRESS_MASK_4KB);
+}
+
+// entry 0 can hold nothing but the table's count and still be empty
+static inline bool _entry_is_empty(u64 entry)
+{
+    return (entry & ~PAGING_COUNT_MASK) == 0;
+}
+
+// write an entry without disturbing the count. the count is updated with plain stores, so an accessed or dirty bit the
+// cpu sets in entry 0 at the same time can be lost, which is fine since nothing here uses them
+static inline void _set_entry(u64* table, u32 index, u64 entry)
+{
+    table[index] = entry | (table[index] & PAGING_COUNT_MASK);
+}
+
+static inline u32 _get_count(u64* table)
+{
+    return (table[0] & PAGING_COUNT_MASK) >> PAGING_COUNT_SHIFT;
+}
+
+static inline void _set_count(u64* table, u32 count)
+{
+    table[0] = (table[0] & ~PAGING_COUNT_MASK) | ((u64)count << PAGING_COUNT_SHIFT);
+}
+
+static inline void _add_count(u64* table, s32 delta)
+{
+    _set_count(table, _get_count(table) + delta);
+}
+
+// pml4 entry 0 (low memory) and the kernel half are the same in every address space
+static inline bool _is_shared_address(intp virt)
+{
+    u32 pml4_index = (virt >> 39) & 0x1FF;
+    return pml4_index == 0 || pml4_index >= 256;
+}
+
+// convert enum MAP_PAGE_FLAGS to page table entry flags for a mapping at virt
+static u64 _entry_flags(u32 flags, intp virt)
+{
+    u64 pt_flags = CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT;
+
+    // shared mappings are global so that their TLB entries survive cr3 writes
+    if(_is_shared_address(virt)) pt_flags |= CPU_PAGE_TABLE_ENTRY_FLAG_GLOBAL;
+    if(flags & MAP_PAGE_FLAG_DISABLE_CACHE) pt_flags |= CPU_PAGE_TABLE_ENTRY_CACHE_DISABLE;
+    if(flags & MAP_PAGE_FLAG_WRITABLE) pt_flags |= CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE;
+    if(flags & MAP_PAGE_FLAG_USER) pt_flags |= CPU_PAGE_TABLE_ENTRY_FLAG_USER;
+    return pt_flags;
+}
+
+// return the next level table in slot `index` of `table`, creating it if necessary
+static u64* _get_or_create_table(u64* table, u32 index)
+{
+    if(_entry_is_empty(table[index])) {
+        u64* lower = _allocate_table();
+        _set_entry(table, index, (intp)lower | CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT | CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE | CPU_PAGE_TABLE_ENTRY_FLAG_USER);
+        _add_count(table, 1);
+    }
+
+    assert(!(table[index] & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE), "mapping for virtual address already exists");
+    return _table_of(table[index]);
+}
+
+// replace the huge page in slot `index` of `table` with a table of 512 smaller pages that map the same memory
+static void _split_huge_page(u64* table, u32 index, u64 page_size)
+{
+    u64 entry = table[index];
+    u64 lower_size = page_size >> 9;
+    u64 flags = entry & (CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT | CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE | CPU_PAGE_TABLE_ENTRY_FLAG_USER
+                         | CPU_PAGE_TABLE_ENTRY_WRITE_THROUGH | CPU_PAGE_TABLE_ENTRY_CACHE_DISABLE | CPU_PAGE_TABLE_ENTRY_FLAG_GLOBAL);
+    if(lower_size != PAGE_SIZE) flags |= CPU_PAGE_TABLE_ENTRY_FLAG_HUGE;
+    intp phys = entry & ((page_size == PAGING_1GB) ? CPU_PAGE_TABLE_ADDRESS_MASK_1GB : CPU_PAGE_TABLE_ADDRESS_MASK_2MB);
+
+    u64* lower = _allocate_table();
+    for(u32 i = 0; i < 512; i++) {
+        lower[i] = (phys + i * lower_size) | flags;
+    }
+    _set_count(lower, 512);
+
+    // the translation for every address stays the same, and the caller invalidates what it unmaps
+    _set_entry(table, index, (intp)lower | CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT | CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE | CPU_PAGE_TABLE_ENTRY_FLAG_USER);
+}
+
+// remove the table in slot `index` of `table` if nothing is mapped in it anymore. other cpus can still have it in their
+// paging-structure caches, so it's only freed by _free_tables() after the batch has been shot down. until then the
+// first entry of the emptied table links it to the next one, which the cpu sees as a non-present entry
+static void _free_table_if_empty(u64* table, u32 index, struct tlb_batch* batch)
+{
+    u64* lower = _table_of(table[index]);
+    if(_get_count(lower) != 0) return;
+
+    _set_entry(table, index, 0);
+    _add_count(table, -1);
+
+    lower[0] = (u64)batch->freed_tables;
+    batch->freed_tables = lower;
+}
+
+static void _free_tables(u64* table)
+{
+    while(table != null) {
+        u64* next = (u64*)table[0];
+        _free_table(table);
+        table = next;
+    }
 }
 
 static void _map_kernel()
@@ -67,11 +211,8 @@ static void _map_kernel()
     fprintf(stderr, "paging: userland data at 0x%lX, size=0x%lX\n", (intp)&_userland_data_start, (intp)&_userland_data_end - (intp)&_userland_data_start);
 
     // map only the pages the kernel occupies into virtual memory
-    for(intp offs = 0; offs < kernel_size; offs += PAGE_SIZE) {
-        intp phys = (intp)&_kernel_load_address + offs;
-        intp virt = phys | (intp)&_kernel_vma_base;
-        _map_page(kernel_page_table, phys, virt, MAP_PAGE_FLAG_WRITABLE);
-    }
+    paging_map_range(kernel_page_table, (intp)&_kernel_load_address, (intp)&_kernel_load_address | (intp)&_kernel_vma_base, 
+                     (intp)__alignup(kernel_size, PAGE_SIZE), MAP_PAGE_FLAG_WRITABLE);
 
     // All of the lowmem free regions are identity mapped so that palloc/kalloc
     // and other various modules that used bootmem up until this point, continue to work.
@@ -101,6 +242,7 @@ static void _map_kernel()
     }
 }
 
+
 void paging_init()
 {
     // build a new page table using memory allocated from palloc and switch to it
@@ -108,6 +250,19 @@ void paging_init()
     kernel_page_table = _allocate_page_table();
     fprintf(stderr, "paging: initializing page tables (kernel_page_table->_cpu_table=0x%lX)\n", kernel_page_table->_cpu_table);
 
+    // 1GiB pages can be used in range mappings if the cpu supports them
+    u64 a, b, c, d;
+    __cpuid(0x80000001, &a, &b, &c, &d);
+    has_1gb_pages = (d & CPUID_EXT_FEAT_EDX_PAGE1GB) != 0;
+
+    // pcids are only used when invpcid is available too, since that's the only way to invalidate
+    // translations in an address space that isn't loaded
+    __cpuid(1, &a, &b, &c, &d);
+    has_pcid = (c & CPUID_FEAT_ECX_PCID) != 0;
+    __cpuid_subleaf(7, 0, &a, &b, &c, &d);
+    has_pcid = has_pcid && (b & CPUID_EXT7_FEAT_EBX_INVPCID) != 0;
+    fprintf(stderr, "paging: 1GiB pages %s, pcids %s\n", has_1gb_pages ? "enabled" : "disabled", has_pcid ? "enabled" : "disabled");
+
     // map the kernel into virtual space
     _map_kernel();
 
@@ -117,14 +272,10 @@ void paging_init()
 
     // create empty but present tables for all the high memory pml4 entries
     for(u32 i = 256; i < 512; i++) {
-        if(kernel_page_table->_cpu_table[i] != 0) continue;
-
-        struct page_table* pdpt = _allocate_page_table();
-        kernel_page_table->entries[i] = pdpt;
-        kernel_page_table->_cpu_table[i] = (intp)pdpt->_cpu_table | CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT | CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE | CPU_PAGE_TABLE_ENTRY_FLAG_USER;
-        kernel_page_table->num_entries++;
+        _get_or_create_table(kernel_page_table->_cpu_table, i);
     }
-    
+
+    fprintf(stderr, "paging: %lu page tables using %lu KiB\n", num_tables, (num_tables * PAGE_SIZE) >> 10);
     return;
 }
 
@@ -133,6 +284,15 @@ void paging_set_kernel_page_table()
     __wrcr3((u64)kernel_page_table->_cpu_table);
 }
 
+void paging_init_cpu()
+{
+    // global pages keep the kernel's TLB entries across cr3 writes
+    __wrcr4(__rdcr4() | CR4_PGE);
+
+    // cr3 has to have pcid 0 when turning on pcids, which the kernel table does
+    if(has_pcid) __wrcr4(__rdcr4() | CR4_PCIDE);
+}
+
 struct page_table* paging_get_kernel_page_table()
 {
     return kernel_page_table;
@@ -143,147 +303,169 @@ intp paging_get_cpu_table(struct page_table* table_root)
     return (intp)table_root->_cpu_table;
 }
 
+intp paging_prepare_table_switch(struct page_table* from, struct page_table* to)
+{
+    struct cpu* cpu = get_cpu();
+    u32 cpu_index = cpu->cpu_index;
+    intp cr3 = (intp)to->_cpu_table;
+    assert(cpu_index < PAGING_MAX_CPUS, "cpu_mask only holds 64 cpus");
+
+    if(!has_pcid) {
+        if(from == to) return cr3;
+
+        // loading cr3 flushes every translation from the old table, so after the switch this cpu can't have any of them
+        // cached. shootdowns that miss this cpu in between are fine, since the scheduler doesn't touch user memory
+        if(from != null) __sync_and_and_fetch(&from->cpu_mask, ~(1ULL << cpu_index));
+        __sync_or_and_fetch(&to->cpu_mask, 1ULL << cpu_index);
+        return cr3;
+    }
+
+    // with pcids the old table's translations stay cached after switching away, so this cpu stays in its mask until
+    // its pcid for the table is retired (see paging_forget_stale_pcid())
+    if(!(to->cpu_mask & (1ULL << cpu_index))) __sync_or_and_fetch(&to->cpu_mask, 1ULL << cpu_index);
+    if(to == kernel_page_table) return cr3 | PAGING_KERNEL_PCID | CR3_NOFLUSH;
+
+    struct page_table_pcid* pcid = &to->pcids[cpu_index];
+    if(pcid->generation != 0 && pcid->generation == cpu->pcid_generation) return cr3 | pcid->pcid | CR3_NOFLUSH;
+
+    // out of pcids (or first use). start a new generation, which makes every pcid handed out before it invalid,
+    // so forget everything they have cached
+    if(cpu->pcid_next == 0 || cpu->pcid_next == PAGING_NUM_PCIDS) {
+        cpu->pcid_generation++;
+        cpu->pcid_next = PAGING_KERNEL_PCID + 1;
+        __invpcid(INVPCID_ALL_CONTEXTS, 0, 0);
+    }
+
+    pcid->generation = cpu->pcid_generation;
+    pcid->pcid = cpu->pcid_next++;
+
+    // a new pcid has nothing cached, so loading it without the no-flush bit costs nothing
+    return cr3 | pcid->pcid;
+}
+
+u64 paging_get_cpu_mask(struct page_table* table_root)
+{
+    return table_root->cpu_mask;
+}
+
+bool paging_has_pcid()
+{
+    return has_pcid;
+}
+
+s32 paging_get_pcid(struct page_table* table_root)
+{
+    if(table_root == kernel_page_table) return PAGING_KERNEL_PCID;
+
+    struct cpu* cpu = get_cpu();
+    struct page_table_pcid* pcid = &table_root->pcids[cpu->cpu_index];
+    return (pcid->generation != 0 && pcid->generation == cpu->pcid_generation) ? pcid->pcid : -1;
+}
+
+// Once a cpu starts a new pcid generation, the tables it switched away from have nothing cached on it anymore, but
+// it's still in their masks. Retiring a generation would mean finding every table with this cpu in its mask, so
+// instead the cpu drops out of a table's mask the first time it's asked to invalidate for it. Only the cpu itself
+// clears its bit, and the table it's running on always has a current pcid, so this can't race with a switch.
+// Returns true if the bit was cleared
+bool paging_forget_stale_pcid(struct page_table* table_root)
+{
+    if(!has_pcid || table_root == kernel_page_table || paging_get_pcid(table_root) >= 0) return false;
+
+    __sync_and_and_fetch(&table_root->cpu_mask, ~(1ULL << get_cpu()->cpu_index));
+    return true;
+}
+
+
+u64 paging_num_tables()
+{
+    return num_tables;
+}
+
 // create a new page table root, and map the kernel into it by copying pages for 0-4GiB and 0xFFFF800000000000+
 struct page_table* paging_create_private_table()
 {
     struct page_table* private = _allocate_page_table();
+    u64* kernel_pml4 = kernel_page_table->_cpu_table;
+
+    if(has_pcid) {
+        private->pcids = (struct page_table_pcid*)kalloc(sizeof(struct page_table_pcid) * PAGING_MAX_CPUS);
+        memset64(private->pcids, 0, sizeof(struct page_table_pcid) * PAGING_MAX_CPUS / sizeof(u64));
+    }
 
     // entry 0 maps 0x00000000_00000000->0x0000007F_FFFFFFFF
-    // entry 0 will never be null
-    assert(kernel_page_table->entries[0] != null, "low mem missing pointer in page table?");
-    private->entries[0]    = kernel_page_table->entries[0];
-    private->_cpu_table[0] = kernel_page_table->_cpu_table[0];
-    private->num_entries++; 
+    // entry 0 will never be null. it also holds the kernel table's count, which isn't ours
+    assert(kernel_pml4[0] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT, "low mem missing pointer in page table?");
+    private->_cpu_table[0] = kernel_pml4[0] & ~PAGING_COUNT_MASK;
 
     // entries 256-511 map 0xFFFF8000_00000000-0xFFFFFFFF_FFFFFFFF
     for(u64 i = 256; i < 512; i++) {
-        assert(kernel_page_table->entries[i] != null, "kernel high memory must have page table entries in the PML4");
-        private->entries[i]    = kernel_page_table->entries[i];
-        private->_cpu_table[i] = kernel_page_table->_cpu_table[i];
-        private->num_entries++;
+        assert(kernel_pml4[i] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT, "kernel high memory must have page table entries in the PML4");
+        private->_cpu_table[i] = kernel_pml4[i];
     }
 
+    _set_count(private->_cpu_table, 1 + 256);
     return private;
 }
 
-// _map_page does the hard work of mapping a physical address for the specified virtual address
-// location, but does not flush the TLB. For TLB flush, call paging_map_page() instead.
-static void _map_page(struct page_table* table_root, intp phys, intp virt, u32 flags)
+// free a table and every table below it. level is 3 for a pdpt, 2 for a pd and 1 for a pt
+static void _free_table_tree(u64* table, u8 level)
 {
-    assert((virt >> 47) == 0 || (virt >> 47) == 0x1FFFF, "virtual address must be canonical");
-    assert(__alignof(virt, 4096) == 0, "virtual address must be 4KB aligned");
-    assert(__alignof(phys, 4096) == 0, "physical address must be 4KB aligned");
-
-    //fprintf(stderr, "paging: mapping page at 0x%08lX to virtual address 0x%08lX\n", phys, virt);
-
-    // shift right 12 for pt1
-    // shift right 21 for pt2
-    // shift right 30 for pt3
-    // shift right 39 for pt4
-
-    // create a level 3 page table (page directory pointers) if necessary
-    u32 pml4_index = (virt >> 39) & 0x1FF;
-    struct page_table* pdpt = table_root->entries[pml4_index];
-    if(table_root->_cpu_table[pml4_index] == 0) {
-        pdpt = _allocate_page_table();
-        table_root->entries[pml4_index] = pdpt;
-        table_root->_cpu_table[pml4_index] = (intp)pdpt->_cpu_table | CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT | CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE | CPU_PAGE_TABLE_ENTRY_FLAG_USER;
-        table_root->num_entries++;
+    if(level > 1) {
+        for(u32 i = 0; i < 512; i++) {
+            if((table[i] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT) && !(table[i] & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE)) {
+                _free_table_tree(_table_of(table[i]), level - 1);
+            }
+        }
     }
 
-    // create a level 2 page table (page directory) if necessary
-    u32 pdpt_index = (virt >> 30) & 0x1FF;
-    struct page_table* pd = pdpt->entries[pdpt_index];
-    if(pdpt->_cpu_table[pdpt_index] == 0) {
-        pd = _allocate_page_table();
-        pdpt->entries[pdpt_index] = pd;
-        pdpt->_cpu_table[pdpt_index] = (intp)pd->_cpu_table | CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT | CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE | CPU_PAGE_TABLE_ENTRY_FLAG_USER;
-        pdpt->num_entries++;
-    }
+    _free_table(table);
+}
 
-    // create a level 1 page table if necessary
-    u32 pd_index = (virt >> 21) & 0x1FF;
-    struct page_table* pt = pd->entries[pd_index];
-    if(pd->_cpu_table[pd_index] == 0) {
-        pt = _allocate_page_table();
-        pd->entries[pd_index] = pt;
-        pd->_cpu_table[pd_index] = (intp)pt->_cpu_table | CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT | CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE | CPU_PAGE_TABLE_ENTRY_FLAG_USER;
-        pd->num_entries++;
+void paging_destroy_private_table(struct page_table* table_root)
+{
+    assert(table_root != kernel_page_table, "can't destroy the kernel page table");
+    assert(has_pcid || table_root->cpu_mask == 0, "page table is still in use");
+
+    // entry 0 and the kernel half are shared with the kernel table. with pcids, cpus that used the table can still
+    // have translations cached under its pcid, but that pcid isn't handed out again until the cpu starts a new
+    // generation, which flushes it
+    u64* pml4 = table_root->_cpu_table;
+    for(u32 i = 1; i < 256; i++) {
+        if(pml4[i] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT) _free_table_tree(_table_of(pml4[i]), 3);
     }
 
-    // create the entry in the lowest level table (page table). if it already exists, error out
-    u32 pt_index = (virt >> 12) & 0x1FF;
-    u64* pte = &pt->_cpu_table[pt_index];
-    assert(*pte == 0, "mapping for virtual address already exists");
-
-    // set the page directory entry
-    u32 pt_flags = CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT;
-    if(flags & MAP_PAGE_FLAG_DISABLE_CACHE) pt_flags |= CPU_PAGE_TABLE_ENTRY_CACHE_DISABLE;
-    if(flags & MAP_PAGE_FLAG_WRITABLE) pt_flags |= CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE;
-    if(flags & MAP_PAGE_FLAG_USER) pt_flags |= CPU_PAGE_TABLE_ENTRY_FLAG_USER;
-    *pte = (phys & CPU_PAGE_TABLE_ADDRESS_MASK_4KB) | pt_flags;
-    pt->num_entries++;
+    if(table_root->pcids != null) kfree(table_root->pcids, sizeof(struct page_table_pcid) * PAGING_MAX_CPUS);
+    _free_table(pml4);
+    kfree(table_root, sizeof(struct page_table));
 }
 
-// _unmap_page simply removes the entry that 'virt' resolves to from the lowest level page table
-static intp _unmap_page(struct page_table* table_root, intp virt)
+// _map_page does the hard work of mapping a physical address for the specified virtual address
+// location, but does not flush the TLB. For TLB flush, call paging_map_page() instead.
+static void _map_page(struct page_table* table_root, intp phys, intp virt, u32 flags)
 {
     assert((virt >> 47) == 0 || (virt >> 47) == 0x1FFFF, "virtual address must be canonical");
     assert(__alignof(virt, 4096) == 0, "virtual address must be 4KB aligned");
+    assert(__alignof(phys, 4096) == 0, "physical address must be 4KB aligned");
 
-    //fprintf(stderr, "paging: unmapping page at 0x%08lX\n", virt);
+    //fprintf(stderr, "paging: mapping page at 0x%08lX to virtual address 0x%08lX\n", phys, virt);
 
     // shift right 12 for pt1
     // shift right 21 for pt2
     // shift right 30 for pt3
     // shift right 39 for pt4
 
-    // find the level 3 page table (page directory pointers), and error out if it doesn't exist
-    u32 pml4_index = (virt >> 39) & 0x1FF;
-    assert(table_root->_cpu_table[pml4_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT, "virtual address mapping not found");
-    struct page_table* pdpt = table_root->entries[pml4_index];
-
-    // find the level 2 page table (page directory pointers), and error out if it doesn't exist
-    u32 pdpt_index = (virt >> 30) & 0x1FF;
-    assert(pdpt->_cpu_table[pdpt_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT, "virtual address mapping not found");
-    struct page_table* pd = pdpt->entries[pdpt_index];
+    // create the level 3 (page directory pointers), level 2 (page directory) and level 1 tables if necessary
+    u64* pdpt = _get_or_create_table(table_root->_cpu_table, (virt >> 39) & 0x1FF);
+    u64* pd   = _get_or_create_table(pdpt, (virt >> 30) & 0x1FF);
+    u64* pt   = _get_or_create_table(pd, (virt >> 21) & 0x1FF);
 
-    // find the level 1 page table (page directory pointers), and error out if it doesn't exist
-    u32 pd_index = (virt >> 21) & 0x1FF;
-    assert(pd->_cpu_table[pd_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT, "virtual address not found");
-    struct page_table* pt = pd->entries[pd_index];
-
-    // make sure the level 0 page table entry exists
+    // create the entry in the lowest level table (page table). if it already exists, error out
     u32 pt_index = (virt >> 12) & 0x1FF;
-    u64* pte = &pt->_cpu_table[pt_index];
-    assert(*pte & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT, "page table entry not present");
+    assert(_entry_is_empty(pt[pt_index]), "mapping for virtual address already exists");
 
-    // free the page table entry
-    intp ret = *pte & CPU_PAGE_TABLE_ADDRESS_MASK_4KB;
-    *pte = 0;
-
-    // free nested page tables if they become empty
-    if(--pt->num_entries != 0) goto done;
-
-    _free_page_table(pt);
-    pd->entries[pd_index] = null;
-    pd->_cpu_table[pd_index] = 0;  // TODO do these have to be invalidated?
-
-    if(--pd->num_entries != 0) goto done;
-
-    _free_page_table(pd);
-    pdpt->entries[pdpt_index] = null;
-    pdpt->_cpu_table[pdpt_index] = 0;  // TODO do these have to be invalidated?
-
-    if(--pdpt->num_entries != 0) goto done;
-
-    _free_page_table(pdpt);
-    table_root->entries[pml4_index] = null;
-    table_root->_cpu_table[pml4_index] = 0; // TODO do these have to be invalidated?
-    pdpt->num_entries -= 1;
-
-done:
-    return ret;
+    // set the page table entry
+    _set_entry(pt, pt_index, (phys & CPU_PAGE_TABLE_ADDRESS_MASK_4KB) | _entry_flags(flags, virt));
+    _add_count(pt, 1);
 }
 
 
@@ -306,18 +488,22 @@ void _make_flags_string(char* buf, u64 v)
     else                                       buf[7] = 'd';
     if(v & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE)     buf[8] = 'H';
     else                                       buf[8] = 'h';
+    if(v & CPU_PAGE_TABLE_ENTRY_FLAG_GLOBAL)   buf[9] = 'G';
+    else                                       buf[9] = 'g';
+    if(v & CPU_PAGE_TABLE_ENTRY_FLAG_COW)      buf[10] = 'O';
+    else                                       buf[10] = 'o';
 }
 
 void paging_debug_address(intp virt)
 {
-    char buf[] = "[........]";
+    char buf[] = "[..........]";
 
     fprintf(stderr, "paging: table dump for address 0x%016lX\n", virt);
     fprintf(stderr, "0x%016lX (kernel_page_table)\n", kernel_page_table->_cpu_table);
 
     // print pml4 entry
     u32 pml4_index = (virt >> 39) & 0x1FF;
-    struct page_table* pdpt = kernel_page_table->entries[pml4_index];
+    u64* pdpt = _table_of(kernel_page_table->_cpu_table[pml4_index]);
     _make_flags_string(buf, kernel_page_table->_cpu_table[pml4_index]);
     u64 base = pml4_index * (1ULL << 39);
     fprintf(stderr, "`- [%d] 0x%016X (pdpt), 0x%016lX .. 0x%016lX flags=%s\n", pml4_index, kernel_page_table->_cpu_table[pml4_index], base, (base + (1ULL << 39)) - 1, buf);
@@ -325,37 +511,37 @@ void paging_debug_address(intp virt)
 
     // print page directory pointers table entry
     u32 pdpt_index = (virt >> 30) & 0x1FF;
-    struct page_table* pd = pdpt->entries[pdpt_index];
-    _make_flags_string(buf, pdpt->_cpu_table[pdpt_index]);
+    u64* pd = _table_of(pdpt[pdpt_index]);
+    _make_flags_string(buf, pdpt[pdpt_index]);
     base += pdpt_index * (1ULL << 30);
-    fprintf(stderr, "   `- [%d] 0x%016X (pd), 0x%016lX .. 0x%016lX flags=%s\n", pdpt_index, pdpt->_cpu_table[pdpt_index], base, (base + (1ULL << 30)) - 1, buf);
+    fprintf(stderr, "   `- [%d] 0x%016X (pd), 0x%016lX .. 0x%016lX flags=%s\n", pdpt_index, pdpt[pdpt_index], base, (base + (1ULL << 30)) - 1, buf);
     if(buf[1] == 'p' || buf[8] == 'H') return;
 
     // print page directory table entry
     u32 pd_index = (virt >> 21) & 0x1FF;
-    struct page_table* pt = pd->entries[pd_index];
-    _make_flags_string(buf, pd->_cpu_table[pd_index]);
+    u64* pt = _table_of(pd[pd_index]);
+    _make_flags_string(buf, pd[pd_index]);
     base += pd_index * (1ULL << 21);
-    fprintf(stderr, "      `- [%d] 0x%016X (pt), 0x%016lX .. 0x%016lX flags=%s\n", pd_index, pd->_cpu_table[pd_index], base, (base + (1ULL << 21)) - 1, buf);
+    fprintf(stderr, "      `- [%d] 0x%016X (pt), 0x%016lX .. 0x%016lX flags=%s\n", pd_index, pd[pd_index], base, (base + (1ULL << 21)) - 1, buf);
     if(buf[1] == 'p' || buf[8] == 'H') return;
 
     // print page table entry
     u32 pt_index = (virt >> 12) & 0x1FF;
-    _make_flags_string(buf, pt->_cpu_table[pt_index]);
+    _make_flags_string(buf, pt[pt_index]);
     base += pt_index * (1ULL << 12);
-    fprintf(stderr, "         `- [%d] 0x%016X (pte), 0x%016lX .. 0x%016lX flags=%s\n", pt_index, pt->_cpu_table[pt_index], base, (base + (1ULL << 12)) - 1, buf);
+    fprintf(stderr, "         `- [%d] 0x%016X (pte), 0x%016lX .. 0x%016lX flags=%s\n", pt_index, pt[pt_index], base, (base + (1ULL << 12)) - 1, buf);
 }
 
 void paging_debug_table(struct page_table* table_root)
 {
-    char buf[] = "[........]";
+    char buf[] = "[..........]";
 
-    fprintf(stderr, "paging: full table dump\n");
+    fprintf(stderr, "paging: full table dump (%lu page tables in all address spaces)\n", num_tables);
     fprintf(stderr, "0x%016lX (_cpu_table (cr3))\n", table_root->_cpu_table);
 
     for(u32 pml4_index = 256; pml4_index < 512; pml4_index++) {
         // print pml4 entry
-        struct page_table* pdpt = table_root->entries[pml4_index];
+        u64* pdpt = _table_of(table_root->_cpu_table[pml4_index]);
         _make_flags_string(buf, table_root->_cpu_table[pml4_index]);
         if(buf[1] == 'p' || buf[8] == 'H') continue;
         u64 base = pml4_index * (1ULL << 39);
@@ -364,26 +550,26 @@ void paging_debug_table(struct page_table* table_root)
 
         for(u32 pdpt_index = 0; pdpt_index < 512; pdpt_index++) {
             // print page directory pointers table entry
-            struct page_table* pd = pdpt->entries[pdpt_index];
-            _make_flags_string(buf, pdpt->_cpu_table[pdpt_index]);
+            u64* pd = _table_of(pdpt[pdpt_index]);
+            _make_flags_string(buf, pdpt[pdpt_index]);
             if(buf[1] == 'p' || buf[8] == 'H') continue;
             base += pdpt_index * (1ULL << 30);
-            fprintf(stderr, "   `- [%d] 0x%016X (pd), 0x%016lX .. 0x%016lX flags=%s\n", pdpt_index, pdpt->_cpu_table[pdpt_index], base, (base + (1ULL << 30)) - 1, buf);
+            fprintf(stderr, "   `- [%d] 0x%016X (pd), 0x%016lX .. 0x%016lX flags=%s\n", pdpt_index, pdpt[pdpt_index], base, (base + (1ULL << 30)) - 1, buf);
 
             for(u32 pd_index = 0; pd_index < 512; pd_index++) {
                 // print page directory table entry
-                struct page_table* pt = pd->entries[pd_index];
-                _make_flags_string(buf, pd->_cpu_table[pd_index]);
+                u64* pt = _table_of(pd[pd_index]);
+                _make_flags_string(buf, pd[pd_index]);
                 if(buf[1] == 'p' || buf[8] == 'H') continue;
                 base += pd_index * (1ULL << 21);
-                fprintf(stderr, "      `- [%d] 0x%016X (pt), 0x%016lX .. 0x%016lX flags=%s\n", pd_index, pd->_cpu_table[pd_index], base, (base + (1ULL << 21)) - 1, buf);
+                fprintf(stderr, "      `- [%d] 0x%016X (pt), 0x%016lX .. 0x%016lX flags=%s\n", pd_index, pd[pd_index], base, (base + (1ULL << 21)) - 1, buf);
 
                 for(u32 pt_index = 0; pt_index < 512; pt_index++) {
                     // print page table entry
-                    _make_flags_string(buf, pt->_cpu_table[pt_index]);
+                    _make_flags_string(buf, pt[pt_index]);
                     if(buf[1] == 'p' || buf[8] == 'H') continue;
                     base += pt_index * (1ULL << 12);
-                    fprintf(stderr, "         `- [%d] 0x%016X (pte), 0x%016lX .. 0x%016lX flags=%s\n", pt_index, pt->_cpu_table[pt_index], base, (base + (1ULL << 12)) - 1, buf);
+                    fprintf(stderr, "         `- [%d] 0x%016X (pte), 0x%016lX .. 0x%016lX flags=%s\n", pt_index, pt[pt_index], base, (base + (1ULL << 12)) - 1, buf);
                 }
             }
         }
@@ -400,95 +586,345 @@ void paging_map_page(struct page_table* table_root, intp phys, intp virt, u32 fl
 
 intp paging_unmap_page(struct page_table* table_root, intp virt)
 {
-    return _unmap_page(table_root, virt);
+    return paging_unmap_range(table_root, virt, PAGE_SIZE);
 }
 
-// _map_2mb does the hard work of mapping the physical address into the specified virtual address
-// location, but does not flush the TLB. For TLB flush, call paging_map_2mb() instead.
-static void _map_2mb(intp phys, intp virt, u32 flags)
+void paging_map_range(struct page_table* table_root, intp phys, intp virt, u64 size, u32 flags)
 {
     assert((virt >> 47) == 0 || (virt >> 47) == 0x1FFFF, "virtual address must be canonical");
-    assert(__alignof(virt, 4096) == 0, "virtual address must be 4KB aligned");
-    assert(__alignof(phys, 0x200000) == 0, "physical address must be 2MiB aligned");
+    assert(__alignof(virt, PAGE_SIZE) == 0, "virtual address must be 4KB aligned");
+    assert(__alignof(phys, PAGE_SIZE) == 0, "physical address must be 4KB aligned");
+    assert(__alignof(size, PAGE_SIZE) == 0, "size must be a multiple of the page size");
+
+    intp end = virt + size;
+
+    // non-present entries aren't cached by the TLB, so nothing needs to be invalidated here
+    while(virt < end) {
+        u64 left = end - virt;
+        u64 pt_flags = _entry_flags(flags, virt);
+        u64* pdpt = _get_or_create_table(table_root->_cpu_table, (virt >> 39) & 0x1FF);
+        u32 pdpt_index = (virt >> 30) & 0x1FF;
+
+        // use a 1GiB page when both addresses are aligned and there's enough left
+        if(has_1gb_pages && left >= PAGING_1GB && __alignof(virt | phys, PAGING_1GB) == 0) {
+            assert(_entry_is_empty(pdpt[pdpt_index]), "mapping for virtual address already exists");
+            _set_entry(pdpt, pdpt_index, (phys & CPU_PAGE_TABLE_ADDRESS_MASK_1GB) | CPU_PAGE_TABLE_ENTRY_FLAG_HUGE | pt_flags);
+            _add_count(pdpt, 1);
+            virt += PAGING_1GB;
+            phys += PAGING_1GB;
+            continue;
+        }
 
-    //fprintf(stderr, "paging: mapping 1GiB at 0x%08lX to virtual address 0x%08lX\n", phys, virt);
+        u64* pd = _get_or_create_table(pdpt, pdpt_index);
+        u32 pd_index = (virt >> 21) & 0x1FF;
+
+        // same for 2MiB pages
+        if(left >= PAGING_2MB && __alignof(virt | phys, PAGING_2MB) == 0) {
+            assert(_entry_is_empty(pd[pd_index]), "mapping for virtual address already exists");
+            _set_entry(pd, pd_index, (phys & CPU_PAGE_TABLE_ADDRESS_MASK_2MB) | CPU_PAGE_TABLE_ENTRY_FLAG_HUGE | pt_flags);
+            _add_count(pd, 1);
+            virt += PAGING_2MB;
+            phys += PAGING_2MB;
+            continue;
+        }
 
-    // shift right 12 for pt1
-    // shift right 21 for pt2
-    // shift right 30 for pt3
-    // shift right 39 for pt4
+        // fill 4KiB entries up to the end of this page table, which is the next place a larger page could start
+        u64* pt = _get_or_create_table(pd, pd_index);
+        for(u32 pt_index = (virt >> 12) & 0x1FF; pt_index < 512 && virt < end; pt_index++) {
+            assert(_entry_is_empty(pt[pt_index]), "mapping for virtual address already exists");
+            _set_entry(pt, pt_index, (phys & CPU_PAGE_TABLE_ADDRESS_MASK_4KB) | pt_flags);
+            _add_count(pt, 1);
+            virt += PAGE_SIZE;
+            phys += PAGE_SIZE;
+        }
+    }
+}
 
-    // create a level 3 page table (page directory pointers) if necessary
-    u32 pml4_index = (virt >> 39) & 0x1FF;
-    struct page_table* pdpt = kernel_page_table->entries[pml4_index];
-    if(kernel_page_table->_cpu_table[pml4_index] == 0) {
-        pdpt = _allocate_page_table();
-        kernel_page_table->entries[pml4_index] = pdpt;
-        kernel_page_table->_cpu_table[pml4_index] = (intp)pdpt->_cpu_table | CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT | CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE | CPU_PAGE_TABLE_ENTRY_FLAG_USER;
+// clear page table entries without invalidating anything. every page removed is added to batch
+static intp _unmap_range(struct page_table* table_root, intp virt, u64 size, struct tlb_batch* batch)
+{
+    assert((virt >> 47) == 0 || (virt >> 47) == 0x1FFFF, "virtual address must be canonical");
+    assert(__alignof(virt, PAGE_SIZE) == 0, "virtual address must be 4KB aligned");
+    assert(__alignof(size, PAGE_SIZE) == 0, "size must be a multiple of the page size");
+
+    intp ret = (intp)-1;
+    intp end = virt + size;
+
+    while(virt < end) {
+        u64 left = end - virt;
+
+        // page directory pointer tables are shared between address spaces (the kernel half and entry 0), so they're never freed here
+        u32 pml4_index = (virt >> 39) & 0x1FF;
+        assert(table_root->_cpu_table[pml4_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT, "virtual address mapping not found");
+        u64* pdpt = _table_of(table_root->_cpu_table[pml4_index]);
+
+        u32 pdpt_index = (virt >> 30) & 0x1FF;
+        u64* pdpte = &pdpt[pdpt_index];
+        assert(*pdpte & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT, "virtual address mapping not found");
+        if(*pdpte & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE) {
+            if(left >= PAGING_1GB && __alignof(virt, PAGING_1GB) == 0) {
+                if(ret == (intp)-1) ret = *pdpte & CPU_PAGE_TABLE_ADDRESS_MASK_1GB;
+                _set_entry(pdpt, pdpt_index, 0);
+                _add_count(pdpt, -1);
+                tlb_batch_add(batch, virt, 30);
+                virt += PAGING_1GB;
+                continue;
+            }
+
+            // only part of the 1GiB page is going away
+            _split_huge_page(pdpt, pdpt_index, PAGING_1GB);
+        }
+
+        u64* pd = _table_of(*pdpte);
+        u32 pd_index = (virt >> 21) & 0x1FF;
+        u64* pde = &pd[pd_index];
+        assert(*pde & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT, "virtual address mapping not found");
+        if(*pde & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE) {
+            if(left >= PAGING_2MB && __alignof(virt, PAGING_2MB) == 0) {
+                if(ret == (intp)-1) ret = *pde & CPU_PAGE_TABLE_ADDRESS_MASK_2MB;
+                _set_entry(pd, pd_index, 0);
+                _add_count(pd, -1);
+                tlb_batch_add(batch, virt, 21);
+                virt += PAGING_2MB;
+                _free_table_if_empty(pdpt, pdpt_index, batch);
+                continue;
+            }
+
+            _split_huge_page(pd, pd_index, PAGING_2MB);
+        }
+
+        // clear 4KiB entries up to the end of this page table
+        u64* pt = _table_of(*pde);
+        for(u32 pt_index = (virt >> 12) & 0x1FF; pt_index < 512 && virt < end; pt_index++) {
+            assert(pt[pt_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT, "page table entry not present");
+            if(ret == (intp)-1) ret = pt[pt_index] & CPU_PAGE_TABLE_ADDRESS_MASK_4KB;
+            _set_entry(pt, pt_index, 0);
+            _add_count(pt, -1);
+            tlb_batch_add(batch, virt, PAGE_SHIFT);
+            virt += PAGE_SIZE;
+        }
+
+        // free nested page tables if they become empty
+        _free_table_if_empty(pd, pd_index, batch);
+        if(_get_count(pd) == 0) _free_table_if_empty(pdpt, pdpt_index, batch);
     }
 
-    // create a level 2 page table (page directory) if necessary
-    u32 pdpt_index = (virt >> 30) & 0x1FF;
-    struct page_table* pd = pdpt->entries[pdpt_index];
-    if(pdpt->_cpu_table[pdpt_index] == 0) {
-        pd = _allocate_page_table();
-        pdpt->entries[pdpt_index] = pd;
-        pdpt->_cpu_table[pdpt_index] = (intp)pd->_cpu_table | CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT | CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE | CPU_PAGE_TABLE_ENTRY_FLAG_USER;
+    return ret;
+}
+
+intp paging_unmap_range(struct page_table* table_root, intp virt, u64 size)
+{
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, table_root);
+
+    intp ret = _unmap_range(table_root, virt, size, &batch);
+
+    // one shootdown for the whole range
+    u64* freed_tables = (u64*)batch.freed_tables;
+    tlb_batch_finish(&batch);
+    _free_tables(freed_tables);
+    return ret;
+}
+
+void paging_unmap_pages(struct page_table* table_root, intp virt, u64 npages, intp* phys)
+{
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, table_root);
+
+    for(u64 i = 0; i < npages; i++, virt += PAGE_SIZE) {
+        phys[i] = paging_is_mapped(table_root, virt) ? _unmap_range(table_root, virt, PAGE_SIZE, &batch) : 0;
     }
 
-    // create the entry in the level 2 table (page directory). if it already exists, error out
+    u64* freed_tables = (u64*)batch.freed_tables;
+    tlb_batch_finish(&batch);
+    _free_tables(freed_tables);
+}
+
+bool paging_is_mapped(struct page_table* table_root, intp virt)
+{
+    u32 pml4_index = (virt >> 39) & 0x1FF;
+    if(!(table_root->_cpu_table[pml4_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) return false;
+    u64* pdpt = _table_of(table_root->_cpu_table[pml4_index]);
+
+    u32 pdpt_index = (virt >> 30) & 0x1FF;
+    if(!(pdpt[pdpt_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) return false;
+    if(pdpt[pdpt_index] & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE) return true;
+    u64* pd = _table_of(pdpt[pdpt_index]);
+
     u32 pd_index = (virt >> 21) & 0x1FF;
-    u64* pde = &pd->_cpu_table[pd_index];
-    assert(*pde == 0, "mapping for virtual address already exists");
+    if(!(pd[pd_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) return false;
+    if(pd[pd_index] & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE) return true;
+    u64* pt = _table_of(pd[pd_index]);
 
-    // set the page directory entry with huge page bit set
-    u32 pt_flags = CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT;
-    if(flags & MAP_PAGE_FLAG_DISABLE_CACHE) pt_flags |= CPU_PAGE_TABLE_ENTRY_CACHE_DISABLE;
-    if(flags & MAP_PAGE_FLAG_WRITABLE) pt_flags |= CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE;
-    if(flags & MAP_PAGE_FLAG_USER) pt_flags |= CPU_PAGE_TABLE_ENTRY_FLAG_USER;
-    *pde = (phys & CPU_PAGE_TABLE_ADDRESS_MASK_2MB) | CPU_PAGE_TABLE_ENTRY_FLAG_HUGE | pt_flags;
+    u32 pt_index = (virt >> 12) & 0x1FF;
+    return (pt[pt_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT) != 0;
 }
 
-// calls _map_2mb and then flushes TLB
-void paging_map_2mb(intp phys, intp virt, u32 flags)
+u64 paging_page_size(struct page_table* table_root, intp virt)
 {
-    _map_2mb(phys, virt, flags);
+    u32 pml4_index = (virt >> 39) & 0x1FF;
+    if(!(table_root->_cpu_table[pml4_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) return 0;
+    u64* pdpt = _table_of(table_root->_cpu_table[pml4_index]);
 
-    // invlpg invalidates all TLB entries associated with the 2mb page, so only one invlpg is necessary
-    __invlpg(virt);
+    u32 pdpt_index = (virt >> 30) & 0x1FF;
+    if(!(pdpt[pdpt_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) return 0;
+    if(pdpt[pdpt_index] & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE) return PAGING_1GB;
+    u64* pd = _table_of(pdpt[pdpt_index]);
+
+    u32 pd_index = (virt >> 21) & 0x1FF;
+    if(!(pd[pd_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) return 0;
+    if(pd[pd_index] & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE) return PAGING_2MB;
+    u64* pt = _table_of(pd[pd_index]);
+
+    u32 pt_index = (virt >> 12) & 0x1FF;
+    return (pt[pt_index] & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT) ? PAGE_SIZE : 0;
 }
 
-void paging_identity_map_region(struct page_table* table_root, intp region_start, u64 region_size, u32 flags)
+// the 4KiB page table that maps virt, or null if there isn't one
+static u64* _find_pt(struct page_table* table_root, intp virt)
 {
-    assert(__alignof(region_start, 4096) == 0, "regions must start on page boundaries");
-    assert(__alignof(region_size, 4096) == 0, "region size must be a multiple of page size");
+    u64 entry = table_root->_cpu_table[(virt >> 39) & 0x1FF];
+    if(!(entry & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) return null;
 
-    //fprintf(stderr, "paging: identity mapping whole region 0x%lX-0x%lX\n", region_start, region_start+region_size-1);
+    entry = _table_of(entry)[(virt >> 30) & 0x1FF];
+    if(!(entry & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT) || (entry & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE)) return null;
 
-    // map 4K pages to start if the address doesn't sit on a 2MiB boundary
-    u32 pre = __alignof(region_start, 0x200000);
-    if(pre) {
-        intp pre_size = min(region_size, 0x200000 - pre); // might be less than 2MiB
-        for(intp offs = 0; offs < pre_size; offs += 0x1000) {
-            _map_page(table_root, region_start + offs, region_start + offs, flags);
+    entry = _table_of(entry)[(virt >> 21) & 0x1FF];
+    if(!(entry & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT) || (entry & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE)) return null;
+
+    return _table_of(entry);
+}
+
+void paging_clone_range(struct page_table* from, struct page_table* to, intp virt, u64 size)
+{
+    assert((virt >> 47) == 0 && !_is_shared_address(virt) && !_is_shared_address(virt + size - 1), "only private user memory can be cloned");
+    assert(__alignof(virt, PAGE_SIZE) == 0, "virtual address must be 4KB aligned");
+    assert(__alignof(size, PAGE_SIZE) == 0, "size must be a multiple of the page size");
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, from);
+
+    intp end = virt + size;
+    while(virt < end) {
+        // skip over whatever has never been touched a whole table at a time, so the cost follows what's mapped
+        u64 entry = from->_cpu_table[(virt >> 39) & 0x1FF];
+        if(!(entry & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) {
+            virt = (virt + (1ULL << 39)) & ~((1ULL << 39) - 1);
+            continue;
         }
-        region_start = (intp)__alignup(region_start, 0x200000);
-        region_size -= pre_size;
-    }
 
-    // continually map 2MiB blocks while there's >2MiB left
-    while(region_size >= 0x200000) {
-        _map_2mb(region_start, region_start, flags);
-        region_start += 0x200000;
-        region_size  -= 0x200000;
+        entry = _table_of(entry)[(virt >> 30) & 0x1FF];
+        if(!(entry & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) {
+            virt = (virt + PAGING_1GB) & ~(PAGING_1GB - 1);
+            continue;
+        }
+        assert(!(entry & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE), "huge pages can't be cloned");
+
+        entry = _table_of(entry)[(virt >> 21) & 0x1FF];
+        if(!(entry & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) {
+            virt = (virt + PAGING_2MB) & ~(PAGING_2MB - 1);
+            continue;
+        }
+        assert(!(entry & CPU_PAGE_TABLE_ENTRY_FLAG_HUGE), "huge pages can't be cloned");
+
+        u64* pt = _table_of(entry);
+        u64* to_pt = null;
+        for(u32 pt_index = (virt >> 12) & 0x1FF; pt_index < 512 && virt < end; pt_index++, virt += PAGE_SIZE) {
+            u64 pte = pt[pt_index] & ~PAGING_COUNT_MASK;
+            if(!(pte & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) continue;
+
+            // writable pages become read-only in both tables, and the cached writable translations have to go
+            if(pte & CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE) {
+                pte = (pte & ~CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE) | CPU_PAGE_TABLE_ENTRY_FLAG_COW;
+                _set_entry(pt, pt_index, pte);
+                tlb_batch_add(&batch, virt, PAGE_SHIFT);
+            }
+
+            if(to_pt == null) {
+                u64* pdpt = _get_or_create_table(to->_cpu_table, (virt >> 39) & 0x1FF);
+                u64* pd   = _get_or_create_table(pdpt, (virt >> 30) & 0x1FF);
+                to_pt     = _get_or_create_table(pd, (virt >> 21) & 0x1FF);
+            }
+
+            assert(_entry_is_empty(to_pt[pt_index]), "mapping for virtual address already exists");
+
+            // without a descriptor to count the extra owner in, the clone gets its own copy. both sides then have the
+            // only reference, and their copy-on-write faults make the pages writable in place
+            intp phys = pte & CPU_PAGE_TABLE_ADDRESS_MASK_4KB;
+            if(!palloc_share(phys)) {
+                intp copy = palloc_claim_one();
+                assert(copy != 0, "out of memory");
+                memcpy((void*)copy, (void*)phys, PAGE_SIZE);
+                pte = copy | (pte & ~CPU_PAGE_TABLE_ADDRESS_MASK_4KB);
+            }
+
+            _set_entry(to_pt, pt_index, pte);
+            _add_count(to_pt, 1);
+        }
     }
 
-    // finally map remaining 4K pages
-    while(region_size > 0) {
-        _map_page(table_root, region_start, region_start, flags);
-        region_start += 0x1000;
-        region_size  -= 0x1000;
+    tlb_batch_finish(&batch);
+}
+
+bool paging_handle_cow_fault(struct page_table* table_root, intp virt)
+{
+    virt &= ~(PAGE_SIZE - 1);
+
+    u64* pt = _find_pt(table_root, virt);
+    if(pt == null) return false;
+
+    u32 pt_index = (virt >> 12) & 0x1FF;
+    u64 pte = pt[pt_index] & ~PAGING_COUNT_MASK;
+    if(!(pte & CPU_PAGE_TABLE_ENTRY_FLAG_PRESENT)) return false;
+
+    // another cpu already resolved it. the fault removed this cpu's stale read-only translation, so just retry
+    if(pte & CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE) return true;
+    if(!(pte & CPU_PAGE_TABLE_ENTRY_FLAG_COW)) return false;
+
+    intp phys = pte & CPU_PAGE_TABLE_ADDRESS_MASK_4KB;
+    u64 flags = (pte & ~(CPU_PAGE_TABLE_ADDRESS_MASK_4KB | CPU_PAGE_TABLE_ENTRY_FLAG_COW)) | CPU_PAGE_TABLE_ENTRY_FLAG_WRITEABLE;
+
+    // everyone else has let go of the page, so it can be made writable in place. adding write access doesn't need a
+    // shootdown, other cpus with the read-only translation cached fault and end up in the check above
+    if(palloc_refs(phys) == 1) {
+        _set_entry(pt, pt_index, phys | flags);
+        __invlpg(virt);
+        return true;
     }
+
+    // palloc memory is identity mapped, so the copy doesn't need to be mapped anywhere else
+    intp copy = palloc_claim_one();
+    if(copy == 0) return false;
+    memcpy((void*)copy, (void*)phys, PAGE_SIZE);
+
+    // other cpus running this address space must stop using the shared page before it can be released
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, table_root);
+    _set_entry(pt, pt_index, copy | flags);
+    tlb_batch_add(&batch, virt, PAGE_SHIFT);
+    tlb_batch_finish(&batch);
+
+    palloc_release(phys);
+    return true;
+}
+
+void paging_map_2mb(intp phys, intp virt, u32 flags)
+{
+    assert(__alignof(virt | phys, PAGING_2MB) == 0, "addresses must be 2MiB aligned");
+
+    // paging_map_range always uses a 2MiB page for this
+    paging_map_range(kernel_page_table, phys, virt, PAGING_2MB, flags);
+}
+
+void paging_identity_map_region(struct page_table* table_root, intp region_start, u64 region_size, u32 flags)
+{
+    assert(__alignof(region_start, 4096) == 0, "regions must start on page boundaries");
+    assert(__alignof(region_size, 4096) == 0, "region size must be a multiple of page size");
+
+    //fprintf(stderr, "paging: identity mapping whole region 0x%lX-0x%lX\n", region_start, region_start+region_size-1);
+
+    // paging_map_range uses 4K pages up to the first 2MiB boundary, then 2MiB (or 1GiB) pages, then 4K pages for what's left
+    paging_map_range(table_root, region_start, region_start, region_size, flags);
 }
 
 
@@ -19,21 +19,60 @@ enum MAP_PAGE_FLAGS {
 };
 
 void paging_init();
+void paging_init_cpu(); // enable paging features on the current cpu, with the kernel table loaded
 
 // called on the APs
 void paging_set_kernel_page_table();
 struct page_table* paging_get_kernel_page_table();
 intp paging_get_cpu_table(struct page_table*);
 
+// returns the value to load into cr3 to switch to 'to' on the current cpu. assigns the table a pcid on this cpu when
+// pcids are supported, and tracks which cpus may hold TLB entries for an address space. call with interrupts disabled
+intp paging_prepare_table_switch(struct page_table* from, struct page_table* to);
+u64  paging_get_cpu_mask(struct page_table*);
+
+// process-context identifiers let the TLB hold translations from several address spaces at once
+bool paging_has_pcid();
+s32  paging_get_pcid(struct page_table*); // pcid of the table on the current cpu, or -1 if it can't have anything cached here
+bool paging_forget_stale_pcid(struct page_table*); // drop the current cpu from the table's cpu_mask if its pcid there was retired
+
 // user space page tables
 struct page_table* paging_create_private_table();
 
+// free a table from paging_create_private_table along with all of its user half page tables. pages still mapped in
+// it are not freed. the table must not be loaded on any cpu
+void paging_destroy_private_table(struct page_table*);
+
+// number of page table pages allocated for every address space, including the roots
+u64 paging_num_tables();
+
 // map a single page into virtual memory
 // flags uses enum MAP_PAGE_FLAGS
 void paging_map_page(struct page_table*, intp phys, intp virt, u32 flags);
 intp paging_unmap_page(struct page_table*, intp virt); // returns the physical address stored in that page table entry
+bool paging_is_mapped(struct page_table*, intp virt);  // true if virt is covered by a present 4KiB, 2MiB or 1GiB page
+u64  paging_page_size(struct page_table*, intp virt);  // size of the page mapping virt (4KiB, 2MiB or 1GiB), 0 if unmapped
+
+// map a physically contiguous range, walking the tables once and using 2MiB and 1GiB pages
+// wherever virt and phys are both aligned. flags uses enum MAP_PAGE_FLAGS
+void paging_map_range(struct page_table*, intp phys, intp virt, u64 size, u32 flags);
+
+// unmap a range, splitting any huge page that is only partially covered. the TLB is invalidated on every
+// cpu using the table before this returns. returns the physical address of the first page
+intp paging_unmap_range(struct page_table*, intp virt, u64 size);
+
+// unmap npages individual 4KiB pages with a single TLB shootdown, storing each page's physical address in phys.
+// pages that aren't mapped are skipped and get 0. phys must hold npages entries
+void paging_unmap_pages(struct page_table*, intp virt, u64 npages, intp* phys);
+
+// share every page mapped in [virt, virt+size) of 'from' with 'to' at the same addresses. writable pages become
+// read-only and copy-on-write in both tables, and each page gains a palloc reference. only 4KiB pages in the user
+// half can be cloned, and the range must be unmapped in 'to'. unmapped parts of the range cost almost nothing
+void paging_clone_range(struct page_table* from, struct page_table* to, intp virt, u64 size);
 
-// unmap a single page
+// resolve a write fault at virt. if the page is copy-on-write, the table gets its own writable copy (or the page
+// itself if nobody else shares it anymore). returns false if virt isn't a copy-on-write page
+bool paging_handle_cow_fault(struct page_table*, intp virt);
 
 // map a 2MiB huge block into virtual memory
 void paging_map_2mb(intp phys, intp vert, u32 flags);
@@ -5,33 +5,73 @@
 
 #include "common.h"
 
+#include "apic.h"
 #include "bootmem.h"
+#include "cpu.h"
+#include "kalloc.h"
 #include "kernel.h"
 #include "multiboot2.h"
+#include "numa.h"
 #include "palloc.h"
 #include "paging.h"
+#include "shrinker.h"
 #include "smp.h"
 #include "stdio.h"
 #include "string.h"
 
 #define PALLOC_VERBOSE 0
 
+#define PALLOC_ZERO_MAX_ORDER 3    // orders 0, 1 and 2 can be kept pre-zeroed
+#define PALLOC_ZERO_HIGH      256  // pre-zeroed order 0 blocks kept per zone, halved for each higher order
+#define PALLOC_ZERO_BATCH     16   // pages an idle cpu clears before going back to look for work
+
+#define PALLOC_BOOT_SECTIONS  8    // highmem sections (128MiB each) made available during boot, the rest waits for smp
+
+#define PALLOC_HUGE_RESERVE   16   // 2MiB blocks set aside for huge pages at boot, 0 to disable
+
+// free page watermarks across all zones, see palloc_reclaim_idle()
+#define PALLOC_WATERMARK_MIN  1024 // below this, claims take memory back from the caches themselves
+#define PALLOC_WATERMARK_LOW  4096 // below this, idle cpus start asking the caches for memory...
+#define PALLOC_WATERMARK_HIGH 8192 // ...until this many pages are free again
+#define PALLOC_RECLAIM_BATCH  256  // most pages a single reclaim asks for
+
 struct free_page {
     struct free_page* next;
     struct free_page* prev;
 };
 
-static struct free_page* free_page_head[PALLOC_MAX_ORDER] = { null, };
+// Every NUMA node gets its own zone with separate buddy lists and lock. A block always belongs to the zone
+// of the section it lives in (see below), and since buddies never span sections they never span zones either.
+struct palloc_zone {
+    struct free_page* free_page_head[PALLOC_MAX_ORDER];
+    struct ticketlock lock;
+    u64    free_pages;
+    u64    free_blocks[PALLOC_MAX_ORDER]; // length of each buddy list
+    u64    total_pages; // every page the zone manages, free or not
+    u8     node;
+
+    // blocks known to be all zero, linked through their first word (see palloc_zero_idle())
+    struct free_page* zero_head[PALLOC_ZERO_MAX_ORDER];
+    u32    zero_count[PALLOC_ZERO_MAX_ORDER];
+    struct ticketlock zero_lock;
+
+    // 2MiB blocks held back for huge pages, linked through their first word and protected by the zone lock
+    struct free_page* huge_head;
+    u32    huge_count;
+    u32    huge_reserve; // the pool is refilled by abandoned blocks up to this many
+};
+
+static struct palloc_zero_stats zero_stats = { 0, };
+static struct palloc_huge_stats huge_stats = { 0, };
+
+static struct palloc_zone* zones;
+static u8 num_zones;
 
-// region data is required to determine page index for the bitmaps
-// maps are stored in this region struction, one for each order 
-// we need the start of a region to be index 0 in every map
-// TODO in the long run it would be nice to have a single bitmap for all pages, per order
+// region data is only kept around for bookkeeping. the buddy bitmaps live in the section table below
 struct region {
     intp start;
     u64  size;
     u64  npages;
-    u8*  maps[PALLOC_MAX_ORDER-1]; // highest order doesn't need a map
 };
 
 static struct region* regions;
@@ -39,48 +79,119 @@ static u8 num_highmem_regions;
 static u8 num_bootmem_regions;
 static u8 num_regions;
 
-// if nb is not null, set nb to non-zero if the bit in the bitmap was set, 0 otherwise
-// returns false if the address of the page isn't managed by palloc (i.e., doesn't
-// fit in any region)
-static inline bool palloc_togglebit(struct free_page* base, u8 order, u8* nb)
+// Physical memory is divided into 128MiB sections, and every section that contains managed memory
+// gets a single page that holds the buddy bitmaps for all orders. Looking up the bit for any block is
+// then a shift into the section table and never depends on how many regions exist. A buddy pair never
+// spans two sections, since the largest pair (2x4MiB) is much smaller than a section.
+//
+// Each bit is the XOR of the free state of the two buddies in a pair, so when a block is abandoned and
+// its bit goes to 0, the buddy is also free and the two can merge. Blocks at the edges of regions are
+// marked free in the bitmap when they're added, which means their (unmanaged) buddies look permanently
+// allocated and they never merge with memory that palloc doesn't own.
+#define PALLOC_SECTION_SHIFT 27
+#define PALLOC_SECTION_SIZE  (1ULL << PALLOC_SECTION_SHIFT)
+#define PALLOC_SECTION_PAGES (PALLOC_SECTION_SIZE >> PAGE_SHIFT)
+
+static u8** section_maps;
+static u8*  section_nodes; // numa node (and therefore zone) that owns each section
+static u64  num_sections;
+static u16  section_map_offsets[PALLOC_MAX_ORDER-1]; // byte offset of each order's bitmap within a section page. highest order doesn't need a map
+
+// Every page can have a struct page (see palloc.h) for reference counts, flags and an owner, kept in one array per
+// section so that finding the descriptor of a page is an index. Most memory never needs one, so a section only
+// gets its array the first time a descriptor in it is asked for. Pages of a section without an array all have
+// the state of a zeroed descriptor, which is also what every page palloc hands out starts with.
+#define PALLOC_PAGES_ORDER 7 // 2^7 pages = 512KiB of descriptors per section
+static struct page* volatile* section_pages;
+static u64 volatile num_page_arrays;
+
+static void _reset_pages(intp base, u8 n);
+static struct shrinker zero_shrinker;
+
+// Highmem past the first PALLOC_BOOT_SECTIONS sections is only given bitmap storage during boot. Clearing the bitmaps
+// and linking the blocks into the free lists happens one section at a time once all cpus are running, claimed
+// through deferred_cursor (see palloc_init_deferred()). Claims that run out of memory initialize sections themselves.
+static u64 volatile deferred_cursor;    // next section to look at
+static u64 volatile deferred_pending;   // sections left to initialize
+static u64 deferred_sections;
+static u64 volatile deferred_start;     // tsc when the first deferred section was started
+static u64 volatile deferred_cycles;    // time spent by all cpus
+
+static_assert(PALLOC_SECTION_PAGES * sizeof(struct page) == (PAGE_SIZE << PALLOC_PAGES_ORDER), "page descriptors must fill the allocation");
+static_assert(((PALLOC_SECTION_PAGES >> 1) >> 3) * 2 <= PAGE_SIZE, "all bitmaps for a section must fit in a page");
+static_assert((1ULL << (PALLOC_MAX_ORDER + PAGE_SHIFT)) <= PALLOC_SECTION_SIZE, "buddy pairs must not span sections");
+
+// toggle the bit for the buddy pair that 'base' belongs to, and return non-zero if the bit is now set
+static inline u8 palloc_togglebit(intp base, u8 order)
 {
-    intp base_addr = (intp)base;
-    u64 block_size = 1 << (order + PAGE_SHIFT);
-
-    for(u8 i = 0; i < num_regions; i++) {
-        // check if not in this region. the block has to be within the region entirely
-        if(base_addr < regions[i].start || (base_addr + block_size) >= (regions[i].start + regions[i].size)) continue;
+    u8* maps = section_maps[base >> PALLOC_SECTION_SHIFT];
+    u64 index = (base & (PALLOC_SECTION_SIZE - 1)) >> (order + 1 + PAGE_SHIFT);
+    u8* byte = &maps[section_map_offsets[order] + (index >> 3)];
 
-        // base_addr is in this region, determine the bitmap block index
-        // since region start could start in the middle of the left buddy, align down to get the
-        // the index calculation correct
-        u64 aligned_region_start = regions[i].start & ~((1 << (order + 1 + PAGE_SHIFT)) - 1);
-        u64 index = (base_addr - aligned_region_start) >> (order + 1 + PAGE_SHIFT);
-
-        // flip the bit
-        regions[i].maps[order][index >> 3] ^= 1 << (index & 7);
+    *byte ^= 1 << (index & 7);
 
 #if PALLOC_VERBOSE > 3
-        fprintf(stderr, "palloc: toggle bit region=$%lX order=%d index=%d base=$%lX new bit=$%02X\n",
-                regions[i].start, order, index, (intp)base, regions[i].maps[order][index >> 3] & (1 << (index & 7)));
+    fprintf(stderr, "palloc: toggle bit section=%d order=%d index=%d base=$%lX new bit=$%02X\n",
+            base >> PALLOC_SECTION_SHIFT, order, index, base, *byte & (1 << (index & 7)));
 #endif
 
-        // and get the new value
-        if(nb != null) *nb = regions[i].maps[order][index >> 3] & (1 << (index & 7));
-        
-        // done
-        return true;
+    return *byte & (1 << (index & 7));
+}
+
+// number of sections that don't have a bitmap page yet in the range [start, start+size)
+static u64 _count_missing_sections(intp start, u64 size)
+{
+    u64 count = 0;
+    for(u64 s = start >> PALLOC_SECTION_SHIFT; s <= ((start + size - 1) >> PALLOC_SECTION_SHIFT); s++) {
+        if(section_maps[s] == null) count++;
+    }
+    return count;
+}
+
+// hand out bitmap pages from 'storage' to all sections without one in the range [start, start+size). deferred
+// sections leave the page to be cleared by _initialize_section()
+static void _assign_section_maps(intp start, u64 size, intp storage, bool clear)
+{
+    for(u64 s = start >> PALLOC_SECTION_SHIFT; s <= ((start + size - 1) >> PALLOC_SECTION_SHIFT); s++) {
+        if(section_maps[s] != null) continue;
+        section_maps[s] = (u8*)storage;
+        if(clear) memset(section_maps[s], 0, PAGE_SIZE);
+        storage += PAGE_SIZE;
+
+        // nodes are tracked with section granularity. if a node boundary isn't 128MiB aligned, the section
+        // goes to the first node that has memory in it
+        section_nodes[s] = numa_node_of_range(s << PALLOC_SECTION_SHIFT, PALLOC_SECTION_SIZE);
     }
+}
 
-    return false;
+static inline struct palloc_zone* _zone_of(intp base)
+{
+    return &zones[section_nodes[base >> PALLOC_SECTION_SHIFT]];
 }
 
-static void _initialize_region(struct region* r, intp region_start, u64 region_size)
+// the cpu caches take zone locks with interrupts disabled, so every other path has to as well. otherwise a task
+// preempted while holding a zone lock could leave the next task on its cpu spinning on it with interrupts off
+static inline u64 _lock_zone(struct palloc_zone* zone)
+{
+    u64 cpu_flags = __cli_saveflags();
+    acquire_lock(zone->lock);
+    return cpu_flags;
+}
+
+static inline void _unlock_zone(struct palloc_zone* zone, u64 cpu_flags)
+{
+    release_lock(zone->lock);
+    __restoreflags(cpu_flags);
+}
+
+// page align the region and record it
+static void _setup_region(struct region* r, intp region_start, u64 region_size)
 {
     // alignup
     u16 wasted_alignment = (intp)__alignup(region_start, 4096) - (intp)region_start;
     region_start = (intp)__alignup(region_start, 4096);
     region_size -= wasted_alignment;
+    region_size &= ~(PAGE_SIZE - 1);
 
 #if PALLOC_VERBOSE > 0
     fprintf(stderr, "palloc: reclaiming region at start=$%lX size=%d wasted=%d\n", region_start, region_size, wasted_alignment);
@@ -94,8 +205,11 @@ static void _initialize_region(struct region* r, intp region_start, u64 region_s
 #if PALLOC_VERBOSE > 1
     fprintf(stderr, "palloc: region 0x%lX has npages=%d end=0x%lX\n", region_start, r->npages, region_start + r->size);
 #endif
+}
 
-    // now add the region to free_page_head
+// add the page aligned range to the free lists of the zones that own it, as large blocks as alignment allows
+static void _add_free_range(intp region_start, u64 region_size)
+{
     while(region_size != 0) {
         u8 order = PALLOC_MAX_ORDER - 1;
         u32 block_size = 1 << (order + PAGE_SHIFT);
@@ -107,14 +221,21 @@ static void _initialize_region(struct region* r, intp region_start, u64 region_s
             block_size >>= 1;
         }
 
-        // add the block to the list
+        // add the block to the list of the zone that owns it
+        struct palloc_zone* zone = _zone_of(region_start);
         struct free_page* fp = (struct free_page*)region_start;
-        fp->next = free_page_head[order]->next;
+        fp->next = zone->free_page_head[order]->next;
         fp->prev = null; // doesn't actually point back to free_page_head[order], since that's not a block of pages
         if(fp->next != null) {
             fp->next->prev = fp;
         }
-        free_page_head[order]->next = fp;
+        zone->free_page_head[order]->next = fp;
+        zone->free_pages += 1 << order;
+        zone->total_pages += 1 << order;
+        zone->free_blocks[order]++;
+
+        // mark the block free in the bitmap
+        if(order < PALLOC_MAX_ORDER - 1) palloc_togglebit(region_start, order);
 
 #if PALLOC_VERBOSE > 4
         fprintf(stderr, "palloc: adding block at order=%d address=$%lX size=%llu next=$%lX\n", order, (intp)region_start, region_size, (intp)fp->next);
@@ -126,24 +247,74 @@ static void _initialize_region(struct region* r, intp region_start, u64 region_s
     }
 }
 
+static void _initialize_region(struct region* r, intp region_start, u64 region_size)
+{
+    _setup_region(r, region_start, region_size);
+    _add_free_range(r->start, r->size);
+}
+
+// clear the bitmap of highmem section s and free every part of a region that falls in it. buddies never span
+// sections, so nothing outside of the section is touched and sections can be initialized on different cpus
+static void _initialize_section(u64 s)
+{
+    intp section_start = s << PALLOC_SECTION_SHIFT;
+    intp section_end = section_start + PALLOC_SECTION_SIZE;
+    struct palloc_zone* zone = &zones[section_nodes[s]];
+
+    // no block of the section is in the free lists yet, so nobody else is using the bitmap
+    memset(section_maps[s], 0, PAGE_SIZE);
+
+    u64 zone_flags = _lock_zone(zone);
+    for(u8 i = num_bootmem_regions; i < num_regions; i++) {
+        intp start = max(regions[i].start, section_start);
+        intp end = min(regions[i].start + regions[i].size, section_end);
+        if(start < end) _add_free_range(start, end - start);
+    }
+    _unlock_zone(zone, zone_flags);
+}
+
 
 void palloc_init()
 {
-    // allocate storage for our free_page_head pointers
-    for(u8 i = 0; i < PALLOC_MAX_ORDER; i++) {
-        free_page_head[i] = (struct free_page*)bootmem_alloc(sizeof(struct free_page), 8);
-        zero(free_page_head[i]);
+    u64 start_time = __rdtsc();
+
+    // one zone per numa node, each with storage for its free_page_head pointers
+    num_zones = numa_num_nodes();
+    zones = (struct palloc_zone*)bootmem_alloc(sizeof(struct palloc_zone) * num_zones, 8);
+    for(u8 node = 0; node < num_zones; node++) {
+        struct palloc_zone* zone = &zones[node];
+        zero(zone);
+
+        declare_ticketlock(lock_init);
+        zone->lock = lock_init;
+        zone->zero_lock = lock_init;
+        zone->node = node;
+
+        for(u8 i = 0; i < PALLOC_MAX_ORDER; i++) {
+            zone->free_page_head[i] = (struct free_page*)bootmem_alloc(sizeof(struct free_page), 8);
+            zero(zone->free_page_head[i]);
+        }
+    }
+
+    // every order's bitmap is placed one after the other in the section page
+    u16 offset = 0;
+    for(u8 order = 0; order < PALLOC_MAX_ORDER - 1; order++) {
+        section_map_offsets[order] = offset;
+        offset += (PALLOC_SECTION_PAGES >> (order + 1)) >> 3; // divide pages by 2^(order layer, plus 1 because of the buddy), then divide by sizeof(byte) in bits
     }
 
     // later, we will be adding high memory regions to palloc, but as of right now, they aren't available
     // in the kernel's page table. so we cound them up so that we can allocate storage for the region info
-    // that will be filled in later.
+    // that will be filled in later. we also need the end of physical memory to size the section table
     intp region_start;
     u64  region_size;
     u8   region_type;
+    intp memory_end = 0;
     num_highmem_regions = 0;
     while((region_start = multiboot2_mmap_next_free_region(&region_size, &region_type)) != (intp)-1) {
-        if(region_type == MULTIBOOT_REGION_TYPE_AVAILABLE && region_start >= 0x100000000) num_highmem_regions++;
+        if(region_type != MULTIBOOT_REGION_TYPE_AVAILABLE) continue;
+        if(region_start >= 0x100000000) num_highmem_regions++;
+        memory_end = max(memory_end, region_start + region_size);
     }
 
     // create storage for the region info
@@ -152,33 +323,24 @@ void palloc_init()
     regions = (struct region*)bootmem_alloc(sizeof(struct region) * num_regions, 8);
     memset(regions, 0, sizeof(struct region) * num_regions);
 
-    // We ask bootmem for how many free pages it has, and then allocate bitmaps
-    // using that information. however, allocating the bitmap itself reduces the number
-    // of pages available to the system, which means there are pages consumed for the bitmap
-    // that represent the bitmap itself, which is unnecessary. For example, at order 0,
-    //
-    // 1TiB ram = 268,435,456 pages, requiring a 33,554,432 byte bitmap, or 8192 pages. So 8KiB (2 pages) of
-    // space in the bitmap will be completely unused and left as zero for eternity.
-    //
-    // 8KiB/1TiB = 00.0000007% wasted space for my completely naive implementation
-    //
-    // Also, 33,554,432/1TiB = 00.00305% space is used for the bitmap
-    //
-    // The bitmap and sizes decrease by 2 for every higher order
-    //
-    // Also, all the bitmap sizes are halved due to the buddy system
-    //
-
-    // have to loop over only bootmem regions and build bitmaps for them individually
-    for(u8 r = 0; r < num_bootmem_regions; r++) {
-        u32 npages = bootmem_get_region_size(r) >> PAGE_SHIFT;
-
-        // allocate the bitmaps
-        for(u32 order = 0; order < PALLOC_MAX_ORDER - 1; ++order) {
-            u64 mapsize = ((npages >> (order + 1)) + 7) >> 3; // divide pages by 2^(order layer, plus 1 because of the buddy), then divide by sizeof(byte) in bits, rounded up
-            regions[r].maps[order] = (u8*)bootmem_alloc(mapsize, 8);
-            memset(regions[r].maps[order], 0, mapsize);
-        }
+    // the section table covers all of physical memory, but only sections with managed memory get a bitmap page.
+    // 1TiB of ram needs 8192 sections = 64KiB of table and 32MiB of bitmaps (0.003%)
+    num_sections = (memory_end + PALLOC_SECTION_SIZE - 1) >> PALLOC_SECTION_SHIFT;
+    section_maps = (u8**)bootmem_alloc(sizeof(u8*) * num_sections, 8);
+    memset(section_maps, 0, sizeof(u8*) * num_sections);
+    section_nodes = (u8*)bootmem_alloc(num_sections, 8);
+    memset(section_nodes, 0, num_sections);
+    section_pages = (struct page* volatile*)bootmem_alloc(sizeof(struct page*) * num_sections, 8);
+    memset((void*)section_pages, 0, sizeof(struct page*) * num_sections);
+
+    // low memory section bitmaps come from bootmem. highmem sections are done in palloc_init_highmem
+    while((region_start = multiboot2_mmap_next_free_region(&region_size, &region_type)) != (intp)-1) {
+        if(region_type != MULTIBOOT_REGION_TYPE_AVAILABLE || region_start >= 0x100000000) continue;
+
+        u64 missing = _count_missing_sections(region_start, region_size);
+        if(missing == 0) continue;
+
+        _assign_section_maps(region_start, region_size, (intp)bootmem_alloc(missing * PAGE_SIZE, 8), true);
     }
 
     // and now that we have a bitmaps, we can start reclaiming bootmem
@@ -188,10 +350,14 @@ void palloc_init()
         _initialize_region(&regions[region_index], region_start, region_size);
         region_index++;
     }
+
+    fprintf(stderr, "palloc: low memory initialized in %lu cycles\n", __rdtsc() - start_time);
 }
 
 void palloc_init_highmem()
 {
+    u64 start_time = __rdtsc();
+
     // now we can finally add highmem to palloc. region structures were already allocated, now we just have to initialize them
     intp region_start;
     u64  region_size;
@@ -203,59 +369,136 @@ void palloc_init_highmem()
         // for now, we assume that all high memory is mapped by the hardware under 64TiB
         assert((region_start + region_size) <= 0x0000400000000000UL, "only support hardware with highmem positioned under 64TiB");
 
-        // we have to allocate the bitmaps first, directly in the region itself
-        u32 npages = region_size >> PAGE_SHIFT;
-
-        for(u32 order = 0; order < PALLOC_MAX_ORDER - 1; ++order) {
-            u64 mapsize = ((npages >> (order + 1)) + 7) >> 3; // divide pages by 2^(order layer, plus 1 because of the buddy), then divide by sizeof(byte) rounded up
-            regions[region_index].maps[order] = (u8*)__alignup(region_start, 8); // map pointer needs to be 8 byte aligned
-            memset(regions[region_index].maps[order], 0, mapsize);
-
-            // reduce the remaining size of the region (_initialize_region will round up any non-page boundary, which just becomes unusable memory)
-            // all maps need to be 8 byte aligned
-            u8 wasted = (intp)regions[region_index].maps[order] - (intp)region_start;
-            region_start += (mapsize + wasted);
-            region_size -= (mapsize + wasted);
+        // we have to allocate the section bitmaps first, directly in the region itself
+        u64 missing = _count_missing_sections(region_start, region_size);
+        intp storage = (intp)__alignup(region_start, PAGE_SIZE);
+        u64 used = (storage - region_start) + missing * PAGE_SIZE;
+        if(used >= region_size) { // too small to hold its own bitmaps, so just leave it empty
+            regions[region_index++].start = region_start;
+            continue;
         }
 
+        _assign_section_maps(region_start, region_size, storage, false);
+        region_start += used;
+        region_size -= used;
+
 #if PALLOC_VERBOSE > 0
         fprintf(stderr, "palloc: adding high mem region 0x%lX size=%d\n", region_start, region_size);
 #endif
-        _initialize_region(&regions[region_index], region_start, region_size);
+        _setup_region(&regions[region_index], region_start, region_size);
         region_index++;
     }
 
     assert(region_index == num_regions, "we should have all the regions now. why not?");
+
+    // make the first few sections available now, and leave the rest to palloc_init_deferred()
+    u64 s = 0x100000000 >> PALLOC_SECTION_SHIFT;
+    for(u32 count = 0; s < num_sections && count < PALLOC_BOOT_SECTIONS; s++) {
+        if(section_maps[s] == null) continue;
+        _initialize_section(s);
+        count++;
+    }
+
+    deferred_cursor = s;
+    for(; s < num_sections; s++) {
+        if(section_maps[s] != null) deferred_sections++;
+    }
+    deferred_pending = deferred_sections;
+
+    fprintf(stderr, "palloc: high memory boot sections initialized in %lu cycles, %lu sections (%lu MiB) deferred\n",
+            __rdtsc() - start_time, deferred_sections, deferred_sections << (PALLOC_SECTION_SHIFT - 20));
+
+    // take the huge page pool now, before anything has had a chance to fragment memory
+    palloc_reserve_huge(PALLOC_HUGE_RESERVE);
+
+    shrinker_register(&zero_shrinker);
 }
 
-declare_ticketlock(palloc_lock);
+enum PALLOC_DEFERRED_STATUS palloc_init_deferred()
+{
+    if(deferred_pending == 0) return PALLOC_DEFERRED_DONE;
 
-intp palloc_claim(u8 n) // allocate 2^n pages
+    while(true) {
+        u64 s = __atomic_inc(&deferred_cursor) - 1;
+        if(s >= num_sections) {
+            // every section has been handed out, but other cpus may still be initializing theirs. their memory shows up
+            // as soon as they're done
+            return (deferred_pending == 0) ? PALLOC_DEFERRED_DONE : PALLOC_DEFERRED_BUSY;
+        }
+        if(section_maps[s] == null) continue;
+
+        u64 start_time = __rdtsc();
+        if(deferred_start == 0) __compare_and_exchange(&deferred_start, 0, start_time);
+
+        _initialize_section(s);
+        __atomic_add(&deferred_cycles, __rdtsc() - start_time);
+
+        if(__atomic_dec(&deferred_pending) == 0) {
+            fprintf(stderr, "palloc: %lu deferred sections initialized in %lu cycles (%lu cycles of work across all cpus)\n",
+                    deferred_sections, __rdtsc() - deferred_start, deferred_cycles);
+        }
+
+        return PALLOC_DEFERRED_INITIALIZED;
+    }
+}
+
+u32 palloc_num_regions()
 {
-    assert(n < PALLOC_MAX_ORDER, "n must be a valid order size");
+    return num_regions;
+}
 
+u64 palloc_num_sections()
+{
+    u64 count = 0;
+    for(u64 s = 0; s < num_sections; s++) {
+        if(section_maps[s] != null) count++;
+    }
+    return count;
+}
+
+// The per-cpu page cache sits in front of the buddy lists for the smallest orders. Each cached order keeps
+// a single list with a hot end and a cold end: recently abandoned blocks go onto the hot end (head) since
+// they're likely still in this cpu's cache, while blocks brought over from the buddy lists in a batch
+// are appended to the cold end (tail). Claims take from the hot end and drains give back from the cold end.
+// The lists are only ever touched by their own cpu with interrupts disabled, so no lock is required
+// except when refilling from or draining to the buddy lists.
+#define PALLOC_PCP_MAX_ORDER 3   // orders 0, 1 and 2 are cached per cpu
+#define PALLOC_PCP_BATCH     16  // number of order 0 blocks moved to/from the buddy lists at once, halved for each higher order
+#define PALLOC_PCP_HIGH      64  // high watermark for order 0 lists, halved for each higher order
+
+struct palloc_cpu_list {
+    struct free_page* head;  // hot end
+    struct free_page* tail;  // cold end
+    u32    count;
+    u32    batch;
+    u32    high;
+    u32    padding0;
+};
+
+struct palloc_cpu_cache {
+    struct palloc_cpu_list lists[PALLOC_PCP_MAX_ORDER];
+    u8     node;  // only blocks from this node's zone are cached
+};
+
+static intp _palloc_claim_locked(struct palloc_zone* zone, u8 n)
+{
     // working order
     u8 order = n;
 
-    // we need a lock to be threadsafe
-    acquire_lock(palloc_lock);
-
     // find first order >= requested size with free blocks
-    while(order < PALLOC_MAX_ORDER && free_page_head[order]->next == null) order++;
+    while(order < PALLOC_MAX_ORDER && zone->free_page_head[order]->next == null) order++;
 
     // out of memory?
-    if(order == PALLOC_MAX_ORDER) {
-        release_lock(palloc_lock);
-        return 0;
-    }
+    if(order == PALLOC_MAX_ORDER) return 0;
 
     // remove the head from the current order
-    struct free_page* left = free_page_head[order]->next;
-    free_page_head[order]->next = left->next;
-    if(free_page_head[order]->next != null) free_page_head[order]->next->prev = null;
+    struct free_page* left = zone->free_page_head[order]->next;
+    zone->free_page_head[order]->next = left->next;
+    if(zone->free_page_head[order]->next != null) zone->free_page_head[order]->next->prev = null;
+    zone->free_blocks[order]--;
 
 #if PALLOC_VERBOSE > 1
-    fprintf(stderr, "palloc: removed block $%lX at order %d (new free_page_head[order]->next = 0x%lX)\n", (intp)left, order, free_page_head[order]->next);
+    fprintf(stderr, "palloc: removed block $%lX at order %d (new zone->free_page_head[order]->next = 0x%lX)\n", (intp)left, order, zone->free_page_head[order]->next);
 #endif
 
     // split blocks all the way down to the requested size, if necessary
@@ -267,76 +510,65 @@ intp palloc_claim(u8 n) // allocate 2^n pages
         assert(((intp)left ^ (1 << ((order - 1) + PAGE_SHIFT))) == (intp)right, "verifying buddy address");
 
         // immediately toggle the bit out of the order the block comes from, before any splits
-        u8 bit;
-        palloc_togglebit(left, order, &bit);
-
+        if(order < PALLOC_MAX_ORDER - 1) {
+            u8 bit = palloc_togglebit((intp)left, order);
 #if PALLOC_VERBOSE > 2
-        fprintf(stderr, "palloc: splitting block order %d left=$%lX right=$%lX (new bit = $%02X)\n", order, (intp)left, (intp)right, bit);
+            fprintf(stderr, "palloc: splitting block order %d left=$%lX right=$%lX (new bit = $%02X)\n", order, (intp)left, (intp)right, bit);
 #else
-        unused(bit);
+            unused(bit);
 #endif
+        }
 
         // add the right node to the free page list at the lower order. the bitmap bit will be 
         // toggled below/next time through the loop
-        right->next = free_page_head[order - 1]->next;
-        right->prev = null; // doesn't actually point back to free_page_head[order], since that's not an actual block of pages
+        right->next = zone->free_page_head[order - 1]->next;
+        right->prev = null; // doesn't actually point back to zone->free_page_head[order], since that's not an actual block of pages
         if(right->next != null) right->next->prev = right;
-        free_page_head[order - 1]->next = right;
+        zone->free_page_head[order - 1]->next = right;
+        zone->free_blocks[order - 1]++;
 
         // and continue dividing 'left' if necessary
         --order;
     }
 
     // toggle the left bit
-    u8 bit;
-    bool buddy_valid = palloc_togglebit(left, order, &bit);
-
+    if(order < PALLOC_MAX_ORDER - 1) {
+        u8 bit = palloc_togglebit((intp)left, order);
 #if PALLOC_VERBOSE > 1
-    fprintf(stderr, "palloc: marked block $%lX order %d used (new bit = $%02X) buddy_valid=%d\n", left, order, bit, (u8)buddy_valid);
+        fprintf(stderr, "palloc: marked block $%lX order %d used (new bit = $%02X)\n", left, order, bit);
 #else
-    unused(bit);
-    unused(buddy_valid);
+        unused(bit);
 #endif
-
-
-    // release lock
-    release_lock(palloc_lock);
+    }
 
     // return the page
+    zone->free_pages -= 1 << n;
     return (intp)left;
 }
 
-void palloc_abandon(intp base, u8 n)
+static void _palloc_abandon_locked(struct palloc_zone* zone, intp base, u8 n)
 {
-    assert(n < PALLOC_MAX_ORDER, "n must be a valid order size");
-
     // working order
     u8 order = n;
 
-    // claim palloc lock
-    acquire_lock(palloc_lock);
+    zone->free_pages += 1 << n;
 
     while(true) {
         // start by determining if the buddy is available or not
         u64 block_size = 1 << (order + PAGE_SHIFT); // 2^n*4096
         intp buddy_addr = base ^ block_size; // toggle the bit to get the buddy address
 
-        // buddy_addr and 'base' both have the same bitmap index for palloc_togglebit,
-        // so we try to set buddy_addr first (most of the time it succeeds),
-        // but if buddy_addr isn't valid, then flip the bit on base instead. now we know
-        // if there's a valid buddy to merge
-        u8 bit;
-        bool buddy_valid;
-        if(!(buddy_valid = palloc_togglebit((struct free_page*)buddy_addr, order, &bit))) {
-            palloc_togglebit((struct free_page*)base, order, &bit);
-        }
+        // buddy_addr and 'base' both have the same bitmap index for palloc_togglebit. the top order has no
+        // bitmap since those blocks never combine
+        u8 bit = 1;
+        if(order < PALLOC_MAX_ORDER - 1) bit = palloc_togglebit(base, order);
 
 #if PALLOC_VERBOSE > 1
-        fprintf(stderr, "palloc: marking block $%lX order %d free (new bit = $%02X) buddy_valid=%d\n", base, order, bit, (u8)buddy_valid);
+        fprintf(stderr, "palloc: marking block $%lX order %d free (new bit = $%02X)\n", base, order, bit);
 #endif
 
         // a released block with no buddy must stay at this level, otherwise try combining to larger blocks
-        if(buddy_valid && (bit == 0) && order < PALLOC_MAX_ORDER - 1) {
+        if(bit == 0) {
 #if PALLOC_VERBOSE > 2
             fprintf(stderr, "palloc: combining blocks base=$%lX and buddy=$%lX into order %d\n", base, buddy_addr, order + 1);
 #endif
@@ -347,14 +579,15 @@ void palloc_abandon(intp base, u8 n)
             // remove buddy from free_list
             if(buddy->prev == null) { 
 #if PALLOC_VERBOSE > 2
-                fprintf(stderr, "free_page_head[%d]->next = $%lX, buddy = $%lX\n", order, free_page_head[order]->next, buddy);
+                fprintf(stderr, "zone->free_page_head[%d]->next = $%lX, buddy = $%lX\n", order, zone->free_page_head[order]->next, buddy);
 #endif
-                assert(free_page_head[order]->next == buddy, "must be the case"); // the only time a node's prev pointer should be null is if it's at the start of the free list
-                free_page_head[order]->next = buddy->next;
+                assert(zone->free_page_head[order]->next == buddy, "must be the case"); // the only time a node's prev pointer should be null is if it's at the start of the free list
+                zone->free_page_head[order]->next = buddy->next;
             } else {
                 buddy->prev->next = buddy->next;
             }
-            buddy->next->prev = buddy->prev;
+            if(buddy->next != null) buddy->next->prev = buddy->prev;
+            zone->free_blocks[order]--;
 
             // use the lower address and add try combining in the next higher order
             base &= ~block_size;
@@ -363,15 +596,666 @@ void palloc_abandon(intp base, u8 n)
             // not combing with a buddy, so add to current order and break out
             struct free_page* np = (struct free_page*)base;
             np->prev = null;
-            assert(free_page_head[order]->next != np, "what4");
-            np->next = free_page_head[order]->next;
+            assert(zone->free_page_head[order]->next != np, "what4");
+            np->next = zone->free_page_head[order]->next;
             if(np->next != null) np->next->prev = np;
-            free_page_head[order]->next = np;
+            zone->free_page_head[order]->next = np;
+            zone->free_blocks[order]++;
             assert(np->next != np, "what3");
             break;
         }
     }
+}
+
+// move up to 'count' blocks from the local zone to the cold end of the cpu list
+static void _pcp_refill(struct palloc_cpu_cache* pcp, struct palloc_cpu_list* list, u8 order, u32 count)
+{
+    struct palloc_zone* zone = &zones[pcp->node];
+
+    u64 zone_flags = _lock_zone(zone);
+    while(count-- > 0) {
+        struct free_page* fp = (struct free_page*)_palloc_claim_locked(zone, order);
+        if(fp == null) break;
+
+        fp->next = null;
+        fp->prev = list->tail;
+        if(list->tail != null) list->tail->next = fp;
+        else                   list->head = fp;
+        list->tail = fp;
+        list->count++;
+    }
+    _unlock_zone(zone, zone_flags);
+}
+
+// give up to 'count' blocks from the cold end of the cpu list back to the local zone
+static void _pcp_drain(struct palloc_cpu_cache* pcp, struct palloc_cpu_list* list, u8 order, u32 count)
+{
+    if(count == 0 || list->count == 0) return;
+
+    struct palloc_zone* zone = &zones[pcp->node];
+
+    u64 zone_flags = _lock_zone(zone);
+    while(count-- > 0 && list->tail != null) {
+        struct free_page* fp = list->tail;
+        list->tail = fp->prev;
+        if(list->tail != null) list->tail->next = null;
+        else                   list->head = null;
+        list->count--;
+
+        _palloc_abandon_locked(zone, (intp)fp, order);
+    }
+    _unlock_zone(zone, zone_flags);
+}
+
+void palloc_init_cpu()
+{
+    struct cpu* cpu = get_cpu();
+    assert(cpu->palloc_cache == null, "only call palloc_init_cpu once per cpu");
+
+    struct palloc_cpu_cache* pcp = (struct palloc_cpu_cache*)kalloc(sizeof(struct palloc_cpu_cache));
+    zero(pcp);
+
+    for(u8 order = 0; order < PALLOC_PCP_MAX_ORDER; order++) {
+        pcp->lists[order].batch = max(1, PALLOC_PCP_BATCH >> order);
+        pcp->lists[order].high  = max(2, PALLOC_PCP_HIGH >> order);
+    }
+
+    // cache pages from the node this cpu lives on
+    pcp->node = numa_node_of_apic_id(apic_get_apic_id(cpu->cpu_index));
+    if(pcp->node >= num_zones) pcp->node = 0;
+
+    cpu->palloc_cache = pcp;
+}
+
+// the node of the cpu we're running on, or node 0 during boot
+static inline u8 _local_node()
+{
+    return smp_ready() ? get_cpu()->palloc_cache->node : 0;
+}
+
+// Idle cpus clear blocks ahead of time so that claims with PALLOC_ZERO don't have to. Each zone has its own
+// pool with a separate lock from the buddy lists. Blocks in the pool are linked through their first word, which
+// is cleared again when the block is handed out. The pool counts as allocated memory, but plain claims take from it
+// before failing.
+static u64 _total_free_pages()
+{
+    u64 free = 0;
+    for(u8 node = 0; node < num_zones; node++) free += zones[node].free_pages;
+    return free;
+}
+
+// set by palloc_reclaim_idle() while the system is working its way back up to PALLOC_WATERMARK_HIGH
+static bool volatile reclaim_active = false;
+
+// the pool locks follow the zone locks and are taken with interrupts disabled
+static inline u64 _lock_zero_pool(struct palloc_zone* zone)
+{
+    u64 cpu_flags = __cli_saveflags();
+    acquire_lock(zone->zero_lock);
+    return cpu_flags;
+}
+
+static inline void _unlock_zero_pool(struct palloc_zone* zone, u64 cpu_flags)
+{
+    release_lock(zone->zero_lock);
+    __restoreflags(cpu_flags);
+}
+
+// zero_lock must be held. the block's first word still holds the list link
+static struct free_page* _zero_pool_pop_locked(struct palloc_zone* zone, u8 n)
+{
+    struct free_page* fp = zone->zero_head[n];
+    if(fp != null) {
+        zone->zero_head[n] = fp->next;
+        zone->zero_count[n]--;
+        __atomic_add(&zero_stats.pool_pages, -(1LL << n));
+    }
+    return fp;
+}
+
+static intp _zero_pool_take(struct palloc_zone* zone, u8 n)
+{
+    if(n >= PALLOC_ZERO_MAX_ORDER || zone->zero_count[n] == 0) return 0;
+
+    u64 cpu_flags = _lock_zero_pool(zone);
+    struct free_page* fp = _zero_pool_pop_locked(zone, n);
+    _unlock_zero_pool(zone, cpu_flags);
+
+    if(fp == null) return 0;
+
+    fp->next = null;
+    return (intp)fp;
+}
+
+void palloc_zero_idle()
+{
+    if(!smp_ready()) return;
+
+    struct palloc_zone* zone = &zones[_local_node()];
+    u32 budget = PALLOC_ZERO_BATCH;
+
+    for(u8 order = 0; order < PALLOC_ZERO_MAX_ORDER; order++) {
+        while(zone->zero_count[order] < (u32)(PALLOC_ZERO_HIGH >> order) && budget >= (1U << order)) {
+            // don't tie up memory the rest of the system needs, and don't undo the work of reclaim
+            if(reclaim_active || _total_free_pages() < PALLOC_WATERMARK_HIGH) return;
+
+            // only from this zone. palloc_claim() would fall back to other zones, and a block in the wrong zone's
+            // pool would be abandoned into the wrong buddy lists
+            u64 zone_flags = _lock_zone(zone);
+            intp block = _palloc_claim_locked(zone, order);
+            _unlock_zone(zone, zone_flags);
+            if(block == 0) return;
+
+            u64 start = __rdtsc();
+            memset64((void*)block, 0, (PAGE_SIZE << order) / sizeof(u64));
+            __atomic_add(&zero_stats.zero_cycles, __rdtsc() - start);
+            __atomic_add(&zero_stats.pages_zeroed, 1 << order);
+            __atomic_add(&zero_stats.pool_pages, 1 << order);
+
+            // the shrinker abandons pool blocks into the zone that holds the pool
+            assert(_zone_of(block) == zone, "zero pool block belongs to another zone");
+
+            struct free_page* fp = (struct free_page*)block;
+            u64 cpu_flags = _lock_zero_pool(zone);
+            fp->next = zone->zero_head[order];
+            zone->zero_head[order] = fp;
+            zone->zero_count[order]++;
+            _unlock_zero_pool(zone, cpu_flags);
+
+            budget -= 1 << order;
+        }
+    }
+}
+
+void palloc_get_zero_stats(struct palloc_zero_stats* stats)
+{
+    *stats = zero_stats;
+}
+
+void palloc_get_huge_stats(struct palloc_huge_stats* stats)
+{
+    *stats = huge_stats;
+}
+
+void palloc_get_mem_stats(struct palloc_mem_stats* stats)
+{
+    zero(stats);
+
+    // the counters are read without the zone locks, so they can be slightly off from each other
+    for(u8 node = 0; node < num_zones; node++) {
+        struct palloc_zone* zone = &zones[node];
+        stats->total_pages += zone->total_pages;
+        stats->free_pages  += zone->free_pages;
+        for(u8 order = 0; order < PALLOC_MAX_ORDER; order++) stats->free_blocks[order] += zone->free_blocks[order];
+        for(u8 order = 0; order < PALLOC_ZERO_MAX_ORDER; order++) stats->zero_pages += (u64)zone->zero_count[order] << order;
+        stats->huge_pages += (u64)zone->huge_count << PALLOC_HUGE_ORDER;
+    }
+
+    stats->descriptor_pages = num_page_arrays << PALLOC_PAGES_ORDER;
+
+    for(u32 i = 0; i < apic_num_local_apics(); i++) {
+        struct cpu* cpu = apic_get_cpu(i);
+        if(cpu == null || cpu->palloc_cache == null) continue;
+        for(u8 order = 0; order < PALLOC_PCP_MAX_ORDER; order++) stats->cached_pages += (u64)cpu->palloc_cache->lists[order].count << order;
+    }
+}
+
+// the unusable free space index: the share of free pages, in tenths of a percent, that sit in blocks too small to
+// satisfy a claim of 'order'. 0 means all free memory is usable at that order, 1000 means none of it is
+u32 palloc_fragmentation_index(struct palloc_mem_stats const* stats, u8 order)
+{
+    assert(order < PALLOC_MAX_ORDER, "n must be a valid order size");
+    if(stats->free_pages == 0) return 0;
+
+    u64 usable = 0;
+    for(u8 i = order; i < PALLOC_MAX_ORDER; i++) usable += stats->free_blocks[i] << i;
+
+    return (u32)(((stats->free_pages - min(usable, stats->free_pages)) * 1000) / stats->free_pages);
+}
+
+void palloc_dump_stats()
+{
+    for(u8 node = 0; node < num_zones; node++) {
+        struct palloc_zone* zone = &zones[node];
+        fprintf(stderr, "palloc: node %d: %lu pages free, pre-zeroed blocks %d/%d/%d (orders 0/1/2)\n",
+                node, zone->free_pages, zone->zero_count[0], zone->zero_count[1], zone->zero_count[2]);
+    }
+
+    struct palloc_zero_stats stats;
+    palloc_get_zero_stats(&stats);
+
+    u64 requests = stats.hits + stats.misses;
+    fprintf(stderr, "palloc: zeroed claims %lu, %lu from the pool (%d%%), %lu pages in the pool\n",
+            requests, stats.hits, (requests == 0) ? 0 : (stats.hits * 100) / requests, stats.pool_pages);
+    if(stats.pages_zeroed != 0) {
+        fprintf(stderr, "palloc: idle cpus zeroed %lu pages at %lu cycles per page\n", stats.pages_zeroed, stats.zero_cycles / stats.pages_zeroed);
+    }
+
+    struct palloc_huge_stats hstats;
+    palloc_get_huge_stats(&hstats);
+    fprintf(stderr, "palloc: huge claims %lu from the pool, %lu from the buddy lists, %lu failed, %lu blocks in the pool\n",
+            hstats.pool_hits, hstats.buddy_claims, hstats.failures, hstats.pool_blocks);
+}
+
+// Caches all over the kernel hold on to memory that they can give back through their shrinkers (see shrinker.c).
+// Idle cpus start reclaiming once free memory drops below the low watermark and keep going until it's back above
+// the high one. Claims only reclaim themselves when memory is below the min watermark or they would otherwise fail,
+// and then only from the shrinkers that are safe to call with locks held.
+// reclaimed blocks usually land in this cpu's cache, where a claim for another order or node can't see them
+static void _drain_local_cache()
+{
+    u64 cpu_flags = __cli_saveflags();
+    struct palloc_cpu_cache* pcp = get_cpu()->palloc_cache;
+    for(u8 order = 0; order < PALLOC_PCP_MAX_ORDER; order++) _pcp_drain(pcp, &pcp->lists[order], order, pcp->lists[order].count);
+    __restoreflags(cpu_flags);
+}
+
+static u64 _direct_reclaim(u64 nr_pages)
+{
+    u64 freed = shrinker_reclaim(nr_pages, true);
+    if(freed != 0) _drain_local_cache();
+    return freed;
+}
+
+void palloc_reclaim_idle()
+{
+    if(!smp_ready()) return;
+
+    u64 free = _total_free_pages();
+    if(free < PALLOC_WATERMARK_LOW) reclaim_active = true;
+    if(!reclaim_active) return;
+
+    // stop at the high watermark, or when the caches have nothing left to give
+    if(free >= PALLOC_WATERMARK_HIGH || shrinker_reclaim(min(PALLOC_WATERMARK_HIGH - free, PALLOC_RECLAIM_BATCH), false) == 0) {
+        reclaim_active = false;
+    }
+}
+
+// the pre-zeroed pool is the cheapest thing to give back, it's just free memory with a head start
+static u64 _zero_shrinker_count(struct shrinker* shrinker)
+{
+    unused(shrinker);
+    return zero_stats.pool_pages;
+}
+
+static u64 _zero_shrinker_scan(struct shrinker* shrinker, u64 nr_pages)
+{
+    unused(shrinker);
+
+    // this can run from inside a claim, possibly one made while holding either of these locks, so zones that are
+    // busy are skipped rather than waited on. every block in a zone's pool was claimed from that zone (see
+    // palloc_zero_idle()), so its buddy lists are the ones the block goes back to
+    u64 freed = 0;
+    for(u8 node = 0; node < num_zones && freed < nr_pages; node++) {
+        struct palloc_zone* zone = &zones[node];
+
+        u64 cpu_flags = __cli_saveflags();
+        if(!try_lock(zone->zero_lock)) {
+            __restoreflags(cpu_flags);
+            continue;
+        }
+
+        if(!try_lock(zone->lock)) {
+            release_lock(zone->zero_lock);
+            __restoreflags(cpu_flags);
+            continue;
+        }
+
+        for(s8 order = PALLOC_ZERO_MAX_ORDER - 1; order >= 0; order--) {
+            struct free_page* fp;
+            while(freed < nr_pages && (fp = _zero_pool_pop_locked(zone, order)) != null) {
+                fp->next = null;
+                _palloc_abandon_locked(zone, (intp)fp, order);
+                freed += 1 << order;
+            }
+        }
+
+        release_lock(zone->lock);
+        release_lock(zone->zero_lock);
+        __restoreflags(cpu_flags);
+    }
 
-    release_lock(palloc_lock);
+    return freed;
 }
 
+static struct shrinker zero_shrinker = {
+    .name  = "palloc-zero",
+    .count = _zero_shrinker_count,
+    .scan  = _zero_shrinker_scan,
+    .flags = SHRINKER_FLAG_DIRECT,
+};
+
+intp palloc_claim(u8 n) // allocate 2^n pages
+{
+    assert(n < PALLOC_MAX_ORDER, "n must be a valid order size");
+
+    // small orders are served from the cpu cache once all cpus have one
+    if(n < PALLOC_PCP_MAX_ORDER && smp_ready()) {
+        u64 cpu_flags = __cli_saveflags();
+        struct palloc_cpu_cache* pcp = get_cpu()->palloc_cache;
+        struct palloc_cpu_list* list = &pcp->lists[n];
+
+        if(list->head == null) _pcp_refill(pcp, list, n, list->batch);
+
+        // take from the hot end
+        struct free_page* fp = list->head;
+        if(fp != null) {
+            list->head = fp->next;
+            if(list->head != null) list->head->prev = null;
+            else                   list->tail = null;
+            list->count--;
+        }
+
+        u8 node = pcp->node;
+        __restoreflags(cpu_flags);
+
+        if(fp != null) return (intp)fp;
+
+        // the local zone is empty, so go through the fallback zones and finally the pre-zeroed pages
+        intp ret = palloc_claim_node(node, n);
+        if(ret == 0) ret = _zero_pool_take(&zones[node], n);
+        return ret;
+    }
+
+    return palloc_claim_node(_local_node(), n);
+}
+
+intp palloc_claim_flags(u8 n, u32 flags)
+{
+    if(!(flags & PALLOC_ZERO)) return palloc_claim(n);
+
+    intp ret = _zero_pool_take(&zones[_local_node()], n);
+    if(ret != 0) {
+        __atomic_inc(&zero_stats.hits);
+        return ret;
+    }
+
+    // nothing cleared ahead of time, so do it now
+    __atomic_inc(&zero_stats.misses);
+    ret = palloc_claim(n);
+    if(ret != 0) memset64((void*)ret, 0, (PAGE_SIZE << n) / sizeof(u64));
+    return ret;
+}
+
+intp palloc_claim_node(u8 node, u8 n)
+{
+    assert(n < PALLOC_MAX_ORDER, "n must be a valid order size");
+    assert(node < num_zones, "invalid node");
+
+    // running low, so get some memory back before it runs out
+    if(smp_ready() && _total_free_pages() < PALLOC_WATERMARK_MIN) _direct_reclaim(PALLOC_RECLAIM_BATCH);
+
+    u8 const* fallback = numa_fallback_nodes(node);
+    bool reclaimed = false;
+    while(true) {
+        // try each zone in order of distance from 'node'
+        for(u8 i = 0; i < num_zones; i++) {
+            struct palloc_zone* zone = &zones[fallback[i]];
+
+            // we need a lock to be threadsafe
+            u64 zone_flags = _lock_zone(zone);
+            intp ret = _palloc_claim_locked(zone, n);
+            _unlock_zone(zone, zone_flags);
+
+            if(ret != 0) return ret;
+        }
+
+        // out of memory, unless some of it hasn't been initialized yet. that includes sections other cpus are still
+        // working on, so wait for them
+        enum PALLOC_DEFERRED_STATUS deferred = palloc_init_deferred();
+        if(deferred == PALLOC_DEFERRED_BUSY) __pause_barrier();
+        if(deferred != PALLOC_DEFERRED_DONE) continue;
+
+        // or the caches can give some back. only once, since the freed pages might not merge into a large enough block
+        if(reclaimed || !smp_ready()) break;
+        reclaimed = true;
+        if(_direct_reclaim(max(1ULL << n, PALLOC_RECLAIM_BATCH)) == 0) break;
+    }
+
+    return 0;
+}
+
+// Huge pages come out of the buddy lists like any other order 9 block, and the pool is only there for when the lists
+// can't produce one anymore. Each zone keeps its own pool under the zone lock.
+static intp _huge_pool_take(struct palloc_zone* zone)
+{
+    if(zone->huge_count == 0) return 0;
+
+    u64 zone_flags = _lock_zone(zone);
+    struct free_page* fp = zone->huge_head;
+    if(fp != null) {
+        zone->huge_head = fp->next;
+        zone->huge_count--;
+    }
+    _unlock_zone(zone, zone_flags);
+
+    if(fp == null) return 0;
+
+    fp->next = null;
+    __atomic_dec(&huge_stats.pool_blocks);
+    return (intp)fp;
+}
+
+// At boot most of the remote nodes' memory is still deferred, so a zone that can't produce a 2MiB block is skipped
+// for the next one. The reserve is spread over the nodes that have memory, and only falls short when none do
+void palloc_reserve_huge(u32 count)
+{
+    u32 reserved = 0;
+    for(u32 i = 0; i < count; i++) {
+        struct free_page* fp = null;
+
+        for(u8 j = 0; j < num_zones && fp == null; j++) {
+            struct palloc_zone* zone = &zones[(i + j) % num_zones];
+
+            u64 zone_flags = _lock_zone(zone);
+            fp = (struct free_page*)_palloc_claim_locked(zone, PALLOC_HUGE_ORDER);
+            if(fp != null) {
+                fp->next = zone->huge_head;
+                zone->huge_head = fp;
+                zone->huge_count++;
+                zone->huge_reserve++;
+            }
+            _unlock_zone(zone, zone_flags);
+        }
+
+        if(fp == null) break;
+        __atomic_inc(&huge_stats.pool_blocks);
+        reserved++;
+    }
+
+    if(reserved < count) fprintf(stderr, "palloc: warning: only %d of %d huge pages could be reserved\n", reserved, count);
+
+#if PALLOC_VERBOSE > 0
+    fprintf(stderr, "palloc: reserved %lu huge pages\n", huge_stats.pool_blocks);
+#endif
+}
+
+intp palloc_claim_huge()
+{
+    u8 node = _local_node();
+
+    // the buddy lists of every node come first, nearest first
+    intp ret = palloc_claim_node(node, PALLOC_HUGE_ORDER);
+    if(ret != 0) {
+        __atomic_inc(&huge_stats.buddy_claims);
+        return ret;
+    }
+
+    // they're all out of 2MiB blocks, so fall back to the pools, starting with the local one
+    u8 const* fallback = numa_fallback_nodes(node);
+    for(u8 i = 0; i < num_zones; i++) {
+        ret = _huge_pool_take(&zones[fallback[i]]);
+        if(ret != 0) {
+            __atomic_inc(&huge_stats.pool_hits);
+            return ret;
+        }
+    }
+
+    __atomic_inc(&huge_stats.failures);
+    return 0;
+}
+
+void palloc_abandon_huge(intp base)
+{
+    assert((base & ((PAGE_SIZE << PALLOC_HUGE_ORDER) - 1)) == 0, "huge pages must be 2MiB aligned");
+
+    struct palloc_zone* zone = _zone_of(base);
+    struct free_page* fp = (struct free_page*)base;
+    _reset_pages(base, PALLOC_HUGE_ORDER);
+
+    u64 zone_flags = _lock_zone(zone);
+    bool pooled = zone->huge_count < zone->huge_reserve;
+    if(pooled) {
+        fp->next = zone->huge_head;
+        zone->huge_head = fp;
+        zone->huge_count++;
+    } else {
+        _palloc_abandon_locked(zone, base, PALLOC_HUGE_ORDER);
+    }
+    _unlock_zone(zone, zone_flags);
+
+    if(pooled) __atomic_inc(&huge_stats.pool_blocks);
+}
+
+void palloc_abandon(intp base, u8 n)
+{
+    assert(n < PALLOC_MAX_ORDER, "n must be a valid order size");
+
+    struct palloc_zone* zone = _zone_of(base);
+    _reset_pages(base, n);
+
+    if(n < PALLOC_PCP_MAX_ORDER && smp_ready()) {
+        u64 cpu_flags = __cli_saveflags();
+        struct palloc_cpu_cache* pcp = get_cpu()->palloc_cache;
+
+        // remote blocks go straight back to their own zone
+        if(zone->node == pcp->node) {
+            struct palloc_cpu_list* list = &pcp->lists[n];
+
+            // put the block on the hot end
+            struct free_page* fp = (struct free_page*)base;
+            fp->prev = null;
+            fp->next = list->head;
+            if(list->head != null) list->head->prev = fp;
+            else                   list->tail = fp;
+            list->head = fp;
+            list->count++;
+
+            // past the high watermark, give a batch of the coldest blocks back
+            if(list->count > list->high) _pcp_drain(pcp, list, n, list->batch);
+
+            __restoreflags(cpu_flags);
+            return;
+        }
+
+        __restoreflags(cpu_flags);
+    }
+
+    u64 zone_flags = _lock_zone(zone);
+    _palloc_abandon_locked(zone, base, n);
+    _unlock_zone(zone, zone_flags);
+}
+
+// called when a cpu runs out of work. trims the cpu cache down to one batch per
+// order so that idle cpus don't sit on pages other cpus could use
+void palloc_drain_idle()
+{
+    if(!smp_ready()) return;
+
+    u64 cpu_flags = __cli_saveflags();
+    struct palloc_cpu_cache* pcp = get_cpu()->palloc_cache;
+
+    for(u8 order = 0; order < PALLOC_PCP_MAX_ORDER; order++) {
+        struct palloc_cpu_list* list = &pcp->lists[order];
+        if(list->count > list->batch) _pcp_drain(pcp, list, order, list->count - list->batch);
+    }
+
+    __restoreflags(cpu_flags);
+}
+
+// the descriptor of the page at 'base', allocating the section's descriptors if create is set. returns null when the
+// section has none, which includes running out of memory while creating them
+static struct page* _page_of(intp base, bool create)
+{
+    u64 s = base >> PALLOC_SECTION_SHIFT;
+    assert(s < num_sections && section_maps[s] != null, "page isn't managed by palloc");
+
+    struct page* pages = section_pages[s];
+    if(pages == null) {
+        if(!create) return null;
+
+        pages = (struct page*)palloc_claim(PALLOC_PAGES_ORDER);
+        if(pages == null) return null;
+        memset64(pages, 0, (PAGE_SIZE << PALLOC_PAGES_ORDER) / sizeof(u64));
+
+        // another cpu may have gotten there first
+        struct page* prev = __compare_and_exchange(&section_pages[s], null, pages);
+        if(prev != null) {
+            palloc_abandon((intp)pages, PALLOC_PAGES_ORDER);
+            pages = prev;
+        } else {
+            __atomic_inc(&num_page_arrays);
+        }
+    }
+
+    return &pages[(base & (PALLOC_SECTION_SIZE - 1)) >> PAGE_SHIFT];
+}
+
+// freed pages go back to the state of a zeroed descriptor. blocks never span sections, so one array covers them
+static void _reset_pages(intp base, u8 n)
+{
+    struct page* page = _page_of(base, false);
+    if(page != null) memset64(page, 0, ((u64)sizeof(struct page) << n) / sizeof(u64));
+}
+
+struct page* palloc_page(intp base)
+{
+    return _page_of(base, true);
+}
+
+u32 palloc_page_flags(intp base)
+{
+    struct page* page = _page_of(base, false);
+    return (page == null) ? 0 : page->flags;
+}
+
+bool palloc_share(intp base)
+{
+    struct page* page = _page_of(base, true);
+    if(page == null) return false;
+
+    u32 prev = __sync_fetch_and_add(&page->shared, 1);
+    assert(prev != (u32)-1, "too many references to one page");
+    return true;
+}
+
+void palloc_release(intp base)
+{
+    struct page* page = _page_of(base, false);
+
+    // drop an extra reference if there is one. otherwise this was the last owner. when two owners release at
+    // the same time, only the one that finds no extra references left frees the page
+    u32 prev;
+    while(page != null && (prev = page->shared) != 0) {
+        if(__compare_and_exchange(&page->shared, prev, prev - 1) == prev) return;
+    }
+
+    palloc_abandon(base, 0);
+}
+
+u32 palloc_refs(intp base)
+{
+    struct page* page = _page_of(base, false);
+    return 1 + ((page == null) ? 0 : page->shared);
+}
+
+u8 palloc_node_of(intp base)
+{
+    return _zone_of(base)->node;
+}
+
+u64 palloc_free_pages_node(u8 node)
+{
+    assert(node < num_zones, "invalid node");
+    return zones[node].free_pages;
+}
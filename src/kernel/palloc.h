@@ -3,11 +3,114 @@
 
 #define PALLOC_MAX_ORDER 11 // 1 greater than the actual order, 2^10 pages * 4KiB/page = 4MiB max contiguous allocation
 
+#define PALLOC_HUGE_ORDER 9  // 2^9 pages = 2MiB, the size of a huge page in a page directory
+
 #define palloc_claim_one() palloc_claim(0)
 
+enum PALLOC_FLAGS {
+    PALLOC_ZERO = (1 << 0)  // the memory must be cleared. orders below 3 usually come pre-zeroed from idle cpus
+};
+
+enum PALLOC_DEFERRED_STATUS {
+    PALLOC_DEFERRED_DONE = 0,     // every section has been initialized
+    PALLOC_DEFERRED_BUSY,         // nothing left to hand out, but other cpus are still initializing their sections
+    PALLOC_DEFERRED_INITIALIZED   // this call initialized a section
+};
+
+struct palloc_zero_stats {
+    u64 hits;          // PALLOC_ZERO claims served from the pre-zeroed pool
+    u64 misses;        // PALLOC_ZERO claims that had to clear the memory themselves
+    u64 pages_zeroed;  // pages cleared by idle cpus
+    u64 zero_cycles;   // time idle cpus spent clearing them
+    u64 pool_pages;    // pages currently waiting in the pool
+};
+
+struct palloc_huge_stats {
+    u64 pool_hits;     // huge claims served from the reserved pool
+    u64 buddy_claims;  // huge claims served from the buddy lists
+    u64 failures;      // huge claims that found no 2MiB block anywhere
+    u64 pool_blocks;   // blocks currently waiting in the pool
+};
+
+// a snapshot of where free memory is. pages in per-cpu caches and the pre-zeroed pool are not in the buddy lists
+struct palloc_mem_stats {
+    u64 total_pages;                    // pages managed by palloc
+    u64 free_pages;                     // pages in the buddy lists
+    u64 free_blocks[PALLOC_MAX_ORDER];  // blocks in the buddy lists of each order
+    u64 cached_pages;                   // free pages held in the per-cpu caches
+    u64 zero_pages;                     // free pages in the pre-zeroed pools
+    u64 huge_pages;                     // free pages in the reserved huge page pools
+    u64 descriptor_pages;               // pages used by struct page arrays
+};
+
 void palloc_init();
-void palloc_init_highmem();
-intp palloc_claim(u8 n); // allocate 2^n pages
+void palloc_init_highmem(); // only the first few highmem sections, the rest is left for palloc_init_deferred()
+enum PALLOC_DEFERRED_STATUS palloc_init_deferred(); // initialize one more highmem section
+void palloc_init_cpu(); // create the page cache for the current cpu
+intp palloc_claim(u8 n); // allocate 2^n pages, preferring the current cpu's numa node
+intp palloc_claim_flags(u8 n, u32 flags); // palloc_claim with enum PALLOC_FLAGS
+intp palloc_claim_node(u8 node, u8 n); // allocate 2^n pages from 'node', falling back to the nearest nodes by SLIT distance
 void palloc_abandon(intp base, u8 n); //base is 2^n pages
+void palloc_drain_idle(); // return excess pages in the current cpu's cache to the buddy lists
+void palloc_zero_idle(); // clear a few pages for the pre-zeroed pool of the current cpu's node
+void palloc_reclaim_idle(); // run the shrinkers while free memory is between the low and high watermarks
+
+// 2MiB blocks for huge page mappings. a pool can be set aside at boot so that huge pages are still available after
+// the buddy lists have been fragmented. claims return 0 when there's no free block, and callers fall back to 4KiB pages
+void palloc_reserve_huge(u32 count); // move up to 'count' blocks into the pools, spread over the numa nodes
+intp palloc_claim_huge(); // allocate a naturally aligned 2MiB block, preferring the current cpu's numa node
+void palloc_abandon_huge(intp base); // refills the pool of the owning node before going back to the buddy lists
+
+void palloc_get_zero_stats(struct palloc_zero_stats*);
+void palloc_get_huge_stats(struct palloc_huge_stats*);
+void palloc_dump_stats();
+
+void palloc_get_mem_stats(struct palloc_mem_stats*); // summed over all numa nodes
+u32  palloc_fragmentation_index(struct palloc_mem_stats const*, u8 order); // 0 (none) to 1000 (no block of order is free)
+
+enum PAGE_FLAGS {
+    PAGE_FLAG_DIRTY     = (1 << 0), // the contents differ from the backing store
+    PAGE_FLAG_LOCKED    = (1 << 1), // held by palloc_page_trylock()
+    PAGE_FLAG_SLAB      = (1 << 2), // first page of a kalloc or kmem slab. owner is the pool or cache
+    PAGE_FLAG_PAGECACHE = (1 << 3), // holds file data. owner is the file
+};
+
+// Every page palloc manages has a descriptor, found by its physical address in O(1). A page starts out with a
+// zeroed descriptor when it's claimed, and palloc resets the descriptor when the page is abandoned
+struct page {
+    u32 volatile shared;  // owners beyond the first, see palloc_share()
+    u16 volatile flags;   // enum PAGE_FLAGS
+    u16 unused0;
+    void* owner;          // whatever the flags say, or anything the page's user wants to keep there
+};
+
+static_assert(sizeof(struct page) == 16, "struct page should stay small");
+
+// descriptor of the page at base. the first call for a 128MiB section allocates its descriptors, and returns null if
+// there isn't enough memory for them
+struct page* palloc_page(intp base);
+u32  palloc_page_flags(intp base);   // flags of the page at base, without allocating any descriptors
+
+static inline bool palloc_page_trylock(struct page* page)
+{
+    return (__sync_fetch_and_or(&page->flags, PAGE_FLAG_LOCKED) & PAGE_FLAG_LOCKED) == 0;
+}
+
+static inline void palloc_page_unlock(struct page* page)
+{
+    __sync_fetch_and_and(&page->flags, (u16)~PAGE_FLAG_LOCKED);
+}
+
+// reference counts for order 0 pages owned by more than one address space. palloc_share adds an owner, or returns
+// false when there's no memory for the page's descriptor. palloc_release drops one and abandons the page when it
+// was the last
+bool palloc_share(intp base);
+void palloc_release(intp base);
+u32  palloc_refs(intp base); // number of owners, 1 for any allocated page that was never shared
+
+u32 palloc_num_regions();
+u64 palloc_num_sections(); // number of 128MiB sections that have buddy bitmaps
+u8  palloc_node_of(intp base); // numa node that owns the page at 'base'
+u64 palloc_free_pages_node(u8 node); // pages free in the node's buddy lists, not counting per-cpu caches
 
 #endif
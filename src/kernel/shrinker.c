@@ -0,0 +1,116 @@
+// shrinker - giving cached memory back to palloc under memory pressure
+//
+// Subsystems that keep memory around for speed (empty slabs, pre-zeroed pages, mapped stacks) register a shrinker
+// that can count and free what they hold. palloc reclaims in two ways: idle cpus run every shrinker once free
+// memory drops below the low watermark, and a claim that would fail (or that finds free memory below the min
+// watermark) runs the shrinkers that are safe to call with arbitrary locks held. Each reclaim splits the request
+// between the shrinkers in proportion to what they report, then makes a second pass for anything still missing.
+
+#include "common.h"
+
+#include "cpu.h"
+#include "kernel.h"
+#include "shrinker.h"
+#include "smp.h"
+#include "stdio.h"
+
+#define SHRINKER_VERBOSE 0
+
+static struct shrinker* volatile shrinkers = null;
+static u32 volatile reclaiming = 0;
+static struct shrinker_stats stats = { 0, };
+declare_ticketlock(shrinkers_lock);
+
+void shrinker_register(struct shrinker* shrinker)
+{
+    shrinker->calls = 0;
+    shrinker->pages_reclaimed = 0;
+
+    // the list is only ever added to, so reclaim can walk it without the lock
+    acquire_lock(shrinkers_lock);
+    shrinker->next = shrinkers;
+    __sync_synchronize();
+    shrinkers = shrinker;
+    release_lock(shrinkers_lock);
+}
+
+static inline bool _eligible(struct shrinker* shrinker, bool direct)
+{
+    return !direct || (shrinker->flags & SHRINKER_FLAG_DIRECT) != 0;
+}
+
+static u64 _scan(struct shrinker* shrinker, u64 nr_pages)
+{
+    u64 freed = shrinker->scan(shrinker, nr_pages);
+    __atomic_inc(&shrinker->calls);
+    __atomic_add(&shrinker->pages_reclaimed, freed);
+
+#if SHRINKER_VERBOSE > 0
+    fprintf(stderr, "shrinker: %s freed %lu of %lu pages\n", shrinker->name, freed, nr_pages);
+#endif
+
+    return freed;
+}
+
+u64 shrinker_reclaim(u64 nr_pages, bool direct)
+{
+    if(!smp_ready() || nr_pages == 0) return 0;
+
+    // a shrinker that frees memory can't end up back here, and two cpus reclaiming at once would only fight
+    if(__compare_and_exchange(&reclaiming, 0, 1) != 0) {
+        __atomic_inc(&stats.busy);
+        return 0;
+    }
+
+    __atomic_inc(direct ? &stats.direct_runs : &stats.background_runs);
+
+    u64 total = 0;
+    for(struct shrinker* shrinker = shrinkers; shrinker != null; shrinker = shrinker->next) {
+        if(_eligible(shrinker, direct)) total += shrinker->count(shrinker);
+    }
+
+    u64 freed = 0;
+    if(total != 0) {
+        // everyone gives up their share first
+        for(struct shrinker* shrinker = shrinkers; shrinker != null && freed < nr_pages; shrinker = shrinker->next) {
+            if(!_eligible(shrinker, direct)) continue;
+
+            u64 count = shrinker->count(shrinker);
+            if(count == 0) continue;
+
+            u64 share = max((nr_pages * count) / total, 1);
+            freed += _scan(shrinker, min(share, nr_pages - freed));
+        }
+
+        // then whoever still has something makes up the difference
+        for(struct shrinker* shrinker = shrinkers; shrinker != null && freed < nr_pages; shrinker = shrinker->next) {
+            if(_eligible(shrinker, direct) && shrinker->count(shrinker) != 0) freed += _scan(shrinker, nr_pages - freed);
+        }
+    }
+
+    __atomic_add(&stats.pages_reclaimed, freed);
+    reclaiming = 0;
+    return freed;
+}
+
+void shrinker_get_stats(struct shrinker_stats* out)
+{
+    *out = stats;
+}
+
+struct shrinker* shrinker_first()
+{
+    return shrinkers;
+}
+
+void shrinker_dump_stats()
+{
+    fprintf(stderr, "shrinker: %lu direct reclaims, %lu background reclaims, %lu skipped while busy, %lu pages reclaimed\n",
+            stats.direct_runs, stats.background_runs, stats.busy, stats.pages_reclaimed);
+
+    fprintf(stderr, "shrinker        direct  reclaimable      calls  reclaimed\n");
+    for(struct shrinker* shrinker = shrinkers; shrinker != null; shrinker = shrinker->next) {
+        fprintf(stderr, "%-14s  %6s  %11lu  %9lu  %9lu\n", shrinker->name, (shrinker->flags & SHRINKER_FLAG_DIRECT) ? "yes" : "no",
+                shrinker->count(shrinker), shrinker->calls, shrinker->pages_reclaimed);
+    }
+}
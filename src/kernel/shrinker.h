@@ -0,0 +1,41 @@
+#ifndef __SHRINKER_H__
+#define __SHRINKER_H__
+
+enum SHRINKER_FLAGS {
+    // the shrinker can run from inside palloc_claim, where the caller may be holding any lock. it only takes locks
+    // with try_lock (skipping whatever it can't get) or locks that are never held while allocating
+    SHRINKER_FLAG_DIRECT = (1 << 0),
+};
+
+// a cache that can give memory back under pressure. the structure belongs to the subsystem and has to live forever
+struct shrinker {
+    char const* name;
+    u64  (*count)(struct shrinker*);               // pages scan could free right now, can be approximate
+    u64  (*scan)(struct shrinker*, u64 nr_pages);  // free up to nr_pages and return how many were freed
+    u32  flags;                                    // enum SHRINKER_FLAGS
+    u32  unused0;
+
+    // maintained by the registry
+    struct shrinker* next;
+    u64 volatile calls;
+    u64 volatile pages_reclaimed;
+};
+
+struct shrinker_stats {
+    u64 direct_runs;      // reclaims from inside palloc_claim
+    u64 background_runs;  // reclaims from idle cpus
+    u64 busy;             // reclaims skipped because another cpu was already reclaiming
+    u64 pages_reclaimed;
+};
+
+void shrinker_register(struct shrinker*);
+
+// ask the shrinkers for nr_pages, split between them by how much each can free. direct only uses shrinkers with
+// SHRINKER_FLAG_DIRECT. only one cpu reclaims at a time, and the others get 0 back. returns the pages freed
+u64  shrinker_reclaim(u64 nr_pages, bool direct);
+
+void shrinker_get_stats(struct shrinker_stats*);
+struct shrinker* shrinker_first(); // walk the registry with ->next
+void shrinker_dump_stats();
+
+#endif
@@ -5,8 +5,10 @@
 #include "deque.h"
 #include "gdt.h"
 #include "hashtable.h"
+#include "heap.h"
 #include "hpet.h"
 #include "idt.h"
+#include "kalloc.h"
 #include "kernel.h"
 #include "paging.h"
 #include "palloc.h"
@@ -15,6 +17,7 @@
 #include "stdlib.h"
 #include "string.h"
 #include "task.h"
+#include "tlb.h"
 
 #define AP_BOOT_PAGE 8
 
@@ -64,9 +67,8 @@ void smp_init()
         _ap_boot_ack = false;
 
         // allocate stack, pointing to the end of memory
-        u64 stack_size;
-        _ap_boot_stack_bottom = task_allocate_stack((intp)null, &stack_size, false); // vmem=null means kernel virtual memory
-        *(u64*)&_ap_boot_stack_top = _ap_boot_stack_bottom + stack_size; // 4096*2^2 = 16KiB
+        _ap_boot_stack_bottom = task_allocate_stack((intp)null, TASK_STACK_ORDER, false); // vmem=null means kernel virtual memory
+        *(u64*)&_ap_boot_stack_top = _ap_boot_stack_bottom + (PAGE_SIZE << TASK_STACK_ORDER);
 
         // tell the bootstrap code what to use for the kernel page table
         *(u64*)&_ap_page_table = paging_get_cpu_table(PAGING_KERNEL);
@@ -74,7 +76,7 @@ void smp_init()
         // try to boot the cpu
         if(apic_boot_cpu(i, AP_BOOT_PAGE) < 0) {
             fprintf(stderr, "smp: couldn't boot cpu %d\n", i);
-            palloc_abandon((intp)&_ap_boot_stack_top, 2);
+            task_free_stack((intp)null, _ap_boot_stack_bottom, TASK_STACK_ORDER);
             continue;
         }
 
@@ -90,6 +92,9 @@ void smp_init()
 
     // gdt has to be fixed up to use _kernel_vma_base before switching the AP page tables and interrupts over to highmem
 //    _ap_gdt_fixup((intp)&_kernel_vma_base);
+
+    // every cpu has its double fault stack now. the APs load the idt after the all-go
+    idt_set_ist(8, IDT_DOUBLE_FAULT_IST);
     _ap_all_go = true;
 
     // enable the timer on the BSP too
@@ -125,6 +130,21 @@ static void _create_cpu(u8 cpu_index)
     cpu->tss_stack_bottom = palloc_claim(2); // allocate 16KiB for stack
     gdt_set_tss_rsp0(cpu->tss_stack_bottom + (1 << 14));
 
+    // double faults get a stack of their own, so that overflowing into a kernel stack's guard page can be reported
+    intp df_stack_bottom = palloc_claim(1);
+    gdt_set_tss_ist(IDT_DOUBLE_FAULT_IST, df_stack_bottom + (1 << 13));
+
+    // turn on pcids, if available
+    paging_init_cpu();
+
+    // create the page cache, kalloc magazines and heap cache for this cpu
+    palloc_init_cpu();
+    kalloc_init_cpu();
+    heap_init_cpu();
+
+    // and the stack cache for new tasks
+    task_init_cpu();
+
     // initialize the ipcall lock
     declare_ticketlock(lock_init);
     cpu->ipcall_lock = lock_init;
@@ -149,6 +169,7 @@ __noreturn void ap_main(u8 cpu_index)
 
     // save stack bottom
     cpu->current_task->stack_bottom = _ap_boot_stack_bottom;
+    cpu->current_task->stack_order = TASK_STACK_ORDER;
 
     // tell the BSP that we're ready and wait for the all-go signal
     _ap_boot_ack = true;
@@ -173,7 +194,10 @@ static void spinlock_acquire(struct spinlock* lock)
         if(__xchgb(&lock->_v, 1) == 0) return;
 
         // if the lock value was 1, wait until it's not
-        while(lock->_v) __pause_barrier();
+        while(lock->_v) {
+            tlb_poll();
+            __pause_barrier();
+        }
     }
 }
 
@@ -208,7 +232,10 @@ struct lock_functions spinlock_functions = {
 static void ticketlock_acquire(struct ticketlock* tkt)
 {
     u32 me = __atomic_xadd(&tkt->users, (u32)1);
-    while(tkt->ticket != me) __pause_barrier();
+    while(tkt->ticket != me) {
+        tlb_poll();
+        __pause_barrier();
+    }
 }
 
 static void ticketlock_release(struct ticketlock* tkt)
@@ -51,10 +51,18 @@ _task_switch_to:
     ; load new stack pointer
     mov rsp, [rsi+TASK_RSP_OFFSET]
 
-    ; load the task's page table
-    mov rax, [rsi+TASK_CR3_OFFSET];
+    ; load the task's page table, but only if it changes. writing cr3 flushes the TLB (or with pcids, serializes)
+    ; even when the value is the same. bit 63 (don't flush the pcid) is never set when reading cr3
+    mov rax, [rsi+TASK_CR3_OFFSET]
+    mov rdx, rax
+    btr rdx, 63
+    mov rcx, cr3
+    cmp rcx, rdx
+    je .same_cr3
     mov cr3, rax
 
+.same_cr3:
+
     ; set the global ticks value now that the process is running again
     mov rax, [rbp]
     mov [rsi+TASK_LAST_GLOBAL_TICKS_OFFSET], rax
@@ -4,8 +4,11 @@
 #include "cpu.h"
 #include "interrupts.h"
 #include "kernel.h"
+#include "kmem.h"
+#include "meminfo.h"
 #include "paging.h"
 #include "palloc.h"
+#include "shrinker.h"
 #include "task.h"
 #include "smp.h"
 #include "stdio.h"
@@ -13,13 +16,36 @@
 #include "string.h"
 #include "vmem.h"
 
-// log2 size of the stack (order for palloc) that is allocated to each task
-#define TASK_STACK_SIZE 2     // 2^2 = 4*4096 = 16KiB
+#define TASK_STACK_CACHE_SIZE 8 // ready kernel stacks of each order kept on each cpu
 
 #define TASK_PUSH_STACK(t,val) (t)->rsp -= sizeof(u64); *((u64*)(t)->rsp) = (u64)(val)
 
 static u64 next_task_id = (u64)-1;
 
+// tasks are constructed zeroed and linked to themselves, and task_free() puts them back that way
+static struct kmem_cache* task_cache;
+
+// kernel stacks that are still mapped, ready for the next task created on this cpu
+struct task_stack_cache {
+    u32  count[TASK_STACK_MAX_ORDER + 1];
+    intp stacks[TASK_STACK_MAX_ORDER + 1][TASK_STACK_CACHE_SIZE];
+};
+
+static struct task_stack_stats stack_stats;
+
+// Every cpu has a list of ready tasks for each priority level and a bitmap of the levels that have any, so finding
+// the next task to run is a bit scan and a list pop no matter how many tasks there are. Only ready (and new) tasks
+// are queued. The running task is taken out while it runs and goes to the back of its level when it yields, and
+// blocked and exited tasks are kept on their own lists. Run queues are only touched by their own cpu, with interrupts
+// disabled, and other cpus hand tasks over with an ipcall.
+struct task_run_queue {
+    u32  bitmap;    // bit n is set when levels[n] isn't empty
+    u32  num_ready;
+    struct task* volatile levels[TASK_PRIORITY_LEVELS];
+};
+
+static_assert(TASK_PRIORITY_LEVELS <= 32, "priority levels must fit in the bitmap");
+
 extern void _task_switch_to(struct task*, struct task*);
 extern void _task_entry_user(void);
 
@@ -28,11 +54,8 @@ extern void _task_entry_user(void);
 void task_become()
 {
     struct cpu* cpu = get_cpu();
-    struct task* task = (struct task*)malloc(sizeof(struct task));
-    zero(task);
-
-    // initialize the linked list to just point to itself
-    task->prev = task->next = task;
+    struct task* task = (struct task*)kmem_cache_alloc(task_cache);
+    meminfo_tag_alloc(MEMINFO_TAG_TASK, sizeof(struct task));
 
     // setup state
     task->task_id = __atomic_inc(&next_task_id);
@@ -67,10 +90,12 @@ static __noreturn void _task_entry_kernel()
     task_exit(task->entry(task));
 }
 
-struct task* task_create(task_entry_point_function* entry, intp userdata, bool is_user)
+// create a task. user tasks get a private address space, copied from parent's if it isn't null
+static struct task* _task_create(task_entry_point_function* entry, intp userdata, bool is_user, struct task* parent, u8 stack_order)
 {
-    struct task* task = (struct task*)malloc(sizeof(struct task));
-    zero(task);
+    struct task* task = (struct task*)kmem_cache_alloc(task_cache);
+    assert(task != null, "out of memory");
+    meminfo_tag_alloc(MEMINFO_TAG_TASK, sizeof(struct task));
 
     // assign the task id
     task->task_id = __atomic_inc(&next_task_id);
@@ -81,14 +106,12 @@ struct task* task_create(task_entry_point_function* entry, intp userdata, bool i
     task->entry = entry;
     task->userdata = userdata;
 
-    // default to looping to itself
-    task->prev = task->next = task;
-
     // set up the task's page table (kernel page table if kernel task, new one otherwise)
     if(is_user) {
         task->flags |= TASK_FLAG_USER;
         task->page_table = paging_create_private_table();
-        task->vmem = vmem_create_private_memory(task->page_table);
+        if(parent != null && parent->vmem != 0) task->vmem = vmem_clone_private_memory(parent->vmem, task->page_table);
+        else                                   task->vmem = vmem_create_private_memory(task->page_table);
     } else {
         task->page_table = paging_get_kernel_page_table();
     }
@@ -101,9 +124,9 @@ struct task* task_create(task_entry_point_function* entry, intp userdata, bool i
     task->rflags = __saveflags() & ~(1 << 9); // IF (interrupt enable flag) is bit 9. Section 3.4.3 of Volume 1 Software Development Manual
 
     // allocate stack, and set RSP to the top of the stack
-    u64 stack_size;
-    task->stack_bottom = task_allocate_stack(task->vmem, &stack_size, is_user);
-    task->rsp = (u64)task->stack_bottom + stack_size;
+    task->stack_order = stack_order;
+    task->stack_bottom = task_allocate_stack(task->vmem, stack_order, is_user);
+    task->rsp = (u64)task->stack_bottom + (PAGE_SIZE << stack_order);
 
     // we don't need to initialize the 6 registers (r15, r14, r13, r12, rbp, rbx) on the new task's stack
     // since they're already zero from task_allocate_stack. we just need to move the stack pointer to
@@ -113,37 +136,296 @@ struct task* task_create(task_entry_point_function* entry, intp userdata, bool i
     return task;
 }
 
-intp task_allocate_stack(intp vmem, u64* stack_size, bool is_user)
+struct task* task_create(task_entry_point_function* entry, intp userdata, bool is_user)
+{
+    return _task_create(entry, userdata, is_user, null, TASK_STACK_ORDER);
+}
+
+struct task* task_create_with_stack(task_entry_point_function* entry, intp userdata, bool is_user, u8 stack_order)
+{
+    return _task_create(entry, userdata, is_user, null, stack_order);
+}
+
+struct task* task_clone(task_entry_point_function* entry, intp userdata)
+{
+    return _task_create(entry, userdata, true, get_cpu()->current_task, TASK_STACK_ORDER);
+}
+
+static void _task_ctor(void* object)
+{
+    struct task* task = (struct task*)object;
+    zero(task);
+
+    // the linked list starts out pointing to itself
+    task->prev = task->next = task;
+}
+
+// unmap the stack, release the region along with the guard page, and free the physical pages used for it
+static void _release_stack(intp vmem, intp stack_bottom, u8 order)
+{
+    u64 npages = 1 << order;
+    intp phys = vmem_unmap_pages_at(vmem, stack_bottom, npages);
+    vmem_free_region(vmem, stack_bottom - PAGE_SIZE, npages + 1);
+    palloc_abandon(phys, order);
+    meminfo_tag_free(MEMINFO_TAG_TASK, npages * PAGE_SIZE);
+}
+
+// the stack caches give their stacks back under memory pressure. each cpu only touches its own cache, so this frees
+// the stacks of the cpu that's reclaiming, and since freeing a stack takes the vmem lock it's never run directly from
+// inside palloc_claim
+static u64 _stack_shrinker_count(struct shrinker* shrinker)
+{
+    unused(shrinker);
+
+    u64 cpu_flags = __cli_saveflags();
+    struct task_stack_cache* cache = get_cpu()->task_stack_cache;
+    u64 pages = 0;
+    if(cache != null) {
+        for(u8 order = 0; order <= TASK_STACK_MAX_ORDER; order++) pages += (u64)cache->count[order] << order;
+    }
+    __restoreflags(cpu_flags);
+
+    return pages;
+}
+
+static u64 _stack_shrinker_scan(struct shrinker* shrinker, u64 nr_pages)
 {
-    intp ret = palloc_claim(TASK_STACK_SIZE);
+    unused(shrinker);
+
+    u64 freed = 0;
+    for(s8 order = TASK_STACK_MAX_ORDER; order >= 0 && freed < nr_pages; order--) {
+        while(freed < nr_pages) {
+            u64 cpu_flags = __cli_saveflags();
+            struct task_stack_cache* cache = get_cpu()->task_stack_cache;
+            intp stack_bottom = (cache != null && cache->count[order] > 0) ? cache->stacks[order][--cache->count[order]] : 0;
+            __restoreflags(cpu_flags);
+
+            if(stack_bottom == 0) break;
+            _release_stack(VMEM_KERNEL, stack_bottom, order);
+            freed += 1 << order;
+        }
+    }
+
+    return freed;
+}
 
-    // palloc addresses are identity mapped, so we can safely clear the stack here
-    memset64((void*)ret, 0, (1ULL << (TASK_STACK_SIZE + PAGE_SHIFT - 3)));
+static struct shrinker stack_shrinker = {
+    .name  = "task-stacks",
+    .count = _stack_shrinker_count,
+    .scan  = _stack_shrinker_scan,
+    .flags = 0,
+};
+
+void task_init()
+{
+    task_cache = kmem_cache_create("task", sizeof(struct task), 0, _task_ctor);
+    shrinker_register(&stack_shrinker);
+}
+
+void task_init_cpu()
+{
+    struct cpu* cpu = get_cpu();
+    assert(cpu->task_stack_cache == null, "only call task_init_cpu once per cpu");
+
+    struct task_run_queue* rq = (struct task_run_queue*)malloc(sizeof(struct task_run_queue));
+    zero(rq);
+    cpu->run_queue = rq;
+
+    struct task_stack_cache* cache = (struct task_stack_cache*)malloc(sizeof(struct task_stack_cache));
+    zero(cache);
+    cpu->task_stack_cache = cache;
+}
+
+// stacks start out zeroed, so the lowest word that isn't zero is as deep as the stack has gone. zeros stored at the
+// very deepest point are missed, which under-reports by a few words at most
+static u64 _stack_used(intp stack_bottom, u64 size)
+{
+    u64* words = (u64*)stack_bottom;
+    u64 count = size / sizeof(u64);
 
-    // map the stack into virtual memory
+    u64 i = 0;
+    while(i < count && words[i] == 0) i++;
+    return (count - i) * sizeof(u64);
+}
+
+intp task_allocate_stack(intp vmem, u8 order, bool is_user)
+{
+    assert(order <= TASK_STACK_MAX_ORDER, "stack order too large");
+
+    // kernel stacks are all in the same address space, so any cpu can reuse one
+    if(vmem == VMEM_KERNEL && smp_ready()) {
+        u64 cpu_flags = __cli_saveflags();
+        struct task_stack_cache* cache = get_cpu()->task_stack_cache;
+        if(cache->count[order] > 0) {
+            intp ret = cache->stacks[order][--cache->count[order]];
+            __restoreflags(cpu_flags);
+            __atomic_inc(&stack_stats.cache_hits[order]);
+            return ret;
+        }
+        __restoreflags(cpu_flags);
+    }
+
+    // the stack starts out zeroed, usually by an idle cpu ahead of time
+    u64 npages = 1 << order;
+    intp phys = palloc_claim_flags(order, PALLOC_ZERO);
+
+    // reserve one more page than needed and leave the lowest one unmapped, so that overflowing the stack faults
+    // instead of running into whatever is below it
+    intp region = vmem_alloc_region(vmem, npages + 1);
     u32 map_flags = MAP_PAGE_FLAG_WRITABLE;
     if(is_user) map_flags |= MAP_PAGE_FLAG_USER;
-    ret = vmem_map_pages(vmem, ret, 1 << TASK_STACK_SIZE, map_flags);
+    vmem_map_pages_at(vmem, phys, region + PAGE_SIZE, npages, map_flags);
 
-    *stack_size = (1 << TASK_STACK_SIZE) * PAGE_SIZE;
+    __atomic_inc(&stack_stats.allocated[order]);
+    meminfo_tag_alloc(MEMINFO_TAG_TASK, npages * PAGE_SIZE);
+    return region + PAGE_SIZE;
+}
+
+void task_free_stack(intp vmem, intp stack_bottom, u8 order)
+{
+    u64 npages = 1 << order;
+
+    // user stacks aren't mapped in the current address space, so only kernel stacks are measured and cached
+    if(vmem == VMEM_KERNEL) {
+        u64 used = _stack_used(stack_bottom, npages * PAGE_SIZE);
+
+        __atomic_inc(&stack_stats.freed[order]);
+        __atomic_add(&stack_stats.total_used[order], used);
+
+        u64 max_used;
+        while((max_used = stack_stats.max_used[order]) < used) {
+            if(__compare_and_exchange(&stack_stats.max_used[order], max_used, used) == max_used) break;
+        }
 
-    return ret;
+        if(smp_ready()) {
+            u64 cpu_flags = __cli_saveflags();
+            struct task_stack_cache* cache = get_cpu()->task_stack_cache;
+            if(cache->count[order] < TASK_STACK_CACHE_SIZE) {
+                // only the part that was written needs clearing for the stack to be zero (and measurable) again
+                memset64(stack_bottom + npages * PAGE_SIZE - used, 0, used / sizeof(u64));
+                cache->stacks[order][cache->count[order]++] = stack_bottom;
+                __restoreflags(cpu_flags);
+                return;
+            }
+            __restoreflags(cpu_flags);
+        }
+    }
+
+    _release_stack(vmem, stack_bottom, order);
 }
 
 void task_free(struct task* task)
 {
     if(task->stack_bottom != 0) { // the boot threads use stacks that are in .bss, and this is set to 0
-        // unmap the stack, and free the physical pages used for it
-        intp phys = vmem_unmap_pages(task->vmem, task->stack_bottom, 1 << TASK_STACK_SIZE);
-        palloc_abandon(phys, TASK_STACK_SIZE);
+        task_free_stack(task->vmem, task->stack_bottom, task->stack_order);
+    }
+
+    // a user task's stack lives in its private address space, so that goes after it. dropping the address space
+    // also drops its references to pages shared copy-on-write with the parent
+    if(task->flags & TASK_FLAG_USER) {
+        vmem_destroy_private_memory(task->vmem);
+        paging_destroy_private_table(task->page_table);
     }
 
-    free(task);
+    meminfo_tag_free(MEMINFO_TAG_TASK, sizeof(struct task));
+    _task_ctor(task);
+    kmem_cache_free(task_cache, task);
 }
 
-void task_set_priority(s8 priority)
+u64 task_stack_used(struct task* task)
 {
-    get_cpu()->current_task->priority = priority;
+    if(task->stack_bottom == 0) return 0;
+
+    // a user task's stack is only mapped while its address space is loaded
+    if(task->vmem != VMEM_KERNEL && task != get_cpu()->current_task) return 0;
+
+    return _stack_used(task->stack_bottom, PAGE_SIZE << task->stack_order);
+}
+
+bool task_is_stack_guard(intp address)
+{
+    if(!smp_ready()) return false;
+
+    struct task* task = get_cpu()->current_task;
+    if(task == null || task->stack_bottom == 0) return false;
+
+    return address >= (intp)task->stack_bottom - PAGE_SIZE && address < (intp)task->stack_bottom;
+}
+
+void task_get_stack_stats(struct task_stack_stats* stats)
+{
+    *stats = stack_stats;
+}
+
+void task_dump_stack_stats()
+{
+    struct task_stack_stats stats;
+    task_get_stack_stats(&stats);
+
+    for(u8 order = 0; order <= TASK_STACK_MAX_ORDER; order++) {
+        if(stats.allocated[order] == 0 && stats.cache_hits[order] == 0) continue;
+
+        fprintf(stderr, "task: %luKiB stacks: %lu allocated, %lu from cache, %lu freed\n", (PAGE_SIZE << order) >> 10,
+                stats.allocated[order], stats.cache_hits[order], stats.freed[order]);
+        if(stats.freed[order] != 0) {
+            fprintf(stderr, "task: %luKiB stacks: avg %lu bytes used, high-water mark %lu bytes\n", (PAGE_SIZE << order) >> 10,
+                    stats.total_used[order] / stats.freed[order], stats.max_used[order]);
+        }
+    }
+}
+
+static inline u8 _priority_level(s8 priority)
+{
+    return (u8)(priority - TASK_PRIORITY_MIN);
+}
+
+// the run queue helpers are called with interrupts disabled
+static void _run_queue_push(struct task_run_queue* rq, struct task* task)
+{
+    u8 level = _priority_level(task->priority);
+    task_enqueue(&rq->levels[level], task);
+    rq->bitmap |= 1U << level;
+    rq->num_ready++;
+    task->flags |= TASK_FLAG_QUEUED;
+}
+
+static void _run_queue_remove(struct task_run_queue* rq, struct task* task)
+{
+    u8 level = _priority_level(task->priority);
+    task_dequeue(&rq->levels[level], task);
+    if(rq->levels[level] == null) rq->bitmap &= ~(1U << level);
+    rq->num_ready--;
+    task->flags &= ~TASK_FLAG_QUEUED;
+}
+
+// take the task at the front of the highest level that has one
+static struct task* _run_queue_pop(struct task_run_queue* rq)
+{
+    if(rq->bitmap == 0) return null;
+
+    struct task* task = rq->levels[31 - __builtin_clz(rq->bitmap)];
+    _run_queue_remove(rq, task);
+    return task;
+}
+
+void task_set_priority(struct task* task, s8 priority)
+{
+    assert(priority >= TASK_PRIORITY_MIN && priority <= TASK_PRIORITY_MAX, "priority out of range");
+
+    u64 cpu_flags = __cli_saveflags();
+
+    // a queued task moves to the back of its new level
+    if((task->flags & TASK_FLAG_QUEUED) != 0) {
+        struct cpu* cpu = get_cpu();
+        assert(task->cpu == cpu, "queued task is on another cpu");
+        _run_queue_remove(cpu->run_queue, task);
+        task->priority = priority;
+        _run_queue_push(cpu->run_queue, task);
+    } else {
+        task->priority = priority;
+    }
+
+    __restoreflags(cpu_flags);
 }
 
 void task_set_preemtable(struct task* task, bool preemptable)
@@ -152,6 +434,15 @@ void task_set_preemtable(struct task* task, bool preemptable)
     else            task->flags |= TASK_FLAG_NOT_PREEMPTABLE;
 }
 
+void task_enqueue_ready(struct task* new_task)
+{
+    assert(new_task->state == TASK_STATE_NEW || new_task->state == TASK_STATE_READY, "only ready tasks can be queued");
+
+    u64 cpu_flags = __cli_saveflags();
+    _run_queue_push(get_cpu()->run_queue, new_task);
+    __restoreflags(cpu_flags);
+}
+
 void task_enqueue_for(u32 target_cpu_index, struct task* new_task)
 {
     // wake up the other cpu and tell it to add the task to its running queue
@@ -209,39 +500,14 @@ void task_dequeue(struct task* volatile* task_queue, struct task* task)
     __restoreflags(cpu_flags);
 }
 
-static struct task* _select_next_task(struct task* start)
+// move tasks that task_unblock() set aside into the run queue. called with interrupts disabled
+static void _queue_unblocked(struct cpu* cpu)
 {
-    if(start == null) return null;
-
-    // current task will never be null if we get there from a task switch
-    // so start looking through the list for a next valid task
-
-    // simple round robin algorithm finds the next task that is runnable
-    struct task* next_task = start;
-    while(next_task != start->prev) {
-        // skip low priority tasks, and tasks that aren't runnable
-        if(next_task->priority >= 0 && (next_task->state == TASK_STATE_NEW || next_task->state == TASK_STATE_READY)) {
-            return next_task;
-        }
-
-        next_task = next_task->next;
-    }
-
-    // if we get here then no task other than the current task was valid, so we have to check 
-    // if the current task is still runnable
-    if(next_task->state == TASK_STATE_NEW || next_task->state == TASK_STATE_READY) {
-        // if the current task has a low priority, but so does the next one, move onto the next one
-        // this simple move-forward move will allow all low priority tasks to get a chance when no
-        // other normal priority tasks exist. It also doesn't matter if next_task->next == next_task,
-        // since it'll just be the same result either way
-        if(next_task->priority < 0 && next_task->next->priority < 0) return next_task->next;
-
-        // otherwise, current task will do
-        return next_task;
+    while(cpu->unblocked_task != null) {
+        struct task* unblocked_task = cpu->unblocked_task;
+        task_dequeue(&cpu->unblocked_task, unblocked_task);
+        _run_queue_push(cpu->run_queue, unblocked_task);
     }
-
-    // no tasks found, go idle
-    return null;
 }
 
 void task_yield(enum TASK_YIELD_REASON reason)
@@ -292,64 +558,50 @@ void task_yield(enum TASK_YIELD_REASON reason)
         break;
     }
 
-    // it's now safe to transfer unblocked tasks to the running task pool
-    while(cpu->unblocked_task != null) {
-        struct task* unblocked_task = cpu->unblocked_task;
-        task_dequeue(&cpu->unblocked_task, unblocked_task);
-        task_enqueue(&cpu->current_task, unblocked_task);
-    }
+    // it's now safe to transfer unblocked tasks to the run queue
+    struct task_run_queue* rq = cpu->run_queue;
+    _queue_unblocked(cpu);
 
-    // if the current task has exited or otherwise can't continue running, remove it from the running list
-    struct task* to_task;
+    // put the current task wherever its new state belongs
     switch(from_task->state) {
     case TASK_STATE_EXITED:
-        task_dequeue(&cpu->current_task, from_task);
-
         // when a task exits, we must have it to be freed later. if it is freed now, the stack *that we're currently using*
         // will be released to palloc, and very likely get destroyed. thus, all processors must have a cleanup task that occassionally runs
-        // see task_idle_forever()
+        // see task_clean()
         task_enqueue(&cpu->exited_task, from_task);
-
-        // select the next task starting with the next task
-        to_task = _select_next_task(cpu->current_task);
         break;
 
     case TASK_STATE_BLOCKED: // move blocked tasks to the blocked task wait list
-        task_dequeue(&cpu->current_task, from_task);
         task_enqueue(&cpu->blocked_task, from_task);
-
-        // select next task as normal
-        to_task = _select_next_task(cpu->current_task);
         break;
 
-    default: // the current task can continue running, so we select starting at the next task
-        to_task = _select_next_task(cpu->current_task->next);
+    default: // the current task can continue running, after the others at its level have had a turn
+        _run_queue_push(rq, from_task);
         break;
     }
 
+    struct task* to_task = _run_queue_pop(rq);
+
     // when all tasks are blocked (there's always at least a kernel work thread on each cpu),
     // then we may have a situation where to_task is null and we can't switch to any task
-    // so we have to enable interrupts so that IPIs can unblock tasks
-    if(to_task == null) { // will only happen when cpu->current_task set is empty
-        assert(cpu->current_task == null, "there must be no runnable tasks for this to happen");
+    // so we have to enable interrupts so that IPIs can unblock or enqueue tasks
+    if(to_task == null) {
+        // there's a chance we get preempted while waiting, but with current_task null task_yield() will do nothing
+        cpu->current_task = null;
 
         u32 cpu_flags = __sti_saveflags(); // shadows parent cpu_flags
-        while((to_task = cpu->unblocked_task) == null) { // we wait here until a task becomes unblocked
-            // there's a chance we get preempted here, but current_task will be null, where task_yield() will do nothing
-            __pause_barrier();
-        }
+        while(cpu->unblocked_task == null && rq->bitmap == 0) __pause_barrier();
         __restoreflags(cpu_flags);
 
-        // just move one unblocked task for now
-        task_dequeue(&cpu->unblocked_task, to_task);
-        task_enqueue(&cpu->current_task, to_task);
-        // ... and let to_task become the current task
-        assert(to_task->state == TASK_STATE_READY, "unblocked task must be in ready state");
+        _queue_unblocked(cpu);
+        to_task = _run_queue_pop(rq);
+        assert(to_task != null, "a task must be ready after waiting");
     }
 
     // now have a task, switch to it
     cpu->current_task = to_task;
     cpu->current_task->state = TASK_STATE_RUNNING;
+    to_task->cr3 = paging_prepare_table_switch(from_task->page_table, to_task->page_table); // picks the pcid and tracks cpus for tlb shootdowns
     _task_switch_to(from_task, to_task);
 
     goto resume_task;
@@ -370,8 +622,7 @@ void task_unblock(struct task* task)
         u64 cpu_flags = __cli_saveflags();
         task_dequeue(&cpu->blocked_task, task);
 
-        // it's not safe to put unblocked tasks directly in the current queue, because
-        // the current queue could be empty and we may be waiting in task_wait_for_task()
+        // unblocked tasks are set aside and moved into the run queue by the next task_yield()
         task->state = TASK_STATE_READY;
         task_enqueue(&cpu->unblocked_task, task);
         __restoreflags(cpu_flags);
@@ -3,6 +3,10 @@
 
 typedef s64 (task_entry_point_function)();
 
+// task stacks are 2^order pages with an unmapped guard page below them
+#define TASK_STACK_ORDER     2  // default stack for task_create, 2^2 = 4*4096 = 16KiB
+#define TASK_STACK_MAX_ORDER 4  // largest stack, 64KiB
+
 enum TASK_STATE {
     TASK_STATE_NEW = 0,   // task has been created but has not run once yet
     TASK_STATE_EXITED,    // task has exited but structure is still valid
@@ -14,8 +18,14 @@ enum TASK_STATE {
 enum TASK_FLAGS {
     TASK_FLAG_USER            = 1 << 0,
     TASK_FLAG_NOT_PREEMPTABLE = 1 << 1,
+    TASK_FLAG_QUEUED          = 1 << 2, // in its cpu's run queue
 };
 
+// higher priorities always run first, and tasks of the same priority take turns. new tasks start at 0
+#define TASK_PRIORITY_MIN    -16
+#define TASK_PRIORITY_MAX    15
+#define TASK_PRIORITY_LEVELS (TASK_PRIORITY_MAX - TASK_PRIORITY_MIN + 1)
+
 struct page_table;
 struct task {
     ////////////////////////////////////////////////////////////////////////////
@@ -59,7 +69,7 @@ struct task {
 
     u64  return_value;
 
-    u8   padding0;
+    u8   stack_order;
     s8   priority;
     u16  padding1;
     u32  padding2;
@@ -73,9 +83,46 @@ struct task {
 
 void task_become();
 struct task* task_create(task_entry_point_function*, intp, bool); 
-intp task_allocate_stack(intp, u64*, bool);
+
+// like task_create, but with a stack of 2^stack_order pages instead of TASK_STACK_ORDER
+struct task* task_create_with_stack(task_entry_point_function*, intp, bool, u8 stack_order);
+
+// create a user task whose private memory is a copy-on-write clone of the current task's. only demand paged
+// (lazy) regions are inherited, so this costs what the current task has touched rather than what it has reserved
+struct task* task_clone(task_entry_point_function*, intp);
+
+// allocate a stack of 2^order pages in vmem and return its bottom. kernel stacks come out of a per-cpu cache
+// of stacks that are already mapped when one is available
+intp task_allocate_stack(intp vmem, u8 order, bool is_user);
+
+// give back a stack from task_allocate_stack, recording how deep it was used
+void task_free_stack(intp vmem, intp stack_bottom, u8 order);
 void task_free(struct task*);
 
+// create the object cache for struct task
+void task_init();
+
+// create the run queue and stack cache for the current cpu
+void task_init_cpu();
+
+// how much of each stack size tasks have actually used, to size stacks from measurements
+struct task_stack_stats {
+    u64 allocated[TASK_STACK_MAX_ORDER + 1];   // stacks newly allocated and mapped
+    u64 cache_hits[TASK_STACK_MAX_ORDER + 1];  // stacks reused from a per-cpu cache
+    u64 freed[TASK_STACK_MAX_ORDER + 1];
+    u64 total_used[TASK_STACK_MAX_ORDER + 1];  // sum of the bytes used by each freed stack
+    u64 max_used[TASK_STACK_MAX_ORDER + 1];    // high-water mark in bytes
+};
+
+void task_get_stack_stats(struct task_stack_stats*);
+void task_dump_stack_stats();
+
+// bytes of the task's stack that have been written to so far
+u64 task_stack_used(struct task*);
+
+// true if address is in the guard page below the current task's stack
+bool task_is_stack_guard(intp address);
+
 // yield from the current task and switch to the next one
 enum TASK_YIELD_REASON {
     TASK_YIELD_PREEMPT,
@@ -84,7 +131,8 @@ enum TASK_YIELD_REASON {
     TASK_YIELD_WAIT_CONDITION
 };
 
-void task_set_priority(s8);
+// a task that's waiting in a run queue can only have its priority changed from the cpu it's queued on
+void task_set_priority(struct task*, s8);
 void task_set_preemtable(struct task*, bool);
 
 void task_yield(enum TASK_YIELD_REASON);
@@ -96,8 +144,12 @@ __noreturn void task_exit(s64);
 // notify that a task can be unblocked, this will often happen on a different cpu
 void task_unblock(struct task*);
 
-void task_enqueue(struct task* volatile*, struct task*);
+// make a new task runnable on the current cpu, or on another one with task_enqueue_for
+void task_enqueue_ready(struct task*);
 void task_enqueue_for(u32, struct task*);
+
+// the circular task lists used for the run queue levels and the exited and blocked tasks
+void task_enqueue(struct task* volatile*, struct task*);
 void task_dequeue(struct task* volatile*, struct task*);
 
 #endif
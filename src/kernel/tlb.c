@@ -0,0 +1,311 @@
+// tlb - invalidating stale translations on every cpu after page table entries are removed
+//
+// Clearing a page table entry doesn't remove the translation from the TLB of any cpu that has used it, so every
+// unmap has to be followed by an invalidation on each cpu that might still have the entry cached. Callers collect
+// the pages they've unmapped into a tlb_batch and finish it once, so unmapping a large range costs one round of
+// IPIs instead of one per page.
+//
+// Each page table keeps a mask of the cpus that have it loaded (see paging_prepare_table_switch()). Addresses in
+// the kernel half and in pml4 entry 0 are shared by every table, so batches touching those go to every running
+// cpu. Each target gets a request pushed onto a lock-free list in its struct cpu followed by an IPI. The target
+// invalidates the ranges (or flushes everything when there are too many pages) and decrements the initiator's pending
+// counter. While waiting, the initiator services its own request list, and lock spin loops do the same through
+// tlb_poll(), so a cpu that is stuck waiting with interrupts disabled still answers.
+//
+// With pcids, a cpu keeps the translations of address spaces it has switched away from, so it stays in their masks
+// and invalidates by pcid. When its pcid for a table has been retired it has nothing left to invalidate, and leaves
+// the table's mask instead, so it isn't sent any more IPIs for it. Shared addresses are mapped global, which invlpg
+// removes no matter the pcid.
+
+#include "common.h"
+
+#include "apic.h"
+#include "cpu.h"
+#include "hpet.h"
+#include "kernel.h"
+#include "paging.h"
+#include "smp.h"
+#include "stdio.h"
+#include "tlb.h"
+
+// verbosity levels 1 or 2
+#define TLB_VERBOSE 0
+
+#define TLB_MAX_CPUS       64
+#define TLB_ACK_TIMEOUT_US 1000000
+
+struct tlb_shootdown {
+    struct tlb_batch* batch;
+    u32 volatile      pending;
+    u32               unused0;
+};
+
+struct tlb_request {
+    struct tlb_request*   next;
+    struct tlb_shootdown* shootdown;
+};
+
+static struct tlb_stats tlb_stats = { 0, };
+
+void tlb_batch_init(struct tlb_batch* batch, struct page_table* page_table)
+{
+    batch->page_table = page_table;
+    batch->num_ranges = 0;
+    batch->num_pages  = 0;
+    batch->shared     = (page_table == paging_get_kernel_page_table());
+    batch->flush_all  = false;
+    batch->freed_tables = null;
+}
+
+void tlb_batch_add(struct tlb_batch* batch, intp virt, u32 page_shift)
+{
+    // pml4 entry 0 and the kernel half are the same in every table
+    u32 pml4_index = (virt >> 39) & 0x1FF;
+    if(pml4_index == 0 || pml4_index >= 256) batch->shared = true;
+
+    batch->num_pages++;
+    if(batch->flush_all) return;
+
+    // extend the last range if this page directly follows it
+    if(batch->num_ranges > 0) {
+        __typeof__(batch->ranges[0])* last = &batch->ranges[batch->num_ranges - 1];
+        if(last->shift == page_shift && last->base + ((intp)last->count << page_shift) == virt) {
+            last->count++;
+            return;
+        }
+    }
+
+    if(batch->num_ranges == TLB_BATCH_MAX_RANGES) {
+        batch->flush_all = true;
+        return;
+    }
+
+    batch->ranges[batch->num_ranges].base  = virt;
+    batch->ranges[batch->num_ranges].count = 1;
+    batch->ranges[batch->num_ranges].shift = page_shift;
+    batch->num_ranges++;
+}
+
+// global translations stay in the TLB across cr3 writes, so flushing everything means toggling CR4.PGE
+static void _flush_global()
+{
+    u64 cr4 = __rdcr4();
+    __wrcr4(cr4 & ~CR4_PGE);
+    __wrcr4(cr4);
+}
+
+static void _invlpg_ranges(struct tlb_batch* batch)
+{
+    for(u32 i = 0; i < batch->num_ranges; i++) {
+        intp virt = batch->ranges[i].base;
+        for(u32 j = 0; j < batch->ranges[i].count; j++) {
+            __invlpg(virt);
+            virt += (intp)1 << batch->ranges[i].shift;
+        }
+    }
+}
+
+// with pcids, translations for other address spaces stay cached after switching away from them, so invalidation has
+// to name the pcid. shared addresses are all mapped global, and invlpg removes global translations from every pcid
+static void _invalidate_local_pcid(struct tlb_batch* batch)
+{
+    bool full = batch->flush_all || batch->num_pages > TLB_FULL_FLUSH_THRESHOLD;
+
+    if(batch->shared) {
+        // removed page tables can be in the paging-structure caches of any pcid
+        if(full || batch->freed_tables != null) {
+            __invpcid(INVPCID_ALL_CONTEXTS_GLOBAL, 0, 0);
+            __atomic_inc(&tlb_stats.full_flushes);
+        } else {
+            _invlpg_ranges(batch);
+            __atomic_add(&tlb_stats.pages_invalidated, batch->num_pages);
+        }
+        return;
+    }
+
+    // the pcid was recycled, which already flushed it. the cpu rejoins the mask when it switches to the table again
+    if(paging_forget_stale_pcid(batch->page_table)) return;
+
+    s32 pcid = paging_get_pcid(batch->page_table);
+
+    if(full || batch->freed_tables != null) {
+        __invpcid(INVPCID_SINGLE_CONTEXT, (u16)pcid, 0);
+        __atomic_inc(&tlb_stats.full_flushes);
+        return;
+    }
+
+    for(u32 i = 0; i < batch->num_ranges; i++) {
+        intp virt = batch->ranges[i].base;
+        for(u32 j = 0; j < batch->ranges[i].count; j++) {
+            __invpcid(INVPCID_ADDRESS, (u16)pcid, virt);
+            virt += (intp)1 << batch->ranges[i].shift;
+        }
+    }
+
+    __atomic_add(&tlb_stats.pages_invalidated, batch->num_pages);
+}
+
+// invalidate the batch on the current cpu
+static void _invalidate_local(struct tlb_batch* batch)
+{
+    // before smp only the kernel table has ever been loaded, and invlpg covers its pcid
+    if(paging_has_pcid() && smp_ready()) {
+        _invalidate_local_pcid(batch);
+        return;
+    }
+
+    // a full flush is cheaper than a long run of invlpgs. reloading cr3 only drops non-global translations
+    if(batch->flush_all || batch->num_pages > TLB_FULL_FLUSH_THRESHOLD) {
+        if(batch->shared) _flush_global();
+        else              __wrcr3(__rdcr3());
+        __atomic_inc(&tlb_stats.full_flushes);
+        return;
+    }
+
+    // invlpg also drops all of the paging-structure caches, which covers freed page tables
+    _invlpg_ranges(batch);
+    __atomic_add(&tlb_stats.pages_invalidated, batch->num_pages);
+}
+
+// run every shootdown request queued for this cpu
+static void _process_requests(struct cpu* cpu)
+{
+    struct tlb_request* req = (struct tlb_request*)__xchgq((u64*)&cpu->tlb_requests, (u64)null);
+
+    while(req != null) {
+        // the request lives on the initiator's stack and is gone as soon as pending reaches zero
+        struct tlb_request* next = req->next;
+        struct tlb_shootdown* sd = req->shootdown;
+
+        _invalidate_local(sd->batch);
+        __atomic_dec(&sd->pending);
+
+        req = next;
+    }
+}
+
+void tlb_notify_shootdown_interrupt()
+{
+    _process_requests(get_cpu());
+}
+
+void tlb_poll()
+{
+    if(!smp_ready()) return;
+
+    struct cpu* cpu = get_cpu();
+    if(cpu->tlb_requests != null) _process_requests(cpu);
+}
+
+void tlb_batch_finish(struct tlb_batch* batch)
+{
+    if(batch->num_pages == 0) return;
+
+    // before the APs are running there's nobody else to tell
+    if(!smp_ready()) {
+        _invalidate_local(batch);
+        __atomic_inc(&tlb_stats.local_flushes);
+        tlb_batch_init(batch, batch->page_table);
+        return;
+    }
+
+    u64 flags = __cli_saveflags();
+    struct cpu* cpu = get_cpu();
+
+    // make sure the cleared page table entries are visible before reading which cpus use the table. a cpu that
+    // loads the table after this point can only see the new entries
+    __sync_synchronize();
+
+    u64 cpu_mask;
+    u32 num_cpus = apic_num_local_apics();
+    if(batch->shared) {
+        cpu_mask = (num_cpus >= TLB_MAX_CPUS) ? (u64)-1 : ((1ULL << num_cpus) - 1);
+    } else {
+        cpu_mask = paging_get_cpu_mask(batch->page_table);
+    }
+
+    // the current cpu only needs to invalidate if it has the table loaded
+    bool local = (cpu_mask & (1ULL << cpu->cpu_index)) != 0;
+    cpu_mask &= ~(1ULL << cpu->cpu_index);
+
+    if(cpu_mask == 0) {
+        if(local) _invalidate_local(batch);
+        __atomic_inc(&tlb_stats.local_flushes);
+        __restoreflags(flags);
+        tlb_batch_init(batch, batch->page_table);
+        return;
+    }
+
+    struct tlb_shootdown sd = { .batch = batch, .pending = 0 };
+    struct tlb_request requests[TLB_MAX_CPUS];
+    u64 start = __rdtsc();
+
+    // count the targets first so that no ack can bring pending to zero before every request has been sent
+    for(u32 i = 0; i < num_cpus && i < TLB_MAX_CPUS; i++) {
+        if(!(cpu_mask & (1ULL << i))) continue;
+        if(apic_get_cpu(i) == null) cpu_mask &= ~(1ULL << i);
+        else sd.pending++;
+    }
+
+    for(u32 i = 0; i < num_cpus && i < TLB_MAX_CPUS; i++) {
+        if(!(cpu_mask & (1ULL << i))) continue;
+
+        struct cpu* target = apic_get_cpu(i);
+        struct tlb_request* req = &requests[i];
+        req->shootdown = &sd;
+
+        // push onto the target's list
+        struct tlb_request* head;
+        do {
+            head = target->tlb_requests;
+            req->next = head;
+        } while(__compare_and_exchange(&target->tlb_requests, head, req) != head);
+
+        apic_send_tlb_shootdown(i);
+        __atomic_inc(&tlb_stats.ipis_sent);
+    }
+
+    // do our own invalidation while the IPIs are in flight
+    if(local) _invalidate_local(batch);
+
+    u64 timer_start = timer_now();
+    while(sd.pending != 0) {
+        // someone could be waiting on us with interrupts disabled
+        _process_requests(cpu);
+        __pause_barrier();
+        assert(timer_since(timer_start) < TLB_ACK_TIMEOUT_US, "tlb shootdown was never acknowledged");
+    }
+
+    u64 cycles = __rdtsc() - start;
+    __atomic_inc(&tlb_stats.shootdowns);
+    __atomic_add(&tlb_stats.total_cycles, cycles);
+
+    u64 max_cycles;
+    while((max_cycles = tlb_stats.max_cycles) < cycles) {
+        if(__compare_and_exchange(&tlb_stats.max_cycles, max_cycles, cycles) == max_cycles) break;
+    }
+
+#if TLB_VERBOSE > 1
+    fprintf(stderr, "tlb: cpu%d shot down %d pages on mask 0x%lX in %lu cycles\n", cpu->cpu_index, batch->num_pages, cpu_mask, cycles);
+#endif
+
+    __restoreflags(flags);
+    tlb_batch_init(batch, batch->page_table);
+}
+
+void tlb_get_stats(struct tlb_stats* stats)
+{
+    *stats = tlb_stats;
+}
+
+void tlb_dump_stats()
+{
+    struct tlb_stats stats;
+    tlb_get_stats(&stats);
+
+    fprintf(stderr, "tlb: %lu shootdowns, %lu local only, %lu IPIs sent\n", stats.shootdowns, stats.local_flushes, stats.ipis_sent);
+    fprintf(stderr, "tlb: %lu pages invalidated, %lu full flushes\n", stats.pages_invalidated, stats.full_flushes);
+    if(stats.shootdowns != 0) {
+        fprintf(stderr, "tlb: shootdown latency avg %lu cycles, max %lu cycles\n", stats.total_cycles / stats.shootdowns, stats.max_cycles);
+    }
+}
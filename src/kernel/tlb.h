@@ -0,0 +1,55 @@
+#ifndef __TLB_H__
+#define __TLB_H__
+
+#define TLB_BATCH_MAX_RANGES     16
+#define TLB_FULL_FLUSH_THRESHOLD 32  // above this many invlpgs a cpu reloads cr3 instead
+
+struct page_table;
+
+// a set of virtual ranges whose page table entries have been cleared and that still need to be
+// invalidated on every cpu that may have them cached. contiguous pages are merged into one range,
+// and if the batch runs out of ranges it falls back to flushing everything
+struct tlb_batch {
+    struct page_table* page_table;
+    u32    num_ranges;
+    u32    num_pages;   // total invlpgs needed to invalidate every range
+    bool   shared;      // at least one address lives in the part of the address space all tables share
+    bool   flush_all;
+    u8     unused0[6];
+    void*  freed_tables; // page tables removed by paging, freed once the batch is finished
+
+    struct {
+        intp base;
+        u32  count;     // number of pages
+        u32  shift;     // page size of each page, 12, 21 or 30
+    } ranges[TLB_BATCH_MAX_RANGES];
+};
+
+struct tlb_stats {
+    u64 shootdowns;        // batches that needed at least one other cpu
+    u64 local_flushes;     // batches that were only invalidated on the current cpu
+    u64 ipis_sent;
+    u64 full_flushes;      // times any cpu reloaded cr3 instead of using invlpg
+    u64 pages_invalidated; // invlpgs executed across all cpus
+    u64 total_cycles;      // time spent by initiators waiting for acknowledgements
+    u64 max_cycles;
+};
+
+void tlb_batch_init(struct tlb_batch*, struct page_table*);
+void tlb_batch_add(struct tlb_batch*, intp virt, u32 page_shift);
+
+// invalidate the batch on this cpu and every other cpu that may be using the table,
+// and wait for all of them to finish. the batch can be reused after this returns
+void tlb_batch_finish(struct tlb_batch*);
+
+// called from the shootdown IPI
+void tlb_notify_shootdown_interrupt();
+
+// run any queued shootdown requests. lock spin loops call this so that a cpu waiting on a lock with interrupts
+// disabled still answers a shootdown from the cpu holding that lock
+void tlb_poll();
+
+void tlb_get_stats(struct tlb_stats*);
+void tlb_dump_stats();
+
+#endif
@@ -3,30 +3,64 @@
 #include "cpu.h"
 #include "kalloc.h"
 #include "kernel.h"
+#include "kmem.h"
 #include "palloc.h"
 #include "paging.h"
 #include "rbtree.h"
+#include "smp.h"
 #include "stdio.h"
+#include "string.h"
+#include "task.h"
 #include "vmem.h"
 
 // verbosity levels 1, 2 or 3
 #define VMEM_VERBOSE 1
 
+#define VMEM_HUGE_PAGE_SIZE (1ULL << 21)
+#define VMEM_UNMAP_BATCH    64          // lazy pages freed per tlb shootdown
+
 struct vmem_node {
     MAKE_RB_TREE;
 
     intp base; 
     u64  length;
+    u64  max_length; // largest length in this node's subtree. only maintained in free_areas
+
+    // only used by lazy regions
+    u32  flags;
+    u32  fault_around;
 };
 
 struct vmem {
     struct vmem_node* free_areas;
+    struct vmem_node* lazy_areas;    // demand paged regions
     struct page_table* page_table;
     struct ticketlock lock;
 };
 
 struct vmem* kernel_vmem = null;
 
+// nodes are constructed zeroed, and _vmem_node_free() zeroes them again before giving them back
+static struct kmem_cache* vmem_node_cache;
+
+static void _vmem_node_ctor(void* object)
+{
+    zero((struct vmem_node*)object);
+}
+
+static inline struct vmem_node* _vmem_node_alloc()
+{
+    struct vmem_node* node = (struct vmem_node*)kmem_cache_alloc(vmem_node_cache);
+    assert(node != null, "out of memory");
+    return node;
+}
+
+static inline void _vmem_node_free(struct vmem_node* node)
+{
+    zero(node);
+    kmem_cache_free(vmem_node_cache, node);
+}
+
 // compare two regions using their base address
 static s64 _vmem_node_cmp_bases(struct vmem_node const* a, struct vmem_node const* b)
 {
@@ -35,6 +69,24 @@ static s64 _vmem_node_cmp_bases(struct vmem_node const* a, struct vmem_node cons
     return (b->base - a->base);
 }
 
+// match the region that contains a->base
+static s64 _vmem_node_cmp_contains(struct vmem_node const* a, struct vmem_node const* b)
+{
+    if(a->base >= b->base && a->base < (b->base + b->length)) return 0;
+    return (b->base - a->base);
+}
+
+// keep max_length up to date for the free area tree
+static void _vmem_node_augment(struct vmem_node* node)
+{
+    struct vmem_node* left  = (struct vmem_node*)RB_TREE_LEFT(node);
+    struct vmem_node* right = (struct vmem_node*)RB_TREE_RIGHT(node);
+
+    node->max_length = node->length;
+    if(left != null)  node->max_length = max(node->max_length, left->max_length);
+    if(right != null) node->max_length = max(node->max_length, right->max_length);
+}
+
 // compare two regions using their end address
 static s64 _vmem_node_cmp_ends(struct vmem_node const* a, struct vmem_node const* b)
 {
@@ -45,6 +97,8 @@ static s64 _vmem_node_cmp_ends(struct vmem_node const* a, struct vmem_node const
 
 void vmem_init()
 {
+    vmem_node_cache = kmem_cache_create("vmem_node", sizeof(struct vmem_node), 0, _vmem_node_ctor);
+
     kernel_vmem = (struct vmem*)kalloc(sizeof(struct vmem));
     zero(kernel_vmem);
 
@@ -54,12 +108,11 @@ void vmem_init()
     // when mapping/unmapping, make sure to use the kernel page table
     kernel_vmem->page_table = paging_get_kernel_page_table();
 
-    struct vmem_node* node = (struct vmem_node*)kalloc(sizeof(struct vmem_node));
-    zero(node);
+    struct vmem_node* node = _vmem_node_alloc();
     node->base = 0xFFFF800000000000;
     node->length = (u64)&_kernel_vma_base - (u64)node->base;
 
-    RB_TREE_INSERT(kernel_vmem->free_areas, node, _vmem_node_cmp_bases);
+    RB_TREE_INSERT_AUGMENTED(kernel_vmem->free_areas, node, _vmem_node_cmp_bases, _vmem_node_augment);
 
 #if VMEM_VERBOSE > 0
     fprintf(stderr, "vmem: initialized virtual memory for area 0x%lX-0x%lX\n", kernel_vmem->free_areas->base, kernel_vmem->free_areas->base + kernel_vmem->free_areas->length);
@@ -76,13 +129,12 @@ intp vmem_create_private_memory(struct page_table* page_table)
 
     private_vmem->page_table = page_table;
 
-    struct vmem_node* node = (struct vmem_node*)kalloc(sizeof(struct vmem_node));
-    zero(node);
+    struct vmem_node* node = _vmem_node_alloc();
     node->base = 0x0000400000000000; // the PML4 page table has entries that are 0x80_00000000 (512GiB) in size, and the first 64TiB is for identity mapping memory
                                      // which leaves 64TiB for user space memory
     node->length = 0x0000800000000000ULL - (u64)node->base; // user land virtual memory goes up to the last valid canonical address with high bit 0 set
 
-    RB_TREE_INSERT(private_vmem->free_areas, node, _vmem_node_cmp_bases);
+    RB_TREE_INSERT_AUGMENTED(private_vmem->free_areas, node, _vmem_node_cmp_bases, _vmem_node_augment);
 
 #if VMEM_VERBOSE > 0
     fprintf(stderr, "vmem: initialized private virtual memory area 0x%lX-0x%lX\n", private_vmem->free_areas->base, private_vmem->free_areas->base + private_vmem->free_areas->length - 1);
@@ -90,59 +142,190 @@ intp vmem_create_private_memory(struct page_table* page_table)
     return (intp)private_vmem;
 }
 
-intp vmem_map_pages(intp _vmem, intp phys, u64 npages, u32 flags)
+void vmem_destroy_private_memory(intp _vmem)
 {
-    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+    struct vmem* vmem = (struct vmem*)_vmem;
+    assert(_vmem != 0 && vmem != kernel_vmem, "can't destroy kernel vmem");
 
-    intp virtual_address = 0;
-    u64 wanted_size = npages << PAGE_SHIFT;
+    // the lazy regions own their pages
+    while(vmem->lazy_areas != null) vmem_free_lazy_region(_vmem, vmem->lazy_areas->base);
+
+    struct vmem_node* node;
+    while((node = vmem->free_areas) != null) {
+        RB_TREE_REMOVE_AUGMENTED(vmem->free_areas, node, _vmem_node_augment);
+        _vmem_node_free(node);
+    }
+
+#if VMEM_VERBOSE > 1
+    fprintf(stderr, "vmem: destroyed private memory 0x%lX\n", _vmem);
+#endif
+    kfree(vmem, sizeof(struct vmem));
+}
+
+intp vmem_clone_private_memory(intp _src, struct page_table* page_table)
+{
+    struct vmem* src = (struct vmem*)_src;
+    struct vmem* clone = (struct vmem*)kalloc(sizeof(struct vmem));
+    zero(clone);
+
+    declare_ticketlock(lock_init);
+    clone->lock = lock_init;
+
+    clone->page_table = page_table;
+
+    // holding the lock keeps the source from faulting in pages while they're being shared
+    acquire_lock(src->lock);
+
+    // the same areas are free, so anything mapped with vmem_map_pages stays reserved in the clone even though it isn't mapped there
+    struct vmem_node* node;
+    RB_TREE_FOREACH(src->free_areas, node) {
+        struct vmem_node* newnode = _vmem_node_alloc();
+        *newnode = *node;
+        RB_TREE_INSERT_AUGMENTED(clone->free_areas, newnode, _vmem_node_cmp_bases, _vmem_node_augment);
+    }
+
+    // lazy regions own their pages, so whatever has been touched is shared copy-on-write
+    RB_TREE_FOREACH(src->lazy_areas, node) {
+        struct vmem_node* newnode = _vmem_node_alloc();
+        *newnode = *node;
+        RB_TREE_INSERT(clone->lazy_areas, newnode, _vmem_node_cmp_bases);
+
+        paging_clone_range(src->page_table, page_table, node->base, node->length);
+    }
+
+    release_lock(src->lock);
+
+#if VMEM_VERBOSE > 1
+    fprintf(stderr, "vmem: cloned private memory 0x%lX into 0x%lX\n", (intp)src, (intp)clone);
+#endif
+    return (intp)clone;
+}
+
+// returns the first address in node that can hold size bytes at the given alignment, or 0 if it doesn't fit
+static intp _vmem_node_fit(struct vmem_node* node, u64 size, u64 alignment)
+{
+    intp start = (intp)__alignup(node->base, alignment);
+    if(start < node->base || (start + size) > (node->base + node->length)) return 0;
+    return start;
+}
+
+// first fit in tree order. subtrees without a large enough area are skipped, so with page alignment
+// this only ever walks down one path
+static struct vmem_node* _vmem_find_first_fit(struct vmem_node* node, u64 size, u64 alignment)
+{
+    if(node == null || node->max_length < size) return null;
+
+    struct vmem_node* ret = _vmem_find_first_fit((struct vmem_node*)RB_TREE_LEFT(node), size, alignment);
+    if(ret != null) return ret;
+
+    if(_vmem_node_fit(node, size, alignment) != 0) return node;
+
+    return _vmem_find_first_fit((struct vmem_node*)RB_TREE_RIGHT(node), size, alignment);
+}
+
+// smallest area that fits. has to look at every area that's large enough, but stops on an exact fit
+static void _vmem_find_best_fit(struct vmem_node* node, u64 size, u64 alignment, struct vmem_node** best)
+{
+    if(node == null || node->max_length < size) return;
+    if(*best != null && (*best)->length == size) return;
+
+    if(_vmem_node_fit(node, size, alignment) != 0 && (*best == null || node->length < (*best)->length)) *best = node;
+
+    _vmem_find_best_fit((struct vmem_node*)RB_TREE_LEFT(node), size, alignment, best);
+    _vmem_find_best_fit((struct vmem_node*)RB_TREE_RIGHT(node), size, alignment, best);
+}
+
+// find and remove a free area of wanted_size bytes, returning its base address
+static intp _vmem_take_area(struct vmem* vmem, u64 wanted_size, u64 alignment, u32 flags)
+{
+    struct vmem_node* node = null;
 
-    // loop over free areas looking for a large enough node
     acquire_lock(vmem->lock);
-    struct vmem_node* iter;
-    RB_TREE_FOREACH(vmem->free_areas, iter) {
-        virtual_address = iter->base;
+    if(flags & VMEM_ALLOC_BEST_FIT) {
+        _vmem_find_best_fit(vmem->free_areas, wanted_size, alignment, &node);
+    } else {
+        node = _vmem_find_first_fit(vmem->free_areas, wanted_size, alignment);
+    }
 
-        if(iter->length > wanted_size) {
+    if(node == null) {
+        release_lock(vmem->lock);
+        return 0;
+    }
+
+    intp virtual_address = _vmem_node_fit(node, wanted_size, alignment);
+    intp end = virtual_address + wanted_size;
+    intp node_end = node->base + node->length;
+
+    if(virtual_address == node->base) {
+        if(end == node_end) {
+            // exact fit, remove the node
+            RB_TREE_REMOVE_AUGMENTED(vmem->free_areas, node, _vmem_node_augment);
+            _vmem_node_free(node);
+        } else {
             // increment the base address, easy
-            iter->base += wanted_size;
-            iter->length -= wanted_size;
-            break;
-        } else if(iter->length == wanted_size) {
-            // remove the node
-            RB_TREE_REMOVE(vmem->free_areas, iter);
-            kfree(iter, sizeof(struct vmem_node));
-            break;
+            node->base = end;
+            node->length -= wanted_size;
+            RB_TREE_AUGMENT(node, _vmem_node_augment);
+        }
+    } else {
+        // alignment left a gap at the start of the node, so keep that and put anything after the area in a new node
+        node->length = virtual_address - node->base;
+        RB_TREE_AUGMENT(node, _vmem_node_augment);
+
+        if(end < node_end) {
+            struct vmem_node* newnode = _vmem_node_alloc();
+            newnode->base = end;
+            newnode->length = node_end - end;
+            RB_TREE_INSERT_AUGMENTED(vmem->free_areas, newnode, _vmem_node_cmp_bases, _vmem_node_augment);
         }
-
-        // region too small, go onto the next
-        continue;
     }
     release_lock(vmem->lock);
 
+    return virtual_address;
+}
+
+intp vmem_alloc_region(intp _vmem, u64 npages)
+{
+    return vmem_alloc_region_aligned(_vmem, npages, PAGE_SIZE, 0);
+}
+
+intp vmem_alloc_region_aligned(intp _vmem, u64 npages, u64 alignment, u32 flags)
+{
+    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+
+    assert(is_power_of_2(alignment) && alignment >= PAGE_SIZE, "alignment must be a power of 2 and at least a page");
+
+    intp virtual_address = _vmem_take_area(vmem, npages << PAGE_SHIFT, alignment, flags);
+
 #if VMEM_VERBOSE > 1
-    fprintf(stderr, "vmem: mapping %d pages start 0x%lX to 0x%lX-0x%lX\n", npages, phys, virtual_address, virtual_address+wanted_size);
+    fprintf(stderr, "vmem: reserved %d pages at 0x%lX (alignment 0x%lX)\n", npages, virtual_address, alignment);
 #endif
-    for(u64 offs = 0; offs < wanted_size; offs += PAGE_SIZE) {
-        paging_map_page(vmem->page_table, phys + offs, virtual_address + offs, flags);
-    }
 
     return virtual_address;
 }
 
-intp vmem_unmap_pages(intp _vmem, intp virt, u64 npages)
+intp vmem_map_pages(intp _vmem, intp phys, u64 npages, u32 flags)
 {
     struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
 
-    intp ret;
-    assert(npages != 0, "must unmap at least one page");
+    u64 wanted_size = npages << PAGE_SHIFT;
 
-    intp size = npages * PAGE_SIZE;
-    intp end = virt + size;
+    // line up 2MiB aligned physical memory with 2MiB aligned virtual memory so paging can use huge pages
+    u64 alignment = (wanted_size >= VMEM_HUGE_PAGE_SIZE && __alignof(phys, VMEM_HUGE_PAGE_SIZE) == 0) ? VMEM_HUGE_PAGE_SIZE : PAGE_SIZE;
+    intp virtual_address = _vmem_take_area(vmem, wanted_size, alignment, 0);
 
 #if VMEM_VERBOSE > 1
-    fprintf(stderr, "vmem: unmapping %d pages at 0x%lX-0x%lX\n", npages, virt, end);
+    fprintf(stderr, "vmem: mapping %d pages start 0x%lX to 0x%lX-0x%lX\n", npages, phys, virtual_address, virtual_address+wanted_size);
 #endif
+    paging_map_range(vmem->page_table, phys, virtual_address, wanted_size, flags);
+
+    return virtual_address;
+}
+
+// return [virt, virt+size) to the free areas, merging with neighboring areas
+static void _vmem_release_area(struct vmem* vmem, intp virt, u64 size)
+{
+    intp end = virt + size;
 
     // look up the end of the freed region to see if it matches the beginning of any other region
     struct vmem_node lookup = { .base = end };
@@ -155,6 +338,7 @@ intp vmem_unmap_pages(intp _vmem, intp virt, u64 npages)
 #endif
         result->base -= size;    
         result->length += size;
+        RB_TREE_AUGMENT(result, _vmem_node_augment);
 
         // look for a node that ends with result->base
         lookup.base = 0;
@@ -162,11 +346,12 @@ intp vmem_unmap_pages(intp _vmem, intp virt, u64 npages)
         struct vmem_node* result2;
         while(RB_TREE_FIND(vmem->free_areas, result2, lookup, _vmem_node_cmp_ends)) {
             // so result2 is a node that ends where result begins, so they can be merged
-            RB_TREE_REMOVE(vmem->free_areas, result2);
+            RB_TREE_REMOVE_AUGMENTED(vmem->free_areas, result2, _vmem_node_augment);
 
             // update result to include the region
             result->base = result2->base;
             result->length += result2->length;
+            RB_TREE_AUGMENT(result, _vmem_node_augment);
 #if VMEM_VERBOSE > 2
             fprintf(stderr, "    merging node 0x%lX-0x%lX into 0x%lX-0x%lX\n", result2->base, result2->base + result2->length, result->base, result->base + result->length);
 #endif
@@ -175,7 +360,7 @@ intp vmem_unmap_pages(intp _vmem, intp virt, u64 npages)
             lookup.length = result->base;
 
             // free old memory
-            kfree(result2, sizeof(struct vmem_node));
+            _vmem_node_free(result2);
         }
 
         // we just extended downward as much as possible, so there's no more free regions to merge
@@ -192,28 +377,284 @@ intp vmem_unmap_pages(intp _vmem, intp virt, u64 npages)
         fprintf(stderr, "    extending 0x%lX-0x%lX upward to 0x%lX\n", result->base, result->base+result->length, result->base+result->length+size);
 #endif
         result->length += size;
+        RB_TREE_AUGMENT(result, _vmem_node_augment);
         goto done;
     }
 
     // no node was found for extending, so make a new one
-    struct vmem_node* newnode = (struct vmem_node*)kalloc(sizeof(struct vmem_node));
-    zero(newnode);
+    struct vmem_node* newnode = _vmem_node_alloc();
     newnode->base = virt;
     newnode->length = size;
 #if VMEM_VERBOSE > 2
     fprintf(stderr, "    inserting new vmem_node 0x%lX-0x%lX\n", newnode->base, newnode->base+newnode->length);
 #endif
-    RB_TREE_INSERT(vmem->free_areas, newnode, _vmem_node_cmp_bases);
+    RB_TREE_INSERT_AUGMENTED(vmem->free_areas, newnode, _vmem_node_cmp_bases, _vmem_node_augment);
 
 done:
     release_lock(vmem->lock);
+}
 
-    ret = paging_unmap_page(vmem->page_table, virt); // unmap the first page to get the physical return address
-    for(u64 offs = PAGE_SIZE; offs < size; offs += PAGE_SIZE) {
-        paging_unmap_page(vmem->page_table, virt + offs);
-    }
+void vmem_free_region(intp _vmem, intp virt, u64 npages)
+{
+    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+    _vmem_release_area(vmem, virt, npages << PAGE_SHIFT);
+}
+
+void vmem_map_pages_at(intp _vmem, intp phys, intp virt, u64 npages, u32 flags)
+{
+    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+
+#if VMEM_VERBOSE > 1
+    fprintf(stderr, "vmem: mapping %d pages start 0x%lX at 0x%lX-0x%lX\n", npages, phys, virt, virt + (npages << PAGE_SHIFT));
+#endif
+    paging_map_range(vmem->page_table, phys, virt, npages << PAGE_SHIFT, flags);
+}
+
+intp vmem_unmap_pages_at(intp _vmem, intp virt, u64 npages)
+{
+    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+
+    assert(npages != 0, "must unmap at least one page");
+    return paging_unmap_range(vmem->page_table, virt, npages << PAGE_SHIFT);
+}
+
+intp vmem_unmap_pages(intp _vmem, intp virt, u64 npages)
+{
+    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+
+    intp ret;
+    assert(npages != 0, "must unmap at least one page");
+
+    intp size = npages * PAGE_SIZE;
+
+#if VMEM_VERBOSE > 1
+    fprintf(stderr, "vmem: unmapping %d pages at 0x%lX-0x%lX\n", npages, virt, virt + size);
+#endif
+
+    // unmap before giving the area back, so nobody else can map there first
+    ret = paging_unmap_range(vmem->page_table, virt, size);
+    _vmem_release_area(vmem, virt, size);
 
     return ret;
 }
 
+// unmap and free the memory behind [virt, virt+size) from vmem_alloc_huge. each 2MiB chunk is either one huge page
+// or 512 separate pages from the fallback
+static void _vmem_unmap_huge(struct vmem* vmem, intp virt, u64 size)
+{
+    intp phys[VMEM_UNMAP_BATCH];
+
+    for(intp offs = 0; offs < size; offs += VMEM_HUGE_PAGE_SIZE) {
+        if(paging_page_size(vmem->page_table, virt + offs) == VMEM_HUGE_PAGE_SIZE) {
+            palloc_abandon_huge(paging_unmap_range(vmem->page_table, virt + offs, VMEM_HUGE_PAGE_SIZE));
+            continue;
+        }
+
+        for(intp poffs = 0; poffs < VMEM_HUGE_PAGE_SIZE; poffs += VMEM_UNMAP_BATCH * PAGE_SIZE) {
+            paging_unmap_pages(vmem->page_table, virt + offs + poffs, VMEM_UNMAP_BATCH, phys);
+            for(u64 i = 0; i < VMEM_UNMAP_BATCH; i++) {
+                if(phys[i] != 0) palloc_abandon(phys[i], 0);
+            }
+        }
+    }
+}
+
+intp vmem_alloc_huge(intp _vmem, u64 size, u32 flags)
+{
+    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+
+    size = (u64)__alignup(size, VMEM_HUGE_PAGE_SIZE);
+    assert(size != 0, "must allocate at least one page");
+
+    intp virt = _vmem_take_area(vmem, size, VMEM_HUGE_PAGE_SIZE, 0);
+    if(virt == 0) return 0;
+
+    // user memory can't leak what was in it before, kernel callers clear what they need themselves
+    bool clear = (flags & MAP_PAGE_FLAG_USER) != 0;
+    u64 huge_pages = 0;
+
+    for(intp offs = 0; offs < size; offs += VMEM_HUGE_PAGE_SIZE) {
+        intp phys = palloc_claim_huge();
+        if(phys != 0) {
+            if(clear) memset64((void*)phys, 0, VMEM_HUGE_PAGE_SIZE / sizeof(u64));
+            paging_map_range(vmem->page_table, phys, virt + offs, VMEM_HUGE_PAGE_SIZE, flags);
+            huge_pages++;
+            continue;
+        }
+
+        // no 2MiB block is free, so back the chunk with separate pages instead
+        for(intp poffs = 0; poffs < VMEM_HUGE_PAGE_SIZE; poffs += PAGE_SIZE) {
+            phys = palloc_claim_flags(0, clear ? PALLOC_ZERO : 0);
+            if(phys == 0) {
+                _vmem_unmap_huge(vmem, virt, offs + poffs);
+                _vmem_release_area(vmem, virt, size);
+                return 0;
+            }
+            paging_map_page(vmem->page_table, phys, virt + offs + poffs, flags);
+        }
+    }
+
+#if VMEM_VERBOSE > 1
+    fprintf(stderr, "vmem: allocated %lu bytes at 0x%lX with %lu of %lu chunks as huge pages\n", size, virt, huge_pages, size / VMEM_HUGE_PAGE_SIZE);
+#else
+    unused(huge_pages);
+#endif
+
+    return virt;
+}
+
+void vmem_free_huge(intp _vmem, intp virt, u64 size)
+{
+    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+
+    assert((virt & (VMEM_HUGE_PAGE_SIZE - 1)) == 0, "not an address from vmem_alloc_huge");
+    size = (u64)__alignup(size, VMEM_HUGE_PAGE_SIZE);
+
+    // unmap before giving the area back, so nobody else can map there first
+    _vmem_unmap_huge(vmem, virt, size);
+    _vmem_release_area(vmem, virt, size);
+}
+
+void vmem_get_stats(intp _vmem, struct vmem_stats* stats)
+{
+    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+    zero(stats);
+
+    acquire_lock(vmem->lock);
+
+    struct vmem_node* node;
+    RB_TREE_FOREACH(vmem->free_areas, node) {
+        stats->free_areas++;
+        stats->free_bytes += node->length;
+    }
+
+    // the root's augmented length covers the whole tree
+    if(vmem->free_areas != null) stats->largest_free = vmem->free_areas->max_length;
+
+    RB_TREE_FOREACH(vmem->lazy_areas, node) {
+        stats->lazy_areas++;
+    }
+
+    release_lock(vmem->lock);
+}
+
+intp vmem_alloc_lazy_region(intp _vmem, u64 npages, u32 flags, u32 fault_around)
+{
+    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+
+    if(fault_around == 0) fault_around = VMEM_DEFAULT_FAULT_AROUND;
+    assert(is_power_of_2(fault_around), "fault_around must be a power of 2");
+
+    intp virtual_address = _vmem_take_area(vmem, npages << PAGE_SHIFT, PAGE_SIZE, 0);
+    if(virtual_address == 0) return 0;
+
+    struct vmem_node* node = _vmem_node_alloc();
+    node->base = virtual_address;
+    node->length = npages << PAGE_SHIFT;
+    node->flags = flags;
+    node->fault_around = fault_around;
+
+    acquire_lock(vmem->lock);
+    RB_TREE_INSERT(vmem->lazy_areas, node, _vmem_node_cmp_bases);
+    release_lock(vmem->lock);
+
+#if VMEM_VERBOSE > 1
+    fprintf(stderr, "vmem: reserved lazy region of %d pages at 0x%lX (fault_around=%d)\n", npages, virtual_address, fault_around);
+#endif
+
+    return virtual_address;
+}
+
+void vmem_free_lazy_region(intp _vmem, intp virt)
+{
+    struct vmem* vmem = (struct vmem*)(_vmem == 0 ? kernel_vmem : (void*)_vmem);
+
+    struct vmem_node lookup = { .base = virt };
+    struct vmem_node* node;
+
+    acquire_lock(vmem->lock);
+    bool found = RB_TREE_FIND(vmem->lazy_areas, node, lookup, _vmem_node_cmp_bases);
+    assert(found, "not a lazy region");
+    RB_TREE_REMOVE(vmem->lazy_areas, node);
+    release_lock(vmem->lock);
+
+    // free only the pages that have been faulted in. the region can't fault anymore now that it's out of the tree,
+    // so the lock isn't held across the tlb shootdowns
+    intp phys[VMEM_UNMAP_BATCH];
+    for(intp offs = 0; offs < node->length; offs += VMEM_UNMAP_BATCH * PAGE_SIZE) {
+        u64 count = min((u64)(node->length - offs) >> PAGE_SHIFT, VMEM_UNMAP_BATCH);
+        paging_unmap_pages(vmem->page_table, virt + offs, count, phys);
+        for(u64 i = 0; i < count; i++) {
+            if(phys[i] != 0) palloc_release(phys[i]); // pages can be shared with a clone
+        }
+    }
+
+    _vmem_release_area(vmem, virt, node->length);
+    _vmem_node_free(node);
+}
+
+bool vmem_handle_page_fault(intp address, bool write_protect)
+{
+    struct vmem* vmem = kernel_vmem;
+
+    // user addresses belong to the current task's private memory
+    if((address >> 47) == 0) {
+        if(!smp_ready() || get_cpu()->current_task->vmem == 0) return false;
+        vmem = (struct vmem*)get_cpu()->current_task->vmem;
+    }
+
+    if(vmem == null) return false;
+
+    struct vmem_node lookup = { .base = address };
+    struct vmem_node* node;
+
+    // hold the lock while mapping so that two cpus faulting on the same page don't both map it
+    acquire_lock(vmem->lock);
+    if(!RB_TREE_FIND(vmem->lazy_areas, node, lookup, _vmem_node_cmp_contains)) {
+        release_lock(vmem->lock);
+        return false;
+    }
+
+    // a write to a present page can only be resolved if it's shared copy-on-write
+    if(write_protect) {
+        bool ret = paging_handle_cow_fault(vmem->page_table, address);
+        release_lock(vmem->lock);
+        return ret;
+    }
+
+    // map the fault_around aligned window of pages containing address, clipped to the region
+    u64 window = (u64)node->fault_around << PAGE_SHIFT;
+    intp start = max(node->base, address & ~(window - 1));
+    intp end   = min(node->base + node->length, (address & ~(window - 1)) + window);
+
+    // the page that faulted comes first, and only failing to map it fails the fault. otherwise a claim failing
+    // earlier in the window would return to the same fault over and over
+    intp fault_page = address & ~(PAGE_SIZE - 1);
+    if(!paging_is_mapped(vmem->page_table, fault_page)) {
+        intp phys = palloc_claim_flags(0, PALLOC_ZERO);
+        if(phys == 0) {
+            release_lock(vmem->lock);
+            return false;
+        }
+
+        paging_map_page(vmem->page_table, phys, fault_page, node->flags);
+    }
+
+    // the rest of the window is best effort
+    for(intp virt = start; virt < end; virt += PAGE_SIZE) {
+        if(virt == fault_page || paging_is_mapped(vmem->page_table, virt)) continue;
+
+        intp phys = palloc_claim_flags(0, PALLOC_ZERO);
+        if(phys == 0) continue;
+
+        paging_map_page(vmem->page_table, phys, virt, node->flags);
+    }
+    release_lock(vmem->lock);
+
+#if VMEM_VERBOSE > 2
+    fprintf(stderr, "vmem: fault at 0x%lX mapped 0x%lX-0x%lX\n", address, start, end);
+#endif
+
+    return true;
+}
 
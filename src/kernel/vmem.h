@@ -3,12 +3,18 @@
 
 #define VMEM_KERNEL 0
 
+#define VMEM_DEFAULT_FAULT_AROUND 16 // pages mapped per fault in lazy regions
+
 // initialize the virtual memory manager
 void vmem_init();
 
 // create a new virtual memory area in the private address space
 intp vmem_create_private_memory(struct page_table*);
 
+// free private memory along with every lazy region in it and the pages they hold. pages mapped with vmem_map_pages
+// belong to whoever mapped them and have to be unmapped first. the page table itself is left to the caller
+void vmem_destroy_private_memory(intp _vmem);
+
 // map contiguous pages
 // returns base virtual address of mapped pages
 //intp vmem_map_pages(intp phys, u64 npages, u32 flags);
@@ -19,8 +25,62 @@ intp vmem_map_pages(intp _vmem, intp phys, u64 npages, u32 flags);
 //intp vmem_unmap_pages(intp virt, u64 npages);
 intp vmem_unmap_pages(intp _vmem, intp virt, u64 npages);
 
-// TODO implement these
-intp vmem_alloc_region(intp _vmem, u64 npages);                        // Allocates a contiguous region of vmem that is not backed by physical memory
+// allocates a contiguous region of vmem that is not backed by physical memory
+// returns base virtual address of the region
+intp vmem_alloc_region(intp _vmem, u64 npages);
+
+enum VMEM_ALLOC_FLAGS {
+    VMEM_ALLOC_BEST_FIT = (1 << 0)  // use the smallest free area that fits instead of the first
+};
+
+// like vmem_alloc_region, but the region starts at a multiple of alignment (a power of 2, at least PAGE_SIZE)
+// flags uses enum VMEM_ALLOC_FLAGS
+intp vmem_alloc_region_aligned(intp _vmem, u64 npages, u64 alignment, u32 flags);
+
+// give back a region from vmem_alloc_region. anything mapped into it must already be unmapped
+void vmem_free_region(intp _vmem, intp virt, u64 npages);
+
+// map contiguous pages at virt, which has to be inside a region from vmem_alloc_region. pages of the region that
+// are left unmapped (e.g., a guard page) fault when touched
+void vmem_map_pages_at(intp _vmem, intp phys, intp virt, u64 npages, u32 flags);
+
+// unmap pages mapped with vmem_map_pages_at without giving their addresses back to the region
+// returns base physical address of unmapped pages
+intp vmem_unmap_pages_at(intp _vmem, intp virt, u64 npages);
+
+// allocate size bytes (rounded up to 2MiB) of memory and map it with flags (enum MAP_PAGE_FLAGS) at a 2MiB aligned
+// address. each 2MiB of it is a single huge page when palloc has one, and 4KiB pages otherwise. user memory is cleared.
+// returns 0 when out of memory
+intp vmem_alloc_huge(intp _vmem, u64 size, u32 flags);
+
+// unmap and free memory from vmem_alloc_huge, and release its addresses
+void vmem_free_huge(intp _vmem, intp virt, u64 size);
+
+// reserves a region like vmem_alloc_region, but pages are allocated and mapped with flags (enum MAP_PAGE_FLAGS)
+// the first time they're touched. each fault maps up to fault_around pages around the faulting address, which
+// should be a power of 2 (0 uses VMEM_DEFAULT_FAULT_AROUND)
+intp vmem_alloc_lazy_region(intp _vmem, u64 npages, u32 flags, u32 fault_around);
+
+// unmap and free whatever pages of a lazy region have been touched, and release the region
+void vmem_free_lazy_region(intp _vmem, intp virt);
+
+// create private memory for page_table with the same layout as _src. pages touched so far in lazy regions are
+// shared copy-on-write, so the clone costs only what has actually been mapped. pages mapped with vmem_map_pages
+// belong to whoever mapped them and aren't inherited, but their addresses stay reserved
+intp vmem_clone_private_memory(intp _src, struct page_table* page_table);
+
+// called from the page fault handler for not-present faults and for writes to read-only pages (write_protect).
+// returns true if the fault was resolved
+bool vmem_handle_page_fault(intp address, bool write_protect);
+
+struct vmem_stats {
+    u64 free_areas;     // separate free ranges
+    u64 free_bytes;
+    u64 largest_free;   // the largest free range, in bytes
+    u64 lazy_areas;     // demand paged regions
+};
+
+void vmem_get_stats(intp _vmem, struct vmem_stats*);
 
 // helpers for single page map/unmap
 #define vmem_map_page(vmem,phys,flags) vmem_map_pages(vmem, phys, 1, flags)
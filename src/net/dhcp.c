@@ -167,7 +167,7 @@ s64 dhcp_configure_network(struct net_interface* iface, bool wait_for_network)
     struct task* dhcp_task = task_create(dhcp_main, (intp)iface, false);
     if(dhcp_task == null) return -ENOMEM;
 
-    task_enqueue(&get_cpu()->current_task, dhcp_task);
+    task_enqueue_ready(dhcp_task);
 
     if(wait_for_network) wait_condition(network_ready);
 
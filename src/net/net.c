@@ -4,8 +4,9 @@
 #include "errno.h"
 #include "kernel/buffer.h"
 #include "kernel/cpu.h"
-#include "kernel/kalloc.h"
 #include "kernel/kernel.h"
+#include "kernel/kmem.h"
+#include "kernel/meminfo.h"
 #include "kernel/paging.h"
 #include "kernel/palloc.h"
 #include "net/arp.h"
@@ -38,10 +39,30 @@ static declare_spinlock(send_queue_lock);
 
 static void _receive_packet(struct net_receive_packet_info*);
 
+// send queue entries are constructed zeroed, and _free_send_queue_entry() zeroes them again before giving them back
+static struct kmem_cache* send_queue_entry_cache;
+
+static void _send_queue_entry_ctor(void* object)
+{
+    zero((struct net_send_packet_queue_entry*)object);
+}
+
+static void _free_send_queue_entry(struct net_send_packet_queue_entry* entry)
+{
+    free(entry->packet_start);
+    meminfo_tag_free(MEMINFO_TAG_NET, sizeof(struct net_send_packet_queue_entry));
+    zero(entry);
+    kmem_cache_free(send_queue_entry_cache, entry);
+}
+
 void net_init()
 {
+    send_queue_entry_cache = kmem_cache_create("net_send_entry", sizeof(struct net_send_packet_queue_entry), 0, _send_queue_entry_ctor);
+    tcp_init();
+
     send_queue_size = (1 << (PAGE_SHIFT + SEND_QUEUE_PAGE_ORDER)) / sizeof(struct net_send_packet_queue_entry*);
     send_queue = (struct net_send_packet_queue_entry**)palloc_claim(SEND_QUEUE_PAGE_ORDER);
+    meminfo_tag_alloc(MEMINFO_TAG_NET, PAGE_SIZE << SEND_QUEUE_PAGE_ORDER);
     send_queue_head = send_queue_tail = 0;
 }
 
@@ -71,8 +92,7 @@ static bool net_do_tx_work()
         // free all packets that have been sent that are the beginning of the list
         if(send_queue[send_queue_head]->sent) {
             struct net_send_packet_queue_entry* entry = send_queue[send_queue_head];
-            free(entry->packet_start);
-            kfree(entry, sizeof(struct net_send_packet_queue_entry));
+            _free_send_queue_entry(entry);
             send_queue_head = (send_queue_head + 1) % send_queue_size;
             continue;
         }
@@ -108,8 +128,7 @@ static bool net_do_tx_work()
         }
 
         if(can_free) {
-            free(entry->packet_start);
-            kfree(entry, sizeof(struct net_send_packet_queue_entry));
+            _free_send_queue_entry(entry);
         }
 
         return true;
@@ -403,14 +422,14 @@ s64 net_request_send_packet_queue_entry(struct net_interface* iface, struct net_
     }
 
     // allocate memory for the entry (don't like that we hold the lock here, but whatever, this should be fast)
-    *ret = (struct net_send_packet_queue_entry*)kalloc(sizeof(struct net_send_packet_queue_entry));
+    *ret = (struct net_send_packet_queue_entry*)kmem_cache_alloc(send_queue_entry_cache);
     if(*ret == null) {
         release_lock(send_queue_lock);
         return -ENOMEM;
     }
+    meminfo_tag_alloc(MEMINFO_TAG_NET, sizeof(struct net_send_packet_queue_entry));
 
     struct net_send_packet_queue_entry* entry = *ret;
-    zero(entry);
     send_queue[slot] = entry;
     send_queue_tail = (send_queue_tail + 1) % send_queue_size;
 
@@ -6,6 +6,8 @@
 #include "kernel/cpu.h"
 #include "kernel/kalloc.h"
 #include "kernel/kernel.h"
+#include "kernel/kmem.h"
+#include "kernel/meminfo.h"
 #include "kernel/task.h"
 #include "net/ethernet.h"
 #include "net/icmp.h"
@@ -187,18 +189,49 @@ static struct net_socket_ops tcp_socket_ops = {
 };
 ////////////////////////////////////////////////////////////////////////////////
 
-struct net_socket* tcp_socket_create(struct net_socket_info* sockinfo)
+// sockets in the cache are in their constructed state: locks initialized and released, and everything else as a
+// closed socket that has never been used. tcp_socket_destroy() resets what a connection changes before freeing
+static struct kmem_cache* tcp_socket_cache;
+
+// everything a connection can change, back to how a new socket starts out
+static void _tcp_socket_reset(struct tcp_socket* socket)
 {
-    declare_ticketlock(lock_init);
     declare_condition(condition_init);
 
-    assert(sockinfo->protocol == NET_PROTOCOL_TCP, "required TCP sockinfo");
+    zero(&socket->net_socket);
+    socket->net_socket.ops          = &tcp_socket_ops;
 
-    // right now only support IPv4. TODO IPv6
-    if(sockinfo->source_address.protocol != NET_PROTOCOL_IPv4 ||
-       sockinfo->dest_address.protocol != NET_PROTOCOL_IPv4) return null;
+    socket->pending_accept          = null;
+    socket->pending_accept_tail     = null;
+    socket->send_segment_queue      = null;
+    socket->send_segment_queue_head = 0;
+    socket->send_segment_queue_tail = 0;
+    socket->send_segment_queue_size = 0;
+    socket->send_buffers            = null;
+    socket->receive_buffer          = null;
+
+    socket->state                   = TCP_SOCKET_STATE_CLOSED;
+    socket->listen_backlog          = 0;
+    socket->pending_accept_count    = 0;
+
+    socket->my_sequence_number         = 0;
+    socket->their_sequence_number      = 0;
+    socket->my_sequence_base           = 0;
+    socket->their_sequence_base        = 0;
+    socket->their_maximum_segment_size = 0;
+    socket->their_window_scale         = 0;
+    socket->their_ack_number           = 0;
+
+    // conditions keep their signal counts, so they start over too
+    socket->receive_ready           = condition_init;
+    socket->connection_established  = condition_init;
+}
+
+static void _tcp_socket_ctor(void* object)
+{
+    declare_ticketlock(lock_init);
 
-    struct tcp_socket* socket = (struct tcp_socket*)kalloc(sizeof(struct tcp_socket)); // use kalloc for fast allocation
+    struct tcp_socket* socket = (struct tcp_socket*)object;
     zero(socket);
 
     socket->main_lock               = lock_init;
@@ -206,11 +239,26 @@ struct net_socket* tcp_socket_create(struct net_socket_info* sockinfo)
     socket->receive_buffer_lock     = lock_init;
     socket->send_buffers_lock       = lock_init;
     socket->send_segment_queue_lock = lock_init;
-    socket->receive_ready           = condition_init;
-    socket->connection_established  = condition_init;
 
-    socket->state                   = TCP_SOCKET_STATE_CLOSED;
-    socket->net_socket.ops          = &tcp_socket_ops;
+    _tcp_socket_reset(socket);
+}
+
+void tcp_init()
+{
+    tcp_socket_cache = kmem_cache_create("tcp_socket", sizeof(struct tcp_socket), 0, _tcp_socket_ctor);
+}
+
+struct net_socket* tcp_socket_create(struct net_socket_info* sockinfo)
+{
+    assert(sockinfo->protocol == NET_PROTOCOL_TCP, "required TCP sockinfo");
+
+    // right now only support IPv4. TODO IPv6
+    if(sockinfo->source_address.protocol != NET_PROTOCOL_IPv4 ||
+       sockinfo->dest_address.protocol != NET_PROTOCOL_IPv4) return null;
+
+    struct tcp_socket* socket = (struct tcp_socket*)kmem_cache_alloc(tcp_socket_cache);
+    if(socket == null) return null;
+    meminfo_tag_alloc(MEMINFO_TAG_NET, sizeof(struct tcp_socket));
 
     return &socket->net_socket;
 }
@@ -241,7 +289,9 @@ void tcp_socket_destroy(struct net_socket* net_socket)
         buffer_destroy(socket->receive_buffer);
     }
 
-    kfree(socket, sizeof(struct tcp_socket));
+    meminfo_tag_free(MEMINFO_TAG_NET, sizeof(struct tcp_socket));
+    _tcp_socket_reset(socket);
+    kmem_cache_free(tcp_socket_cache, socket);
 }
 
 static s64 _allocate_send_segment_queue(struct tcp_socket* socket)
@@ -1166,7 +1216,7 @@ static s64 _queue_segment(struct tcp_socket* socket, struct buffer* payload, u16
 
     // we can't build the packet here since it may need to be retransmitted with different a ACK, among other
     // flags that may change during retransmission
-    struct tcp_build_segment_info* info = (struct tcp_build_segment_info*)kalloc(sizeof(struct tcp_build_segment_info));
+    struct tcp_build_segment_info* info = (struct tcp_build_segment_info*)kalloc_tagged(sizeof(struct tcp_build_segment_info), MEMINFO_TAG_NET);
     info->socket          = socket;
     info->payload         = payload_buffer;
     info->payload_length  = payload_length;
@@ -1191,7 +1241,7 @@ static s64 _queue_segment(struct tcp_socket* socket, struct buffer* payload, u16
         // we're blocked, we can't add data to the send queue so we either need to yield or drop the data
         fprintf(stderr, "tcp: TODO send queue is full. handle this case properly"); // TODO
         if(payload_buffer != null) free(payload_buffer);
-        kfree(info, sizeof(struct tcp_build_segment_info));
+        kfree_tagged(info, sizeof(struct tcp_build_segment_info), MEMINFO_TAG_NET);
         return -EAGAIN;
     }
 
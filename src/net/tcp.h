@@ -7,6 +7,7 @@ struct net_receive_packet_info;
 struct net_socket;
 struct net_socket_info;
 
+void               tcp_init(); // create the object cache for tcp sockets
 struct net_socket* tcp_socket_create(struct net_socket_info*);
 void               tcp_destroy_socket(struct net_socket*);
 
@@ -4,6 +4,7 @@
 #include "kernel/cpu.h"
 #include "kernel/kalloc.h"
 #include "kernel/kernel.h"
+#include "kernel/meminfo.h"
 #include "net/ethernet.h"
 #include "net/icmp.h"
 #include "net/ipv4.h"
@@ -312,7 +313,7 @@ struct net_socket* udp_socket_create(struct net_socket_info* sockinfo)
     if(sockinfo->source_address.protocol != NET_PROTOCOL_IPv4 ||
        sockinfo->dest_address.protocol != NET_PROTOCOL_IPv4) return null;
 
-    struct udp_socket* socket = (struct udp_socket*)kalloc(sizeof(struct udp_socket)); // use kalloc for fast allocation
+    struct udp_socket* socket = (struct udp_socket*)kalloc_tagged(sizeof(struct udp_socket), MEMINFO_TAG_NET); // use kalloc for fast allocation
     zero(socket);
 
     socket->main_lock           = lock_init;
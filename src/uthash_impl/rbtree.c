@@ -12,7 +12,15 @@ static __always_inline bool is_red(struct rb_node* node)
     return (node != null) && (node->color);
 }
 
-static void _left_rotate(struct rb_node** rootptr, struct rb_node* rot)
+// recompute the augmented value of `node` and every ancestor above it
+static void _augment_to_root(struct rb_node* node, _rb_node_augment_func* augment)
+{
+    if(augment == null) return;
+
+    for(; node != null; node = node->parent) augment(node);
+}
+
+static void _left_rotate(struct rb_node** rootptr, struct rb_node* rot, _rb_node_augment_func* augment)
 {
     /* rotate the `rot` node counter-clockwise around its right child
      * so a tree that looks like this:
@@ -53,9 +61,15 @@ static void _left_rotate(struct rb_node** rootptr, struct rb_node* rot)
     rot->right  = tmp->left;
     if(rot->right != null) rot->right->parent = rot;
     tmp->left   = rot;
+
+    // rot's subtree changed and tmp now holds what rot used to, so recompute bottom up
+    if(augment != null) {
+        augment(rot);
+        augment(tmp);
+    }
 }
 
-static void _right_rotate(struct rb_node** rootptr, struct rb_node* rot)
+static void _right_rotate(struct rb_node** rootptr, struct rb_node* rot, _rb_node_augment_func* augment)
 {
     /* rotate the `rot` node clockwise around its left child
      * so a tree that looks like this:
@@ -97,9 +111,14 @@ static void _right_rotate(struct rb_node** rootptr, struct rb_node* rot)
     rot->left   = tmp->right;
     if(rot->left != null) rot->left->parent = rot;
     tmp->right  = rot;
+
+    if(augment != null) {
+        augment(rot);
+        augment(tmp);
+    }
 }
 
-static void _insert_fixup(struct rb_node** rootptr, struct rb_node* node)
+static void _insert_fixup(struct rb_node** rootptr, struct rb_node* node, _rb_node_augment_func* augment)
 {
     struct rb_node* cur = node;
 
@@ -130,7 +149,7 @@ static void _insert_fixup(struct rb_node** rootptr, struct rb_node* node)
                      * we need to perform a Left-Right rotate, since we fall through to a right rotate, we just do left here
                      */
                     cur = cur->parent;
-                    _left_rotate(rootptr, cur);
+                    _left_rotate(rootptr, cur, augment);
 
                     /* now our tree looks like (note cur changes too):
                      *      g         g
@@ -152,7 +171,7 @@ static void _insert_fixup(struct rb_node** rootptr, struct rb_node* node)
                  *    cur                   cur  ...
                  * easy case means a right rotate of g about p.
                  */
-                _right_rotate(rootptr, cur->parent->parent);
+                _right_rotate(rootptr, cur->parent->parent, augment);
 
                 /* now our tree looks like:
                  *      p
@@ -186,7 +205,7 @@ static void _insert_fixup(struct rb_node** rootptr, struct rb_node* node)
                      * we need to perform a Right-Left rotate, since we fall through to a left rotate, we just do right here
                      */
                     cur = cur->parent;
-                    _right_rotate(rootptr, cur);
+                    _right_rotate(rootptr, cur, augment);
 
                     /* now our tree looks like (note cur changes too):
                      *  g        g
@@ -208,7 +227,7 @@ static void _insert_fixup(struct rb_node** rootptr, struct rb_node* node)
                  *      cur               ...  cur
                  * easy case means a left rotate of g about p.
                  */
-                _left_rotate(rootptr, cur->parent->parent);
+                _left_rotate(rootptr, cur->parent->parent, augment);
 
                 /* now our tree looks like:
                  *      p
@@ -223,7 +242,7 @@ static void _insert_fixup(struct rb_node** rootptr, struct rb_node* node)
     (*rootptr)->color = false;
 }
 
-void  _RBTREE__insert(void** _rootptr, void* _node, _rb_node_comparison_func* cmp)
+void  _RBTREE__insert(void** _rootptr, void* _node, _rb_node_comparison_func* cmp, _rb_node_augment_func* augment)
 {
     struct rb_node** rootptr = (struct rb_node**)_rootptr;
     struct rb_node* node = (struct rb_node*)_node;
@@ -256,10 +275,13 @@ void  _RBTREE__insert(void** _rootptr, void* _node, _rb_node_comparison_func* cm
     node->left = null;
     node->color = true;
 
-    _insert_fixup(rootptr, node);
+    // the new leaf changes the augmented value of all its ancestors. rotations in the fixup keep the values correct
+    _augment_to_root(node, augment);
+
+    _insert_fixup(rootptr, node, augment);
 }
 
-static void _remove_fixup(struct rb_node** rootptr, struct rb_node* node)
+static void _remove_fixup(struct rb_node** rootptr, struct rb_node* node, _rb_node_augment_func* augment)
 {
     while(node != *rootptr) {
         struct rb_node* parent = node->parent;
@@ -274,8 +296,8 @@ static void _remove_fixup(struct rb_node** rootptr, struct rb_node* node)
             // recolor parent and sibling
             parent->color = true;
             sib->color = false;
-            if(parent->left == sib) _right_rotate(rootptr, parent);
-            else                    _left_rotate(rootptr, parent);
+            if(parent->left == sib) _right_rotate(rootptr, parent, augment);
+            else                    _left_rotate(rootptr, parent, augment);
 
             // fix up 'node' again
             continue;
@@ -287,21 +309,21 @@ static void _remove_fixup(struct rb_node** rootptr, struct rb_node* node)
                 if(parent->left == sib) { // left child of parent: left-left case
                     sib->left->color = sib->color;
                     sib->color = parent->color;
-                    _right_rotate(rootptr, parent);
+                    _right_rotate(rootptr, parent, augment);
                 } else { // right child of parent: right-left case
                     sib->left->color = parent->color;
-                    _right_rotate(rootptr, sib);
-                    _left_rotate(rootptr, parent); // can't use sib->parent here because it changes after the right_rotate, we need to rotate the old sib->parent
+                    _right_rotate(rootptr, sib, augment);
+                    _left_rotate(rootptr, parent, augment); // can't use sib->parent here because it changes after the right_rotate, we need to rotate the old sib->parent
                 }
             } else { // right child of sib is red
                 if(parent->left == sib) { // left child of parent: left-right case
                     sib->right->color = parent->color;
-                    _left_rotate(rootptr, sib);
-                    _right_rotate(rootptr, parent);
+                    _left_rotate(rootptr, sib, augment);
+                    _right_rotate(rootptr, parent, augment);
                 } else { // right child of parent: right-right case
                     sib->right->color = sib->color;
                     sib->color = parent->color;
-                    _left_rotate(rootptr, parent);
+                    _left_rotate(rootptr, parent, augment);
                 }
             }
             parent->color = false; // parent turns black in this case
@@ -322,7 +344,7 @@ static void _remove_fixup(struct rb_node** rootptr, struct rb_node* node)
 }
 
 // algorithm followed from here https://www.geeksforgeeks.org/red-black-tree-set-3-delete-2/
-void  _RBTREE__remove(void** _rootptr, void* _node)
+void  _RBTREE__remove(void** _rootptr, void* _node, _rb_node_augment_func* augment)
 {
     struct rb_node** rootptr = (struct rb_node**)_rootptr;
     struct rb_node* node = (struct rb_node*)_node;
@@ -349,7 +371,7 @@ void  _RBTREE__remove(void** _rootptr, void* _node)
             if(parent == null) { // tree is now empty
                 (*rootptr) = null;
             } else {
-                if(both_black) _remove_fixup(rootptr, node); // since repl was null, this really just checks if `node` was black
+                if(both_black) _remove_fixup(rootptr, node, augment); // since repl was null, this really just checks if `node` was black
                 else {
                     // since repl was null (black), that means `node` is red. if there's a sibling, change it to red
                     struct rb_node* sib = sibling(node);
@@ -362,6 +384,8 @@ void  _RBTREE__remove(void** _rootptr, void* _node)
                 } else {
                     parent->right = null;
                 }
+
+                _augment_to_root(parent, augment);
             }
 
             // done
@@ -372,6 +396,7 @@ void  _RBTREE__remove(void** _rootptr, void* _node)
             if(parent == null) { // if we're removing the root
                 (*rootptr) = repl; // will be the non-null child of `node`
                 repl->parent = null;
+                repl->color = false; // the root is always black
             } else {
                 // remove `node` from the tree, and move `repl` up
                 if(parent->left == node) parent->left = repl;
@@ -379,11 +404,13 @@ void  _RBTREE__remove(void** _rootptr, void* _node)
                 repl->parent = parent;
 
                 // fixup the tree in the double-black situation
-                if(both_black) _remove_fixup(rootptr, repl);
+                if(both_black) _remove_fixup(rootptr, repl, augment);
                 else {
                     // otherwise, we can keep the black color at this location
                     repl->color = false;
                 }
+
+                _augment_to_root(repl->parent, augment);
             }
 
             return;
@@ -394,23 +421,29 @@ void  _RBTREE__remove(void** _rootptr, void* _node)
         // keeping all the other surrounding nodes in the same location
         //
         struct rb_node* tmp = repl->right; // save repl's right child
-        repl->right = node->right;         // make new right be node's right
-        if(repl->right != null) repl->right->parent = repl; // fix up node->right's parent to be repl
+        struct rb_node* replparent = repl->parent; // save the old parent
         repl->left = node->left;           // make new left be node's left (repl->left was null before and doesn't need to be saved)
         if(repl->left != null) repl->left->parent = repl; // fix up node->left's parent to be repl
 
+        if(replparent == node) {
+            // repl was node's right child, so node becomes repl's right child
+            repl->right = node;
+            node->parent = repl;
+        } else {
+            repl->right = node->right;         // make new right be node's right
+            if(repl->right != null) repl->right->parent = repl; // fix up node->right's parent to be repl
+
+            // update node's new parent. repl was the minimum, so it was a left child
+            replparent->left = node;
+            node->parent = replparent;
+        }
+
         // update repl's parent
-        struct rb_node* replparent = repl->parent; // save the old one
         if(parent == null) (*rootptr) = repl; // if we're swapping the root, update the root
         else if(parent->left == node) parent->left = repl;
         else                          parent->right = repl;
         repl->parent = parent;       // update the parent of repl, might be null
 
-        // update node's new parent
-        if(replparent->left == repl) replparent->left = node;
-        else                         replparent->right = node;
-        node->parent = replparent;
-
         // fix up node's children to be those of repl
         node->right = tmp;
         if(node->right != null) node->right->parent = node;
@@ -425,6 +458,11 @@ void  _RBTREE__remove(void** _rootptr, void* _node)
     }
 }
 
+void _RBTREE__augment(void* _node, _rb_node_augment_func* augment)
+{
+    _augment_to_root((struct rb_node*)_node, augment);
+}
+
 void* _RBTREE__find(void* _root, void* _key, _rb_node_comparison_func* cmp)
 {
     struct rb_node* cur = (struct rb_node*)_root;
@@ -466,29 +504,15 @@ void* _RBTREE__next(void* _cur, bool asc)
     if(asc) {
         if(cur->right) return _RBTREE__first(cur->right, true);
 
-        // go up the tree looking for another non-null right node
-        while(cur->parent != null) {
-            cur = cur->parent;
-            if(cur->right != null) {
-                return _RBTREE__first(cur->right, true);
-            }
-        }
-
-        // if we get there then no more nodes
+        // go up the tree until we come up from a left subtree. that parent is next
+        while(cur->parent != null && cur->parent->right == cur) cur = cur->parent;
     } else {
-        if(cur->left) return _RBTREE__first(cur->right, false);
-
-        // go up the tree looking for another non-null left node
-        while(cur->parent != null) {
-            cur = cur->parent;
-            if(cur->left != null) {
-                return _RBTREE__first(cur->right, false);
-            }
-        }
+        if(cur->left) return _RBTREE__first(cur->left, false);
 
-        // if we get there then terminate the loop
+        // go up the tree until we come up from a right subtree. that parent is next
+        while(cur->parent != null && cur->parent->left == cur) cur = cur->parent;
     }
 
-    return null;
+    // null parent means there are no more nodes
+    return cur->parent;
 }
-
@@ -17,14 +17,31 @@ struct rb_node {
     struct rb_node _rbn;
 
 #define RB_TREE_INSERT(root,newnode,cmp) \
-    _RBTREE__insert((void**)&(root), newnode, (_rb_node_comparison_func*)&(cmp))
+    _RBTREE__insert((void**)&(root), newnode, (_rb_node_comparison_func*)&(cmp), null)
 
 // returns boolean if `ret` is not null
 #define RB_TREE_FIND(root,ret,key,cmp) \
     (((ret) = _RBTREE__find((void*)(root), &(key), (_rb_node_comparison_func*)&(cmp))) != null)
 
 #define RB_TREE_REMOVE(root,node) \
-    _RBTREE__remove((void**)&(root), node)
+    _RBTREE__remove((void**)&(root), node, null)
+
+// augmented trees keep a value in each node that depends on the node and its children (i.e., the max of
+// some field over the subtree). `aug` recomputes that value for a single node from its children, and is
+// called on every node whose subtree changes. use these instead of RB_TREE_INSERT/RB_TREE_REMOVE
+#define RB_TREE_INSERT_AUGMENTED(root,newnode,cmp,aug) \
+    _RBTREE__insert((void**)&(root), newnode, (_rb_node_comparison_func*)&(cmp), (_rb_node_augment_func*)&(aug))
+
+#define RB_TREE_REMOVE_AUGMENTED(root,node,aug) \
+    _RBTREE__remove((void**)&(root), node, (_rb_node_augment_func*)&(aug))
+
+// call after changing a node in place (without changing its order) to update it and its ancestors
+#define RB_TREE_AUGMENT(node,aug) \
+    _RBTREE__augment(node, (_rb_node_augment_func*)&(aug))
+
+// child accessors for walking an augmented tree by hand
+#define RB_TREE_LEFT(node)  ((void*)((struct rb_node*)(node))->left)
+#define RB_TREE_RIGHT(node) ((void*)((struct rb_node*)(node))->right)
 
 #define RB_TREE_FOREACH(root, node) \
     for(node = _RBTREE__first(root, true); \
@@ -94,10 +111,12 @@ struct rb_node {
 
 // do not call these functions directly
 typedef s64 (_rb_node_comparison_func)(void const*, void const*);
+typedef void (_rb_node_augment_func)(void*);
 
-void  _RBTREE__insert(void**, void*, _rb_node_comparison_func*);
+void  _RBTREE__insert(void**, void*, _rb_node_comparison_func*, _rb_node_augment_func*);
 void* _RBTREE__find(void*, void*, _rb_node_comparison_func*);
-void  _RBTREE__remove(void**, void*);
+void  _RBTREE__remove(void**, void*, _rb_node_augment_func*);
+void  _RBTREE__augment(void*, _rb_node_augment_func*);
 void* _RBTREE__first(void*, bool);
 void* _RBTREE__next(void*, bool);
 